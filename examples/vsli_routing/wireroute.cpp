@@ -19,7 +19,7 @@
 #include <functional>
 #include <cstdlib>
 #include <climits>
-#include "../../compass.h"
+#include "compass.h"
 
 #include <unistd.h>
 #include <omp.h>
@@ -97,6 +97,11 @@ void write_output(const std::vector<Wire>& wires, const int num_wires, const std
     out_wires.close();
 }
 
+// Work done per thread, sampled into logs/scopes.compass at every COMPASS_SCOPE
+static const uint32_t wires_rerouted = compass_counter("wires_rerouted");
+static const uint32_t sa_random_moves = compass_counter("sa_random_moves");
+static const uint32_t cost_evaluations = compass_counter("cost_evaluations");
+
 auto generate_SA_coin(double SA_prob) {
     std::random_device rd;
     std::mt19937 gen(rd());
@@ -105,7 +110,7 @@ auto generate_SA_coin(double SA_prob) {
 }
 
 void update_grid_along_wire(Wire& wire, std::vector<std::vector<int>>& occupancy, int delta) {
-    // compass_trace_begin("UPDATE_GRID_ALONG_WIRE");
+    COMPASS_SCOPE("UPDATE_GRID_ALONG_WIRE");
     int pos_x = wire.start_x;
     int pos_y = wire.start_y;
 
@@ -177,7 +182,6 @@ void update_grid_along_wire(Wire& wire, std::vector<std::vector<int>>& occupancy
 
         occupancy[pos_y][pos_x] += delta;
     }
-    // compass_trace_end("UPDATE_GRID_ALONG_WIRE");
 }
 
 void update_grid_along_wire_v2(Wire& wire, std::vector<std::vector<int>>& occupancy, std::vector<std::vector<int>>& occupancy2, int delta) {
@@ -481,7 +485,7 @@ int get_cost_of_route_v2(Wire& wire, int suggested_x, int suggested_y, std::vect
 }
 
 void set_best_route_v1(Wire& wire, std::vector<std::vector<int>>& occupancy, int squares_table[], bool in_parallel = false) {
-    // compass_trace_begin("SET_BEST_ROUTE_V1");
+    COMPASS_SCOPE("SET_BEST_ROUTE_V1");
     /* Uses parallel loop and dynamic scheduling */
     int delta_x = wire.end_x - wire.start_x;
     int delta_y = wire.end_y - wire.start_y;
@@ -501,7 +505,8 @@ void set_best_route_v1(Wire& wire, std::vector<std::vector<int>>& occupancy, int
     }
      
     update_bend(wire, best_movement);
-    // compass_trace_end("SET_BEST_ROUTE_V1");
+    compass_counter_add(wires_rerouted, 1);
+    compass_counter_add(cost_evaluations, num_movements - 1);
 }
 
 
@@ -536,6 +541,7 @@ void set_best_route_v3(Wire& wire, std::vector<std::vector<int>>& occupancy, std
     #pragma omp parallel default(shared)
     {
         MinCost min_cost = {INT_MAX, 0};
+        uint64_t evaluations = 0;
         
         #pragma omp for schedule(auto)
         for (int j = 1; j < std::abs(delta_x) + std::abs(delta_y) + 1; j++) {
@@ -543,13 +549,16 @@ void set_best_route_v3(Wire& wire, std::vector<std::vector<int>>& occupancy, std
             auto [new_bend1_x, new_bend1_y] = get_bend(wire, movement);
             int cost = get_cost_of_route_v2(wire, new_bend1_x, new_bend1_y, occupancy, occupancy2, squares_table);
             min_cost = std::min(min_cost, MinCost{cost, movement});
+            evaluations++;
         }
+        compass_counter_add(cost_evaluations, evaluations);
 
         #pragma omp critical
         global_min_cost = std::min(global_min_cost, min_cost);
     }
 
     update_bend(wire, global_min_cost.movement);
+    compass_counter_add(wires_rerouted, 1);
 }
 
 void set_random_route(Wire& wire) {
@@ -622,6 +631,7 @@ void within_wires(std::vector<std::vector<int>>& occupancy, std::vector<std::vec
                     set_best_route_v3(wire, occupancy, occupancy2, squares_table);
                 } else { 
                     set_random_route(wire);
+                    compass_counter_add(sa_random_moves, 1);
                 }
             }
             add_wire_to_grid_v2(wire, occupancy, occupancy2);
@@ -708,6 +718,7 @@ void across_wires(std::vector<std::vector<int>>& occupancy, std::vector<Wire>& w
                             set_best_route_v1(wires[j], occupancy, squares_table);
                         } else {
                             set_random_route(wires[j]);
+                            compass_counter_add(sa_random_moves, 1);
                         }
                     }
 
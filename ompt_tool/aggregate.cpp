@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include "aggregate.h"
+#include "thread_registry.h"
+#include "timestamp.h"
+
+
+// Accumulators of one OpenMP thread. Only the owning thread writes them, and
+// the struct is cache-line aligned so neighbouring threads never share a line.
+struct alignas(64) ThreadAggregate {
+    uint64_t thread_id = 0;
+
+    // Outermost parallel region the thread is working in, keyed by parallel id
+    int region_depth = 0;
+    uint64_t region_start = 0;
+    RegionTotals *current = nullptr;
+    std::unordered_map<uint64_t, RegionTotals> regions;
+
+    uint64_t mutex_wait_start = 0;
+    int critical_depth = 0;
+    uint64_t critical_start = 0;
+
+    // Waits nest when a barrier runs tasks that wait themselves; only the
+    // outermost wait is counted
+    int wait_depth = 0;
+    ompt_sync_region_t wait_kind = ompt_sync_region_barrier_explicit;
+    uint64_t wait_start = 0;
+};
+
+static PerThreadRegistry<ThreadAggregate> aggregates("COMPASS_AGGREGATE");
+
+void aggregate_implicit_task(ompt_scope_endpoint_t endpoint, uint64_t parallel_id, int flags, uint64_t thread_id) {
+    // The initial task spans the whole program and is not a parallel region
+    if (flags & ompt_task_initial) {
+        return;
+    }
+    ThreadAggregate *aggregate = aggregates.get_or_create();
+    if (!aggregate) {
+        return;
+    }
+
+    uint64_t now = read_timestamp();
+    if (endpoint == ompt_scope_begin) {
+        if (aggregate->region_depth++ == 0) {
+            aggregate->thread_id = thread_id;
+            aggregate->region_start = now;
+            aggregate->current = &aggregate->regions[parallel_id];
+        }
+    } else if (aggregate->region_depth > 0 && --aggregate->region_depth == 0) {
+        aggregate->current->total += now - aggregate->region_start;
+        aggregate->current = nullptr;
+    }
+}
+
+void aggregate_mutex_acquire() {
+    ThreadAggregate *aggregate = aggregates.get_or_create();
+    if (aggregate && aggregate->current) {
+        aggregate->mutex_wait_start = read_timestamp();
+    }
+}
+
+void aggregate_mutex_acquired(ompt_mutex_t kind) {
+    ThreadAggregate *aggregate = aggregates.get_or_create();
+    if (!aggregate || !aggregate->current) {
+        return;
+    }
+
+    uint64_t now = read_timestamp();
+    if (aggregate->mutex_wait_start) {
+        uint64_t waited = now - aggregate->mutex_wait_start;
+        if (kind == ompt_mutex_critical) {
+            aggregate->current->critical_wait += waited;
+        } else {
+            aggregate->current->lock_wait += waited;
+        }
+        aggregate->mutex_wait_start = 0;
+    }
+    if (kind == ompt_mutex_critical && aggregate->critical_depth++ == 0) {
+        aggregate->critical_start = now;
+    }
+}
+
+void aggregate_mutex_released(ompt_mutex_t kind) {
+    ThreadAggregate *aggregate = aggregates.get_or_create();
+    if (!aggregate || !aggregate->current || kind != ompt_mutex_critical) {
+        return;
+    }
+    if (aggregate->critical_depth > 0 && --aggregate->critical_depth == 0) {
+        aggregate->current->critical += read_timestamp() - aggregate->critical_start;
+    }
+}
+
+void aggregate_sync_region_wait(ompt_sync_region_t kind, ompt_scope_endpoint_t endpoint) {
+    ThreadAggregate *aggregate = aggregates.get_or_create();
+    if (!aggregate || !aggregate->current) {
+        return;
+    }
+
+    if (endpoint == ompt_scope_begin) {
+        if (aggregate->wait_depth++ == 0) {
+            aggregate->wait_kind = kind;
+            aggregate->wait_start = read_timestamp();
+        }
+        return;
+    }
+    if (aggregate->wait_depth == 0 || --aggregate->wait_depth > 0) {
+        return;
+    }
+
+    uint64_t waited = read_timestamp() - aggregate->wait_start;
+    switch (aggregate->wait_kind) {
+        case ompt_sync_region_barrier_explicit:
+            aggregate->current->barrier += waited;
+            break;
+        case ompt_sync_region_taskgroup:
+            aggregate->current->taskgroup += waited;
+            break;
+        case ompt_sync_region_taskwait:
+            aggregate->current->taskwait += waited;
+            break;
+        default:
+            aggregate->current->implicit_barrier += waited;
+            break;
+    }
+}
+
+void write_aggregate_summary() {
+    // parallel id -> thread id -> totals, so rows come out sorted
+    std::map<uint64_t, std::map<uint64_t, RegionTotals>> merged;
+    for (ThreadAggregate *aggregate : aggregates.all()) {
+        for (const auto &[parallel_id, totals] : aggregate->regions) {
+            RegionTotals &row = merged[parallel_id][aggregate->thread_id];
+            row.total += totals.total;
+            row.critical += totals.critical;
+            row.critical_wait += totals.critical_wait;
+            row.lock_wait += totals.lock_wait;
+            row.implicit_barrier += totals.implicit_barrier;
+            row.barrier += totals.barrier;
+            row.taskgroup += totals.taskgroup;
+            row.taskwait += totals.taskwait;
+        }
+    }
+
+    std::ofstream out(AGGREGATE_SUMMARY_FILE_NAME);
+    if (!out) {
+        std::cerr << "Could not open " << AGGREGATE_SUMMARY_FILE_NAME << "\n";
+        return;
+    }
+    out << "parallel_id,thread,total_ns,working_ns,critical_ns,critical_wait_ns,lock_wait_ns,"
+           "implicit_barrier_ns,barrier_ns,taskgroup_ns,taskwait_ns\n";
+    for (const auto &[parallel_id, threads] : merged) {
+        for (const auto &[thread_id, row] : threads) {
+            uint64_t waiting = row.critical_wait + row.lock_wait + row.implicit_barrier +
+                               row.barrier + row.taskgroup + row.taskwait;
+            uint64_t working = row.total > waiting ? row.total - waiting : 0;
+            out << parallel_id << "," << thread_id << ","
+                << ticks_to_ns(row.total) << "," << ticks_to_ns(working) << ","
+                << ticks_to_ns(row.critical) << "," << ticks_to_ns(row.critical_wait) << ","
+                << ticks_to_ns(row.lock_wait) << "," << ticks_to_ns(row.implicit_barrier) << ","
+                << ticks_to_ns(row.barrier) << "," << ticks_to_ns(row.taskgroup) << ","
+                << ticks_to_ns(row.taskwait) << "\n";
+        }
+    }
+    std::cout << "Aggregated " << merged.size() << " parallel regions into " << AGGREGATE_SUMMARY_FILE_NAME << "\n";
+}
@@ -0,0 +1,38 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <cstdint>
+#include <omp-tools.h>
+
+// Summary written by write_aggregate_summary(), one row per thread per parallel region
+constexpr const char *AGGREGATE_SUMMARY_FILE_NAME = "logs/summary.csv";
+
+/**
+ * @brief Time one thread spent in one parallel region, in timestamp ticks.
+ *
+ * Mirrors the sections of visualization/bar_graph.py. Working is whatever part
+ * of total is not spent waiting; critical is the time spent holding critical
+ * sections and is part of working.
+ */
+struct alignas(64) RegionTotals {
+    uint64_t total = 0;
+    uint64_t critical = 0;
+    uint64_t critical_wait = 0;
+    uint64_t lock_wait = 0;
+    uint64_t implicit_barrier = 0;
+    uint64_t barrier = 0;
+    uint64_t taskgroup = 0;
+    uint64_t taskwait = 0;
+};
+
+// Per-thread accumulators, updated from the callbacks without synchronization
+void aggregate_implicit_task(ompt_scope_endpoint_t endpoint, uint64_t parallel_id, int flags, uint64_t thread_id);
+void aggregate_mutex_acquire();
+void aggregate_mutex_acquired(ompt_mutex_t kind);
+void aggregate_mutex_released(ompt_mutex_t kind);
+void aggregate_sync_region_wait(ompt_sync_region_t kind, ompt_scope_endpoint_t endpoint);
+
+// Merges every thread's accumulators into AGGREGATE_SUMMARY_FILE_NAME
+void write_aggregate_summary();
+
+#endif // AGGREGATE_H
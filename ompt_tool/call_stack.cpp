@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <pthread.h>
+#include <unordered_map>
+#include "call_stack.h"
+#include "helper.h"
+#include "symbolizer.h"
+#include "thread_registry.h"
+
+constexpr size_t MAX_STACK_DEPTH = 64;
+// How far above the callback's frame the slot holding codeptr_ra is looked
+// for, which covers the runtime's frames between the call and the callback
+constexpr size_t ANCHOR_SCAN_BYTES = 64 * 1024;
+
+// Trie nodes, ids are slot + 1. Zero-initialized, so the table costs no
+// memory until stacks are captured.
+constexpr size_t STACK_NODE_CAPACITY = 1 << 18;
+constexpr size_t STACK_NODE_PROBES = 64;
+// Whole-stack cache: direct-mapped, each entry packs the high 40 bits of the
+// stack's hash with the 24-bit id of its innermost node
+constexpr size_t STACK_CACHE_SIZE = 1 << 14;
+constexpr uint64_t STACK_CACHE_ID_MASK = (1 << 24) - 1;
+
+static_assert(STACK_NODE_CAPACITY <= STACK_CACHE_ID_MASK, "node ids must fit a cache entry");
+
+enum NodeState : uint32_t {
+    NODE_EMPTY,
+    NODE_BUSY,      // claimed, parent and address being written
+    NODE_READY
+};
+
+struct StackNode {
+    std::atomic<uint32_t> state{NODE_EMPTY};
+    uint32_t parent;        // NO_CALL_STACK for an outermost frame
+    uint64_t address;       // return address
+};
+
+static StackNode stack_nodes[STACK_NODE_CAPACITY];
+static std::atomic<uint64_t> stack_cache[STACK_CACHE_SIZE];
+static std::atomic<uint64_t> stack_node_count{0};
+// Captures that did not fit the trie
+static std::atomic<uint64_t> dropped_stacks{0};
+
+static thread_local bool stack_range_loaded = false;
+static thread_local StackRange stack_range;
+
+static StackRange read_stack_range() {
+    StackRange range;
+#if defined(__APPLE__)
+    pthread_t self = pthread_self();
+    range.high = reinterpret_cast<uintptr_t>(pthread_get_stackaddr_np(self));
+    range.low = range.high - pthread_get_stacksize_np(self);
+#elif defined(__linux__)
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return range;
+    }
+    void *address = nullptr;
+    size_t size = 0;
+    if (pthread_attr_getstack(&attr, &address, &size) == 0) {
+        range.low = reinterpret_cast<uintptr_t>(address);
+        range.high = range.low + size;
+    }
+    pthread_attr_destroy(&attr);
+#endif
+    return range;
+}
+
+StackRange current_stack_range() {
+    if (!stack_range_loaded) {
+        stack_range = read_stack_range();
+        stack_range_loaded = true;
+    }
+    return stack_range;
+}
+
+// A frame record is plausible if it lies above inner, so the chain moves
+// outwards, and its saved frame pointer and return address are on the stack
+static bool plausible_frame(uintptr_t fp, uintptr_t inner, const StackRange &stack) {
+    return fp > inner && fp >= stack.low && fp % sizeof(uintptr_t) == 0 && fp + 2 * sizeof(uintptr_t) <= stack.high;
+}
+
+__attribute__((no_sanitize_address))
+size_t follow_frame_pointers(uintptr_t fp, uintptr_t sp, const StackRange &stack, uint64_t *frames, size_t max) {
+    size_t depth = 0;
+    uintptr_t inner = sp - 1;
+    while (depth < max && plausible_frame(fp, inner, stack)) {
+        const uintptr_t *record = reinterpret_cast<const uintptr_t *>(fp);
+        if (!record[1]) {
+            break;
+        }
+        frames[depth++] = record[1];
+        inner = fp;
+        fp = record[0];
+    }
+    return depth;
+}
+
+// Counts of one OpenMP thread, only written by that thread
+struct alignas(64) ThreadStacks {
+    // (event << 32 | stack id) -> captures
+    std::unordered_map<uint64_t, uint64_t> counts;
+};
+
+static PerThreadRegistry<ThreadStacks> thread_stacks("COMPASS_STACKS");
+
+// Fills frames with codeptr_ra followed by the return addresses of the
+// application frames around it, see capture_call_stack(). callback_fp is the
+// frame of the OMPT callback. Reads other frames' memory, which the address
+// sanitizer would report.
+__attribute__((no_sanitize_address))
+static size_t walk_stack(uintptr_t codeptr, uintptr_t callback_fp, uint64_t *frames) {
+    frames[0] = codeptr;
+    StackRange stack = current_stack_range();
+    if (stack.high <= stack.low || !plausible_frame(callback_fp, stack.low, stack)) {
+        return 1;
+    }
+
+    // The runtime's frames start above the callback's saved frame pointer and
+    // return address
+    uintptr_t scan_begin = callback_fp + 2 * sizeof(uintptr_t);
+    uintptr_t scan_end = std::min(stack.high, scan_begin + ANCHOR_SCAN_BYTES);
+    uintptr_t anchor = 0;
+    for (uintptr_t slot = scan_begin; slot + sizeof(uintptr_t) <= scan_end; slot += sizeof(uintptr_t)) {
+        if (*reinterpret_cast<const uintptr_t *>(slot) == codeptr) {
+            anchor = slot;
+            break;
+        }
+    }
+    if (!anchor) {
+        return 1;
+    }
+
+    // The frame pointer register still held the frame of the function that
+    // called into the runtime when the call was made. The runtime saves it
+    // before using the register itself, or the callback's prologue does if
+    // the runtime leaves it alone, so it is one of the words between the
+    // callback's frame and the anchor. Of the words pointing above the anchor
+    // that look like a frame record, the nearest is taken: the caller's own
+    // frame lies below those of its callers.
+    uintptr_t fp = 0;
+    for (uintptr_t slot = callback_fp; slot < anchor; slot += sizeof(uintptr_t)) {
+        uintptr_t candidate = *reinterpret_cast<const uintptr_t *>(slot);
+        if (candidate <= anchor || candidate >= scan_end || (fp && candidate >= fp) ||
+            candidate % (2 * sizeof(uintptr_t)) != 0) {
+            continue;
+        }
+        const uintptr_t *record = reinterpret_cast<const uintptr_t *>(candidate);
+        bool outer_frame = record[0] == 0 || plausible_frame(record[0], candidate, stack);
+        bool code_address = record[1] >= 4096 && (record[1] < stack.low || record[1] >= stack.high);
+        if (outer_frame && code_address) {
+            fp = candidate;
+        }
+    }
+    if (!fp) {
+        return 1;
+    }
+
+    size_t depth = 1 + follow_frame_pointers(fp, anchor, stack, frames + 1, MAX_STACK_DEPTH - 1);
+    // A runtime entry point with a frame of its own returns to codeptr_ra
+    if (depth > 1 && frames[1] == codeptr) {
+        std::copy(frames + 2, frames + depth, frames + 1);
+        depth--;
+    }
+    return depth;
+}
+
+// Id of the child of parent for address, added if it is new
+static uint32_t intern_node(uint32_t parent, uint64_t address) {
+    uint64_t hash = (address ^ ((uint64_t)parent << 40)) * 0x9E3779B97F4A7C15ull;
+    size_t slot = (size_t)(hash >> 32) & (STACK_NODE_CAPACITY - 1);
+    for (size_t probe = 0; probe < STACK_NODE_PROBES; probe++, slot = (slot + 1) & (STACK_NODE_CAPACITY - 1)) {
+        StackNode &node = stack_nodes[slot];
+        uint32_t state = node.state.load(std::memory_order_acquire);
+        if (state == NODE_EMPTY && node.state.compare_exchange_strong(state, NODE_BUSY, std::memory_order_acquire)) {
+            node.parent = parent;
+            node.address = address;
+            node.state.store(NODE_READY, std::memory_order_release);
+            stack_node_count.fetch_add(1, std::memory_order_relaxed);
+            return (uint32_t)slot + 1;
+        }
+        // Another thread claimed the slot; its two fields are written next
+        while (state == NODE_BUSY) {
+            state = node.state.load(std::memory_order_acquire);
+        }
+        if (node.parent == parent && node.address == address) {
+            return (uint32_t)slot + 1;
+        }
+    }
+    return NO_CALL_STACK;
+}
+
+static uint64_t hash_frames(const uint64_t *frames, size_t depth) {
+    uint64_t hash = depth;
+    for (size_t i = 0; i < depth; i++) {
+        hash = (hash ^ frames[i]) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+__attribute__((noinline))
+uint32_t capture_call_stack(StackEvent event, const void *codeptr_ra) {
+    if (!codeptr_ra) {
+        return NO_CALL_STACK;
+    }
+    // This function's saved frame pointer is the callback's frame
+    uintptr_t callback_fp = reinterpret_cast<const uintptr_t *>(__builtin_frame_address(0))[0];
+    uint64_t frames[MAX_STACK_DEPTH];
+    size_t depth = walk_stack(reinterpret_cast<uintptr_t>(codeptr_ra), callback_fp, frames);
+
+    uint64_t hash = hash_frames(frames, depth);
+    std::atomic<uint64_t> &cached = stack_cache[hash & (STACK_CACHE_SIZE - 1)];
+    uint64_t entry = cached.load(std::memory_order_acquire);
+    uint32_t stack_id = NO_CALL_STACK;
+    if (entry && (entry & ~STACK_CACHE_ID_MASK) == (hash & ~STACK_CACHE_ID_MASK)) {
+        stack_id = (uint32_t)(entry & STACK_CACHE_ID_MASK);
+    } else {
+        // Outermost frame first, so stacks sharing callers share nodes
+        for (size_t i = depth; i-- > 0;) {
+            stack_id = intern_node(stack_id, frames[i]);
+            if (stack_id == NO_CALL_STACK) {
+                dropped_stacks.fetch_add(1, std::memory_order_relaxed);
+                return NO_CALL_STACK;
+            }
+        }
+        cached.store((hash & ~STACK_CACHE_ID_MASK) | stack_id, std::memory_order_release);
+    }
+
+    ThreadStacks *stacks = thread_stacks.get_or_create();
+    if (stacks) {
+        stacks->counts[(uint64_t)event << 32 | stack_id]++;
+    }
+    return stack_id;
+}
+
+std::vector<uint64_t> call_stack_frames(uint32_t stack_id) {
+    std::vector<uint64_t> frames;
+    while (stack_id != NO_CALL_STACK && stack_id <= STACK_NODE_CAPACITY) {
+        const StackNode &node = stack_nodes[stack_id - 1];
+        if (node.state.load(std::memory_order_acquire) != NODE_READY) {
+            break;
+        }
+        frames.push_back(node.address);
+        stack_id = node.parent;
+    }
+    return frames;
+}
+
+void symbolize_call_stacks(const std::vector<uint32_t> &stack_ids) {
+    std::vector<uint64_t> addresses;
+    for (uint32_t stack_id : stack_ids) {
+        std::vector<uint64_t> frames = call_stack_frames(stack_id);
+        addresses.insert(addresses.end(), frames.begin(), frames.end());
+    }
+    std::sort(addresses.begin(), addresses.end());
+    addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+    symbolize(addresses);
+}
+
+std::string format_call_stack(uint32_t stack_id, const char *separator) {
+    std::string text;
+    for (uint64_t frame : call_stack_frames(stack_id)) {
+        if (!text.empty()) {
+            text += separator;
+        }
+        text += format_symbol(lookup_symbol(frame));
+    }
+    return text;
+}
+
+static const char *stack_event_name(uint32_t event) {
+    switch (event) {
+        case STACKS_MUTEX:
+            return "mutex";
+        case STACKS_TASK:
+            return "task";
+        case STACKS_BARRIER:
+            return "barrier";
+        default:
+            return "other";
+    }
+}
+
+void write_call_stack_report() {
+    // (event << 32 | stack id) -> captures, merged over threads
+    std::map<uint64_t, uint64_t> merged;
+    for (ThreadStacks *stacks : thread_stacks.all()) {
+        for (const auto &[key, captures] : stacks->counts) {
+            merged[key] += captures;
+        }
+    }
+
+    std::ofstream out(CALL_STACK_REPORT_FILE_NAME);
+    if (!out) {
+        std::cerr << "Could not open " << CALL_STACK_REPORT_FILE_NAME << "\n";
+        return;
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> rows(merged.begin(), merged.end());
+    std::stable_sort(rows.begin(), rows.end(), [](const auto &a, const auto &b) {
+        if (a.first >> 32 != b.first >> 32) {
+            return a.first >> 32 < b.first >> 32;
+        }
+        return a.second > b.second;
+    });
+    std::vector<uint32_t> stack_ids;
+    uint64_t captures = 0;
+    for (const auto &[key, row_count] : rows) {
+        stack_ids.push_back((uint32_t)key);
+        captures += row_count;
+    }
+    symbolize_call_stacks(stack_ids);
+
+    out << "event,stack,count,depth,frames\n";
+    for (const auto &[key, row_count] : rows) {
+        uint32_t stack_id = (uint32_t)key;
+        out << stack_event_name((uint32_t)(key >> 32)) << "," << stack_id << "," << row_count << ","
+            << call_stack_frames(stack_id).size() << "," << csv_field(format_call_stack(stack_id, ";")) << "\n";
+    }
+    std::cout << "Captured " << captures << " call stacks (" << rows.size() << " distinct, "
+              << stack_node_count.load(std::memory_order_relaxed) << " trie nodes) into "
+              << CALL_STACK_REPORT_FILE_NAME << "\n";
+    uint64_t dropped = dropped_stacks.load(std::memory_order_relaxed);
+    if (dropped) {
+        std::cout << dropped << " call stacks did not fit the stack trie and were not recorded\n";
+    }
+}
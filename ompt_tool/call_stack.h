@@ -0,0 +1,74 @@
+#ifndef CALL_STACK_H
+#define CALL_STACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "tool_config.h"
+
+// Report written by write_call_stack_report()
+constexpr const char *CALL_STACK_REPORT_FILE_NAME = "logs/stacks.csv";
+
+// Id of "no stack": capture failed, the trie is full, or capture is off
+constexpr uint32_t NO_CALL_STACK = 0;
+
+/**
+ * @brief Captures the application call stack of the current OMPT event.
+ *
+ * Must be called directly from the OMPT callback. The runtime is usually built
+ * without frame pointers, so the walk is anchored on the slot holding
+ * codeptr_ra, the return address of the call into the runtime, found by
+ * scanning the stack above the callback. The calling function's frame pointer
+ * is recovered from where the runtime saved it, and from there the frame
+ * pointer chain of the application, which must be compiled with
+ * -fno-omit-frame-pointer, is followed. Frames are bounded by the thread's
+ * stack and must move strictly outwards, so a broken chain ends the stack
+ * instead of crashing. When no anchor is found the stack is codeptr_ra alone.
+ *
+ * The stack is interned into a process-wide, lock-free trie of (parent,
+ * return address) nodes and the id of its innermost node is returned. A hash
+ * of the whole stack is cached, so a stack seen before costs one lookup.
+ * The capture is also counted per thread for write_call_stack_report().
+ */
+uint32_t capture_call_stack(StackEvent event, const void *codeptr_ra);
+
+// Address range of a thread's stack
+struct StackRange {
+    uintptr_t low = 0;
+    uintptr_t high = 0;
+};
+
+// Range of the calling thread's stack, empty if unknown. Looked up once per
+// thread; not async-signal-safe, signal handlers keep a copy.
+StackRange current_stack_range();
+
+/**
+ * @brief Follows a frame pointer chain, outermost frames last.
+ *
+ * Starts at the frame record at fp (saved frame pointer, then return address)
+ * and stores up to max return addresses. Records must lie on the stack at or
+ * above sp and each one above the previous, so a broken chain ends the walk.
+ * Async-signal-safe.
+ */
+size_t follow_frame_pointers(uintptr_t fp, uintptr_t sp, const StackRange &stack, uint64_t *frames, size_t max);
+
+// Return addresses of a stack, innermost (the event's codeptr_ra) first
+std::vector<uint64_t> call_stack_frames(uint32_t stack_id);
+
+// Resolves every frame of the given stacks in one symbolize() batch
+void symbolize_call_stacks(const std::vector<uint32_t> &stack_ids);
+
+// The stack's frames formatted by format_symbol(), innermost first, joined by separator
+std::string format_call_stack(uint32_t stack_id, const char *separator);
+
+/**
+ * @brief Writes how often each stack was captured to CALL_STACK_REPORT_FILE_NAME.
+ *
+ * One row per event kind and stack with the capture count, the depth and the
+ * symbolized frames, innermost first and separated by ';'. Rows are sorted by
+ * count within each event kind.
+ */
+void write_call_stack_report();
+
+#endif // CALL_STACK_H
@@ -1,6 +1,8 @@
 #ifndef COMPASS_H
 #define COMPASS_H
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <utility>
 #include <initializer_list>
@@ -11,7 +13,7 @@
  * @param name The name of the trace event.
  * @param optional_details Optional key-value pairs providing additional context.
  */
-void compass_trace_begin(const std::string& name, 
+void compass_trace_begin(const std::string& name,
                          std::initializer_list<std::pair<std::string, std::string>> optional_details = {});
 
 /**
@@ -21,4 +23,120 @@ void compass_trace_begin(const std::string& name,
  */
 void compass_trace_end(const std::string& name);
 
-#endif // COMPASS_H
\ No newline at end of file
+// Scopes are compiled in unless the application is built with -DCOMPASS_SCOPES=0
+#ifndef COMPASS_SCOPES
+#define COMPASS_SCOPES 1
+#endif
+
+/**
+ * @brief Returns the id of a scope name, adding it to the name table on first use.
+ *
+ * Ids start at 1 and are stored with the names in logs/scopes.compass.
+ */
+uint32_t compass_intern_name(const char *name);
+
+/**
+ * @brief Records the begin or end of the scope with the given name id.
+ *
+ * Each call appends one 16-byte record (timestamp, name id, thread, endpoint)
+ * to a buffer of the calling thread; full buffers and, at exit, all buffers
+ * are written to logs/scopes.compass.
+ */
+void compass_scope_begin(uint32_t name_id);
+void compass_scope_end(uint32_t name_id);
+
+/**
+ * @brief Ids of the scopes a thread is in, for the OMPT tool's CPU profiler.
+ *
+ * The first scope a thread enters hands its stack to the tool with
+ * omp_control_tool(COMPASS_CONTROL_SCOPE_STACK, 0, stack), so samples taken
+ * on the thread can be attributed to its innermost scope. Scopes nested
+ * deeper than COMPASS_SCOPE_STACK_DEPTH are counted but not stored.
+ */
+constexpr int COMPASS_CONTROL_SCOPE_STACK = 64;     // tool-specific omp_control_tool commands start at 64
+constexpr uint32_t COMPASS_SCOPE_STACK_DEPTH = 32;
+
+struct CompassScopeStack {
+    uint32_t depth;
+    uint32_t ids[COMPASS_SCOPE_STACK_DEPTH];
+    // Copies the name of a scope id into name, truncated to size bytes including the terminating NUL
+    void (*copy_name)(uint32_t id, char *name, size_t size);
+};
+
+/**
+ * @brief Returns the id of a counter or gauge, adding it to the metric table on first use.
+ *
+ * Call once, for instance when initializing a static, and keep the id:
+ *
+ *     static const uint32_t wires_rerouted = compass_counter("wires_rerouted");
+ *     ...
+ *     compass_counter_add(wires_rerouted, 1);
+ *
+ * At most COMPASS_MAX_METRICS metrics exist; further names get
+ * COMPASS_NO_METRIC, which the update functions ignore.
+ */
+constexpr uint32_t COMPASS_MAX_METRICS = 64;
+constexpr uint32_t COMPASS_NO_METRIC = UINT32_MAX;
+
+uint32_t compass_counter(const char *name);
+uint32_t compass_gauge(const char *name);
+
+/**
+ * @brief Updates the calling thread's copy of a metric.
+ *
+ * Counters add up per thread, gauges keep the last value set on the thread.
+ * Updates only touch the thread's own cache lines; the metrics that changed
+ * are recorded into logs/scopes.compass at the next scope begin or end of the
+ * thread, at compass_sample_metrics() and at exit.
+ */
+void compass_counter_add(uint32_t id, uint64_t n);
+void compass_value(uint32_t id, double value);
+
+// Records the calling thread's changed metrics now, for code without scopes
+void compass_sample_metrics();
+
+namespace compass {
+
+// One id per Name type, interned during static initialization so a scope
+// costs only a load of the id when it runs
+template <typename Name>
+struct ScopeName {
+    static inline const uint32_t id = compass_intern_name(Name::name());
+};
+
+// Records a scope around its own lifetime
+template <typename Name>
+class Scope {
+public:
+    Scope() { compass_scope_begin(ScopeName<Name>::id); }
+    ~Scope() { compass_scope_end(ScopeName<Name>::id); }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+};
+
+} // namespace compass
+
+#define COMPASS_CONCAT_IMPL(a, b) a##b
+#define COMPASS_CONCAT(a, b) COMPASS_CONCAT_IMPL(a, b)
+
+/**
+ * @brief Traces the rest of the enclosing block as a scope named by a string literal.
+ *
+ *     void update_grid_along_wire(...) {
+ *         COMPASS_SCOPE("update_grid_along_wire");
+ *         ...
+ *     }
+ *
+ * Expands to nothing when COMPASS_SCOPES is 0.
+ */
+#if COMPASS_SCOPES
+#define COMPASS_SCOPE(name_literal)                                                         \
+    struct COMPASS_CONCAT(compass_scope_name_, __LINE__) {                                  \
+        static const char *name() { return name_literal; }                                  \
+    };                                                                                      \
+    compass::Scope<COMPASS_CONCAT(compass_scope_name_, __LINE__)> COMPASS_CONCAT(compass_scope_, __LINE__)
+#else
+#define COMPASS_SCOPE(name_literal) static_cast<void>(0)
+#endif
+
+#endif // COMPASS_H
@@ -0,0 +1,297 @@
+// compass-analyze: builds the happens-before graph of a trace natively and
+// reports its work, span and critical path. Writes the graph for Graphviz
+// (--dot) or other tools (--json).
+//
+//   build/compass-analyze [--dot FILE] [--json FILE] [--threads N] [TRACE]
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <omp-tools.h>
+#include "helper.h"
+#include "trace_dag.h"
+
+static const char *const edge_type_names[DAG_EDGE_TYPE_COUNT] = {"temporal", "nesting", "task", "mutex", "dependence"};
+
+// Shapes, colors and labels follow get_shape(), get_color() and get_label() in visualization/diagram.py
+static const char *node_shape(const TraceRecord &node) {
+    switch (node.event) {
+        case TRACE_IMPLICIT_TASK:
+            return "parallelogram";
+        case TRACE_PARALLEL_BEGIN:
+        case TRACE_PARALLEL_END:
+        case TRACE_TASK_CREATE:
+            return "diamond";
+        case TRACE_THREAD_CREATE:
+            return "doublecircle";
+        case TRACE_TASK_SCHEDULE:
+            return node.kind == ompt_task_complete ? "square" : "diamond";
+        case TRACE_SYNC_REGION_WAIT:
+        case TRACE_MUTEX_ACQUIRE:
+        case TRACE_MUTEX_ACQUIRED:
+        case TRACE_MUTEX_RELEASED:
+            return "octagon";
+        default:
+            return "box";
+    }
+}
+
+static const char *node_color(const TraceRecord &node) {
+    switch (node.event) {
+        case TRACE_MUTEX_ACQUIRE:
+            return "darkred";
+        case TRACE_MUTEX_ACQUIRED:
+            return "red";
+        case TRACE_MUTEX_RELEASED:
+            return "pink";
+        case TRACE_SYNC_REGION_WAIT:
+            return node.kind == ompt_sync_region_taskwait ? "orange" : "darkgreen";
+        case TRACE_TASK_SCHEDULE:
+            return node.kind == ompt_task_complete ? "green" : "lightgreen";
+        case TRACE_TASK_CREATE:
+            return "lightgreen";
+        case TRACE_THREAD_CREATE:
+            return "purple";
+        case TRACE_IMPLICIT_TASK:
+            return "pink";
+        case TRACE_PARALLEL_BEGIN:
+        case TRACE_PARALLEL_END:
+            return "yellow";
+        default:
+            return "black";
+    }
+}
+
+static std::string node_label(const TraceRecord &node) {
+    switch (node.event) {
+        case TRACE_TASK_SCHEDULE:
+            return node.kind == ompt_task_complete ? "C" : "S";
+        case TRACE_MUTEX_ACQUIRE:
+            return "W";
+        case TRACE_MUTEX_ACQUIRED:
+            return "A";
+        case TRACE_MUTEX_RELEASED:
+            return "R";
+        case TRACE_TASK_CREATE:
+        case TRACE_IMPLICIT_TASK:
+            return std::to_string(node.task_id);
+        case TRACE_THREAD_CREATE:
+            return std::to_string(node.thread_id);
+        case TRACE_SYNC_REGION_WAIT:
+            return node.kind == ompt_sync_region_taskwait ? "TW" : "B";
+        default:
+            return "";
+    }
+}
+
+static std::string json_string(const std::string &text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+static std::string kind_name(const TraceRecord &node) {
+    switch (node.event) {
+        case TRACE_THREAD_CREATE:
+            return ompt_thread_t_to_string((ompt_thread_t)node.kind);
+        case TRACE_TASK_SCHEDULE:
+            return ompt_task_status_t_to_string((ompt_task_status_t)node.kind);
+        case TRACE_SYNC_REGION_WAIT:
+            return ompt_sync_region_t_to_string((ompt_sync_region_t)node.kind);
+        case TRACE_MUTEX_ACQUIRE:
+        case TRACE_MUTEX_ACQUIRED:
+        case TRACE_MUTEX_RELEASED:
+            return ompt_mutex_t_to_string((ompt_mutex_t)node.kind);
+        case TRACE_IMPLICIT_TASK:
+            return ompt_scope_endpoint_t_to_string((ompt_scope_endpoint_t)node.endpoint);
+        default:
+            return "";
+    }
+}
+
+static void write_dot(const TraceDag &dag, const CriticalPath &path, double ns_per_tick, std::ostream &out) {
+    // Successor of every node on the critical path
+    std::vector<uint32_t> critical(dag.nodes.size(), DAG_NO_NODE);
+    for (size_t i = 0; i < path.nodes.size(); i++) {
+        critical[path.nodes[i]] = i + 1 < path.nodes.size() ? path.nodes[i + 1] : path.nodes[i];
+    }
+
+    out << "digraph compass {\n";
+    for (size_t t = 0; t < dag.threads.size(); t++) {
+        out << "  subgraph cluster_thread_" << dag.threads[t] << " {\n";
+        out << "    label=\"Thread " << dag.threads[t] << "\";\n";
+        for (uint32_t n = dag.thread_first[t]; n < dag.thread_first[t + 1]; n++) {
+            const TraceRecord &node = dag.nodes[n];
+            out << "    n" << n << " [label=\"" << node_label(node) << "\", shape=" << node_shape(node)
+                << ", color=" << node_color(node) << ", tooltip=\"" << trace_event_name(node.event)
+                << "\\nbusy " << (uint64_t)(dag.weights[n] * ns_per_tick) << " ns\"";
+            if (critical[n] != DAG_NO_NODE) {
+                out << ", penwidth=3";
+            }
+            out << "];\n";
+        }
+        out << "  }\n";
+    }
+
+    static const char *const edge_colors[DAG_EDGE_TYPE_COUNT] = {"black", "pink", "green", "red", "darkgreen"};
+    for (uint32_t n = 0; n < dag.nodes.size(); n++) {
+        for (uint64_t e = dag.edge_offsets[n]; e < dag.edge_offsets[n + 1]; e++) {
+            uint8_t type = dag.edge_types[e];
+            uint32_t target = dag.edge_targets[e];
+            out << "  n" << n << " -> n" << target << " [color=" << edge_colors[type]
+                << ", penwidth=" << (critical[n] == target ? "4.0" : type == DAG_EDGE_TEMPORAL ? "1.0" : "2.0");
+            if (type == DAG_EDGE_DEPENDENCE) {
+                out << ", style=dashed";
+            }
+            out << "];\n";
+        }
+    }
+    out << "}\n";
+}
+
+static void write_json(const TraceDag &dag, const CriticalPath &path, const CriticalPath &task_path,
+                       double ns_per_tick, std::ostream &out) {
+    uint64_t start = dag.nodes.empty() ? 0 : dag.nodes[0].time;
+    for (const TraceRecord &node : dag.nodes) {
+        start = std::min(start, node.time);
+    }
+
+    out << "{\n  \"nodes\": [";
+    for (size_t t = 0; t < dag.threads.size(); t++) {
+        for (uint32_t n = dag.thread_first[t]; n < dag.thread_first[t + 1]; n++) {
+            const TraceRecord &node = dag.nodes[n];
+            out << (n ? ",\n    " : "\n    ") << "{\"id\": " << n << ", \"thread\": " << dag.threads[t]
+                << ", \"event\": " << json_string(trace_event_name(node.event))
+                << ", \"kind\": " << json_string(kind_name(node))
+                << ", \"time_ns\": " << (uint64_t)((node.time - start) * ns_per_tick)
+                << ", \"busy_ns\": " << (uint64_t)(dag.weights[n] * ns_per_tick) << "}";
+        }
+    }
+    out << "\n  ],\n  \"edges\": [";
+    bool first = true;
+    for (uint32_t n = 0; n < dag.nodes.size(); n++) {
+        for (uint64_t e = dag.edge_offsets[n]; e < dag.edge_offsets[n + 1]; e++) {
+            out << (first ? "\n    " : ",\n    ") << "{\"from\": " << n << ", \"to\": " << dag.edge_targets[e]
+                << ", \"type\": \"" << edge_type_names[dag.edge_types[e]] << "\"}";
+            first = false;
+        }
+    }
+    out << "\n  ],\n  \"work_ns\": " << (uint64_t)(path.work * ns_per_tick)
+        << ",\n  \"span_ns\": " << (uint64_t)(path.span * ns_per_tick)
+        << ",\n  \"parallelism\": " << (path.span ? (double)path.work / (double)path.span : 0.0)
+        << ",\n  \"critical_path\": [";
+    for (size_t i = 0; i < path.nodes.size(); i++) {
+        out << (i ? ", " : "") << path.nodes[i];
+    }
+
+    out << "],\n  \"tasks\": [";
+    for (size_t i = 0; i < dag.tasks.size(); i++) {
+        const DagTask &task = dag.tasks[i];
+        out << (i ? ",\n    " : "\n    ") << "{\"id\": " << task.id << ", \"parent\": " << task.parent
+            << ", \"busy_ns\": " << (uint64_t)(task.busy * ns_per_tick) << "}";
+    }
+    out << "\n  ],\n  \"task_dependences\": [";
+    for (size_t i = 0; i < dag.task_dependences.size(); i++) {
+        out << (i ? ", " : "") << "[" << dag.tasks[dag.task_dependences[i].first].id << ", "
+            << dag.tasks[dag.task_dependences[i].second].id << "]";
+    }
+    out << "],\n  \"task_work_ns\": " << (uint64_t)(task_path.work * ns_per_tick)
+        << ",\n  \"task_span_ns\": " << (uint64_t)(task_path.span * ns_per_tick)
+        << ",\n  \"task_chain\": [";
+    for (size_t i = 0; i < task_path.nodes.size(); i++) {
+        out << (i ? ", " : "") << dag.tasks[task_path.nodes[i]].id;
+    }
+    out << "]\n}\n";
+}
+
+static void usage(const char *program) {
+    std::cerr << "Usage: " << program << " [--dot FILE] [--json FILE] [--threads N] [TRACE]\n"
+              << "TRACE defaults to " << TRACE_FILE_NAME << "\n";
+}
+
+int main(int argc, char **argv) {
+    std::string trace_path = TRACE_FILE_NAME;
+    std::string dot_path, json_path;
+    unsigned workers = 0;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (std::strcmp(argv[i], "--dot") == 0 && has_value) {
+            dot_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--json") == 0 && has_value) {
+            json_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--threads") == 0 && has_value) {
+            workers = (unsigned)std::strtoul(argv[++i], nullptr, 10);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            trace_path = argv[i];
+        }
+    }
+
+    TraceReader reader;
+    if (!reader.open(trace_path)) {
+        return 1;
+    }
+    double ns_per_tick = 1.0;
+    auto clock = reader.meta().find("clock_ns_per_tick");
+    if (clock != reader.meta().end()) {
+        ns_per_tick = std::strtod(clock->second.c_str(), nullptr);
+    }
+
+    TraceDag dag;
+    if (!build_trace_dag(reader, dag, workers)) {
+        std::cerr << trace_path << " has too many events for one graph\n";
+        return 1;
+    }
+    CriticalPath path = find_critical_path(dag);
+    CriticalPath task_path = find_task_critical_path(dag);
+
+    std::cout << dag.nodes.size() << " nodes on " << dag.threads.size() << " threads, "
+              << dag.edge_targets.size() << " edges (";
+    for (int type = 0; type < DAG_EDGE_TYPE_COUNT; type++) {
+        std::cout << (type ? ", " : "") << dag.edge_counts[type] << " " << edge_type_names[type];
+    }
+    std::cout << ")\n" << std::fixed << std::setprecision(3)
+              << "Work (T1): " << path.work * ns_per_tick / 1e6 << " ms\n"
+              << "Span (T_inf): " << path.span * ns_per_tick / 1e6 << " ms\n"
+              << "Parallelism (T1/T_inf): " << (path.span ? (double)path.work / (double)path.span : 0.0) << "\n"
+              << "Critical path: " << path.nodes.size() << " nodes\n";
+    if (path.unordered) {
+        std::cerr << "Warning: " << path.unordered
+                  << " nodes lie on cycles (skewed clocks between threads?) and were left out\n";
+    }
+
+    if (!dag.task_dependences.empty()) {
+        double task_parallelism = task_path.span ? (double)task_path.work / (double)task_path.span : 0.0;
+        std::cout << "Task graph: " << dag.tasks.size() << " tasks, " << dag.task_dependences.size() << " dependences\n"
+                  << "Task work: " << task_path.work * ns_per_tick / 1e6 << " ms, longest dependence chain: "
+                  << task_path.span * ns_per_tick / 1e6 << " ms over " << task_path.nodes.size() << " tasks\n"
+                  << "Task parallelism: " << task_parallelism << " on " << dag.threads.size() << " threads: ";
+        if (task_parallelism < (double)dag.threads.size()) {
+            std::cout << "latency bound, the dependence chain leaves threads idle\n";
+        } else {
+            std::cout << "throughput bound, there are more ready tasks than threads\n";
+        }
+    }
+
+    if (!dot_path.empty()) {
+        std::ofstream out(dot_path);
+        write_dot(dag, path, ns_per_tick, out);
+    }
+    if (!json_path.empty()) {
+        std::ofstream out(json_path);
+        write_json(dag, path, task_path, ns_per_tick, out);
+    }
+    return 0;
+}
@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <omp.h>
+#include "compass.h"
+#include "thread_registry.h"
+#include "timestamp.h"
+#include "trace_file.h"
+#include "trace_format.h"
+
+// Records per thread buffer; a full buffer is written out as one block
+constexpr size_t SCOPE_BUFFER_CAPACITY = 1 << 14;
+
+// Each thread's buffer starts on its own cache line, and the metrics it
+// updates all the time come first so they never share a line with another thread
+struct alignas(64) ScopeBuffer {
+    uint64_t metrics[COMPASS_MAX_METRICS];  // counter totals and gauge bits
+    uint64_t changed_metrics = 0;           // bit per metric updated since it was last recorded
+    // Created on first use by the thread that owns it
+    uint16_t thread_id = (uint16_t)omp_get_thread_num();
+    size_t count = 0;
+    ScopeRecord records[SCOPE_BUFFER_CAPACITY];
+};
+
+static_assert(COMPASS_MAX_METRICS <= 64, "changed_metrics has one bit per metric");
+
+// Never freed: static destructors may still record scopes after
+// close_scope_trace has written the file
+struct ScopeTrace {
+    std::mutex lock;
+    std::vector<std::string> names;     // name of id i + 1
+    std::vector<std::string> metric_names;
+    TraceFileWriter file;
+    uint64_t records_written = 0;
+    uint64_t records_lost = 0;  // flushed while the scope file was failed or not open
+    bool open_failed = false;
+    bool closed = false;
+};
+
+static PerThreadRegistry<ScopeBuffer> scope_buffers("compass_scope");
+static std::atomic<uint64_t> dropped_scopes{0};
+// SCOPE_COUNTER or SCOPE_GAUGE, set before the metric's id is handed out
+static std::atomic<uint16_t> metric_kinds[COMPASS_MAX_METRICS];
+
+static void copy_scope_name(uint32_t id, char *name, size_t size);
+
+static thread_local CompassScopeStack scope_stack = {0, {}, copy_scope_name};
+static thread_local bool scope_stack_announced = false;
+
+static void close_scope_trace();
+
+static ScopeTrace &scope_trace() {
+    static ScopeTrace *trace = [] {
+        // Same clock as the OMPT tool, so scope times line up with its trace
+        calibrate_timestamps();
+        std::atexit(close_scope_trace);
+        return new ScopeTrace();
+    }();
+    return *trace;
+}
+
+static void copy_scope_name(uint32_t id, char *name, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    ScopeTrace &trace = scope_trace();
+    std::lock_guard<std::mutex> guard(trace.lock);
+    const char *source = id >= 1 && id <= trace.names.size() ? trace.names[id - 1].c_str() : "";
+    size_t length = std::min(std::strlen(source), size - 1);
+    std::memcpy(name, source, length);
+    name[length] = '\0';
+}
+
+uint32_t compass_intern_name(const char *name) {
+    ScopeTrace &trace = scope_trace();
+    std::lock_guard<std::mutex> guard(trace.lock);
+    for (size_t i = 0; i < trace.names.size(); i++) {
+        if (trace.names[i] == name) {
+            return (uint32_t)(i + 1);
+        }
+    }
+    trace.names.emplace_back(name);
+    return (uint32_t)trace.names.size();
+}
+
+static uint32_t intern_metric(const char *name, ScopeEndpoint kind) {
+    ScopeTrace &trace = scope_trace();
+    std::lock_guard<std::mutex> guard(trace.lock);
+    for (size_t i = 0; i < trace.metric_names.size(); i++) {
+        if (trace.metric_names[i] == name) {
+            return (uint32_t)i;
+        }
+    }
+    if (trace.metric_names.size() == COMPASS_MAX_METRICS) {
+        std::cerr << "More than " << COMPASS_MAX_METRICS << " metrics, ignoring " << name << "\n";
+        return COMPASS_NO_METRIC;
+    }
+    metric_kinds[trace.metric_names.size()].store(kind, std::memory_order_relaxed);
+    trace.metric_names.emplace_back(name);
+    return (uint32_t)(trace.metric_names.size() - 1);
+}
+
+uint32_t compass_counter(const char *name) {
+    return intern_metric(name, SCOPE_COUNTER);
+}
+
+uint32_t compass_gauge(const char *name) {
+    return intern_metric(name, SCOPE_GAUGE);
+}
+
+// Called with trace.lock held
+static void write_scope_block(ScopeTrace &trace, ScopeBuffer &buffer) {
+    if (buffer.count == 0 || trace.closed) {
+        return;
+    }
+    // Opened on the first flush and not retried once that fails
+    if (!trace.file.is_open() && !trace.open_failed) {
+        if (trace.file.open(SCOPE_FILE_NAME, sizeof(ScopeRecord))) {
+            std::string meta = "record_fields=" + std::string(SCOPE_RECORD_FIELDS) + "\n" +
+                               "time_unit=ticks\n" +
+                               clock_calibration_meta() +
+                               "pid=" + std::to_string(getpid()) + "\n";
+            trace.file.write_block(TRACE_BLOCK_META, 0, meta.data(), meta.size());
+        } else {
+            trace.open_failed = true;
+        }
+    }
+    if (trace.file.write_block(TRACE_BLOCK_SCOPES, buffer.thread_id, buffer.records,
+                               buffer.count * sizeof(ScopeRecord))) {
+        trace.records_written += buffer.count;
+    } else {
+        trace.records_lost += buffer.count;
+    }
+    buffer.count = 0;
+}
+
+static inline void append_record(ScopeBuffer &buffer, const ScopeRecord &record) {
+    buffer.records[buffer.count++] = record;
+    if (buffer.count == SCOPE_BUFFER_CAPACITY) {
+        ScopeTrace &trace = scope_trace();
+        std::lock_guard<std::mutex> guard(trace.lock);
+        write_scope_block(trace, buffer);
+        if (trace.closed) {
+            buffer.count = 0;
+        }
+    }
+}
+
+// Appends one sample of every metric the thread changed since its last sample
+static void append_changed_metrics(ScopeBuffer &buffer) {
+    while (buffer.changed_metrics) {
+        uint32_t id = (uint32_t)__builtin_ctzll(buffer.changed_metrics);
+        buffer.changed_metrics &= buffer.changed_metrics - 1;
+        append_record(buffer, {buffer.metrics[id], id, buffer.thread_id,
+                               metric_kinds[id].load(std::memory_order_relaxed)});
+    }
+}
+
+static inline void record_scope(uint32_t name_id, ScopeEndpoint endpoint) {
+    ScopeBuffer *buffer = scope_buffers.get_or_create();
+    if (!buffer) {
+        dropped_scopes.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    append_record(*buffer, {read_timestamp(), name_id, buffer->thread_id, endpoint});
+    if (buffer->changed_metrics) {
+        append_changed_metrics(*buffer);
+    }
+}
+
+static inline void push_scope(uint32_t name_id) {
+    CompassScopeStack &stack = scope_stack;
+    if (!scope_stack_announced) {
+        scope_stack_announced = true;
+        // omp_control_tool only reaches the tool once the runtime is fully
+        // initialized, which omp_get_max_threads makes sure of
+        omp_get_max_threads();
+        omp_control_tool(COMPASS_CONTROL_SCOPE_STACK, 0, &stack);
+    }
+    if (stack.depth < COMPASS_SCOPE_STACK_DEPTH) {
+        stack.ids[stack.depth] = name_id;
+    }
+    // The profiler reads the stack from a signal handler on this thread
+    std::atomic_signal_fence(std::memory_order_release);
+    stack.depth++;
+}
+
+static inline void pop_scope() {
+    CompassScopeStack &stack = scope_stack;
+    if (stack.depth > 0) {
+        stack.depth--;
+    }
+}
+
+void compass_scope_begin(uint32_t name_id) {
+    push_scope(name_id);
+    record_scope(name_id, SCOPE_BEGIN);
+}
+
+void compass_scope_end(uint32_t name_id) {
+    pop_scope();
+    record_scope(name_id, SCOPE_END);
+}
+
+void compass_counter_add(uint32_t id, uint64_t n) {
+    ScopeBuffer *buffer = scope_buffers.get_or_create();
+    if (!buffer || id >= COMPASS_MAX_METRICS) {
+        return;
+    }
+    buffer->metrics[id] += n;
+    buffer->changed_metrics |= 1ull << id;
+}
+
+void compass_value(uint32_t id, double value) {
+    ScopeBuffer *buffer = scope_buffers.get_or_create();
+    if (!buffer || id >= COMPASS_MAX_METRICS) {
+        return;
+    }
+    std::memcpy(&buffer->metrics[id], &value, sizeof(value));
+    buffer->changed_metrics |= 1ull << id;
+}
+
+static void sample_metrics(ScopeBuffer &buffer) {
+    if (buffer.changed_metrics) {
+        append_record(buffer, {read_timestamp(), 0, buffer.thread_id, SCOPE_SAMPLE});
+        append_changed_metrics(buffer);
+    }
+}
+
+void compass_sample_metrics() {
+    ScopeBuffer *buffer = scope_buffers.get_or_create();
+    if (buffer) {
+        sample_metrics(*buffer);
+    }
+}
+
+// One entry of a TRACE_BLOCK_STRINGS payload
+static void append_string(std::string &payload, uint64_t key, const std::string &name) {
+    uint32_t length = (uint32_t)name.size();
+    payload.append(reinterpret_cast<const char *>(&key), sizeof(key));
+    payload.append(reinterpret_cast<const char *>(&length), sizeof(length));
+    payload.append(name);
+}
+
+// Samples the metrics of every thread a last time, writes what is left in the
+// buffers, then the name tables. Threads still recording at this point lose
+// their records.
+static void close_scope_trace() {
+    ScopeTrace &trace = scope_trace();
+    std::vector<ScopeBuffer *> buffers = scope_buffers.all();
+    for (ScopeBuffer *buffer : buffers) {
+        sample_metrics(*buffer);
+    }
+
+    std::lock_guard<std::mutex> guard(trace.lock);
+    for (ScopeBuffer *buffer : buffers) {
+        write_scope_block(trace, *buffer);
+    }
+    trace.closed = true;
+    if (trace.records_lost > 0) {
+        std::cerr << "Lost " << trace.records_lost << " scopes that could not be written to the scope file\n";
+    }
+    if (!trace.file.is_open()) {
+        return;
+    }
+
+    std::string payload;
+    for (size_t i = 0; i < trace.names.size(); i++) {
+        append_string(payload, i + 1, trace.names[i]);
+    }
+    for (size_t i = 0; i < trace.metric_names.size(); i++) {
+        append_string(payload, SCOPE_METRIC_KEY((uint32_t)i), trace.metric_names[i]);
+    }
+    trace.file.write_block(TRACE_BLOCK_STRINGS, 0, payload.data(), payload.size());
+
+    uint64_t dropped = dropped_scopes.load();
+    if (dropped > 0) {
+        std::cerr << "Dropped " << dropped << " scopes of threads beyond " << MAX_REGISTERED_THREADS << "\n";
+    }
+    std::string meta = "records=" + std::to_string(trace.records_written) + "\n" +
+                       "dropped=" + std::to_string(dropped) + "\n";
+    trace.file.write_block(TRACE_BLOCK_META, 0, meta.data(), meta.size());
+    trace.file.close();
+}
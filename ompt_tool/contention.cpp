@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "call_stack.h"
+#include "contention.h"
+#include "helper.h"
+#include "histogram.h"
+#include "symbolizer.h"
+#include "thread_registry.h"
+#include "timestamp.h"
+
+
+// A lock as acquired from one call site and call stack
+struct LockSiteKey {
+    ompt_wait_id_t wait_id;
+    uint64_t codeptr_ra;
+    ompt_mutex_t kind;
+    uint32_t stack_id;      // NO_CALL_STACK unless mutex stacks are captured
+
+    bool operator==(const LockSiteKey &other) const {
+        return wait_id == other.wait_id && codeptr_ra == other.codeptr_ra && kind == other.kind &&
+               stack_id == other.stack_id;
+    }
+};
+
+struct LockSiteKeyHash {
+    size_t operator()(const LockSiteKey &key) const {
+        return std::hash<uint64_t>()(key.wait_id * 0x9E3779B97F4A7C15ull ^ key.codeptr_ra ^ (uint64_t)key.stack_id << 48);
+    }
+};
+
+// Durations in timestamp ticks
+struct LockSiteStats {
+    LogHistogram wait;
+    LogHistogram hold;
+};
+
+struct HeldMutex {
+    ompt_wait_id_t wait_id;
+    uint64_t acquired;
+    LockSiteStats *stats;
+};
+
+// Statistics of one OpenMP thread, only written by that thread
+struct alignas(64) ThreadContention {
+    uint64_t thread_id = 0;
+
+    // mutex_acquire not yet matched by mutex_acquired. A thread waits for one
+    // mutex at a time; a failed test lock is simply overwritten by the next acquire.
+    uint64_t acquire_start = 0;
+    ompt_wait_id_t acquire_wait_id = 0;
+    uint64_t acquire_codeptr = 0;
+    uint32_t acquire_stack = NO_CALL_STACK;
+
+    std::vector<HeldMutex> held;
+    // Values never move when the map grows, so held entries can point at them
+    std::unordered_map<LockSiteKey, LockSiteStats, LockSiteKeyHash> sites;
+};
+
+static PerThreadRegistry<ThreadContention> contentions("COMPASS_CONTENTION");
+
+void contention_mutex_acquire(ompt_wait_id_t wait_id, const void *codeptr_ra, uint32_t stack_id) {
+    ThreadContention *contention = contentions.get_or_create();
+    if (!contention) {
+        return;
+    }
+    contention->acquire_wait_id = wait_id;
+    contention->acquire_codeptr = reinterpret_cast<uint64_t>(codeptr_ra);
+    contention->acquire_stack = stack_id;
+    contention->acquire_start = read_timestamp();
+}
+
+void contention_mutex_acquired(ompt_mutex_t kind, ompt_wait_id_t wait_id, const void *codeptr_ra, uint64_t thread_id) {
+    ThreadContention *contention = contentions.get_or_create();
+    if (!contention) {
+        return;
+    }
+    uint64_t now = read_timestamp();
+    contention->thread_id = thread_id;
+
+    // Attribute the acquisition to the call site that started waiting
+    uint64_t waited = 0;
+    uint64_t codeptr = reinterpret_cast<uint64_t>(codeptr_ra);
+    uint32_t stack_id = NO_CALL_STACK;
+    if (contention->acquire_start && contention->acquire_wait_id == wait_id) {
+        waited = now - contention->acquire_start;
+        codeptr = contention->acquire_codeptr;
+        stack_id = contention->acquire_stack;
+    }
+    contention->acquire_start = 0;
+
+    LockSiteStats &stats = contention->sites[{wait_id, codeptr, kind, stack_id}];
+    stats.wait.record(waited);
+    contention->held.push_back({wait_id, now, &stats});
+}
+
+void contention_mutex_released(ompt_wait_id_t wait_id) {
+    ThreadContention *contention = contentions.get_or_create();
+    if (!contention) {
+        return;
+    }
+    std::vector<HeldMutex> &held = contention->held;
+    // Locks are usually released in reverse order of acquisition
+    for (size_t i = held.size(); i-- > 0;) {
+        if (held[i].wait_id == wait_id) {
+            held[i].stats->hold.record(read_timestamp() - held[i].acquired);
+            held[i] = held.back();
+            held.pop_back();
+            return;
+        }
+    }
+}
+
+struct ContentionRow {
+    ompt_mutex_t kind;
+    LockSiteStats stats;
+    std::set<uint64_t> threads;
+};
+
+static void merge_row(ContentionRow &row, ompt_mutex_t kind, const LockSiteStats &stats, uint64_t thread_id) {
+    row.kind = kind;
+    row.stats.wait.merge(stats.wait);
+    row.stats.hold.merge(stats.hold);
+    row.threads.insert(thread_id);
+}
+
+enum SymbolColumn {
+    SYMBOL_NONE,
+    SYMBOL_SITE,        // the id is a code pointer
+    SYMBOL_STACK        // the id is a call stack
+};
+
+// Site rows end with the symbolized call site and stack rows with the frames
+// of the stack, innermost first; lock rows leave it empty
+static void write_rows(std::ofstream &out, const char *scope, const std::map<uint64_t, ContentionRow> &rows,
+                       SymbolColumn symbol) {
+    std::vector<std::pair<uint64_t, const ContentionRow *>> sorted;
+    for (const auto &[id, row] : rows) {
+        sorted.emplace_back(id, &row);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+        return a.second->stats.wait.total > b.second->stats.wait.total;
+    });
+
+    for (const auto &[id, row] : sorted) {
+        const LogHistogram &wait = row->stats.wait;
+        const LogHistogram &hold = row->stats.hold;
+        out << scope << "," << ompt_mutex_t_to_string(row->kind) << ",0x" << std::hex << id << std::dec << ","
+            << wait.count << "," << row->threads.size() << ","
+            << ticks_to_ns(wait.total) << "," << ticks_to_ns(wait.percentile(50)) << ","
+            << ticks_to_ns(wait.percentile(90)) << "," << ticks_to_ns(wait.percentile(99)) << ","
+            << ticks_to_ns(wait.max) << ","
+            << ticks_to_ns(hold.total) << "," << ticks_to_ns(hold.percentile(50)) << ","
+            << ticks_to_ns(hold.percentile(99)) << "," << ticks_to_ns(hold.max) << ","
+            << (symbol == SYMBOL_SITE ? csv_field(format_symbol(lookup_symbol(id)))
+                : symbol == SYMBOL_STACK ? csv_field(format_call_stack((uint32_t)id, ";")) : "") << "\n";
+    }
+}
+
+void write_contention_profile() {
+    // wait_id -> row, codeptr_ra -> row and stack id -> row, merged over threads
+    std::map<uint64_t, ContentionRow> locks;
+    std::map<uint64_t, ContentionRow> sites;
+    std::map<uint64_t, ContentionRow> stacks;
+    for (ThreadContention *contention : contentions.all()) {
+        for (const auto &[key, stats] : contention->sites) {
+            merge_row(locks[key.wait_id], key.kind, stats, contention->thread_id);
+            merge_row(sites[key.codeptr_ra], key.kind, stats, contention->thread_id);
+            if (key.stack_id != NO_CALL_STACK) {
+                merge_row(stacks[key.stack_id], key.kind, stats, contention->thread_id);
+            }
+        }
+    }
+
+    std::ofstream out(CONTENTION_PROFILE_FILE_NAME);
+    if (!out) {
+        std::cerr << "Could not open " << CONTENTION_PROFILE_FILE_NAME << "\n";
+        return;
+    }
+    out << "scope,kind,id,acquisitions,threads,wait_total_ns,wait_p50_ns,wait_p90_ns,wait_p99_ns,wait_max_ns,"
+           "hold_total_ns,hold_p50_ns,hold_p99_ns,hold_max_ns,symbol\n";
+    std::vector<uint64_t> codeptrs;
+    for (const auto &[codeptr, row] : sites) {
+        codeptrs.push_back(codeptr);
+    }
+    symbolize(codeptrs);
+    std::vector<uint32_t> stack_ids;
+    for (const auto &[stack_id, row] : stacks) {
+        stack_ids.push_back((uint32_t)stack_id);
+    }
+    symbolize_call_stacks(stack_ids);
+    write_rows(out, "lock", locks, SYMBOL_NONE);
+    write_rows(out, "site", sites, SYMBOL_SITE);
+    write_rows(out, "stack", stacks, SYMBOL_STACK);
+    std::cout << "Profiled " << locks.size() << " locks from " << sites.size() << " call sites into "
+              << CONTENTION_PROFILE_FILE_NAME << "\n";
+
+    // The stack that waited longest, in full
+    const std::pair<const uint64_t, ContentionRow> *worst = nullptr;
+    for (const auto &entry : stacks) {
+        if (!worst || entry.second.stats.wait.total > worst->second.stats.wait.total) {
+            worst = &entry;
+        }
+    }
+    if (worst && worst->second.stats.wait.total) {
+        std::cout << "Most contended call stack (" << ticks_to_ns(worst->second.stats.wait.total) << " ns waited):\n    "
+                  << format_call_stack((uint32_t)worst->first, "\n    ") << "\n";
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef CONTENTION_H
+#define CONTENTION_H
+
+#include <cstdint>
+#include <omp-tools.h>
+
+// Profile written by write_contention_profile()
+constexpr const char *CONTENTION_PROFILE_FILE_NAME = "logs/contention.csv";
+
+// Per-thread lock statistics, updated from the mutex callbacks without
+// synchronization. Wait time runs from mutex_acquire to mutex_acquired, hold
+// time from mutex_acquired to mutex_released. stack_id is the acquiring call
+// stack from capture_call_stack(), or NO_CALL_STACK.
+void contention_mutex_acquire(ompt_wait_id_t wait_id, const void *codeptr_ra, uint32_t stack_id);
+void contention_mutex_acquired(ompt_mutex_t kind, ompt_wait_id_t wait_id, const void *codeptr_ra, uint64_t thread_id);
+void contention_mutex_released(ompt_wait_id_t wait_id);
+
+/**
+ * @brief Merges every thread's statistics into CONTENTION_PROFILE_FILE_NAME.
+ *
+ * One "lock" row per wait_id and one "site" row per acquiring codeptr_ra, with
+ * the acquisition count, the number of distinct threads that acquired it, and
+ * the total and percentile wait and hold times; site rows also name the
+ * function and source line. When mutex call stacks are captured there is also
+ * one "stack" row per acquiring call stack, naming every frame. Rows are
+ * sorted by total wait time, so the most contended locks, call sites and
+ * stacks come first, and the most contended stack is printed.
+ */
+void write_contention_profile();
+
+#endif // CONTENTION_H
@@ -0,0 +1,480 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+#include "call_stack.h"
+#include "compass.h"
+#include "cpu_profiler.h"
+#include "helper.h"
+#include "ompt_runtime.h"
+#include "parallel_sites.h"
+#include "sampling.h"
+#include "symbolizer.h"
+#include "thread_registry.h"
+#include "timestamp.h"
+#include "tool_config.h"
+#include "trace_buffer.h"
+
+// Older glibc only has the kernel's name for the target thread of SIGEV_THREAD_ID
+#if defined(__linux__) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+constexpr size_t PROFILE_MAX_DEPTH = 128;
+// Distinct (region, scope, stack) entries per thread and the frames they hold
+constexpr size_t PROFILE_STACK_SLOTS = 1 << 12;
+constexpr size_t PROFILE_STACK_PROBES = 32;
+constexpr size_t PROFILE_FRAME_WORDS = 1 << 16;
+// Last samples of each thread kept for CPU_SAMPLES_FILE_NAME
+constexpr size_t PROFILE_RING_SIZE = 4096;
+constexpr size_t PROFILE_REPORT_REGIONS = 5;
+constexpr size_t PROFILE_REPORT_FUNCTIONS = 5;
+
+struct ProfileStack {
+    uint64_t hash = 0;          // 0 for an unused slot
+    uint64_t site = 0;          // parallel region call site, 0 outside of regions
+    uint32_t scope = 0;         // innermost compass scope, 0 for none
+    uint32_t depth = 0;
+    uint32_t frames = 0;        // offset of the frames in frame_pool, innermost first
+    uint64_t samples = 0;
+};
+
+struct ProfileSample {
+    uint64_t time;
+    uint64_t parallel_id;
+    uint64_t task_id;
+    uint64_t pc;
+    uint32_t scope;
+};
+
+// Samples of one OpenMP thread, only written by the signal handler running on
+// that thread, so it needs no synchronization and never allocates
+struct alignas(64) ThreadProfile {
+    uint64_t thread_id = 0;
+    timer_t timer{};
+    std::atomic<bool> armed{false};
+    StackRange stack;                       // looked up at thread begin, the handler cannot
+    const CompassScopeStack *scopes = nullptr;
+    uint64_t sample_count = 0;              // the last PROFILE_RING_SIZE are in ring
+    uint64_t dropped = 0;                   // samples whose stack did not fit
+    size_t frames_used = 0;
+    ProfileStack stacks[PROFILE_STACK_SLOTS];
+    uint64_t frame_pool[PROFILE_FRAME_WORDS];
+    ProfileSample ring[PROFILE_RING_SIZE];
+};
+
+static PerThreadRegistry<ThreadProfile> thread_profiles("COMPASS_CPU_PROFILE");
+static std::atomic<bool> profiler_running{false};
+// Scope names are looked up in the application, which hands over its scope stacks
+static std::atomic<void (*)(uint32_t, char *, size_t)> copy_scope_name{nullptr};
+
+static uint64_t hash_stack(uint64_t site, uint32_t scope, const uint64_t *frames, size_t depth) {
+    uint64_t hash = (site ^ ((uint64_t)scope << 32)) * 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < depth; i++) {
+        hash = (hash ^ frames[i]) * 0x100000001B3ull;
+        hash ^= hash >> 29;
+    }
+    return hash ? hash : 1;
+}
+
+static void count_stack(ThreadProfile &profile, uint64_t site, uint32_t scope, const uint64_t *frames, size_t depth) {
+    uint64_t hash = hash_stack(site, scope, frames, depth);
+    for (size_t probe = 0; probe < PROFILE_STACK_PROBES; probe++) {
+        ProfileStack &entry = profile.stacks[(hash + probe) % PROFILE_STACK_SLOTS];
+        if (entry.hash == 0) {
+            if (profile.frames_used + depth > PROFILE_FRAME_WORDS) {
+                break;
+            }
+            std::copy(frames, frames + depth, profile.frame_pool + profile.frames_used);
+            entry.hash = hash;
+            entry.site = site;
+            entry.scope = scope;
+            entry.depth = (uint32_t)depth;
+            entry.frames = (uint32_t)profile.frames_used;
+            entry.samples = 1;
+            profile.frames_used += depth;
+            return;
+        }
+        if (entry.hash == hash && entry.site == site && entry.scope == scope && entry.depth == depth &&
+            std::equal(frames, frames + depth, profile.frame_pool + entry.frames)) {
+            entry.samples++;
+            return;
+        }
+    }
+    profile.dropped++;
+}
+
+static uint32_t innermost_scope(const ThreadProfile &profile) {
+    const CompassScopeStack *scopes = profile.scopes;
+    if (!scopes) {
+        return 0;
+    }
+    uint32_t depth = std::min(scopes->depth, COMPASS_SCOPE_STACK_DEPTH);
+    std::atomic_signal_fence(std::memory_order_acquire);
+    return depth > 0 ? scopes->ids[depth - 1] : 0;
+}
+
+#ifdef __linux__
+
+// Runs on the sampled thread in signal context: only OMPT inquiry functions,
+// which are async-signal-safe, reads of the thread's own stack and stores into
+// its own ThreadProfile
+static void take_cpu_sample(ThreadProfile &profile, void *context) {
+    uintptr_t pc = 0;
+    uintptr_t fp = 0;
+    uintptr_t sp = 0;
+    const ucontext_t *registers = static_cast<const ucontext_t *>(context);
+#if defined(__x86_64__)
+    pc = (uintptr_t)registers->uc_mcontext.gregs[REG_RIP];
+    fp = (uintptr_t)registers->uc_mcontext.gregs[REG_RBP];
+    sp = (uintptr_t)registers->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    pc = (uintptr_t)registers->uc_mcontext.pc;
+    fp = (uintptr_t)registers->uc_mcontext.regs[29];
+    sp = (uintptr_t)registers->uc_mcontext.sp;
+#else
+    (void)registers;
+#endif
+
+    int flags = 0;
+    int thread_num = 0;
+    ompt_data_t *task_data = nullptr;
+    ompt_data_t *parallel_data = nullptr;
+    ompt_frame_t *task_frame = nullptr;
+    if (!ompt_runtime.get_task_info ||
+        ompt_runtime.get_task_info(0, &flags, &task_data, &task_frame, &parallel_data, &thread_num) != 2) {
+        task_data = nullptr;
+        parallel_data = nullptr;
+        task_frame = nullptr;
+    }
+    // Inside the runtime the frame pointer register holds anything; the task's
+    // enter frame is where it called into the runtime
+    if (task_frame && task_frame->enter_frame.ptr) {
+        fp = (uintptr_t)task_frame->enter_frame.ptr;
+        if (!(task_frame->enter_frame_flags & ompt_frame_framepointer)) {
+            // A canonical frame address lies just above the frame record
+            fp -= 2 * sizeof(uintptr_t);
+        }
+    }
+
+    uint64_t frames[PROFILE_MAX_DEPTH];
+    size_t depth = 0;
+    if (pc) {
+        frames[depth++] = pc;
+    }
+    if (profile.stack.high > profile.stack.low) {
+        depth += follow_frame_pointers(fp, sp, profile.stack, frames + depth, PROFILE_MAX_DEPTH - depth);
+    }
+
+    uint64_t parallel_id = parallel_data ? parallel_data->value : TRACE_ID_NONE;
+    uint32_t scope = innermost_scope(profile);
+    count_stack(profile, parallel_site(parallel_id), scope, frames, depth);
+
+    ProfileSample &sample = profile.ring[profile.sample_count % PROFILE_RING_SIZE];
+    sample.time = read_timestamp();
+    sample.parallel_id = parallel_id;
+    sample.task_id = task_data ? task_data->value & ~TASK_SAMPLED_BIT : TRACE_ID_NONE;
+    sample.pc = pc;
+    sample.scope = scope;
+    profile.sample_count++;
+}
+
+static struct sigaction previous_sigprof;
+
+// SIGPROF that is not one of our timers goes to whatever handler was installed
+// before, such as the thread state sampler's
+static void forward_sigprof(int signal, siginfo_t *info, void *context) {
+    if (previous_sigprof.sa_flags & SA_SIGINFO) {
+        if (previous_sigprof.sa_sigaction) {
+            previous_sigprof.sa_sigaction(signal, info, context);
+        }
+    } else if (previous_sigprof.sa_handler != SIG_DFL && previous_sigprof.sa_handler != SIG_IGN) {
+        previous_sigprof.sa_handler(signal);
+    }
+}
+
+static void on_sigprof(int signal, siginfo_t *info, void *context) {
+    ThreadProfile *profile = nullptr;
+    // Only our own timers carry a ThreadProfile, other timers may carry anything
+    if (info && info->si_code == SI_TIMER && thread_profiles.contains(info->si_value.sival_ptr)) {
+        profile = static_cast<ThreadProfile *>(info->si_value.sival_ptr);
+    }
+    if (!profile) {
+        forward_sigprof(signal, info, context);
+        return;
+    }
+    if (!profiler_running.load(std::memory_order_relaxed)) {
+        return;
+    }
+    int saved_errno = errno;
+    take_cpu_sample(*profile, context);
+    errno = saved_errno;
+}
+
+bool start_cpu_profiler() {
+    struct sigaction action = {};
+    action.sa_sigaction = on_sigprof;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previous_sigprof) != 0) {
+        std::cerr << "COMPASS_CPU_PROFILE: could not install the SIGPROF handler\n";
+        return false;
+    }
+    profiler_running.store(true);
+    return true;
+}
+
+void cpu_profiler_thread_begin(uint64_t thread_id) {
+    if (!profiler_running.load(std::memory_order_relaxed)) {
+        return;
+    }
+    // Registered before the timer is armed, so the handler recognizes the first signal
+    ThreadProfile *profile = thread_profiles.get_or_create();
+    if (!profile) {
+        return;
+    }
+    profile->thread_id = thread_id;
+    profile->stack = current_stack_range();
+
+    // The thread's CPU time clock, so a thread is sampled while it runs,
+    // spinning in the runtime included, and not while it sleeps
+    struct sigevent event = {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_value.sival_ptr = profile;
+    event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &profile->timer) != 0) {
+        std::cerr << "COMPASS_CPU_PROFILE: could not create the timer of thread " << thread_id << "\n";
+        return;
+    }
+    uint64_t interval_ns = 1000000000ull / tool_config.cpu_profile_hz;
+    struct itimerspec spec = {};
+    spec.it_interval.tv_sec = (time_t)(interval_ns / 1000000000ull);
+    spec.it_interval.tv_nsec = (long)(interval_ns % 1000000000ull);
+    spec.it_value = spec.it_interval;
+    timer_settime(profile->timer, 0, &spec, nullptr);
+    profile->armed.store(true, std::memory_order_release);
+}
+
+static void disarm_profile_timer(ThreadProfile &profile) {
+    if (profile.armed.exchange(false)) {
+        timer_delete(profile.timer);
+    }
+}
+
+void cpu_profiler_thread_end() {
+    ThreadProfile *profile = thread_profiles.local();
+    if (profile) {
+        disarm_profile_timer(*profile);
+    }
+}
+
+void stop_cpu_profiler() {
+    profiler_running.store(false);
+    for (ThreadProfile *profile : thread_profiles.all()) {
+        disarm_profile_timer(*profile);
+    }
+}
+
+#else
+
+bool start_cpu_profiler() {
+    std::cerr << "COMPASS_CPU_PROFILE: per-thread timers are not supported on this platform\n";
+    return false;
+}
+
+void cpu_profiler_thread_begin(uint64_t) {}
+void cpu_profiler_thread_end() {}
+void stop_cpu_profiler() {}
+
+#endif
+
+int cpu_profiler_control_tool(uint64_t command, void *arg) {
+    if (command != COMPASS_CONTROL_SCOPE_STACK || !arg) {
+        return omp_control_tool_ignored;
+    }
+    const CompassScopeStack *scopes = static_cast<const CompassScopeStack *>(arg);
+    if (scopes->copy_name) {
+        copy_scope_name.store(scopes->copy_name);
+    }
+    ThreadProfile *profile = thread_profiles.local();
+    if (!profile) {
+        return omp_control_tool_ignored;
+    }
+    profile->scopes = scopes;
+    return omp_control_tool_success;
+}
+
+static std::string scope_name(uint32_t scope) {
+    auto copy_name = copy_scope_name.load();
+    if (!copy_name) {
+        return std::to_string(scope);
+    }
+    char name[256];
+    copy_name(scope, name, sizeof(name));
+    return name;
+}
+
+// Function of an address for the folded stacks, which separate frames by ';'.
+// Addresses in modules without symbols fold into the module's file name.
+static std::string frame_name(uint64_t address) {
+    const Symbol &symbol = lookup_symbol(address);
+    std::string name = symbol.function;
+    if (name.empty()) {
+        name = symbol.module.empty() ? format_symbol(symbol) : symbol.module.substr(symbol.module.rfind('/') + 1);
+    }
+    std::replace(name.begin(), name.end(), ';', ':');
+    return name;
+}
+
+static std::string region_name(uint64_t site) {
+    if (!site) {
+        return "[serial]";
+    }
+    std::string name = "[parallel " + format_symbol(lookup_symbol(site)) + "]";
+    std::replace(name.begin(), name.end(), ';', ':');
+    return name;
+}
+
+static void write_cpu_samples(const std::vector<ThreadProfile *> &threads) {
+    std::ofstream out(CPU_SAMPLES_FILE_NAME);
+    if (!out) {
+        std::cerr << "Could not open " << CPU_SAMPLES_FILE_NAME << "\n";
+        return;
+    }
+    out << "thread,time_ns,parallel_id,task_id,scope,function\n";
+    for (const ThreadProfile *profile : threads) {
+        uint64_t kept = std::min<uint64_t>(profile->sample_count, PROFILE_RING_SIZE);
+        for (uint64_t i = profile->sample_count - kept; i < profile->sample_count; i++) {
+            const ProfileSample &sample = profile->ring[i % PROFILE_RING_SIZE];
+            out << profile->thread_id << "," << timestamp_to_ns(sample.time) << ",";
+            if (sample.parallel_id != TRACE_ID_NONE) {
+                out << sample.parallel_id;
+            }
+            out << ",";
+            if (sample.task_id != TRACE_ID_NONE) {
+                out << sample.task_id;
+            }
+            out << "," << (sample.scope ? csv_field(scope_name(sample.scope)) : "") << ","
+                << (sample.pc ? csv_field(format_symbol(lookup_symbol(sample.pc))) : "") << "\n";
+        }
+    }
+}
+
+struct RegionProfile {
+    uint64_t samples = 0;
+    std::map<std::string, uint64_t> self;   // samples per innermost function
+};
+
+void write_cpu_profile() {
+    std::vector<ThreadProfile *> threads = thread_profiles.all();
+    std::stable_sort(threads.begin(), threads.end(), [](const ThreadProfile *a, const ThreadProfile *b) {
+        return a->thread_id < b->thread_id;
+    });
+
+    std::vector<uint64_t> addresses;
+    for (const ThreadProfile *profile : threads) {
+        for (const ProfileStack &entry : profile->stacks) {
+            if (entry.hash) {
+                addresses.push_back(entry.site);
+            }
+        }
+        addresses.insert(addresses.end(), profile->frame_pool, profile->frame_pool + profile->frames_used);
+        uint64_t kept = std::min<uint64_t>(profile->sample_count, PROFILE_RING_SIZE);
+        for (uint64_t i = profile->sample_count - kept; i < profile->sample_count; i++) {
+            addresses.push_back(profile->ring[i % PROFILE_RING_SIZE].pc);
+        }
+    }
+    std::sort(addresses.begin(), addresses.end());
+    addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+    addresses.erase(std::remove(addresses.begin(), addresses.end(), 0), addresses.end());
+    symbolize(addresses);
+
+    // Stacks that only differ in return addresses within the same functions fold into one line
+    std::map<std::string, uint64_t> folded;
+    std::map<std::string, RegionProfile> regions;
+    std::map<uint64_t, std::string> names;
+    auto name_of = [&names](uint64_t address) -> const std::string & {
+        auto found = names.find(address);
+        if (found == names.end()) {
+            found = names.emplace(address, frame_name(address)).first;
+        }
+        return found->second;
+    };
+    uint64_t total = 0;
+    uint64_t dropped = 0;
+    for (const ThreadProfile *profile : threads) {
+        for (const ProfileStack &entry : profile->stacks) {
+            if (!entry.hash) {
+                continue;
+            }
+            std::string region = region_name(entry.site);
+            std::string line = region + ";[thread " + std::to_string(profile->thread_id) + "]";
+            if (entry.scope) {
+                line += ";[" + scope_name(entry.scope) + "]";
+            }
+            const uint64_t *frames = profile->frame_pool + entry.frames;
+            for (uint32_t i = entry.depth; i > 0; i--) {
+                line += ";" + name_of(frames[i - 1]);
+            }
+            folded[line] += entry.samples;
+
+            RegionProfile &region_profile = regions[region];
+            region_profile.samples += entry.samples;
+            region_profile.self[entry.depth > 0 ? name_of(frames[0]) : "[unknown]"] += entry.samples;
+            total += entry.samples;
+        }
+        dropped += profile->dropped;
+    }
+
+    std::ofstream out(CPU_PROFILE_FILE_NAME);
+    if (!out) {
+        std::cerr << "Could not open " << CPU_PROFILE_FILE_NAME << "\n";
+        return;
+    }
+    for (const auto &[line, samples] : folded) {
+        out << line << " " << samples << "\n";
+    }
+    write_cpu_samples(threads);
+
+    std::cout << "CPU profile of " << total << " samples from " << threads.size() << " threads at "
+              << tool_config.cpu_profile_hz << " Hz written to " << CPU_PROFILE_FILE_NAME << "\n";
+    std::vector<std::pair<const std::string *, const RegionProfile *>> region_rows;
+    for (const auto &[name, region] : regions) {
+        region_rows.emplace_back(&name, &region);
+    }
+    std::stable_sort(region_rows.begin(), region_rows.end(), [](const auto &a, const auto &b) {
+        return a.second->samples > b.second->samples;
+    });
+    for (size_t i = 0; i < region_rows.size() && i < PROFILE_REPORT_REGIONS; i++) {
+        const RegionProfile &region = *region_rows[i].second;
+        std::vector<std::pair<std::string, uint64_t>> functions(region.self.begin(), region.self.end());
+        std::stable_sort(functions.begin(), functions.end(), [](const auto &a, const auto &b) {
+            return a.second > b.second;
+        });
+        std::ostringstream shares;
+        shares << std::fixed << std::setprecision(1);
+        for (size_t j = 0; j < functions.size() && j < PROFILE_REPORT_FUNCTIONS; j++) {
+            shares << (j ? ", " : "") << (double)functions[j].second * 100 / (double)region.samples << "% "
+                   << functions[j].first;
+        }
+        std::cout << "  " << *region_rows[i].first << ": " << region.samples << " samples, " << shares.str()
+                  << "\n";
+    }
+    if (dropped > 0) {
+        std::cout << "  " << dropped << " samples did not fit the " << PROFILE_STACK_SLOTS
+                  << " stacks kept per thread and are not in the profile\n";
+    }
+}
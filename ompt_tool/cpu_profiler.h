@@ -0,0 +1,47 @@
+#ifndef CPU_PROFILER_H
+#define CPU_PROFILER_H
+
+#include <cstdint>
+
+// Reports written by write_cpu_profile()
+constexpr const char *CPU_PROFILE_FILE_NAME = "logs/cpu_profile.folded";
+constexpr const char *CPU_SAMPLES_FILE_NAME = "logs/cpu_samples.csv";
+
+// Sampling CPU profiler. Every OpenMP thread gets a POSIX timer on its own CPU
+// time clock that sends it SIGPROF cpu_profile_hz times per second the thread
+// runs. The handler unwinds the interrupted thread by its frame pointers and
+// tags the stack with the thread's parallel region and task from the OMPT
+// inquiry functions and with its innermost compass scope. While the thread is
+// inside the runtime, which is usually built without frame pointers, the walk
+// continues from the frame the task entered the runtime from. Stacks are
+// counted in a fixed-size table per thread, so the handler never allocates;
+// samples whose stack no longer fits are counted as dropped. Region call
+// sites come from parallel_begin (see parallel_sites.h); without it every
+// sample is counted as serial. Linux only.
+
+// Installs the SIGPROF handler; returns false where per-thread timers are not available
+bool start_cpu_profiler();
+// Stops every thread's timer, before the report is written
+void stop_cpu_profiler();
+
+void cpu_profiler_thread_begin(uint64_t thread_id);
+void cpu_profiler_thread_end();
+
+// Handles omp_control_tool() commands of the application: the compass scope
+// stack of the calling thread (see compass.h). Returns the value
+// omp_control_tool() returns to the application.
+int cpu_profiler_control_tool(uint64_t command, void *arg);
+
+/**
+ * @brief Writes the profile as folded stacks to CPU_PROFILE_FILE_NAME.
+ *
+ * One line per distinct stack in the format of Brendan Gregg's FlameGraph
+ * scripts: the parallel region's call site (or "[serial]"), the thread, the
+ * compass scope if any, then the functions from the outermost to the
+ * innermost, separated by ';' and followed by the sample count. Regions are
+ * told apart by call site; the last samples of each thread with their exact
+ * parallel region and task ids go to CPU_SAMPLES_FILE_NAME.
+ */
+void write_cpu_profile();
+
+#endif // CPU_PROFILER_H
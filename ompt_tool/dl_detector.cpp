@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
@@ -6,9 +9,13 @@
 #include <fstream>
 #include <thread>
 #include <vector>
+#include "call_stack.h"
 #include "dl_detector.h"
+#include "event_queue.h"
+#include "tool_config.h"
+#include "wait_for_graph.h"
 #include <omp-tools.h>
-#include <boost/lockfree/queue.hpp>
+#include <pthread.h>
 
 enum EventType {
     ACQUIRE,
@@ -28,21 +35,119 @@ struct SynchEvent {
     ompt_mutex_t kind;
     ompt_wait_id_t wait_id;
     uint64_t thread_id;
+    uint32_t stack_id;      // call stack of an acquire or barrier, NO_CALL_STACK if not captured
 };
 
-static boost::lockfree::queue<SynchEvent> event_queue{1024};
+// Created in start_dl_detector_thread once the capacity is configured, and
+// never freed for the same reason as detector_wakeup
+static BoundedMpscQueue<SynchEvent> *event_queue = nullptr;
 std::atomic<bool> should_terminate{false};
+// Cleared when the detector thread exits so producers stop queueing events
+// nobody will take
+static std::atomic<bool> detector_running{false};
+static std::atomic<uint64_t> dropped_events{0};
+static std::atomic<uint64_t> blocked_pushes{0};
+
+struct DetectorWakeup {
+    std::mutex mutex;
+    std::condition_variable condition;
+};
+
+// Set while the detector thread sleeps on detector_wakeup. Producers only
+// take its mutex to signal when they see it set.
+static std::atomic<bool> detector_parked{false};
+// Never freed, see ompt_finalize; destroying a condition variable the parked
+// detector still waits on would also block
+static DetectorWakeup *detector_wakeup = new DetectorWakeup();
+
+static void wake_detector() {
+    // Pairs with the fence in wait_for_events: either this sees the detector
+    // parked or the detector sees the event
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (detector_parked.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(detector_wakeup->mutex);
+        detector_wakeup->condition.notify_one();
+    }
+}
+
+// Queues an event for the detector. When the queue is full the event is
+// either dropped and counted, or the producer waits for the detector to make
+// room, depending on tool_config.dl_queue_drop.
+static void push_event(const SynchEvent &event) {
+    if (!detector_running.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (!event_queue->try_push(event)) {
+        if (tool_config.dl_queue_drop) {
+            dropped_events.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        blocked_pushes.fetch_add(1, std::memory_order_relaxed);
+        do {
+            wake_detector();
+            if (!detector_running.load(std::memory_order_relaxed)) {
+                return;
+            }
+            std::this_thread::yield();
+        } while (!event_queue->try_push(event));
+    }
+    wake_detector();
+}
+
+// Waits until the queue has an event or the detector should stop: spins
+// first, then yields, then parks on the condition variable.
+static void wait_for_events() {
+    for (uint32_t i = 0; i < tool_config.dl_spin_iterations; i++) {
+        if (!event_queue->empty() || should_terminate) {
+            return;
+        }
+    }
+    for (uint32_t i = 0; i < tool_config.dl_yield_iterations; i++) {
+        if (!event_queue->empty() || should_terminate) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+    if (!tool_config.dl_park) {
+        while (event_queue->empty() && !should_terminate) {
+            std::this_thread::yield();
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(detector_wakeup->mutex);
+    // Publishing parked before re-checking the queue pairs with the push
+    // before the parked check in wake_detector, so no wakeup is lost
+    detector_parked.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    detector_wakeup->condition.wait(lock, [] { return !event_queue->empty() || should_terminate; });
+    detector_parked.store(false);
+}
+
+static void pin_detector_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        std::cerr << "Could not pin the deadlock detector thread to CPU " << cpu << "\n";
+    }
+#else
+    std::cerr << "COMPASS_DL_CPU: thread pinning is not supported on this platform\n";
+#endif
+}
 
 
-void process_mutex_acquire(ompt_mutex_t kind, ompt_wait_id_t wait_id, uint64_t thread_id) {
+void process_mutex_acquire(ompt_mutex_t kind, ompt_wait_id_t wait_id, uint64_t thread_id, uint32_t stack_id) {
     SynchEvent event{
         .type = EventType::ACQUIRE,
         .kind = kind,
         .wait_id = wait_id,
-        .thread_id = thread_id
+        .thread_id = thread_id,
+        .stack_id = stack_id
     };
     
-    event_queue.push(event); 
+    push_event(event);
 }
 
 void process_mutex_acquired(ompt_mutex_t kind, ompt_wait_id_t wait_id, uint64_t thread_id) {
@@ -53,7 +158,7 @@ void process_mutex_acquired(ompt_mutex_t kind, ompt_wait_id_t wait_id, uint64_t
         .thread_id = thread_id
     };
     
-    event_queue.push(event); 
+    push_event(event);
 }
 
 void process_mutex_released(ompt_mutex_t kind, ompt_wait_id_t wait_id, uint64_t thread_id) {
@@ -64,248 +169,178 @@ void process_mutex_released(ompt_mutex_t kind, ompt_wait_id_t wait_id, uint64_t
         .thread_id = thread_id
     };
     
-    event_queue.push(event); 
+    push_event(event);
 }
 
-void process_barrier(ompt_sync_region_t kind, ompt_scope_endpoint_t endpoint, uint64_t thread_id) {
+void process_barrier(ompt_sync_region_t kind, ompt_scope_endpoint_t endpoint, uint64_t thread_id, uint32_t stack_id) {
     if (kind == ompt_sync_region_barrier_explicit) {
         SynchEvent event{
             .type = endpoint == ompt_scope_begin ? EventType::BARRIER_BEGIN : EventType::BARRIER_END,
-            .thread_id = thread_id
+            .thread_id = thread_id,
+            .stack_id = stack_id
         };
 
-        event_queue.push(event);
-
+        push_event(event);
     }
 }
 
 void start_dl_detector_thread() {
+    event_queue = new BoundedMpscQueue<SynchEvent>(tool_config.dl_queue_capacity);
+    detector_running = true;
     std::thread(dl_detector_thread).detach(); // Assign new thread
 }
 
 void end_dl_detector_thread() {
     should_terminate = true;
+    std::lock_guard<std::mutex> lock(detector_wakeup->mutex);
+    detector_wakeup->condition.notify_one();
 }
 
-class DirectedGraph {
-private:
-    std::unordered_map<std::string, std::unordered_set<std::string>> graph;
-    std::vector<std::string> currentCycle;
-
-    bool dfsCycleDetection(const std::string& node, std::unordered_set<std::string>& visited, 
-                          std::unordered_set<std::string>& recursionStack, 
-                          std::vector<std::string>& cycle) {
-        if (recursionStack.find(node) != recursionStack.end()) {
-            // Found cycle, reconstruct it starting from this node
-            size_t start = 0;
-            for (size_t i = 0; i < cycle.size(); i++) {
-                if (cycle[i] == node) {
-                    start = i;
-                    break;
-                }
-            }
-            currentCycle.clear();
-            for (size_t i = start; i < cycle.size(); i++) {
-                currentCycle.push_back(cycle[i]);
-            }
-            currentCycle.push_back(node);
-            return true;
-        }
-
-        if (visited.find(node) != visited.end()) {
-            return false;
-        }
-
-        visited.insert(node);
-        recursionStack.insert(node);
-        cycle.push_back(node);
-
-        if (graph.find(node) != graph.end()) {
-            for (const auto& neighbor : graph.at(node)) {
-                if (dfsCycleDetection(neighbor, visited, recursionStack, cycle)) {
-                    return true;
-                }
-            }
-        }
-
-        recursionStack.erase(node);
-        cycle.pop_back();
-        return false;
-    }
-
-public:
-    // Add a node to the graph
-    void addNode(const std::string& node) {
-        if (graph.find(node) == graph.end()) {
-            graph[node] = std::unordered_set<std::string>();
-        }
-    }
-
-    // Add a directed edge from node1 to node2
-    void addEdge(const std::string& fromNode, const std::string& toNode) {
-        // Ensure both nodes exist
-        if (graph.find(fromNode) == graph.end() || graph.find(toNode) == graph.end()) {
-            throw std::invalid_argument("One or both nodes do not exist in the graph.");
-        }
-        graph[fromNode].insert(toNode);
-    }
-
-    // Remove a directed edge from node1 to node2
-    void removeEdge(const std::string& fromNode, const std::string& toNode) {
-        if (graph.find(fromNode) != graph.end()) {
-            graph[fromNode].erase(toNode);
-        }
+DetectorQueueStats dl_detector_queue_stats() {
+    DetectorQueueStats stats = {};
+    if (event_queue) {
+        stats.capacity = event_queue->capacity();
+        stats.high_water = event_queue->high_water_mark();
     }
+    stats.blocked = blocked_pushes.load(std::memory_order_relaxed);
+    stats.dropped = dropped_events.load(std::memory_order_relaxed);
+    return stats;
+}
 
-    // Display the graph (for debugging purposes)
-    void display(std::ofstream& outFile) const {
-        outFile << "=== Graph State ===" << std::endl;
-        for (const auto& pair : graph) {
-            outFile << pair.first << " -> { ";
-            bool first = true;
-            for (const auto& neighbor : pair.second) {
-                if (!first) {
-                    outFile << ", ";
-                }
-                outFile << neighbor;
-                first = false;
-            }
-            outFile << " }" << std::endl;
-        }
-    }
-
-
-    bool hasEdge(const std::string& fromNode, const std::string& toNode) const {
-        if (graph.find(fromNode) == graph.end() || graph.find(toNode) == graph.end()) {
-            return false;
+// Prints every edge of the cycle with the call stack behind it: where the
+// thread waits for a mutex or the barrier, or where the mutex's holder
+// acquired it
+static void print_cycle_stacks(const DirectedGraph& graph, const std::vector<uint32_t>& nodeStacks) {
+    const std::vector<uint32_t>& cycle = graph.cycle();
+    std::vector<uint32_t> stack_ids;
+    for (uint32_t node : cycle) {
+        if (node < nodeStacks.size() && nodeStacks[node] != NO_CALL_STACK) {
+            stack_ids.push_back(nodeStacks[node]);
         }
-
-        const auto& neighbors = graph.at(fromNode);
-        return neighbors.find(toNode) != neighbors.end();
     }
-
-    bool hasCycle() {
-        std::unordered_set<std::string> visited;
-        std::unordered_set<std::string> recursionStack;
-        std::vector<std::string> cycle;
-        currentCycle.clear();
-
-        for (const auto& pair : graph) {
-            if (dfsCycleDetection(pair.first, visited, recursionStack, cycle)) {
-                return true;
-            }
-        }
-        return false;
+    if (stack_ids.empty()) {
+        return;
     }
-
-    void displayCycle(std::ofstream& outFile) const {
-        if (currentCycle.empty()) {
-            outFile << "No cycle detected" << std::endl;
-            return;
+    symbolize_call_stacks(stack_ids);
+
+    for (size_t i = 0; i + 1 < cycle.size(); i++) {
+        std::cout << "  ";
+        graph.writeName(std::cout, cycle[i]);
+        // Threads wait for mutexes and the barrier, mutexes are held by threads,
+        // and the barrier waits for the threads that have not arrived
+        bool waits = graph.kind(cycle[i]) == NODE_THREAD || graph.kind(cycle[i]) == NODE_BARRIER;
+        std::cout << (waits ? " waits for " : " is held by ");
+        graph.writeName(std::cout, cycle[i + 1]);
+        std::cout << "\n";
+        uint32_t stack_id = cycle[i] < nodeStacks.size() ? nodeStacks[cycle[i]] : NO_CALL_STACK;
+        if (stack_id != NO_CALL_STACK) {
+            std::cout << "      at " << format_call_stack(stack_id, "\n      at ") << "\n";
         }
-
-        outFile << "=== Deadlock Cycle ===" << std::endl;
-        for (size_t i = 0; i < currentCycle.size(); i++) {
-            outFile << currentCycle[i];
-            if (i < currentCycle.size() - 1) {
-                outFile << " -> ";
-            }
-        }
-        outFile << std::endl;
     }
-};
-
+}
 
 void dl_detector_thread() {
-    DirectedGraph graph;
-    std::unordered_map<std::string, int> threads_to_iteration;
+    std::ofstream outFile("dl_detector_logs/graph_log.txt", std::ios::trunc);
+    DirectedGraph graph(outFile);
+    uint64_t event_index = 0;
+    // Barrier iterations each thread has completed, indexed by thread number;
+    // -1 for threads the detector has not seen yet
+    std::vector<int> threads_to_iteration;
+    // Call stack of each node's outgoing edge: where a thread started waiting
+    // and where a mutex's holder acquired it, indexed by node
+    std::vector<uint32_t> nodeStacks;
     BarrierState barrierState = NOT_IN_USE;
-    std::string barrierName = "Barrier";
+    uint32_t barrierNode = graph.barrierNode();
     int barrier_iteration = 0;
-    std::ofstream outFile("dl_detector_logs/graph_state.txt", std::ios::trunc);
 
-    graph.addNode(barrierName);
+    if (tool_config.dl_cpu >= 0) {
+        pin_detector_thread(tool_config.dl_cpu);
+    }
 
     while (true) {
         SynchEvent event;
 
-        while (event_queue.empty() && !should_terminate) {
-        }
+        wait_for_events();
 
-        if (should_terminate && event_queue.empty()) {
+        if (should_terminate && event_queue->empty()) {
             break;
         }
 
-        if (!event_queue.pop(event)) {
+        if (!event_queue->pop(event)) {
             continue;
         }
 
-        std::string threadName = "Thread: " + std::to_string(event.thread_id);
-        std::string mutexName = "Mutex: " + std::to_string(event.wait_id);
-
-        if (event.kind == ompt_mutex_lock || event.kind == ompt_mutex_test_lock || event.kind == ompt_mutex_nest_lock || event.kind == ompt_mutex_test_nest_lock) {
-            mutexName = "Lock: " + std::to_string(event.wait_id);
-        } else if (event.kind == ompt_mutex_critical) {
-            mutexName = "Critical: " + std::to_string(event.wait_id);
+        if (event.thread_id >= threads_to_iteration.size()) {
+            threads_to_iteration.resize(event.thread_id + 1, -1);
         }
-        
-        if (threads_to_iteration.find(threadName) == threads_to_iteration.end()) {
-            threads_to_iteration[threadName] = 0;
+        if (threads_to_iteration[event.thread_id] < 0) {
+            threads_to_iteration[event.thread_id] = 0;
         }
 
-        graph.addNode(threadName);
+        event_index++;
+        graph.beginEvent(event_index);
+
+        uint32_t threadNode = graph.threadNode(event.thread_id);
+        uint32_t mutexNode = NO_NODE;
         if (event.type == EventType::ACQUIRE || event.type == EventType::ACQUIRED || event.type == EventType::RELEASE) {
-            graph.addNode(mutexName);
+            mutexNode = graph.mutexNode(event.kind, event.wait_id);
         }
+        nodeStacks.resize(graph.nodeCount(), NO_CALL_STACK);
 
         switch (event.type) {
             case EventType::BARRIER_BEGIN:
                 switch (barrierState) {
                     case BarrierState::NOT_IN_USE:
-                        for (const auto& pair : threads_to_iteration) {
-                            graph.addEdge(barrierName, pair.first);
+                        for (uint64_t thread_id = 0; thread_id < threads_to_iteration.size(); thread_id++) {
+                            if (threads_to_iteration[thread_id] >= 0) {
+                                graph.addEdge(barrierNode, graph.threadNode(thread_id));
+                            }
                         }
                         barrierState = BarrierState::IN_USE;
 
-                        graph.removeEdge(barrierName, threadName);
-                        graph.addEdge(threadName, barrierName);
+                        graph.removeEdge(barrierNode, threadNode);
+                        graph.addEdge(threadNode, barrierNode);
                         break;
                     case BarrierState::IN_USE:
-                        graph.removeEdge(barrierName, threadName);
-                        graph.addEdge(threadName, barrierName);
+                        graph.removeEdge(barrierNode, threadNode);
+                        graph.addEdge(threadNode, barrierNode);
                         break;
                 }
+                nodeStacks[threadNode] = event.stack_id;
                 break;
 
             case EventType::BARRIER_END:
                 switch (barrierState) {
                     case BarrierState::NOT_IN_USE:
-                        threads_to_iteration[threadName]++;
+                        threads_to_iteration[event.thread_id]++;
                         break;
                     case BarrierState::IN_USE:
-                        if (threads_to_iteration[threadName] == barrier_iteration) {
-                            for (const auto& pair : threads_to_iteration) {
-                                graph.removeEdge(barrierName, pair.first);
-                                graph.removeEdge(pair.first, barrierName);
+                        if (threads_to_iteration[event.thread_id] == barrier_iteration) {
+                            for (uint64_t thread_id = 0; thread_id < threads_to_iteration.size(); thread_id++) {
+                                if (threads_to_iteration[thread_id] >= 0) {
+                                    graph.removeEdge(barrierNode, graph.threadNode(thread_id));
+                                    graph.removeEdge(graph.threadNode(thread_id), barrierNode);
+                                }
                             }
                             barrierState = NOT_IN_USE;
                             barrier_iteration++;
                         }
                         
-                        threads_to_iteration[threadName]++;
+                        threads_to_iteration[event.thread_id]++;
                         break;
                 }
                 break;
 
             case EventType::ACQUIRE:
+                nodeStacks[threadNode] = event.stack_id;
                 switch (event.kind) {
                     case ompt_mutex_lock:
                     case ompt_mutex_critical:
-                        graph.addEdge(threadName, mutexName);
+                        graph.addEdge(threadNode, mutexNode);
                         break;
                     case ompt_mutex_nest_lock:
-                        if (!graph.hasEdge(mutexName, threadName)) {
-                            graph.addEdge(threadName, mutexName);
+                        if (!graph.hasEdge(mutexNode, threadNode)) {
+                            graph.addEdge(threadNode, mutexNode);
                         }
                         break;
                     case ompt_mutex_test_nest_lock:
@@ -323,8 +358,10 @@ void dl_detector_thread() {
                     case ompt_mutex_nest_lock:
                     case ompt_mutex_test_nest_lock:
                     case ompt_mutex_test_lock:
-                        graph.removeEdge(threadName, mutexName);
-                        graph.addEdge(mutexName, threadName);
+                        graph.removeEdge(threadNode, mutexNode);
+                        graph.addEdge(mutexNode, threadNode);
+                        // The holder acquired it where it started waiting
+                        nodeStacks[mutexNode] = nodeStacks[threadNode];
                         break;
                     case ompt_mutex_atomic:
                     case ompt_mutex_ordered:
@@ -340,7 +377,7 @@ void dl_detector_thread() {
                     case ompt_mutex_nest_lock:
                     case ompt_mutex_test_nest_lock:
                     case ompt_mutex_test_lock:
-                        graph.removeEdge(mutexName, threadName);
+                        graph.removeEdge(mutexNode, threadNode);
                         break;
                     case ompt_mutex_atomic:
                     case ompt_mutex_ordered:
@@ -351,11 +388,20 @@ void dl_detector_thread() {
         
         if (graph.hasCycle()) {
             std::cout << "Deadlock Detected!\n";
-            graph.display(outFile);
-            graph.displayCycle(outFile);
+            print_cycle_stacks(graph, nodeStacks);
+            graph.snapshot();
+            graph.writeCycle();
             break;
         }
-        graph.display(outFile);
+        if (tool_config.dl_snapshot_interval && event_index % tool_config.dl_snapshot_interval == 0) {
+            graph.snapshot();
+        }
     }
+    outFile.flush();
+    detector_running = false;
+
+    DetectorQueueStats stats = dl_detector_queue_stats();
+    std::cout << "Deadlock detector queue: capacity " << stats.capacity << ", high water " << stats.high_water
+              << ", " << stats.blocked << " blocked pushes, " << stats.dropped << " dropped events\n";
     std::cout << "Deadlock Detector Thread Terminated\n";
 }
\ No newline at end of file
@@ -1,15 +1,28 @@
 #ifndef DL_DETECTOR_H
 #define DL_DETECTOR_H
 
+#include <cstddef>
+#include <cstdint>
 #include <omp-tools.h>
 
+// Counters of the queue feeding the deadlock detector thread
+struct DetectorQueueStats {
+    size_t capacity;
+    uint64_t high_water;    // most events queued at once
+    uint64_t blocked;       // pushes that found the queue full and waited
+    uint64_t dropped;       // events discarded because the queue was full
+};
+
 void start_dl_detector_thread();
 void end_dl_detector_thread();
-void process_mutex_acquire(ompt_mutex_t kind, ompt_wait_id_t wait_id, uint64_t thread_id);
+// stack_id is the call stack of an acquire or barrier from capture_call_stack(),
+// or NO_CALL_STACK; a detected deadlock is reported with the stacks of its edges
+void process_mutex_acquire(ompt_mutex_t kind, ompt_wait_id_t wait_id, uint64_t thread_id, uint32_t stack_id);
 void process_mutex_acquired(ompt_mutex_t kind, ompt_wait_id_t wait_id, uint64_t thread_id);
 void process_mutex_released(ompt_mutex_t kind, ompt_wait_id_t wait_id, uint64_t thread_id);
-void process_barrier(ompt_sync_region_t kind, ompt_scope_endpoint_t endpoint, uint64_t thread_id);
+void process_barrier(ompt_sync_region_t kind, ompt_scope_endpoint_t endpoint, uint64_t thread_id, uint32_t stack_id);
 void dl_detector_thread();
+DetectorQueueStats dl_detector_queue_stats();
 
 
 #endif
@@ -0,0 +1,100 @@
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bounded multi-producer single-consumer ring that never allocates after
+// construction. Every slot carries a sequence number: a producer claims a
+// position by advancing tail, writes the value, then publishes it by bumping
+// the slot's sequence, so the consumer sees events in the order their
+// positions were claimed even when producers finish out of order.
+template <typename T>
+class BoundedMpscQueue {
+public:
+    // Capacity is rounded up to a power of two so positions can be masked
+    explicit BoundedMpscQueue(size_t min_capacity) {
+        size_t capacity = 2;
+        while (capacity < min_capacity) {
+            capacity <<= 1;
+        }
+        mask = capacity - 1;
+        slots.reset(new Slot[capacity]);
+        for (size_t i = 0; i < capacity; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns false without waiting if the queue is full
+    bool try_push(const T &value) {
+        uint64_t position = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Slot &slot = slots[position & mask];
+            uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            int64_t difference = (int64_t)(sequence - position);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    slot.value = value;
+                    slot.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer only
+    bool pop(T &value) {
+        uint64_t position = head.load(std::memory_order_relaxed);
+        Slot &slot = slots[position & mask];
+        if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+            return false;
+        }
+        value = slot.value;
+
+        // Depth when this event was taken, including it
+        uint64_t depth = tail.load(std::memory_order_relaxed) - position;
+        if (depth > high_water.load(std::memory_order_relaxed)) {
+            high_water.store(depth, std::memory_order_relaxed);
+        }
+
+        slot.sequence.store(position + mask + 1, std::memory_order_release);
+        head.store(position + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Consumer only. A position that is claimed but not yet published counts
+    // as empty; its producer publishes it right after.
+    bool empty() const {
+        uint64_t position = head.load(std::memory_order_relaxed);
+        return slots[position & mask].sequence.load(std::memory_order_acquire) != position + 1;
+    }
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+    // Most events that were ever queued at once, as seen by the consumer
+    uint64_t high_water_mark() const {
+        return high_water.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> high_water{0};
+};
+
+#endif // EVENT_QUEUE_H
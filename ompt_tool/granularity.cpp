@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "granularity.h"
+#include "helper.h"
+#include "histogram.h"
+#include "symbolizer.h"
+#include "task_origins.h"
+#include "thread_registry.h"
+#include "timestamp.h"
+#include "tool_config.h"
+#include "trace_buffer.h"
+
+constexpr size_t GRANULARITY_REPORT_TOP = 5;
+// A site is too fine-grained when at least this share of its tasks is below the cutoff
+constexpr double GRANULARITY_FINE_SHARE = 0.5;
+
+// Durations in timestamp ticks
+struct TaskSiteStats {
+    LogHistogram busy;
+    uint64_t created = 0;
+    uint64_t below_cutoff = 0;
+    uint64_t create_gap_total = 0;
+    uint64_t create_gaps = 0;
+};
+
+// An explicit task that started on this thread and has not completed
+struct StartedTask {
+    uint64_t codeptr_ra;
+    uint64_t busy = 0;
+    uint64_t resumed = 0;
+    int wait_depth = 0;
+};
+
+// State of one OpenMP thread, only written by that thread
+struct alignas(64) ThreadGranularity {
+    // Elements of an unordered_map never move, so running can point into it
+    std::unordered_map<uint64_t, StartedTask> started;
+    StartedTask *running = nullptr;
+    uint64_t running_task = TRACE_ID_NONE;
+
+    // Previous task_create, while nothing else happened on the thread since
+    uint64_t last_create_parent = TRACE_ID_NONE;
+    uint64_t last_create_codeptr = 0;
+    uint64_t last_create_time = 0;
+
+    std::unordered_map<uint64_t, TaskSiteStats> sites;
+};
+
+static PerThreadRegistry<ThreadGranularity> granularities("COMPASS_GRANULARITY");
+
+void granularity_task_create(uint64_t parent_task, const void *codeptr_ra) {
+    ThreadGranularity *granularity = granularities.get_or_create();
+    if (!granularity) {
+        return;
+    }
+
+    uint64_t now = read_timestamp();
+    uint64_t codeptr = reinterpret_cast<uint64_t>(codeptr_ra);
+
+    TaskSiteStats &site = granularity->sites[codeptr];
+    site.created++;
+    if (granularity->last_create_parent == parent_task && granularity->last_create_codeptr == codeptr) {
+        site.create_gap_total += now - granularity->last_create_time;
+        site.create_gaps++;
+    }
+    granularity->last_create_parent = parent_task;
+    granularity->last_create_codeptr = codeptr;
+    granularity->last_create_time = now;
+}
+
+void granularity_task_schedule(uint64_t prior_task, ompt_task_status_t prior_task_status, uint64_t next_task) {
+    ThreadGranularity *granularity = granularities.get_or_create();
+    if (!granularity) {
+        return;
+    }
+
+    uint64_t now = read_timestamp();
+    granularity->last_create_parent = TRACE_ID_NONE;
+
+    StartedTask *prior = granularity->running;
+    if (prior && granularity->running_task == prior_task) {
+        if (prior->wait_depth == 0) {
+            prior->busy += now - prior->resumed;
+        }
+        if (prior_task_status == ompt_task_complete || prior_task_status == ompt_task_cancel) {
+            if (prior_task_status == ompt_task_complete) {
+                TaskSiteStats &site = granularity->sites[prior->codeptr_ra];
+                site.busy.record(prior->busy);
+                if (ticks_to_ns(prior->busy) < (uint64_t)tool_config.task_cutoff_us * 1000) {
+                    site.below_cutoff++;
+                }
+            }
+            granularity->started.erase(prior_task);
+        }
+    }
+    granularity->running = nullptr;
+    granularity->running_task = TRACE_ID_NONE;
+    if (next_task == TRACE_ID_NONE) {
+        return;
+    }
+
+    auto it = granularity->started.find(next_task);
+    if (it == granularity->started.end()) {
+        // Implicit tasks have no origin, so they are never timed
+        uint64_t site = task_origin(next_task);
+        if (!site) {
+            return;
+        }
+        it = granularity->started.emplace(next_task, StartedTask{site}).first;
+    }
+    it->second.resumed = now;
+    granularity->running = &it->second;
+    granularity->running_task = next_task;
+}
+
+void granularity_sync_region_wait(ompt_scope_endpoint_t endpoint) {
+    ThreadGranularity *granularity = granularities.get_or_create();
+    if (!granularity) {
+        return;
+    }
+    granularity->last_create_parent = TRACE_ID_NONE;
+    StartedTask *running = granularity->running;
+    if (!running) {
+        return;
+    }
+
+    uint64_t now = read_timestamp();
+    if (endpoint == ompt_scope_begin) {
+        if (running->wait_depth++ == 0) {
+            running->busy += now - running->resumed;
+        }
+    } else if (running->wait_depth > 0 && --running->wait_depth == 0) {
+        running->resumed = now;
+    }
+}
+
+static double ticks_to_us(uint64_t ticks) {
+    return ticks_to_ns(ticks) / 1000.0;
+}
+
+void write_granularity_report() {
+    std::map<uint64_t, TaskSiteStats> sites;
+    for (ThreadGranularity *granularity : granularities.all()) {
+        for (const auto &[codeptr, stats] : granularity->sites) {
+            TaskSiteStats &site = sites[codeptr];
+            site.busy.merge(stats.busy);
+            site.created += stats.created;
+            site.below_cutoff += stats.below_cutoff;
+            site.create_gap_total += stats.create_gap_total;
+            site.create_gaps += stats.create_gaps;
+        }
+    }
+
+    auto below_share = [](const TaskSiteStats &site) {
+        return site.busy.count ? (double)site.below_cutoff / (double)site.busy.count : 0.0;
+    };
+    // Largest share of tasks below the cutoff first, then most such tasks, so
+    // the "coarsen" sites lead and the printed list can stop at the first other
+    std::vector<std::pair<uint64_t, const TaskSiteStats *>> rows;
+    uint64_t tasks = 0;
+    for (const auto &[codeptr, site] : sites) {
+        rows.emplace_back(codeptr, &site);
+        tasks += site.busy.count;
+    }
+    std::stable_sort(rows.begin(), rows.end(), [&below_share](const auto &a, const auto &b) {
+        double a_share = below_share(*a.second);
+        double b_share = below_share(*b.second);
+        if (a_share != b_share) {
+            return a_share > b_share;
+        }
+        return a.second->below_cutoff > b.second->below_cutoff;
+    });
+    auto create_cost = [](const TaskSiteStats &site) {
+        return site.create_gaps ? site.create_gap_total / site.create_gaps : 0;
+    };
+
+    std::ofstream out(GRANULARITY_REPORT_FILE_NAME);
+    if (!out) {
+        std::cerr << "Could not open " << GRANULARITY_REPORT_FILE_NAME << "\n";
+        return;
+    }
+    std::vector<uint64_t> codeptrs;
+    for (const auto &[codeptr, site] : sites) {
+        codeptrs.push_back(codeptr);
+    }
+    symbolize(codeptrs);
+
+    out << "site,created,tasks,total_ns,mean_ns,p50_ns,p90_ns,p99_ns,max_ns,create_ns,below_cutoff_pct,advice,symbol\n";
+    for (const auto &[codeptr, site] : rows) {
+        const LogHistogram &busy = site->busy;
+        out << "0x" << std::hex << codeptr << std::dec << "," << site->created << "," << busy.count << ","
+            << ticks_to_ns(busy.total) << "," << ticks_to_ns(busy.count ? busy.total / busy.count : 0) << ","
+            << ticks_to_ns(busy.percentile(50)) << "," << ticks_to_ns(busy.percentile(90)) << ","
+            << ticks_to_ns(busy.percentile(99)) << "," << ticks_to_ns(busy.max) << ","
+            << ticks_to_ns(create_cost(*site)) << ","
+            << std::fixed << std::setprecision(1) << below_share(*site) * 100 << std::defaultfloat << ","
+            << (below_share(*site) >= GRANULARITY_FINE_SHARE ? "coarsen" : "") << ","
+            << csv_field(format_symbol(lookup_symbol(codeptr))) << "\n";
+    }
+
+    std::cout << "Granularity of " << tasks << " tasks from " << sites.size() << " creation sites written to "
+              << GRANULARITY_REPORT_FILE_NAME << "\n";
+    for (size_t i = 0; i < rows.size() && i < GRANULARITY_REPORT_TOP; i++) {
+        const TaskSiteStats &site = *rows[i].second;
+        if (below_share(site) < GRANULARITY_FINE_SHARE) {
+            break;
+        }
+        std::cout << "  " << format_symbol(lookup_symbol(rows[i].first)) << ": " << std::fixed
+                  << std::setprecision(1) << below_share(site) * 100 << "% of " << site.busy.count
+                  << " tasks ran under " << tool_config.task_cutoff_us << " us (median "
+                  << std::setprecision(2) << ticks_to_us(site.busy.percentile(50)) << " us, creation "
+                  << ticks_to_us(create_cost(site)) << " us) - stop creating tasks below a size cutoff"
+                  << " (if or final clause, or a serial base case)\n" << std::defaultfloat;
+    }
+}
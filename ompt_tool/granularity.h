@@ -0,0 +1,33 @@
+#ifndef GRANULARITY_H
+#define GRANULARITY_H
+
+#include <cstdint>
+#include <omp-tools.h>
+
+// Report written by write_granularity_report()
+constexpr const char *GRANULARITY_REPORT_FILE_NAME = "logs/granularity.csv";
+
+// Execution time of explicit tasks per creating call site, updated from the
+// callbacks without synchronization. A task's execution time runs from every
+// switch to it until the next switch away from it, minus the time it spends
+// waiting in taskwaits, task groups and barriers; time its children run while
+// it waits is theirs. Tied tasks are assumed: a task that resumes on another
+// thread only counts from there. The site of a task comes from task_origins.h.
+void granularity_task_create(uint64_t parent_task, const void *codeptr_ra);
+void granularity_task_schedule(uint64_t prior_task, ompt_task_status_t prior_task_status, uint64_t next_task);
+void granularity_sync_region_wait(ompt_scope_endpoint_t endpoint);
+
+/**
+ * @brief Merges the threads' task histograms and writes GRANULARITY_REPORT_FILE_NAME.
+ *
+ * One row per task creation site (codeptr_ra) with the number of tasks, their
+ * total, mean, p50/p90/p99 and maximum execution time, the creation cost, and
+ * the share of tasks that ran for less than COMPASS_TASK_CUTOFF microseconds.
+ * The creation cost is the mean time between two consecutive tasks created by
+ * the same task at the same site, an upper bound on what creating one costs.
+ * Sites where most tasks are below the cutoff are marked "coarsen" and printed,
+ * most fine-grained first.
+ */
+void write_granularity_report();
+
+#endif // GRANULARITY_H
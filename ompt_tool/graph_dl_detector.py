@@ -1,34 +1,48 @@
+import sys
 import networkx as nx
 import matplotlib.pyplot as plt
 
-def parse_graph_state(file_path):
-    with open(file_path, 'r') as f:
-        lines = f.readlines()
+def parse_graph_log(file_path, event=None):
+    """
+    Replays the deadlock detector's graph log (see DirectedGraph in dl_detector.cpp).
 
-    graph_edges = []
+    Returns the edges of the wait-for graph after the given event, or after the
+    last logged event if event is None, together with the deadlock cycle if one
+    was found by then.
+    """
+    names = {}
+    edges = set()
     deadlock_cycle = []
 
-    # Parse the graph state
-    graph_state_section = True
-    for line in lines:
-        line = line.strip()
-        if line.startswith("==="):
-            if "Deadlock Cycle" in line:
-                graph_state_section = False
-            continue
-
-        if graph_state_section:
-            if "->" in line:
-                node, neighbors_str = line.split("->")
-                node = node.strip()
-                neighbors = neighbors_str.strip("{} ").split(", ")
-                for neighbor in neighbors:
-                    graph_edges.append((node, neighbor))
-        else:
-            # Parse the deadlock cycle
-            if "->" in line:
-                deadlock_cycle = line.split(" -> ")
+    with open(file_path, 'r') as f:
+        lines = iter(f)
+        for line in lines:
+            record = line.split()
+            if not record:
+                continue
+            kind = record[0]
+
+            if kind == 'N':
+                names[record[1]] = line.split(' ', 2)[2].strip()
+                continue
+
+            if event is not None and int(record[1]) > event:
+                break
+
+            if kind == '+':
+                edges.add((record[2], record[3]))
+            elif kind == '-':
+                edges.discard((record[2], record[3]))
+            elif kind == 'S':
+                # A snapshot holds the whole graph, so it replaces what was replayed so far
+                edges = set()
+                for _ in range(int(record[2])):
+                    from_node, to_node = next(lines).split()
+                    edges.add((from_node, to_node))
+            elif kind == 'C':
+                deadlock_cycle = [names[node] for node in record[2:]]
 
+    graph_edges = [(names[u], names[v]) for u, v in edges]
     return graph_edges, deadlock_cycle
 
 def plot_graph(graph_edges, deadlock_cycle):
@@ -48,5 +62,7 @@ def plot_graph(graph_edges, deadlock_cycle):
     plt.show()
 
 if __name__ == "__main__":
-    graph_edges, deadlock_cycle = parse_graph_state('./dl_detector_logs/graph_state.txt')
+    # Optional argument: event number to show the graph at, default the last one
+    event = int(sys.argv[1]) if len(sys.argv) > 1 else None
+    graph_edges, deadlock_cycle = parse_graph_log('./dl_detector_logs/graph_log.txt', event)
     plot_graph(graph_edges, deadlock_cycle)
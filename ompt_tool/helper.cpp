@@ -133,6 +133,27 @@ std::string ompt_task_status_t_to_string(ompt_task_status_t taskStatus) {
     }
 }
 
+std::string ompt_dependence_type_t_to_string(ompt_dependence_type_t dependenceType) {
+    switch (dependenceType) {
+        case ompt_dependence_type_in:
+            return "ompt_dependence_type_in";
+        case ompt_dependence_type_out:
+            return "ompt_dependence_type_out";
+        case ompt_dependence_type_inout:
+            return "ompt_dependence_type_inout";
+        case ompt_dependence_type_mutexinoutset:
+            return "ompt_dependence_type_mutexinoutset";
+        case ompt_dependence_type_source:
+            return "ompt_dependence_type_source";
+        case ompt_dependence_type_sink:
+            return "ompt_dependence_type_sink";
+        case ompt_dependence_type_inoutset:
+            return "ompt_dependence_type_inoutset";
+        default:
+            return "Unknown dependence type";
+    }
+}
+
 
 std::string ompt_state_t_to_string(int state) {
     switch (state) {
@@ -200,3 +221,17 @@ std::string ompt_state_t_to_string(int state) {
             return "Unknown state";
     }
 }
+
+std::string csv_field(const std::string &value) {
+    if (value.find_first_of(",\"\n") == std::string::npos) {
+        return value;
+    }
+    std::string quoted = "\"";
+    for (char c : value) {
+        if (c == '"') {
+            quoted += '"';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
@@ -12,6 +12,10 @@ std::string ompt_sync_region_t_to_string(ompt_sync_region_t syncRegion);
 std::string ompt_scope_endpoint_t_to_string(ompt_scope_endpoint_t scopeEndpoint);
 std::string ompt_work_t_to_string(ompt_work_t workType);
 std::string ompt_task_status_t_to_string(ompt_task_status_t taskStatus);
+std::string ompt_dependence_type_t_to_string(ompt_dependence_type_t dependenceType);
 std::string ompt_state_t_to_string(int state);
 
+// Quotes a value for a CSV column if it contains a comma or quote
+std::string csv_field(const std::string &value);
+
 #endif // HELPER_H
\ No newline at end of file
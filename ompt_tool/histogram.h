@@ -0,0 +1,85 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstdint>
+
+/**
+ * @brief Fixed-size log-linear histogram of durations, in the style of HDR
+ * histograms.
+ *
+ * Every power of two is split into 2^HISTOGRAM_SUB_BITS linear buckets, so a
+ * recorded value is known to within 1/8 of itself over the whole uint64_t
+ * range. Recording is a couple of shifts and an increment, and histograms of
+ * different threads are merged by adding their buckets.
+ */
+constexpr uint32_t HISTOGRAM_SUB_BITS = 3;
+constexpr uint32_t HISTOGRAM_SUB_BUCKETS = 1u << HISTOGRAM_SUB_BITS;
+constexpr uint32_t HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS;
+
+struct LogHistogram {
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+    uint32_t buckets[HISTOGRAM_BUCKETS] = {};
+
+    static uint32_t bucket_of(uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) {
+            return (uint32_t)value;
+        }
+        uint32_t shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+        uint32_t sub_bucket = (uint32_t)(value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+        return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+    }
+
+    // Largest value that falls into bucket
+    static uint64_t bucket_limit(uint32_t bucket) {
+        if (bucket < HISTOGRAM_SUB_BUCKETS) {
+            return bucket;
+        }
+        uint32_t shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+        uint64_t lowest = (uint64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+        return lowest + ((1ull << shift) - 1);
+    }
+
+    void record(uint64_t value) {
+        buckets[bucket_of(value)]++;
+        count++;
+        total += value;
+        if (value > max) {
+            max = value;
+        }
+    }
+
+    void merge(const LogHistogram &other) {
+        for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            buckets[i] += other.buckets[i];
+        }
+        count += other.count;
+        total += other.total;
+        if (other.max > max) {
+            max = other.max;
+        }
+    }
+
+    // Upper bound of the bucket holding the given percentile (0-100), capped at max
+    uint64_t percentile(double percent) const {
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(percent / 100.0 * (double)count + 0.5);
+        if (rank == 0) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                uint64_t limit = bucket_limit(i);
+                return limit < max ? limit : max;
+            }
+        }
+        return max;
+    }
+};
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "helper.h"
+#include "imbalance.h"
+#include "parallel_sites.h"
+#include "symbolizer.h"
+#include "thread_registry.h"
+#include "timestamp.h"
+
+constexpr size_t IMBALANCE_REPORT_TOP = 5;
+
+// Busy time of one thread in one execution of a loop, in timestamp ticks.
+// Threads run a region's loops in the same order, so the loop's codeptr_ra and
+// how many times the thread already ran it in the region identify the execution.
+struct LoopSample {
+    uint64_t codeptr_ra;
+    uint32_t occurrence;
+    uint64_t busy;
+};
+
+// State of one OpenMP thread, only written by that thread
+struct alignas(64) ThreadImbalance {
+    uint64_t thread_id = 0;
+
+    // Outermost parallel region the thread is working in
+    int region_depth = 0;
+    uint64_t parallel_id = 0;
+    uint64_t site = 0;
+    uint32_t team_size = 0;
+    uint64_t region_start = 0;
+    uint64_t region_wait = 0;
+
+    int wait_depth = 0;
+    uint64_t wait_start = 0;
+
+    uint64_t loop_start = 0;
+    uint64_t loop_codeptr = 0;
+    // Executions of each loop in the current region, keyed by codeptr_ra
+    std::unordered_map<uint64_t, uint32_t> loop_occurrences;
+    // Loops run in the current region, handed over when it ends
+    std::vector<LoopSample> loops;
+};
+
+static PerThreadRegistry<ThreadImbalance> imbalances("COMPASS_IMBALANCE");
+
+// Imbalance of one construct, summed over the times it ran
+struct ImbalanceRow {
+    bool loop;
+    uint64_t id;                    // codeptr_ra of the region or loop
+    uint64_t instances = 0;
+    uint64_t threads = 0;           // most threads that ran one instance
+    uint64_t max = 0;               // sum over instances of the slowest thread's busy time
+    double mean = 0;                // sum over instances of the mean busy time
+    uint64_t wasted = 0;            // thread time spent waiting for the slowest thread
+    std::map<uint64_t, uint64_t> straggler_counts;
+
+    ImbalanceRow(bool loop, uint64_t id) : loop(loop), id(id) {}
+
+    double recoverable() const {
+        return (double)max - mean;
+    }
+
+    uint64_t straggler() const {
+        auto most = std::max_element(straggler_counts.begin(), straggler_counts.end(),
+                                     [](const auto &a, const auto &b) { return a.second < b.second; });
+        return most == straggler_counts.end() ? 0 : most->first;
+    }
+
+    // Adds one instance given each thread's busy time
+    void add_instance(const std::vector<std::pair<uint64_t, uint64_t>> &busy_by_thread) {
+        uint64_t slowest = 0;
+        uint64_t straggler = 0;
+        uint64_t sum = 0;
+        for (const auto &[thread_id, busy] : busy_by_thread) {
+            sum += busy;
+            if (busy >= slowest) {
+                slowest = busy;
+                straggler = thread_id;
+            }
+        }
+        instances++;
+        threads = std::max<uint64_t>(threads, busy_by_thread.size());
+        max += slowest;
+        mean += (double)sum / busy_by_thread.size();
+        wasted += slowest * busy_by_thread.size() - sum;
+        straggler_counts[straggler]++;
+    }
+};
+
+// Busy times of one region instance, collected as its threads end
+struct RegionInstance {
+    uint64_t site = 0;
+    uint32_t team_size = 0;
+    uint32_t reported = 0;          // team threads that ended their implicit task
+    std::vector<std::pair<uint64_t, uint64_t>> busy_by_thread;
+    // (codeptr_ra, occurrence) -> busy time per thread
+    std::map<std::pair<uint64_t, uint32_t>, std::vector<std::pair<uint64_t, uint64_t>>> loops;
+};
+
+// Region instances still running by parallel id, and the rows of the finished
+// ones by call site. Each thread takes the lock once per region it ends.
+// Never freed, see ompt_finalize
+struct ImbalanceTotals {
+    std::mutex lock;
+    std::unordered_map<uint64_t, RegionInstance> running;
+    std::map<uint64_t, ImbalanceRow> regions;
+    std::map<uint64_t, ImbalanceRow> loops;
+    uint64_t region_instances = 0;
+};
+
+static ImbalanceTotals &totals = *new ImbalanceTotals();
+
+// Called with totals.lock held
+static void fold_instance(const RegionInstance &instance) {
+    if (instance.busy_by_thread.empty()) {
+        return;
+    }
+    totals.region_instances++;
+    totals.regions.try_emplace(instance.site, false, instance.site).first->second.add_instance(instance.busy_by_thread);
+    for (const auto &[loop, busy_by_thread] : instance.loops) {
+        totals.loops.try_emplace(loop.first, true, loop.first).first->second.add_instance(busy_by_thread);
+    }
+}
+
+// Every thread of a team reports once: with its busy times when its implicit
+// task ends or, if it is busy in an outer region, with nothing when it begins.
+// The last report folds the instance into the rows.
+static void report_region(uint64_t parallel_id, uint64_t site, uint32_t team_size, ThreadImbalance *imbalance,
+                          uint64_t busy) {
+    std::lock_guard<std::mutex> guard(totals.lock);
+    RegionInstance &instance = totals.running[parallel_id];
+    if (instance.reported == 0) {
+        instance.site = site;
+        instance.team_size = team_size;
+    }
+    if (imbalance) {
+        instance.busy_by_thread.emplace_back(imbalance->thread_id, busy);
+        for (const LoopSample &sample : imbalance->loops) {
+            instance.loops[{sample.codeptr_ra, sample.occurrence}].emplace_back(imbalance->thread_id, sample.busy);
+        }
+    }
+    if (++instance.reported >= instance.team_size) {
+        fold_instance(instance);
+        totals.running.erase(parallel_id);
+    }
+}
+
+static bool is_loop(ompt_work_t work_type) {
+    switch (work_type) {
+        case ompt_work_loop:
+        case ompt_work_loop_static:
+        case ompt_work_loop_dynamic:
+        case ompt_work_loop_guided:
+        case ompt_work_loop_other:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void imbalance_implicit_task(ompt_scope_endpoint_t endpoint, uint64_t parallel_id, uint32_t team_size, int flags,
+                             uint64_t thread_id) {
+    // The initial task spans the whole program and is not a parallel region
+    if (flags & ompt_task_initial) {
+        return;
+    }
+    ThreadImbalance *imbalance = imbalances.get_or_create();
+    if (!imbalance) {
+        return;
+    }
+
+    uint64_t now = read_timestamp();
+    if (endpoint == ompt_scope_begin) {
+        if (imbalance->region_depth++ == 0) {
+            imbalance->thread_id = thread_id;
+            imbalance->parallel_id = parallel_id;
+            imbalance->site = parallel_site(parallel_id);
+            imbalance->team_size = team_size;
+            imbalance->region_start = now;
+            imbalance->region_wait = 0;
+            imbalance->loop_occurrences.clear();
+            imbalance->loops.clear();
+        } else {
+            // Busy in an outer region: counted there, not in this one
+            report_region(parallel_id, parallel_site(parallel_id), team_size, nullptr, 0);
+        }
+    } else if (imbalance->region_depth > 0 && --imbalance->region_depth == 0) {
+        uint64_t elapsed = now - imbalance->region_start;
+        uint64_t busy = elapsed > imbalance->region_wait ? elapsed - imbalance->region_wait : 0;
+        report_region(imbalance->parallel_id, imbalance->site, imbalance->team_size, imbalance, busy);
+    }
+}
+
+void imbalance_work(ompt_work_t work_type, ompt_scope_endpoint_t endpoint, const void *codeptr_ra) {
+    if (!is_loop(work_type)) {
+        return;
+    }
+    ThreadImbalance *imbalance = imbalances.get_or_create();
+    // Loops of nested regions are attributed to the outermost one
+    if (!imbalance || imbalance->region_depth != 1) {
+        return;
+    }
+
+    uint64_t codeptr = reinterpret_cast<uint64_t>(codeptr_ra);
+    if (endpoint == ompt_scope_begin) {
+        imbalance->loop_start = read_timestamp();
+        imbalance->loop_codeptr = codeptr;
+    } else if (imbalance->loop_start && imbalance->loop_codeptr == codeptr) {
+        uint64_t busy = read_timestamp() - imbalance->loop_start;
+        uint32_t occurrence = imbalance->loop_occurrences[codeptr]++;
+        imbalance->loops.push_back({codeptr, occurrence, busy});
+        imbalance->loop_start = 0;
+    }
+}
+
+void imbalance_sync_region_wait(ompt_scope_endpoint_t endpoint) {
+    ThreadImbalance *imbalance = imbalances.get_or_create();
+    if (!imbalance || imbalance->region_depth == 0) {
+        return;
+    }
+
+    // Waits nest when a barrier runs tasks that wait themselves; only the
+    // outermost wait is counted
+    if (endpoint == ompt_scope_begin) {
+        if (imbalance->wait_depth++ == 0) {
+            imbalance->wait_start = read_timestamp();
+        }
+    } else if (imbalance->wait_depth > 0 && --imbalance->wait_depth == 0) {
+        imbalance->region_wait += read_timestamp() - imbalance->wait_start;
+    }
+}
+
+// "region 0x4011a0" or "loop 0x4011c4"
+static void write_construct(std::ostream &out, const ImbalanceRow &row, char separator) {
+    out << (row.loop ? "loop" : "region") << separator << "0x" << std::hex << row.id << std::dec;
+}
+
+void write_imbalance_report() {
+    std::lock_guard<std::mutex> guard(totals.lock);
+    // Instances some threads never reported, such as threads beyond the
+    // registry limit, are folded with the threads that did
+    for (const auto &[parallel_id, instance] : totals.running) {
+        fold_instance(instance);
+    }
+    totals.running.clear();
+
+    std::vector<ImbalanceRow> rows;
+    std::vector<uint64_t> codeptrs;
+    for (const auto *constructs : {&totals.regions, &totals.loops}) {
+        for (const auto &[codeptr, row] : *constructs) {
+            rows.push_back(row);
+            codeptrs.push_back(codeptr);
+        }
+    }
+    std::stable_sort(rows.begin(), rows.end(), [](const ImbalanceRow &a, const ImbalanceRow &b) {
+        return a.recoverable() > b.recoverable();
+    });
+
+    std::ofstream out(IMBALANCE_REPORT_FILE_NAME);
+    if (!out) {
+        std::cerr << "Could not open " << IMBALANCE_REPORT_FILE_NAME << "\n";
+        return;
+    }
+    symbolize(codeptrs);
+
+    out << "scope,id,instances,threads,max_ns,mean_ns,max_mean_ratio,straggler,wasted_thread_ns,recoverable_ns,symbol\n";
+    for (const ImbalanceRow &row : rows) {
+        double ratio = row.mean > 0 ? (double)row.max / row.mean : 1.0;
+        write_construct(out, row, ',');
+        out << "," << row.instances << "," << row.threads << ","
+            << ticks_to_ns(row.max) << "," << ticks_to_ns((uint64_t)row.mean) << ","
+            << std::fixed << std::setprecision(3) << ratio << std::defaultfloat << ","
+            << row.straggler() << "," << ticks_to_ns(row.wasted) << ","
+            << ticks_to_ns((uint64_t)row.recoverable()) << ","
+            << csv_field(format_symbol(lookup_symbol(row.id))) << "\n";
+    }
+
+    std::cout << "Imbalance of " << totals.region_instances << " parallel regions at " << totals.regions.size()
+              << " sites and " << totals.loops.size() << " loops written to " << IMBALANCE_REPORT_FILE_NAME << "\n";
+    for (size_t i = 0; i < rows.size() && i < IMBALANCE_REPORT_TOP; i++) {
+        const ImbalanceRow &row = rows[i];
+        std::cout << "  ";
+        write_construct(std::cout, row, ' ');
+        std::cout << " " << format_symbol(lookup_symbol(row.id)) << ": "
+                  << ticks_to_ns((uint64_t)row.recoverable()) / 1000
+                  << " us recoverable, straggler thread " << row.straggler() << "\n";
+    }
+}
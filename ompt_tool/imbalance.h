@@ -0,0 +1,34 @@
+#ifndef IMBALANCE_H
+#define IMBALANCE_H
+
+#include <cstdint>
+#include <omp-tools.h>
+
+// Report written by write_imbalance_report()
+constexpr const char *IMBALANCE_REPORT_FILE_NAME = "logs/imbalance.csv";
+
+// Per-thread busy time of parallel regions and worksharing loops, updated from
+// the callbacks without synchronization. A region's busy time is its implicit
+// task minus the time spent in sync region waits; a loop's is the time from
+// its work begin to its work end, before the barrier that follows it. A region
+// instance is folded into its call site's totals once all team_size threads
+// have ended their implicit tasks; the site comes from parallel_sites.h.
+void imbalance_implicit_task(ompt_scope_endpoint_t endpoint, uint64_t parallel_id, uint32_t team_size, int flags,
+                             uint64_t thread_id);
+void imbalance_work(ompt_work_t work_type, ompt_scope_endpoint_t endpoint, const void *codeptr_ra);
+void imbalance_sync_region_wait(ompt_scope_endpoint_t endpoint);
+
+/**
+ * @brief Compares the threads' busy times and writes IMBALANCE_REPORT_FILE_NAME.
+ *
+ * One "region" row per parallel region call site and one "loop" row per loop
+ * construct, each keyed by codeptr_ra and summed over every time it ran. Each
+ * row has the slowest and mean busy time and their ratio, the straggler
+ * thread, the thread time wasted waiting for the straggler, the recoverable
+ * wall time (slowest minus mean) a perfectly balanced schedule would save,
+ * and the function and source line. Rows are ranked by recoverable time and
+ * the top ones are printed.
+ */
+void write_imbalance_report();
+
+#endif // IMBALANCE_H
@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "helper.h"
+#include "lock_order.h"
+#include "symbolizer.h"
+
+// Locks are told apart by wait id within a class: the wait ids of a lock and
+// of a critical section come from different namespaces
+enum LockClass : uint32_t {
+    LOCK_CLASS_LOCK,        // omp_lock_t and omp_nest_lock_t
+    LOCK_CLASS_CRITICAL,
+    LOCK_CLASS_ORDERED,
+    LOCK_CLASS_NONE         // atomics, which are not held
+};
+
+static const char *const lock_class_names[] = {"lock", "critical", "ordered"};
+
+struct LockKey {
+    uint64_t wait_id;
+    LockClass lock_class;
+
+    bool operator==(const LockKey &other) const {
+        return wait_id == other.wait_id && lock_class == other.lock_class;
+    }
+};
+
+struct LockKeyHash {
+    size_t operator()(const LockKey &key) const {
+        return std::hash<uint64_t>()(key.wait_id * 0x9E3779B97F4A7C15ull ^ key.lock_class);
+    }
+};
+
+// "from was held while to was acquired"
+struct LockPair {
+    LockKey from;
+    LockKey to;
+
+    bool operator==(const LockPair &other) const {
+        return from == other.from && to == other.to;
+    }
+};
+
+struct LockPairHash {
+    size_t operator()(const LockPair &pair) const {
+        return LockKeyHash()(pair.from) * 31 ^ LockKeyHash()(pair.to);
+    }
+};
+
+// The first time the pair was seen in the process
+struct LockOrderEdge {
+    LockPair pair;
+    uint64_t thread_id;
+    uint64_t held_codeptr;      // where from was acquired
+    uint64_t acquire_codeptr;   // where to was acquired
+    uint32_t inversion = 0;     // first inversion the edge is part of, 0 for none
+};
+
+// Only pairs new to some thread reach the graph, so a mutex is enough
+struct LockOrderGraph {
+    std::mutex lock;
+    std::vector<LockOrderEdge> edges;
+    std::unordered_map<LockPair, uint32_t, LockPairHash> edge_index;
+    std::unordered_map<LockKey, std::vector<uint32_t>, LockKeyHash> out_edges;
+    // Edge indices of each inversion's cycle, starting with the edge that closed it
+    std::vector<std::vector<uint32_t>> inversions;
+};
+
+// Never freed, see ompt_finalize
+static LockOrderGraph *lock_order_graph = new LockOrderGraph();
+
+struct HeldLock {
+    LockKey lock;
+    uint64_t codeptr_ra;
+};
+
+// State of one OpenMP thread, only touched by that thread
+struct alignas(64) ThreadLockOrder {
+    std::vector<HeldLock> held;     // in acquisition order
+    std::unordered_set<LockPair, LockPairHash> seen;
+};
+
+static thread_local ThreadLockOrder *local_lock_order = nullptr;
+
+static ThreadLockOrder &get_local_lock_order() {
+    if (!local_lock_order) {
+        local_lock_order = new ThreadLockOrder();
+    }
+    return *local_lock_order;
+}
+
+static LockClass lock_class_of(ompt_mutex_t kind) {
+    switch (kind) {
+        case ompt_mutex_lock:
+        case ompt_mutex_test_lock:
+        case ompt_mutex_nest_lock:
+        case ompt_mutex_test_nest_lock:
+            return LOCK_CLASS_LOCK;
+        case ompt_mutex_critical:
+            return LOCK_CLASS_CRITICAL;
+        case ompt_mutex_ordered:
+            return LOCK_CLASS_ORDERED;
+        default:
+            return LOCK_CLASS_NONE;
+    }
+}
+
+// Shortest path of edges from one lock to another, empty if there is none
+static std::vector<uint32_t> find_lock_path(const LockOrderGraph &graph, const LockKey &from, const LockKey &to) {
+    std::unordered_map<LockKey, uint32_t, LockKeyHash> reached_by;
+    std::deque<LockKey> queue{from};
+    std::unordered_set<LockKey, LockKeyHash> visited{from};
+    while (!queue.empty()) {
+        LockKey lock = queue.front();
+        queue.pop_front();
+        auto out = graph.out_edges.find(lock);
+        if (out == graph.out_edges.end()) {
+            continue;
+        }
+        for (uint32_t edge : out->second) {
+            const LockKey &next = graph.edges[edge].pair.to;
+            if (!visited.insert(next).second) {
+                continue;
+            }
+            reached_by[next] = edge;
+            if (next == to) {
+                std::vector<uint32_t> path;
+                for (LockKey step = to; !(step == from); step = graph.edges[reached_by[step]].pair.from) {
+                    path.push_back(reached_by[step]);
+                }
+                std::reverse(path.begin(), path.end());
+                return path;
+            }
+            queue.push_back(next);
+        }
+    }
+    return {};
+}
+
+static void add_lock_order_edge(const LockPair &pair, uint64_t thread_id, uint64_t held_codeptr, uint64_t acquire_codeptr) {
+    LockOrderGraph &graph = *lock_order_graph;
+    std::lock_guard<std::mutex> guard(graph.lock);
+    if (graph.edge_index.count(pair)) {
+        return;
+    }
+    uint32_t index = (uint32_t)graph.edges.size();
+    graph.edges.push_back({pair, thread_id, held_codeptr, acquire_codeptr});
+    graph.edge_index.emplace(pair, index);
+    graph.out_edges[pair.from].push_back(index);
+
+    std::vector<uint32_t> path = find_lock_path(graph, pair.to, pair.from);
+    if (path.empty()) {
+        return;
+    }
+    std::vector<uint32_t> cycle{index};
+    cycle.insert(cycle.end(), path.begin(), path.end());
+    uint32_t inversion = (uint32_t)graph.inversions.size() + 1;
+    for (uint32_t edge : cycle) {
+        if (graph.edges[edge].inversion == 0) {
+            graph.edges[edge].inversion = inversion;
+        }
+    }
+    graph.inversions.push_back(std::move(cycle));
+    std::cout << "Potential deadlock: thread " << thread_id << " acquires " << lock_class_names[pair.to.lock_class]
+              << " 0x" << std::hex << pair.to.wait_id << " while holding " << lock_class_names[pair.from.lock_class]
+              << " 0x" << pair.from.wait_id << std::dec << ", which is taken in the opposite order elsewhere"
+              << " (lock order inversion " << inversion << ")\n";
+}
+
+void lock_order_mutex_acquire(ompt_mutex_t kind, ompt_wait_id_t wait_id, const void *codeptr_ra, uint64_t thread_id) {
+    LockClass lock_class = lock_class_of(kind);
+    if (lock_class == LOCK_CLASS_NONE || kind == ompt_mutex_test_lock || kind == ompt_mutex_test_nest_lock) {
+        return;
+    }
+    ThreadLockOrder &order = get_local_lock_order();
+    LockKey lock{wait_id, lock_class};
+    for (const HeldLock &held : order.held) {
+        // Re-acquiring a held nest lock does not wait
+        if (held.lock == lock) {
+            continue;
+        }
+        LockPair pair{held.lock, lock};
+        if (order.seen.insert(pair).second) {
+            add_lock_order_edge(pair, thread_id, held.codeptr_ra, reinterpret_cast<uint64_t>(codeptr_ra));
+        }
+    }
+}
+
+void lock_order_mutex_acquired(ompt_mutex_t kind, ompt_wait_id_t wait_id, const void *codeptr_ra) {
+    LockClass lock_class = lock_class_of(kind);
+    if (lock_class == LOCK_CLASS_NONE) {
+        return;
+    }
+    get_local_lock_order().held.push_back({{wait_id, lock_class}, reinterpret_cast<uint64_t>(codeptr_ra)});
+}
+
+void lock_order_mutex_released(ompt_mutex_t kind, ompt_wait_id_t wait_id) {
+    LockClass lock_class = lock_class_of(kind);
+    if (lock_class == LOCK_CLASS_NONE) {
+        return;
+    }
+    // Locks need not be released in reverse order, so search from the most recent
+    std::vector<HeldLock> &held = get_local_lock_order().held;
+    LockKey lock{wait_id, lock_class};
+    for (size_t i = held.size(); i-- > 0;) {
+        if (held[i].lock == lock) {
+            held.erase(held.begin() + i);
+            return;
+        }
+    }
+}
+
+std::vector<std::vector<std::pair<uint64_t, uint64_t>>> lock_order_inversions() {
+    LockOrderGraph &graph = *lock_order_graph;
+    std::lock_guard<std::mutex> guard(graph.lock);
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> inversions;
+    for (const std::vector<uint32_t> &cycle : graph.inversions) {
+        std::vector<std::pair<uint64_t, uint64_t>> pairs;
+        for (uint32_t index : cycle) {
+            pairs.emplace_back(graph.edges[index].pair.from.wait_id, graph.edges[index].pair.to.wait_id);
+        }
+        inversions.push_back(std::move(pairs));
+    }
+    return inversions;
+}
+
+static std::string format_lock(const LockKey &lock) {
+    std::ostringstream out;
+    out << lock_class_names[lock.lock_class] << " 0x" << std::hex << lock.wait_id;
+    return out.str();
+}
+
+void write_lock_order_report() {
+    LockOrderGraph &graph = *lock_order_graph;
+    std::lock_guard<std::mutex> guard(graph.lock);
+
+    std::ofstream out(LOCK_ORDER_REPORT_FILE_NAME);
+    if (!out) {
+        std::cerr << "Could not open " << LOCK_ORDER_REPORT_FILE_NAME << "\n";
+        return;
+    }
+    std::vector<uint64_t> codeptrs;
+    std::unordered_set<LockKey, LockKeyHash> locks;
+    for (const LockOrderEdge &edge : graph.edges) {
+        codeptrs.push_back(edge.held_codeptr);
+        codeptrs.push_back(edge.acquire_codeptr);
+        locks.insert(edge.pair.from);
+        locks.insert(edge.pair.to);
+    }
+    symbolize(codeptrs);
+
+    out << "held_kind,held_lock,acquired_kind,acquired_lock,thread,held_site,acquire_site,inversion,"
+           "held_symbol,acquire_symbol\n";
+    for (const LockOrderEdge &edge : graph.edges) {
+        out << lock_class_names[edge.pair.from.lock_class] << ",0x" << std::hex << edge.pair.from.wait_id << ","
+            << lock_class_names[edge.pair.to.lock_class] << ",0x" << edge.pair.to.wait_id << std::dec << ","
+            << edge.thread_id << ",0x" << std::hex << edge.held_codeptr << ",0x" << edge.acquire_codeptr << std::dec
+            << "," << (edge.inversion ? std::to_string(edge.inversion) : "") << ","
+            << csv_field(format_symbol(lookup_symbol(edge.held_codeptr))) << ","
+            << csv_field(format_symbol(lookup_symbol(edge.acquire_codeptr))) << "\n";
+    }
+
+    std::cout << "Lock order graph of " << locks.size() << " locks and " << graph.edges.size() << " edges with "
+              << graph.inversions.size() << " inversions written to " << LOCK_ORDER_REPORT_FILE_NAME << "\n";
+    for (size_t i = 0; i < graph.inversions.size(); i++) {
+        std::cout << "  Lock order inversion " << i + 1 << ":\n";
+        for (uint32_t index : graph.inversions[i]) {
+            const LockOrderEdge &edge = graph.edges[index];
+            std::cout << "    thread " << edge.thread_id << " holds " << format_lock(edge.pair.from)
+                      << " taken at " << format_symbol(lookup_symbol(edge.held_codeptr))
+                      << "\n      and acquires " << format_lock(edge.pair.to)
+                      << " at " << format_symbol(lookup_symbol(edge.acquire_codeptr)) << "\n";
+        }
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef LOCK_ORDER_H
+#define LOCK_ORDER_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <omp-tools.h>
+
+// Report written by write_lock_order_report()
+constexpr const char *LOCK_ORDER_REPORT_FILE_NAME = "logs/lock_order.csv";
+
+// Lock order graph in the style of the Linux kernel's lockdep. Every
+// mutex_acquire made while holding other locks adds a "held before acquired"
+// edge per held lock, the first time the thread sees that pair. A pair new to
+// the whole process is checked against the graph and, if the acquired lock can
+// already reach the held one, reported as an order inversion: two threads
+// taking the locks along the cycle at the same time would deadlock, whether or
+// not this run did. Test locks never block, so they add no edges, and atomics
+// are ignored.
+void lock_order_mutex_acquire(ompt_mutex_t kind, ompt_wait_id_t wait_id, const void *codeptr_ra, uint64_t thread_id);
+void lock_order_mutex_acquired(ompt_mutex_t kind, ompt_wait_id_t wait_id, const void *codeptr_ra);
+void lock_order_mutex_released(ompt_mutex_t kind, ompt_wait_id_t wait_id);
+
+// Inversions found so far, each as the wait ids of the (held, acquired) lock
+// pairs along its cycle, starting with the pair that closed it
+std::vector<std::vector<std::pair<uint64_t, uint64_t>>> lock_order_inversions();
+
+/**
+ * @brief Writes the lock order graph to LOCK_ORDER_REPORT_FILE_NAME.
+ *
+ * One row per edge with both locks, the first thread that took them in that
+ * order and the call sites that acquired the held lock and then the other
+ * one. Edges on an inversion carry its number; every inversion is printed as
+ * its cycle of locks and call sites.
+ */
+void write_lock_order_report();
+
+#endif // LOCK_ORDER_H
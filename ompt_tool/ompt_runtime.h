@@ -0,0 +1,23 @@
+#ifndef OMPT_RUNTIME_H
+#define OMPT_RUNTIME_H
+
+#include <omp-tools.h>
+
+// Runtime entry points the tool uses, resolved once in ompt_initialize so
+// callbacks never go through the string-keyed lookup function.
+struct OmptRuntime {
+    ompt_set_callback_t set_callback;
+    ompt_get_thread_data_t get_thread_data;
+    ompt_get_parallel_info_t get_parallel_info;
+    ompt_get_task_info_t get_task_info;
+    ompt_get_state_t get_state;
+    ompt_get_unique_id_t get_unique_id;
+};
+
+extern OmptRuntime ompt_runtime;
+
+// Fills ompt_runtime. Returns false if an entry point the tool cannot work
+// without is missing.
+bool resolve_ompt_runtime(ompt_function_lookup_t lookup);
+
+#endif // OMPT_RUNTIME_H
@@ -1,108 +1,124 @@
-#include "quill/Backend.h"
-#include "quill/Frontend.h"
-#include "quill/LogMacros.h"
-#include "quill/Logger.h"
-#include "quill/sinks/FileSink.h"
-
 #include <omp-tools.h>
 #include <omp.h>
 #include <iostream>
-#include <fstream>
-#include <chrono> 
+#include "call_stack.h"
 #include "helper.h"
+#include "granularity.h"
+#include "imbalance.h"
+#include "lock_order.h"
+#include "parallel_sites.h"
+#include "perf_counters.h"
+#include "aggregate.h"
+#include "contention.h"
+#include "cpu_profiler.h"
 #include "dl_detector.h"
-#include <vector>
-#include <string>
-#include <utility>
-
-ompt_function_lookup_t global_lookup = NULL;
+#include "ompt_runtime.h"
+#include "sampling.h"
+#include "state_sampler.h"
+#include "symbolizer.h"
+#include "task_origins.h"
+#include "timestamp.h"
+#include "tool_config.h"
+#include "trace_buffer.h"
+
+OmptRuntime ompt_runtime = {};
 int global_task_number = 0;
 int parallel_id_number = 1;
-bool use_dl_detector = false; 
 
-long long get_time_microsecond() {
-    auto now = std::chrono::system_clock::now();
-    auto duration = now.time_since_epoch();
-    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
-    return micros;
+// Thread number of the calling thread, set in on_thread_create
+static thread_local uint64_t cached_thread_id = TRACE_ID_NONE;
+
+static inline uint64_t get_thread_id() {
+    if (cached_thread_id == TRACE_ID_NONE) {
+        cached_thread_id = ompt_runtime.get_thread_data()->value;
+    }
+    return cached_thread_id;
 }
 
-long long get_time_nanosecond() {
-    auto now = std::chrono::system_clock::now();
-    auto duration = now.time_since_epoch();
-    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
-    return nanos;
+static inline uint64_t codeptr_to_uint(const void *codeptr_ra) {
+    return reinterpret_cast<uint64_t>(codeptr_ra);
 }
 
-void log_event(uint64_t thread_id, const std::string &event_type, const std::vector<std::pair<std::string, std::string>> &details) {
-    long long logging_start_time = get_time_nanosecond();
-    std::string log_message;
-    log_message += "Time: " + std::to_string(get_time_microsecond()) + " µs\n";
-    log_message += "Event: " + event_type + "\n";
+// Task number stored in ompt task data, without the sampling bit
+static inline uint64_t task_number(const ompt_data_t *task_data) {
+    return task_data->value & ~TASK_SAMPLED_BIT;
+}
 
-    for (const auto &detail : details) {
-        log_message += detail.first + ": " + detail.second + "\n";
+static inline bool task_sampled(const ompt_data_t *task_data) {
+    return task_data && (task_data->value & TASK_SAMPLED_BIT);
+}
+
+// Records an event that sampling selected; adaptive sampling needs its cost
+static inline void trace_sampled_event(const TraceRecord &record) {
+    if (sampling_config.mode != SAMPLING_ADAPTIVE) {
+        trace_event(record);
+        return;
     }
+    uint64_t start = read_timestamp();
+    trace_event(record);
+    sampling_record_cost(read_timestamp() - start);
+}
 
-    log_message += "--------------------------\n";
+bool resolve_ompt_runtime(ompt_function_lookup_t lookup) {
+    ompt_runtime.set_callback = (ompt_set_callback_t)lookup("ompt_set_callback");
+    ompt_runtime.get_thread_data = (ompt_get_thread_data_t)lookup("ompt_get_thread_data");
+    ompt_runtime.get_parallel_info = (ompt_get_parallel_info_t)lookup("ompt_get_parallel_info");
+    ompt_runtime.get_task_info = (ompt_get_task_info_t)lookup("ompt_get_task_info");
+    ompt_runtime.get_state = (ompt_get_state_t)lookup("ompt_get_state");
+    ompt_runtime.get_unique_id = (ompt_get_unique_id_t)lookup("ompt_get_unique_id");
 
-    if (quill::Backend::is_running()) {
-        
-        auto file_sink = quill::Frontend::create_or_get_sink<quill::FileSink>(
-            "logs/logs_thread_" + std::to_string(thread_id) + ".txt",
-            []()
-        {
-            quill::FileSinkConfig cfg;
-            cfg.set_open_mode('a');
-            return cfg;
-        }());
-
-        quill::Logger* logger =
-            quill::Frontend::create_or_get_logger("thread_logger_" + std::to_string(thread_id), std::move(file_sink));
-       
-        LOG_INFO(logger, "{}", log_message);
-        LOG_INFO(logger, "LOGGING TIME: {} ns", get_time_nanosecond() - logging_start_time);
-    } else {
-        std::ofstream outFile;
-        std::string filename = "logs/logs_thread_" + std::to_string(thread_id) + ".txt";
-        outFile.open(filename, std::ios::app);
-        outFile << log_message;
-        outFile << "LOGGING TIME: " << get_time_nanosecond() - logging_start_time << " ns\n";
-        outFile.flush(); 
+    if (!ompt_runtime.get_thread_data)
+    {
+        std::cout << "ompt_get_thread_data function not found\n";
+        return false;
+    }
+    if (!ompt_runtime.get_parallel_info)
+    {
+        std::cout << "ompt_get_parallel_info function not found\n";
+        return false;
     }
+    return true;
 }
 
 // Callback for parallel region start
 void on_parallel_begin(ompt_data_t *task_data, const ompt_frame_t *task_frame,
                        ompt_data_t *parallel_data, uint32_t requested_parallelism,
                        int flags, const void *codeptr_ra) {
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)global_lookup("ompt_get_thread_data");
         
     parallel_data->value = parallel_id_number;
     #pragma omp atomic
     parallel_id_number++;
 
-    ompt_data_t *thread_data = ompt_get_thread_data();
-    uint64_t thread_id = thread_data->value;
+    uint64_t thread_id = get_thread_id();
 
-    log_event(thread_id, "Parallel Begin", {
-        {"Parallel ID", std::to_string(parallel_data ? parallel_data->value : 0)},
-        {"Requested Parallelism", std::to_string(requested_parallelism)},
-        {"Flags", std::to_string(flags)},
-        {"Code Pointer Return Address", std::to_string(reinterpret_cast<uint64_t>(codeptr_ra))}
-    });
+    if (tool_config.imbalance || tool_config.state_sampling || tool_config.perf_counters || tool_config.cpu_profile) {
+        record_parallel_site(parallel_data->value, codeptr_ra);
+    }
+
+    if (tool_config.trace) {
+        trace_event({
+            .event = TRACE_PARALLEL_BEGIN,
+            .thread_id = (uint16_t)thread_id,
+            .flags = (uint32_t)flags,
+            .codeptr_ra = codeptr_to_uint(codeptr_ra),
+            .parallel_id = parallel_data ? parallel_data->value : 0,
+            .value = requested_parallelism
+        });
+    }
 }
 
 // Callback for parallel region end
 void on_parallel_end(ompt_data_t *parallel_data, ompt_data_t *task_data, const void *codeptr_ra) {
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)global_lookup("ompt_get_thread_data");
-    ompt_data_t *thread_data = ompt_get_thread_data();
-    uint64_t thread_id = thread_data->value;
-
-    log_event(thread_id, "Parallel End", {
-        {"Parallel ID", std::to_string(parallel_data ? parallel_data->value : 0)},
-        {"Code Pointer Return Address", std::to_string(reinterpret_cast<uint64_t>(codeptr_ra))}
-    });
+    uint64_t thread_id = get_thread_id();
+
+    if (tool_config.trace) {
+        trace_event({
+            .event = TRACE_PARALLEL_END,
+            .thread_id = (uint16_t)thread_id,
+            .codeptr_ra = codeptr_to_uint(codeptr_ra),
+            .parallel_id = parallel_data ? parallel_data->value : 0
+        });
+    }
 }
 
 void on_work(
@@ -113,66 +129,156 @@ void on_work(
     uint64_t count,
     const void *codeptr_ra)
 {
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)global_lookup("ompt_get_thread_data");
-
-    ompt_data_t *thread_data = ompt_get_thread_data();
-    uint64_t thread_id = thread_data->value;
-
-    log_event(thread_id, "Work", {
-        {"Parallel ID", parallel_data ? std::to_string(parallel_data->value) : "N/A"},
-        {"Work Type", ompt_work_t_to_string(work_type)},
-        {"Endpoint", ompt_scope_endpoint_t_to_string(endpoint)},
-        {"Count", std::to_string(count)},
-        {"Code Pointer Return Address", std::to_string(reinterpret_cast<uint64_t>(codeptr_ra))}
-    });
+    uint64_t thread_id = get_thread_id();
+
+    if (tool_config.imbalance) {
+        imbalance_work(work_type, endpoint, codeptr_ra);
+    }
+
+    if (tool_config.perf_counters) {
+        perf_counters_work(work_type, endpoint, codeptr_ra);
+    }
+
+    if (tool_config.trace) {
+        if (!sample_work(endpoint)) {
+            trace_skip_event(TRACE_WORK);
+            return;
+        }
+        trace_sampled_event({
+            .event = TRACE_WORK,
+            .thread_id = (uint16_t)thread_id,
+            .kind = (uint32_t)work_type,
+            .endpoint = (uint32_t)endpoint,
+            .codeptr_ra = codeptr_to_uint(codeptr_ra),
+            .parallel_id = parallel_data ? parallel_data->value : TRACE_ID_NONE,
+            .value = count
+        });
+    }
 }
 
 
 void on_task_create(ompt_data_t *parent_task_data, const ompt_frame_t *parent_task_frame,
                     ompt_data_t *new_task_data, int flags, int has_dependences, const void *codeptr_ra) {
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)global_lookup("ompt_get_thread_data");
-    ompt_data_t *thread_data = ompt_get_thread_data();
-    uint64_t thread_id = thread_data->value;
+    uint64_t thread_id = get_thread_id();
 
-    int task_number = global_task_number;
+    int new_task_number = global_task_number;
     #pragma omp atomic
     global_task_number++;
 
-    new_task_data->value = task_number;
+    new_task_data->value = new_task_number;
+
+    if (tool_config.stack_events & STACKS_TASK) {
+        capture_call_stack(STACKS_TASK, codeptr_ra);
+    }
 
-    log_event(thread_id, "Task Create", {
-        {"Task Number", std::to_string(new_task_data->value)},
-        {"Parent Task Number", std::to_string(parent_task_data->value)},
-        {"Flags", std::to_string(flags)},
-        {"Has Dependences", std::to_string(has_dependences)},
-        {"Code Pointer Return Address", std::to_string(reinterpret_cast<uint64_t>(codeptr_ra))}
-    });
+    if (tool_config.granularity || tool_config.perf_counters) {
+        record_task_origin((uint64_t)new_task_number, codeptr_ra);
+    }
+
+    if (tool_config.granularity) {
+        granularity_task_create(task_number(parent_task_data), codeptr_ra);
+    }
+
+    if (tool_config.trace) {
+        if (!sample_new_task()) {
+            trace_skip_event(TRACE_TASK_CREATE);
+            return;
+        }
+        new_task_data->value |= TASK_SAMPLED_BIT;
+        trace_sampled_event({
+            .event = TRACE_TASK_CREATE,
+            .thread_id = (uint16_t)thread_id,
+            .flags = (uint32_t)flags,
+            .codeptr_ra = codeptr_to_uint(codeptr_ra),
+            .task_id = (uint64_t)new_task_number,
+            .aux_id = task_number(parent_task_data),
+            .value = (uint64_t)has_dependences
+        });
+    }
 }
 
 void on_task_schedule(ompt_data_t *prior_task_data, ompt_task_status_t prior_task_status,
                       ompt_data_t *next_task_data) {
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)global_lookup("ompt_get_thread_data");
-    ompt_data_t *thread_data = ompt_get_thread_data();
-    uint64_t thread_id = thread_data->value;
-
-    log_event(thread_id, "Task Schedule", {
-        {"Prior Task Data", std::to_string(prior_task_data->value)},
-        {"Prior Task Status", ompt_task_status_t_to_string(prior_task_status)},
-        {"Next Task Data", next_task_data ? std::to_string(next_task_data->value) : "N/A"}
-    });
+    uint64_t thread_id = get_thread_id();
+
+    if (tool_config.granularity) {
+        granularity_task_schedule(task_number(prior_task_data), prior_task_status,
+                                  next_task_data ? task_number(next_task_data) : TRACE_ID_NONE);
+    }
+
+    if (tool_config.perf_counters) {
+        perf_counters_task_schedule(prior_task_status, next_task_data ? task_number(next_task_data) : TRACE_ID_NONE);
+    }
+
+    if (tool_config.trace) {
+        // Switches involving a sampled task are kept so its intervals are complete
+        if (sampling_config.mode != SAMPLING_OFF &&
+            !task_sampled(prior_task_data) && !task_sampled(next_task_data)) {
+            trace_skip_event(TRACE_TASK_SCHEDULE);
+            return;
+        }
+        trace_sampled_event({
+            .event = TRACE_TASK_SCHEDULE,
+            .thread_id = (uint16_t)thread_id,
+            .kind = (uint32_t)prior_task_status,
+            .task_id = task_number(prior_task_data),
+            .aux_id = next_task_data ? task_number(next_task_data) : TRACE_ID_NONE
+        });
+    }
+}
+
+// Called right after task_create for a task with depend clauses, once with all its items
+void on_dependences(ompt_data_t *task_data, const ompt_dependence_t *deps, int ndeps) {
+    uint64_t thread_id = get_thread_id();
+
+    if (tool_config.trace) {
+        if (sampling_config.mode != SAMPLING_OFF && !task_sampled(task_data)) {
+            for (int i = 0; i < ndeps; i++) {
+                trace_skip_event(TRACE_TASK_DEPENDENCES);
+            }
+            return;
+        }
+        for (int i = 0; i < ndeps; i++) {
+            trace_sampled_event({
+                .event = TRACE_TASK_DEPENDENCES,
+                .thread_id = (uint16_t)thread_id,
+                .kind = (uint32_t)deps[i].dependence_type,
+                .task_id = task_number(task_data),
+                .aux_id = deps[i].variable.value,
+                .value = (uint64_t)ndeps
+            });
+        }
+    }
+}
+
+// The runtime only reports edges to predecessors that have not finished yet;
+// compass-analyze recovers the rest from the depend clauses
+void on_task_dependence(ompt_data_t *src_task_data, ompt_data_t *sink_task_data) {
+    uint64_t thread_id = get_thread_id();
+
+    if (tool_config.trace) {
+        if (sampling_config.mode != SAMPLING_OFF &&
+            !task_sampled(src_task_data) && !task_sampled(sink_task_data)) {
+            trace_skip_event(TRACE_TASK_DEPENDENCE);
+            return;
+        }
+        trace_sampled_event({
+            .event = TRACE_TASK_DEPENDENCE,
+            .thread_id = (uint16_t)thread_id,
+            .task_id = task_number(src_task_data),
+            .aux_id = task_number(sink_task_data)
+        });
+    }
 }
 
 
 void on_implicit_task(ompt_scope_endpoint_t endpoint, ompt_data_t *parallel_data,
                       ompt_data_t *task_data, unsigned int actual_parallelism,
                       unsigned int index, int flags) {
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)global_lookup("ompt_get_thread_data");
-    ompt_data_t *thread_data = ompt_get_thread_data();
-    uint64_t thread_id = thread_data->value;
+    uint64_t thread_id = get_thread_id();
     
-    ompt_get_parallel_info_t ompt_get_parallel_info = (ompt_get_parallel_info_t)global_lookup("ompt_get_parallel_info");
     int team_size;
-    ompt_get_parallel_info(0, &parallel_data, &team_size);
+    ompt_runtime.get_parallel_info(0, &parallel_data, &team_size);
 
     if (endpoint == ompt_scope_begin) {
         task_data->value = global_task_number;
@@ -180,14 +286,31 @@ void on_implicit_task(ompt_scope_endpoint_t endpoint, ompt_data_t *parallel_data
         global_task_number++;
     }
 
-    log_event(thread_id, "Implicit Task", {
-        {"Task Number", std::to_string(task_data->value)},
-        {"Endpoint", ompt_scope_endpoint_t_to_string(endpoint)},
-        {"Actual Parallelism", std::to_string(actual_parallelism)},
-        {"Index", std::to_string(index)},
-        {"Flags", std::to_string(flags)},
-        {"Parallel ID", parallel_data ? std::to_string(parallel_data->value) : "N/A"}
-    });
+    if (tool_config.aggregate) {
+        aggregate_implicit_task(endpoint, parallel_data ? parallel_data->value : TRACE_ID_NONE, flags, thread_id);
+    }
+
+    if (tool_config.imbalance) {
+        imbalance_implicit_task(endpoint, parallel_data ? parallel_data->value : TRACE_ID_NONE, actual_parallelism, flags,
+                                thread_id);
+    }
+
+    if (tool_config.perf_counters) {
+        perf_counters_implicit_task(endpoint, parallel_data ? parallel_data->value : TRACE_ID_NONE, flags);
+    }
+
+    if (tool_config.trace) {
+        trace_event({
+            .event = TRACE_IMPLICIT_TASK,
+            .thread_id = (uint16_t)thread_id,
+            .endpoint = (uint32_t)endpoint,
+            .flags = (uint32_t)flags,
+            .parallel_id = parallel_data ? parallel_data->value : TRACE_ID_NONE,
+            .task_id = task_data->value,
+            .aux_id = index,
+            .value = actual_parallelism
+        });
+    }
 }
 
 // Callback for thread creation
@@ -196,12 +319,51 @@ void on_thread_create(ompt_thread_t thread_type, ompt_data_t *thread_data)
     int omp_thread_num = omp_get_thread_num();
     
     thread_data->value = (uint64_t)omp_get_thread_num();
+    cached_thread_id = thread_data->value;
+
+    if (tool_config.state_sampling) {
+        state_sampler_thread_begin(thread_data->value);
+    }
 
-    quill::Backend::start();
+    if (tool_config.perf_counters) {
+        perf_counters_thread_begin();
+    }
+
+    if (tool_config.cpu_profile) {
+        cpu_profiler_thread_begin(thread_data->value);
+    }
 
-    log_event(omp_thread_num, "Thread Create", {
-        {"Thread Type", ompt_thread_t_to_string(thread_type)}
-    });
+    if (tool_config.trace) {
+        trace_event({
+            .event = TRACE_THREAD_CREATE,
+            .thread_id = (uint16_t)omp_thread_num,
+            .kind = (uint32_t)thread_type
+        });
+    }
+}
+
+// Only registered for state sampling, performance counters and CPU
+// profiling, whose timers and counters must not outlive the thread
+void on_thread_end(ompt_data_t *thread_data)
+{
+    if (tool_config.state_sampling) {
+        state_sampler_thread_end();
+    }
+
+    if (tool_config.perf_counters) {
+        perf_counters_thread_end();
+    }
+
+    if (tool_config.cpu_profile) {
+        cpu_profiler_thread_end();
+    }
+}
+
+// Callback for omp_control_tool(), only registered for CPU profiling, which
+// receives the threads' compass scope stacks through it
+int on_control_tool(uint64_t command, uint64_t, void *arg, const void *)
+{
+    return cpu_profiler_control_tool(command, arg);
 }
 
 // Callback for synchronization region begin and end
@@ -211,17 +373,18 @@ void on_sync_region(ompt_sync_region_t kind,
                     ompt_data_t *task_data,
                     const void *codeptr_ra)
 {
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)global_lookup("ompt_get_thread_data");
-
-    ompt_data_t *thread_data = ompt_get_thread_data();
-    uint64_t thread_id = thread_data->value;
-
-    log_event(thread_id, "Sync Region", {
-        {"Parallel ID", parallel_data ? std::to_string(parallel_data->value) : "N/A"},
-        {"Kind", ompt_sync_region_t_to_string(kind)},
-        {"Endpoint", ompt_scope_endpoint_t_to_string(endpoint)},
-        {"Code Pointer Return Address", std::to_string(reinterpret_cast<uint64_t>(codeptr_ra))}
-    });
+    uint64_t thread_id = get_thread_id();
+
+    if (tool_config.trace) {
+        trace_event({
+            .event = TRACE_SYNC_REGION,
+            .thread_id = (uint16_t)thread_id,
+            .kind = (uint32_t)kind,
+            .endpoint = (uint32_t)endpoint,
+            .codeptr_ra = codeptr_to_uint(codeptr_ra),
+            .parallel_id = parallel_data ? parallel_data->value : TRACE_ID_NONE
+        });
+    }
 }
 
 // Mutex acquire callback
@@ -233,20 +396,38 @@ void on_mutex_acquire(
     const void *codeptr_ra  // Return address of the call site
 )
 {
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)global_lookup("ompt_get_thread_data");
+    uint64_t thread_id = get_thread_id();
 
-    ompt_data_t *thread_data = ompt_get_thread_data();
-    uint64_t thread_id = thread_data->value;
+    uint32_t stack_id = NO_CALL_STACK;
+    if (tool_config.stack_events & STACKS_MUTEX) {
+        stack_id = capture_call_stack(STACKS_MUTEX, codeptr_ra);
+    }
 
-    if (use_dl_detector) {
-        process_mutex_acquire(kind, wait_id, thread_id);
+    if (tool_config.dl_detector) {
+        process_mutex_acquire(kind, wait_id, thread_id, stack_id);
     }
 
-    log_event(thread_id, "Mutex Acquire", {
-        {"Kind", ompt_mutex_t_to_string(kind)},
-        {"Wait id", std::to_string(wait_id)},
-        {"Code Pointer Return Address", std::to_string(reinterpret_cast<uint64_t>(codeptr_ra))}
-    });
+    if (tool_config.aggregate) {
+        aggregate_mutex_acquire();
+    }
+
+    if (tool_config.contention) {
+        contention_mutex_acquire(wait_id, codeptr_ra, stack_id);
+    }
+
+    if (tool_config.lock_order) {
+        lock_order_mutex_acquire(kind, wait_id, codeptr_ra, thread_id);
+    }
+
+    if (tool_config.trace) {
+        trace_event({
+            .event = TRACE_MUTEX_ACQUIRE,
+            .thread_id = (uint16_t)thread_id,
+            .kind = (uint32_t)kind,
+            .codeptr_ra = codeptr_to_uint(codeptr_ra),
+            .aux_id = wait_id
+        });
+    }
 }
 
 void on_mutex_acquired(
@@ -255,20 +436,33 @@ void on_mutex_acquired(
     const void *codeptr_ra  // Return address of the call site
 )
 {
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)global_lookup("ompt_get_thread_data");
+    uint64_t thread_id = get_thread_id();
 
-    ompt_data_t *thread_data = ompt_get_thread_data();
-    uint64_t thread_id = thread_data->value;
-
-    if (use_dl_detector) {
+    if (tool_config.dl_detector) {
         process_mutex_acquired(kind, wait_id, thread_id);
     }
 
-    log_event(thread_id, "Mutex Acquired", {
-        {"Kind", ompt_mutex_t_to_string(kind)},
-        {"Wait id", std::to_string(wait_id)},
-        {"Code Pointer Return Address", std::to_string(reinterpret_cast<uint64_t>(codeptr_ra))}
-    });
+    if (tool_config.aggregate) {
+        aggregate_mutex_acquired(kind);
+    }
+
+    if (tool_config.contention) {
+        contention_mutex_acquired(kind, wait_id, codeptr_ra, thread_id);
+    }
+
+    if (tool_config.lock_order) {
+        lock_order_mutex_acquired(kind, wait_id, codeptr_ra);
+    }
+
+    if (tool_config.trace) {
+        trace_event({
+            .event = TRACE_MUTEX_ACQUIRED,
+            .thread_id = (uint16_t)thread_id,
+            .kind = (uint32_t)kind,
+            .codeptr_ra = codeptr_to_uint(codeptr_ra),
+            .aux_id = wait_id
+        });
+    }
 }
 
 void on_mutex_released(
@@ -277,20 +471,33 @@ void on_mutex_released(
     const void *codeptr_ra  // Return address of the call site
 )
 {
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)global_lookup("ompt_get_thread_data");
+    uint64_t thread_id = get_thread_id();
 
-    ompt_data_t *thread_data = ompt_get_thread_data();
-    uint64_t thread_id = thread_data->value;
-
-    if (use_dl_detector) {
+    if (tool_config.dl_detector) {
         process_mutex_released(kind, wait_id, thread_id);
     }
 
-    log_event(thread_id, "Mutex Released", {
-        {"Kind", ompt_mutex_t_to_string(kind)},
-        {"Wait id", std::to_string(wait_id)},
-        {"Code Pointer Return Address", std::to_string(reinterpret_cast<uint64_t>(codeptr_ra))}
-    });
+    if (tool_config.aggregate) {
+        aggregate_mutex_released(kind);
+    }
+
+    if (tool_config.contention) {
+        contention_mutex_released(wait_id);
+    }
+
+    if (tool_config.lock_order) {
+        lock_order_mutex_released(kind, wait_id);
+    }
+
+    if (tool_config.trace) {
+        trace_event({
+            .event = TRACE_MUTEX_RELEASED,
+            .thread_id = (uint16_t)thread_id,
+            .kind = (uint32_t)kind,
+            .codeptr_ra = codeptr_to_uint(codeptr_ra),
+            .aux_id = wait_id
+        });
+    }
 }
 
 // Callback for synchronization region wait begin and end
@@ -300,70 +507,176 @@ void on_sync_region_wait(ompt_sync_region_t kind,
                          ompt_data_t *task_data,
                          const void *codeptr_ra)
 {
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)global_lookup("ompt_get_thread_data");
+    uint64_t thread_id = get_thread_id();
+
+    if (tool_config.trace) {
+        trace_event({
+            .event = TRACE_SYNC_REGION_WAIT,
+            .thread_id = (uint16_t)thread_id,
+            .kind = (uint32_t)kind,
+            .endpoint = (uint32_t)endpoint,
+            .codeptr_ra = codeptr_to_uint(codeptr_ra),
+            .parallel_id = parallel_data ? parallel_data->value : TRACE_ID_NONE
+        });
+    }
 
-    ompt_data_t *thread_data = ompt_get_thread_data();
-    uint64_t thread_id = thread_data->value;
+    uint32_t stack_id = NO_CALL_STACK;
+    if ((tool_config.stack_events & STACKS_BARRIER) && endpoint == ompt_scope_begin &&
+        kind != ompt_sync_region_taskwait && kind != ompt_sync_region_taskgroup && kind != ompt_sync_region_reduction) {
+        stack_id = capture_call_stack(STACKS_BARRIER, codeptr_ra);
+    }
+
+    if (tool_config.dl_detector) {
+        process_barrier(kind, endpoint, thread_id, stack_id);
+    }
+
+    if (tool_config.aggregate) {
+        aggregate_sync_region_wait(kind, endpoint);
+    }
 
-    log_event(thread_id, "Sync Region Wait", {
-        {"Parallel ID", parallel_data ? std::to_string(parallel_data->value) : "N/A"},
-        {"Kind", ompt_sync_region_t_to_string(kind)},
-        {"Endpoint", ompt_scope_endpoint_t_to_string(endpoint)},
-        {"Code Pointer Return Address", std::to_string(reinterpret_cast<uint64_t>(codeptr_ra))}
-    });
+    if (tool_config.imbalance) {
+        imbalance_sync_region_wait(endpoint);
+    }
 
-    process_barrier(kind, endpoint, thread_id);
+    if (tool_config.granularity) {
+        granularity_sync_region_wait(endpoint);
+    }
 }
 
 // OMPT initialization
 int ompt_initialize(ompt_function_lookup_t lookup, int initial_device_num, ompt_data_t *tool_data)
 {
-    global_lookup = lookup;
-    auto register_callback = (ompt_set_callback_t)lookup("ompt_set_callback");
-
-    ompt_get_thread_data_t ompt_get_thread_data = (ompt_get_thread_data_t)lookup("ompt_get_thread_data");
-    if (!ompt_get_thread_data)
+    if (!resolve_ompt_runtime(lookup))
     {
-        std::cout << "ompt_get_thread_data function not found\n";
         return 0;
     }
+    load_tool_config();
+    auto register_callback = ompt_runtime.set_callback;
 
     if (register_callback)
     {
-        register_callback(ompt_callback_parallel_begin, (ompt_callback_t)on_parallel_begin);
-        register_callback(ompt_callback_parallel_end, (ompt_callback_t)on_parallel_end);
-        register_callback(ompt_callback_sync_region, (ompt_callback_t)on_sync_region);
-        register_callback(ompt_callback_sync_region_wait, (ompt_callback_t)on_sync_region_wait);
+        uint32_t events = tool_config.events;
+
         register_callback(ompt_callback_thread_begin, (ompt_callback_t)on_thread_create);
-        register_callback(ompt_callback_mutex_acquire, (ompt_callback_t)on_mutex_acquire);
-        register_callback(ompt_callback_mutex_acquired, (ompt_callback_t)on_mutex_acquired);
-        register_callback(ompt_callback_mutex_released, (ompt_callback_t)on_mutex_released);
-        register_callback(ompt_callback_task_create, (ompt_callback_t)on_task_create);
-        register_callback(ompt_callback_implicit_task, (ompt_callback_t)on_implicit_task);
-        register_callback(ompt_callback_task_schedule, (ompt_callback_t)on_task_schedule);
-        register_callback(ompt_callback_work, (ompt_callback_t)on_work);
+        if (tool_config.state_sampling || tool_config.perf_counters || tool_config.cpu_profile) {
+            register_callback(ompt_callback_thread_end, (ompt_callback_t)on_thread_end);
+        }
+        if (tool_config.cpu_profile) {
+            register_callback(ompt_callback_control_tool, (ompt_callback_t)on_control_tool);
+        }
+        if (events & EVENTS_PARALLEL) {
+            register_callback(ompt_callback_parallel_begin, (ompt_callback_t)on_parallel_begin);
+            register_callback(ompt_callback_parallel_end, (ompt_callback_t)on_parallel_end);
+            register_callback(ompt_callback_implicit_task, (ompt_callback_t)on_implicit_task);
+        }
+        if (events & EVENTS_WORK) {
+            register_callback(ompt_callback_work, (ompt_callback_t)on_work);
+        }
+        if (events & EVENTS_SYNC) {
+            register_callback(ompt_callback_sync_region, (ompt_callback_t)on_sync_region);
+            register_callback(ompt_callback_sync_region_wait, (ompt_callback_t)on_sync_region_wait);
+        }
+        if (events & EVENTS_MUTEX) {
+            register_callback(ompt_callback_mutex_acquire, (ompt_callback_t)on_mutex_acquire);
+            register_callback(ompt_callback_mutex_acquired, (ompt_callback_t)on_mutex_acquired);
+            register_callback(ompt_callback_mutex_released, (ompt_callback_t)on_mutex_released);
+        }
+        if (events & EVENTS_TASKS) {
+            register_callback(ompt_callback_task_create, (ompt_callback_t)on_task_create);
+            register_callback(ompt_callback_task_schedule, (ompt_callback_t)on_task_schedule);
+            register_callback(ompt_callback_dependences, (ompt_callback_t)on_dependences);
+            register_callback(ompt_callback_task_dependence, (ompt_callback_t)on_task_dependence);
+        }
     }
     else
     {
         std::cerr << "Failed to retrieve ompt_set_callback.\n";
     }
 
-    if (use_dl_detector) {
+    calibrate_timestamps();
+    load_module_map();
+    if (tool_config.trace) {
+        start_trace_writer();
+    }
+
+    if (tool_config.dl_detector) {
         start_dl_detector_thread();
     }
 
-    std::cout << "OMPT tool initialized.\n";
+    if (tool_config.state_sampling && !start_state_sampler()) {
+        tool_config.state_sampling = false;
+    }
+
+    if (tool_config.cpu_profile && !start_cpu_profiler()) {
+        tool_config.cpu_profile = false;
+    }
+
+    std::cout << "OMPT tool initialized (profile: " << tool_config.profile << ").\n";
 
     return 1; // Successful initialization
 }
 
 // OMPT finalization
+//
+// The runtime calls this after the static destructors of the tool library
+// have run, and OpenMP threads keep calling into the tool until then. State
+// that callbacks update or that the reports below read is therefore either
+// constant-initialized and trivially destructible or allocated with new and
+// never freed.
 void ompt_finalize(ompt_data_t *tool_data)
 {
-    if (use_dl_detector) {
+    if (tool_config.cpu_profile) {
+        stop_cpu_profiler();
+    }
+
+    if (tool_config.state_sampling) {
+        stop_state_sampler();
+    }
+
+    if (tool_config.dl_detector) {
         end_dl_detector_thread();
     }
-    
+
+    if (tool_config.trace) {
+        end_trace_writer();
+    }
+
+    if (tool_config.aggregate) {
+        write_aggregate_summary();
+    }
+
+    if (tool_config.contention) {
+        write_contention_profile();
+    }
+
+    if (tool_config.imbalance) {
+        write_imbalance_report();
+    }
+
+    if (tool_config.granularity) {
+        write_granularity_report();
+    }
+
+    if (tool_config.lock_order) {
+        write_lock_order_report();
+    }
+
+    if (tool_config.state_sampling) {
+        write_state_report();
+    }
+
+    if (tool_config.perf_counters) {
+        write_perf_counters_report();
+    }
+
+    if (tool_config.stack_events) {
+        write_call_stack_report();
+    }
+
+    if (tool_config.cpu_profile) {
+        write_cpu_profile();
+    }
+
     std::cout << "OMPT tool finalized.\n";
 }
 
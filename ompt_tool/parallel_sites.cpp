@@ -0,0 +1,35 @@
+#include <atomic>
+#include <cstddef>
+#include "parallel_sites.h"
+#include "trace_buffer.h"
+
+constexpr size_t PARALLEL_SITE_SLOTS = 1 << 12;
+
+struct ParallelSite {
+    std::atomic<uint64_t> parallel_id{0};
+    std::atomic<uint64_t> codeptr_ra{0};
+};
+
+static ParallelSite parallel_sites[PARALLEL_SITE_SLOTS];
+
+void record_parallel_site(uint64_t parallel_id, const void *codeptr_ra) {
+    ParallelSite &slot = parallel_sites[parallel_id % PARALLEL_SITE_SLOTS];
+    slot.parallel_id.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.codeptr_ra.store(reinterpret_cast<uint64_t>(codeptr_ra), std::memory_order_relaxed);
+    slot.parallel_id.store(parallel_id, std::memory_order_release);
+}
+
+uint64_t parallel_site(uint64_t parallel_id) {
+    if (parallel_id == 0 || parallel_id == TRACE_ID_NONE) {
+        return 0;
+    }
+    ParallelSite &slot = parallel_sites[parallel_id % PARALLEL_SITE_SLOTS];
+    if (slot.parallel_id.load(std::memory_order_acquire) != parallel_id) {
+        return 0;
+    }
+    uint64_t site = slot.codeptr_ra.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // A new region may have taken the slot while the site was read
+    return slot.parallel_id.load(std::memory_order_relaxed) == parallel_id ? site : 0;
+}
@@ -0,0 +1,16 @@
+#ifndef PARALLEL_SITES_H
+#define PARALLEL_SITES_H
+
+#include <cstdint>
+
+// Call sites of parallel regions by region id, for the signal handlers of the
+// samplers, which only see the id of the region a thread is in, and for the
+// counters and the imbalance analysis, which look the site up at implicit
+// task begin. A slot is reused once PARALLEL_SITE_SLOTS newer regions have
+// begun, and a region that outlives its slot has no known site.
+void record_parallel_site(uint64_t parallel_id, const void *codeptr_ra);
+
+// Site of a parallel region, 0 if unknown. Async-signal-safe.
+uint64_t parallel_site(uint64_t parallel_id);
+
+#endif // PARALLEL_SITES_H
@@ -0,0 +1,421 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "helper.h"
+#include "parallel_sites.h"
+#include "perf_counters.h"
+#include "symbolizer.h"
+#include "task_origins.h"
+#include "thread_registry.h"
+#include "trace_buffer.h"
+
+constexpr size_t PERF_COUNTERS_REPORT_TOP = 5;
+
+enum CounterId : uint32_t {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_REFERENCES,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_TASK_CLOCK,
+    COUNTER_PAGE_FAULTS,
+    COUNTER_CONTEXT_SWITCHES,
+    COUNTER_COUNT
+};
+
+static const char *const counter_names[] = {
+    "cycles", "instructions", "cache_references", "cache_misses", "branch_misses",
+    "task_clock_ns", "page_faults", "context_switches"
+};
+
+struct CounterValues {
+    uint64_t value[COUNTER_COUNT] = {};
+};
+
+struct CounterTotals {
+    uint64_t intervals = 0;
+    CounterValues values;
+
+    void add(const CounterValues &start, const CounterValues &end) {
+        for (uint32_t id = 0; id < COUNTER_COUNT; id++) {
+            values.value[id] += end.value[id] > start.value[id] ? end.value[id] - start.value[id] : 0;
+        }
+    }
+};
+
+// State of one OpenMP thread, only touched by that thread
+struct alignas(64) ThreadCounters {
+    int group_fd = -1;
+    int fds[COUNTER_COUNT];
+    uint32_t opened = 0;                    // bit per CounterId in the group
+    uint32_t slot[COUNTER_COUNT] = {};      // position of each counter in a group read
+
+    // Outermost parallel region the thread is working in, and its call site
+    int region_depth = 0;
+    uint64_t region_site = 0;
+    CounterValues region_start;
+
+    std::vector<std::pair<uint64_t, CounterValues>> loop_starts;   // codeptr_ra of open loops
+
+    uint64_t task_site = 0;                 // creation site of the running explicit task, 0 for none
+    CounterValues task_start;
+
+    std::unordered_map<uint64_t, CounterTotals> regions;    // by call site, 0 if unknown
+    std::unordered_map<uint64_t, CounterTotals> loops;      // by codeptr_ra
+    std::unordered_map<uint64_t, CounterTotals> tasks;      // by creation codeptr_ra
+};
+
+static PerThreadRegistry<ThreadCounters> thread_counters("COMPASS_PERF_COUNTERS");
+// Counters opened by at least one thread
+static std::atomic<uint32_t> counters_available{0};
+static std::atomic<bool> hardware_warning_printed{false};
+static std::atomic<bool> open_warning_printed{false};
+
+#ifdef __linux__
+
+struct CounterEvent {
+    uint32_t type;
+    uint64_t config;
+};
+
+static const CounterEvent counter_events[COUNTER_COUNT] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+// Layout of a PERF_FORMAT_GROUP read with the enabled and running times
+struct CounterGroupRead {
+    uint64_t count;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[COUNTER_COUNT];
+};
+
+static int open_counter(CounterId id, int group_fd) {
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter_events[id].type;
+    attr.config = counter_events[id].config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // User space only, which perf_event_paranoid 2 still allows
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void add_to_group(ThreadCounters &counters, CounterId id) {
+    int fd = open_counter(id, counters.group_fd);
+    if (fd < 0) {
+        return;
+    }
+    if (counters.group_fd < 0) {
+        counters.group_fd = fd;
+    }
+    counters.fds[id] = fd;
+    counters.slot[id] = (uint32_t)__builtin_popcount(counters.opened);
+    counters.opened |= 1u << id;
+}
+
+// Scaled by enabled over running time when the kernel had to multiplex the group
+static bool read_counters(const ThreadCounters &counters, CounterValues &out) {
+    CounterGroupRead data;
+    ssize_t size = read(counters.group_fd, &data, sizeof(data));
+    if (size < (ssize_t)(3 * sizeof(uint64_t))) {
+        return false;
+    }
+    double scale = data.time_running && data.time_running < data.time_enabled
+                   ? (double)data.time_enabled / (double)data.time_running : 1.0;
+    for (uint32_t id = 0; id < COUNTER_COUNT; id++) {
+        out.value[id] = (counters.opened & (1u << id)) ? (uint64_t)((double)data.values[counters.slot[id]] * scale) : 0;
+    }
+    return true;
+}
+
+void perf_counters_thread_begin() {
+    ThreadCounters *counters = thread_counters.get_or_create();
+    if (!counters) {
+        return;
+    }
+
+    // Cycles lead the group when there is a PMU; other hardware counters the
+    // CPU does not have are left out
+    add_to_group(*counters, COUNTER_CYCLES);
+    if (counters->group_fd >= 0) {
+        for (CounterId id : {COUNTER_INSTRUCTIONS, COUNTER_CACHE_REFERENCES, COUNTER_CACHE_MISSES,
+                             COUNTER_BRANCH_MISSES}) {
+            add_to_group(*counters, id);
+        }
+    } else if (!hardware_warning_printed.exchange(true)) {
+        std::cerr << "perf_event_open: no hardware counters (" << strerror(errno)
+                  << "), counting software events only\n";
+    }
+    for (CounterId id : {COUNTER_TASK_CLOCK, COUNTER_PAGE_FAULTS, COUNTER_CONTEXT_SWITCHES}) {
+        add_to_group(*counters, id);
+    }
+    if (counters->group_fd < 0) {
+        if (!open_warning_printed.exchange(true)) {
+            std::cerr << "perf_event_open: could not open any counter (" << strerror(errno) << ")\n";
+        }
+        return;
+    }
+    counters_available.fetch_or(counters->opened);
+}
+
+void perf_counters_thread_end() {
+    ThreadCounters *counters = thread_counters.local();
+    if (!counters || counters->group_fd < 0) {
+        return;
+    }
+    for (uint32_t id = 0; id < COUNTER_COUNT; id++) {
+        if (counters->opened & (1u << id)) {
+            close(counters->fds[id]);
+        }
+    }
+    counters->group_fd = -1;
+}
+
+#else
+
+static bool read_counters(const ThreadCounters &, CounterValues &) {
+    return false;
+}
+
+void perf_counters_thread_begin() {
+    if (!hardware_warning_printed.exchange(true)) {
+        std::cerr << "COMPASS_PERF_COUNTERS: perf_event_open is not supported on this platform\n";
+    }
+}
+
+void perf_counters_thread_end() {}
+
+#endif
+
+// Counters of the calling thread, nullptr if it has none or they were closed
+static ThreadCounters *current_counters(CounterValues &now) {
+    ThreadCounters *counters = thread_counters.local();
+    if (!counters || counters->group_fd < 0 || !read_counters(*counters, now)) {
+        return nullptr;
+    }
+    return counters;
+}
+
+void perf_counters_implicit_task(ompt_scope_endpoint_t endpoint, uint64_t parallel_id, int flags) {
+    // The initial task spans the whole program and is not a parallel region
+    if (flags & ompt_task_initial) {
+        return;
+    }
+    CounterValues now;
+    ThreadCounters *counters = current_counters(now);
+    if (!counters) {
+        return;
+    }
+    if (endpoint == ompt_scope_begin) {
+        if (counters->region_depth++ == 0) {
+            // Looked up once per region instance, so totals stay per call site
+            counters->region_site = parallel_site(parallel_id);
+            counters->region_start = now;
+        }
+    } else if (counters->region_depth > 0 && --counters->region_depth == 0) {
+        CounterTotals &totals = counters->regions[counters->region_site];
+        totals.add(counters->region_start, now);
+        totals.intervals++;
+    }
+}
+
+static bool is_loop(ompt_work_t work_type) {
+    switch (work_type) {
+        case ompt_work_loop:
+        case ompt_work_loop_static:
+        case ompt_work_loop_dynamic:
+        case ompt_work_loop_guided:
+        case ompt_work_loop_other:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void perf_counters_work(ompt_work_t work_type, ompt_scope_endpoint_t endpoint, const void *codeptr_ra) {
+    if (!is_loop(work_type)) {
+        return;
+    }
+    CounterValues now;
+    ThreadCounters *counters = current_counters(now);
+    if (!counters) {
+        return;
+    }
+    uint64_t codeptr = reinterpret_cast<uint64_t>(codeptr_ra);
+    if (endpoint == ompt_scope_begin) {
+        counters->loop_starts.emplace_back(codeptr, now);
+    } else if (!counters->loop_starts.empty()) {
+        // Loops nest, so the end is the innermost open loop's. Runtimes do
+        // not always pass the same codeptr_ra at both ends; the begin's wins.
+        uint64_t site = counters->loop_starts.back().first ? counters->loop_starts.back().first : codeptr;
+        CounterTotals &totals = counters->loops[site];
+        totals.add(counters->loop_starts.back().second, now);
+        totals.intervals++;
+        counters->loop_starts.pop_back();
+    }
+}
+
+void perf_counters_task_schedule(ompt_task_status_t prior_task_status, uint64_t next_task) {
+    CounterValues now;
+    ThreadCounters *counters = current_counters(now);
+    if (!counters) {
+        return;
+    }
+    // Tied tasks resume on the thread they started on, so the running task's
+    // site is the one remembered at the switch to it
+    if (counters->task_site) {
+        CounterTotals &totals = counters->tasks[counters->task_site];
+        totals.add(counters->task_start, now);
+        // Intervals of a task site count completed tasks, not switches
+        if (prior_task_status == ompt_task_complete || prior_task_status == ompt_task_late_fulfill) {
+            totals.intervals++;
+        }
+    }
+    counters->task_site = task_origin(next_task);
+    counters->task_start = now;
+}
+
+struct CounterRow {
+    const char *scope;
+    uint64_t site;
+    CounterTotals totals;
+};
+
+static bool available(uint32_t id) {
+    return counters_available.load() & (1u << id);
+}
+
+// Ratio of two counters scaled by factor, empty when either is missing or the divisor is 0
+static std::string counter_ratio(const CounterValues &values, uint32_t numerator, uint32_t denominator, double factor) {
+    if (!available(numerator) || !available(denominator) || values.value[denominator] == 0) {
+        return "";
+    }
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2)
+        << (double)values.value[numerator] * factor / (double)values.value[denominator];
+    return out.str();
+}
+
+void write_perf_counters_report() {
+    std::map<uint64_t, CounterTotals> regions;
+    std::map<uint64_t, CounterTotals> loops;
+    std::map<uint64_t, CounterTotals> tasks;
+    auto merge = [](CounterTotals &into, const CounterTotals &from) {
+        into.intervals += from.intervals;
+        for (uint32_t id = 0; id < COUNTER_COUNT; id++) {
+            into.values.value[id] += from.values.value[id];
+        }
+    };
+    for (const ThreadCounters *counters : thread_counters.all()) {
+        for (const auto &[site, totals] : counters->regions) {
+            merge(regions[site], totals);
+        }
+        for (const auto &[codeptr, totals] : counters->loops) {
+            merge(loops[codeptr], totals);
+        }
+        for (const auto &[codeptr, totals] : counters->tasks) {
+            merge(tasks[codeptr], totals);
+        }
+    }
+
+    std::vector<CounterRow> rows;
+    for (const auto &[site, totals] : regions) {
+        rows.push_back({"region", site, totals});
+    }
+    for (const auto &[site, totals] : loops) {
+        rows.push_back({"loop", site, totals});
+    }
+    for (const auto &[site, totals] : tasks) {
+        rows.push_back({"task", site, totals});
+    }
+    // Rank by cycles, or by task-clock without hardware counters
+    uint32_t rank_by = available(COUNTER_CYCLES) ? COUNTER_CYCLES : COUNTER_TASK_CLOCK;
+    std::stable_sort(rows.begin(), rows.end(), [rank_by](const CounterRow &a, const CounterRow &b) {
+        return a.totals.values.value[rank_by] > b.totals.values.value[rank_by];
+    });
+
+    std::ofstream out(PERF_COUNTERS_REPORT_FILE_NAME);
+    if (!out) {
+        std::cerr << "Could not open " << PERF_COUNTERS_REPORT_FILE_NAME << "\n";
+        return;
+    }
+    std::vector<uint64_t> codeptrs;
+    for (const CounterRow &row : rows) {
+        if (row.site) {
+            codeptrs.push_back(row.site);
+        }
+    }
+    symbolize(codeptrs);
+
+    out << "scope,site,count";
+    for (const char *name : counter_names) {
+        out << "," << name;
+    }
+    out << ",ipc,cache_miss_pct,cache_mpki,branch_mpki,symbol\n";
+    for (const CounterRow &row : rows) {
+        const CounterValues &values = row.totals.values;
+        out << row.scope << ",0x" << std::hex << row.site << std::dec << "," << row.totals.intervals;
+        for (uint32_t id = 0; id < COUNTER_COUNT; id++) {
+            out << ",";
+            if (available(id)) {
+                out << values.value[id];
+            }
+        }
+        out << "," << counter_ratio(values, COUNTER_INSTRUCTIONS, COUNTER_CYCLES, 1)
+            << "," << counter_ratio(values, COUNTER_CACHE_MISSES, COUNTER_CACHE_REFERENCES, 100)
+            << "," << counter_ratio(values, COUNTER_CACHE_MISSES, COUNTER_INSTRUCTIONS, 1000)
+            << "," << counter_ratio(values, COUNTER_BRANCH_MISSES, COUNTER_INSTRUCTIONS, 1000)
+            << "," << csv_field(row.site ? format_symbol(lookup_symbol(row.site)) : "") << "\n";
+    }
+
+    std::cout << "Performance counters (" << (available(COUNTER_CYCLES) ? "hardware and software" : "software only")
+              << ") of " << regions.size() << " parallel regions, " << loops.size() << " loops and "
+              << tasks.size() << " task sites written to " << PERF_COUNTERS_REPORT_FILE_NAME << "\n";
+    for (size_t i = 0; i < rows.size() && i < PERF_COUNTERS_REPORT_TOP; i++) {
+        const CounterRow &row = rows[i];
+        const CounterValues &values = row.totals.values;
+        std::cout << "  " << row.scope << " "
+                  << (row.site ? format_symbol(lookup_symbol(row.site)) : std::string("(unknown site)")) << ": ";
+        if (available(COUNTER_CYCLES)) {
+            std::cout << values.value[COUNTER_CYCLES] << " cycles";
+            std::string ipc = counter_ratio(values, COUNTER_INSTRUCTIONS, COUNTER_CYCLES, 1);
+            std::string mpki = counter_ratio(values, COUNTER_CACHE_MISSES, COUNTER_INSTRUCTIONS, 1000);
+            if (!ipc.empty()) {
+                std::cout << ", IPC " << ipc;
+            }
+            if (!mpki.empty()) {
+                std::cout << ", " << mpki << " cache misses per 1000 instructions";
+            }
+        } else {
+            std::cout << std::fixed << std::setprecision(3) << values.value[COUNTER_TASK_CLOCK] / 1e6
+                      << std::defaultfloat << " ms task-clock";
+        }
+        if (available(COUNTER_PAGE_FAULTS)) {
+            std::cout << ", " << values.value[COUNTER_PAGE_FAULTS] << " page faults";
+        }
+        std::cout << "\n";
+    }
+}
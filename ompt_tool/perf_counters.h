@@ -0,0 +1,39 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <omp-tools.h>
+
+// Report written by write_perf_counters_report()
+constexpr const char *PERF_COUNTERS_REPORT_FILE_NAME = "logs/perf_counters.csv";
+
+// Performance counters per parallel region, worksharing loop and explicit task
+// site. Each OpenMP thread opens one perf_event_open group counting its own
+// user-space cycles, instructions, cache references and misses and branch
+// misses, plus task-clock, page faults and context switches; where hardware
+// counters cannot be opened (no PMU, as in most VMs, or a restrictive
+// perf_event_paranoid) only the software ones are counted. The group is read
+// with one read() at implicit task, loop and task switch boundaries, and the
+// deltas are added up per thread without synchronization. Regions and loops
+// include everything run inside them; tasks count from a switch to them to the
+// next switch away, under the site task_origins.h recorded at creation. Linux
+// only.
+void perf_counters_thread_begin();
+void perf_counters_thread_end();
+void perf_counters_implicit_task(ompt_scope_endpoint_t endpoint, uint64_t parallel_id, int flags);
+void perf_counters_work(ompt_work_t work_type, ompt_scope_endpoint_t endpoint, const void *codeptr_ra);
+void perf_counters_task_schedule(ompt_task_status_t prior_task_status, uint64_t next_task);
+
+/**
+ * @brief Writes the counters to PERF_COUNTERS_REPORT_FILE_NAME.
+ *
+ * One "region" row per parallel region call site, one "loop" row per loop
+ * construct and one "task" row per task creation site, summed over threads,
+ * with the raw counts, IPC, cache miss rate, cache and branch misses per
+ * thousand instructions, and the function and line. Counters no thread could
+ * open are left empty. The rows with the most cycles (task-clock without
+ * hardware counters) are printed.
+ */
+void write_perf_counters_report();
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,156 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "sampling.h"
+#include "timestamp.h"
+
+// Adaptive mode re-evaluates each thread's period once per window
+constexpr uint64_t ADAPTIVE_WINDOW_NS = 10000000;
+constexpr uint64_t ADAPTIVE_MAX_PERIOD = 1 << 20;
+// Deepest nesting of worksharing constructs whose sampling decision is tracked
+constexpr int MAX_WORK_DEPTH = 64;
+
+SamplingConfig sampling_config = {SAMPLING_OFF, 1, 0, 0.0};
+
+// Sampler state of one thread. Tasks and worksharing constructs are sampled
+// independently; adaptive mode drives both with a shared period.
+struct ThreadSampler {
+    uint64_t task_count = 0;
+    uint64_t work_count = 0;
+    uint64_t last_task_ticks = 0;
+    uint64_t last_work_ticks = 0;
+    uint64_t period = 1;
+    uint64_t window_start = 0;
+    uint64_t window_cost = 0;
+    uint64_t work_sampled = 0;   // one decision bit per open worksharing construct
+    int work_depth = 0;
+};
+
+static thread_local ThreadSampler sampler;
+
+static uint64_t ns_to_ticks(uint64_t ns) {
+    return (uint64_t)(ns / clock_calibration.ns_per_tick);
+}
+
+void configure_sampling(const char *spec) {
+    sampling_config = {SAMPLING_OFF, 1, 0, 0.0};
+    if (!spec || !*spec || strcmp(spec, "off") == 0) {
+        return;
+    }
+
+    const char *separator = strchr(spec, ':');
+    std::string mode = separator ? std::string(spec, separator - spec) : std::string(spec);
+    const char *argument = separator ? separator + 1 : "";
+
+    if (mode == "count") {
+        long long period = atoll(argument);
+        if (period > 1) {
+            sampling_config.mode = SAMPLING_COUNT;
+            sampling_config.period = (uint64_t)period;
+            return;
+        }
+    } else if (mode == "time") {
+        long long interval_us = atoll(argument);
+        if (interval_us > 0) {
+            sampling_config.mode = SAMPLING_TIME;
+            sampling_config.interval_ns = (uint64_t)interval_us * 1000;
+            return;
+        }
+    } else if (mode == "adaptive") {
+        double budget = *argument ? atof(argument) : 5.0;
+        if (budget > 0.0 && budget < 100.0) {
+            sampling_config.mode = SAMPLING_ADAPTIVE;
+            sampling_config.budget_percent = budget;
+            return;
+        }
+    }
+    std::cerr << "COMPASS_SAMPLING: invalid value " << spec << ", sampling disabled\n";
+}
+
+// Core 1-in-N / 1-per-interval decision for one event stream of the thread
+static bool sample_next(uint64_t &count, uint64_t &last_ticks) {
+    switch (sampling_config.mode) {
+        case SAMPLING_OFF:
+            return true;
+        case SAMPLING_COUNT:
+            return count++ % sampling_config.period == 0;
+        case SAMPLING_ADAPTIVE:
+            return count++ % sampler.period == 0;
+        case SAMPLING_TIME: {
+            uint64_t now = read_timestamp();
+            if (last_ticks != 0 && now - last_ticks < ns_to_ticks(sampling_config.interval_ns)) {
+                return false;
+            }
+            last_ticks = now;
+            return true;
+        }
+    }
+    return true;
+}
+
+bool sample_new_task() {
+    return sample_next(sampler.task_count, sampler.last_task_ticks);
+}
+
+bool sample_work(ompt_scope_endpoint_t endpoint) {
+    if (sampling_config.mode == SAMPLING_OFF) {
+        return true;
+    }
+
+    if (endpoint == ompt_scope_begin) {
+        bool sampled = sample_next(sampler.work_count, sampler.last_work_ticks);
+        if (sampler.work_depth < MAX_WORK_DEPTH) {
+            sampler.work_sampled = (sampler.work_sampled << 1) | (sampled ? 1 : 0);
+        }
+        sampler.work_depth++;
+        return sampled;
+    }
+
+    if (sampler.work_depth == 0) {
+        return true;
+    }
+    sampler.work_depth--;
+    if (sampler.work_depth >= MAX_WORK_DEPTH) {
+        return true;
+    }
+    bool sampled = sampler.work_sampled & 1;
+    sampler.work_sampled >>= 1;
+    return sampled;
+}
+
+void sampling_record_cost(uint64_t ticks) {
+    uint64_t now = read_timestamp();
+    if (sampler.window_start == 0) {
+        sampler.window_start = now;
+    }
+    sampler.window_cost += ticks;
+
+    uint64_t elapsed = now - sampler.window_start;
+    if (elapsed < ns_to_ticks(ADAPTIVE_WINDOW_NS)) {
+        return;
+    }
+
+    // Halve or double the period, with a dead band so it does not oscillate
+    double spent_percent = 100.0 * (double)sampler.window_cost / (double)elapsed;
+    if (spent_percent > sampling_config.budget_percent && sampler.period < ADAPTIVE_MAX_PERIOD) {
+        sampler.period *= 2;
+    } else if (spent_percent < sampling_config.budget_percent / 4 && sampler.period > 1) {
+        sampler.period /= 2;
+    }
+    sampler.window_start = now;
+    sampler.window_cost = 0;
+}
+
+std::string sampling_meta() {
+    switch (sampling_config.mode) {
+        case SAMPLING_OFF:
+            return "sampling_mode=off\n";
+        case SAMPLING_COUNT:
+            return "sampling_mode=count\nsampling_period=" + std::to_string(sampling_config.period) + "\n";
+        case SAMPLING_TIME:
+            return "sampling_mode=time\nsampling_interval_ns=" + std::to_string(sampling_config.interval_ns) + "\n";
+        case SAMPLING_ADAPTIVE:
+            return "sampling_mode=adaptive\nsampling_budget_percent=" + std::to_string(sampling_config.budget_percent) + "\n";
+    }
+    return "";
+}
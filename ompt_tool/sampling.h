@@ -0,0 +1,58 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include <cstdint>
+#include <string>
+#include <omp-tools.h>
+
+// Sampling only thins out the high-frequency events: explicit tasks (their
+// create and schedule events) and worksharing constructs. Every other event is
+// always recorded, and exact counts of all events are kept regardless.
+
+enum SamplingMode : uint32_t {
+    SAMPLING_OFF,
+    SAMPLING_COUNT,      // record 1 in N tasks/constructs per thread
+    SAMPLING_TIME,       // record at most one task/construct per interval per thread
+    SAMPLING_ADAPTIVE    // adjust N per thread to keep recording under a CPU budget
+};
+
+struct SamplingConfig {
+    SamplingMode mode;
+    uint64_t period;            // SAMPLING_COUNT: N
+    uint64_t interval_ns;       // SAMPLING_TIME: minimum time between samples
+    double budget_percent;      // SAMPLING_ADAPTIVE: share of thread time spent recording
+};
+
+extern SamplingConfig sampling_config;
+
+// Explicit tasks picked by the sampler carry this bit in their ompt task data
+constexpr uint64_t TASK_SAMPLED_BIT = 1ull << 63;
+
+/**
+ * @brief Parses the COMPASS_SAMPLING value.
+ *
+ * Accepts off, count:N, time:MICROSECONDS or adaptive[:PERCENT] (default 5%).
+ * Invalid values disable sampling.
+ */
+void configure_sampling(const char *spec);
+
+/**
+ * @brief Decides whether the task being created on the calling thread is recorded.
+ *
+ * A sampled task has its create event and every schedule event it takes part
+ * in recorded, so its execution intervals stay complete in the trace.
+ */
+bool sample_new_task();
+
+// Decides at ompt_scope_begin whether a worksharing construct is recorded and
+// returns the same decision for its matching ompt_scope_end.
+bool sample_work(ompt_scope_endpoint_t endpoint);
+
+// Reports the ticks the calling thread spent recording one sampled event;
+// drives the adaptive mode.
+void sampling_record_cost(uint64_t ticks);
+
+// "key=value" lines describing the sampling configuration for the trace metadata
+std::string sampling_meta();
+
+#endif // SAMPLING_H
@@ -0,0 +1,413 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "helper.h"
+#include "ompt_runtime.h"
+#include "parallel_sites.h"
+#include "sampling.h"
+#include "state_sampler.h"
+#include "symbolizer.h"
+#include "thread_registry.h"
+#include "timestamp.h"
+#include "tool_config.h"
+#include "trace_buffer.h"
+
+// Older glibc only has the kernel's name for the target thread of SIGEV_THREAD_ID
+#if defined(__linux__) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+constexpr size_t STATE_REPORT_TOP = 5;
+// Parallel region call sites counted per thread; samples in further sites only count for the thread
+constexpr size_t STATE_REGION_SLOTS = 64;
+// Last samples of each thread kept for STATE_SAMPLES_FILE_NAME
+constexpr size_t STATE_RING_SIZE = 4096;
+
+enum StateCategory : uint32_t {
+    STATE_WORK,
+    STATE_BARRIER,
+    STATE_TASKWAIT,
+    STATE_LOCK,
+    STATE_IDLE,
+    STATE_OVERHEAD,
+    STATE_OTHER,
+    STATE_CATEGORY_COUNT
+};
+
+static const char *const state_category_names[] = {"work", "barrier", "taskwait", "lock", "idle", "overhead", "other"};
+
+struct StateSample {
+    uint64_t time;
+    uint64_t parallel_id;
+    uint64_t task_id;
+    int state;
+};
+
+struct RegionStates {
+    bool used = false;
+    uint64_t site = 0;
+    uint64_t samples[STATE_CATEGORY_COUNT] = {};
+};
+
+// Samples of one OpenMP thread, only written by the signal handler running on
+// that thread, so it needs no synchronization and never allocates
+struct alignas(64) ThreadStates {
+    uint64_t thread_id = 0;
+    timer_t timer{};
+    std::atomic<bool> armed{false};
+    uint64_t samples[STATE_CATEGORY_COUNT] = {};
+    RegionStates regions[STATE_REGION_SLOTS];
+    uint64_t unplaced_samples = 0;      // samples of sites beyond STATE_REGION_SLOTS
+    uint64_t sample_count = 0;          // the last STATE_RING_SIZE are in ring
+    StateSample ring[STATE_RING_SIZE];
+};
+
+static PerThreadRegistry<ThreadStates> thread_states("COMPASS_STATE_SAMPLING");
+static std::atomic<bool> sampler_running{false};
+
+static StateCategory state_category(int state) {
+    switch (state) {
+        case ompt_state_work_serial:
+        case ompt_state_work_parallel:
+        case ompt_state_work_reduction:
+            return STATE_WORK;
+        case ompt_state_wait_barrier:
+        case ompt_state_wait_barrier_implicit_parallel:
+        case ompt_state_wait_barrier_implicit_workshare:
+        case ompt_state_wait_barrier_implicit:
+        case ompt_state_wait_barrier_explicit:
+        case ompt_state_wait_barrier_implementation:
+        case ompt_state_wait_barrier_teams:
+            return STATE_BARRIER;
+        case ompt_state_wait_taskwait:
+        case ompt_state_wait_taskgroup:
+            return STATE_TASKWAIT;
+        case ompt_state_wait_mutex:
+        case ompt_state_wait_lock:
+        case ompt_state_wait_critical:
+        case ompt_state_wait_atomic:
+        case ompt_state_wait_ordered:
+            return STATE_LOCK;
+        case ompt_state_idle:
+            return STATE_IDLE;
+        case ompt_state_overhead:
+            return STATE_OVERHEAD;
+        default:
+            return STATE_OTHER;
+    }
+}
+
+static void count_region_sample(ThreadStates &states, uint64_t site, StateCategory category) {
+    size_t start = (size_t)((site * 0x9E3779B97F4A7C15ull) >> 32) % STATE_REGION_SLOTS;
+    for (size_t probe = 0; probe < STATE_REGION_SLOTS; probe++) {
+        RegionStates &region = states.regions[(start + probe) % STATE_REGION_SLOTS];
+        if (!region.used) {
+            region.used = true;
+            region.site = site;
+        }
+        if (region.site == site) {
+            region.samples[category]++;
+            return;
+        }
+    }
+    states.unplaced_samples++;
+}
+
+// Runs on the sampled thread in signal context: only OMPT inquiry functions,
+// which are async-signal-safe, and stores into the thread's own ThreadStates
+static void take_state_sample(ThreadStates &states) {
+    ompt_wait_id_t wait_id;
+    int state = ompt_runtime.get_state(&wait_id);
+
+    int flags = 0;
+    int thread_num = 0;
+    ompt_data_t *task_data = nullptr;
+    ompt_data_t *parallel_data = nullptr;
+    ompt_frame_t *task_frame = nullptr;
+    if (!ompt_runtime.get_task_info ||
+        ompt_runtime.get_task_info(0, &flags, &task_data, &task_frame, &parallel_data, &thread_num) != 2) {
+        task_data = nullptr;
+        parallel_data = nullptr;
+    }
+    uint64_t parallel_id = parallel_data ? parallel_data->value : TRACE_ID_NONE;
+
+    StateCategory category = state_category(state);
+    states.samples[category]++;
+    count_region_sample(states, parallel_site(parallel_id), category);
+
+    StateSample &sample = states.ring[states.sample_count % STATE_RING_SIZE];
+    sample.time = read_timestamp();
+    sample.parallel_id = parallel_id;
+    sample.task_id = task_data ? task_data->value & ~TASK_SAMPLED_BIT : TRACE_ID_NONE;
+    sample.state = state;
+    states.sample_count++;
+}
+
+#ifdef __linux__
+
+static struct sigaction previous_sigprof;
+
+// SIGPROF that is not one of our timers goes to whatever handler was installed before
+static void forward_sigprof(int signal, siginfo_t *info, void *context) {
+    if (previous_sigprof.sa_flags & SA_SIGINFO) {
+        if (previous_sigprof.sa_sigaction) {
+            previous_sigprof.sa_sigaction(signal, info, context);
+        }
+    } else if (previous_sigprof.sa_handler != SIG_DFL && previous_sigprof.sa_handler != SIG_IGN) {
+        previous_sigprof.sa_handler(signal);
+    }
+}
+
+static void on_sigprof(int signal, siginfo_t *info, void *context) {
+    ThreadStates *states = nullptr;
+    // Only our own timers carry a ThreadStates, other timers may carry anything
+    if (info && info->si_code == SI_TIMER && thread_states.contains(info->si_value.sival_ptr)) {
+        states = static_cast<ThreadStates *>(info->si_value.sival_ptr);
+    }
+    if (!states) {
+        forward_sigprof(signal, info, context);
+        return;
+    }
+    if (!sampler_running.load(std::memory_order_relaxed)) {
+        return;
+    }
+    int saved_errno = errno;
+    take_state_sample(*states);
+    errno = saved_errno;
+}
+
+bool start_state_sampler() {
+    if (!ompt_runtime.get_state) {
+        std::cerr << "COMPASS_STATE_SAMPLING: ompt_get_state function not found\n";
+        return false;
+    }
+    struct sigaction action = {};
+    action.sa_sigaction = on_sigprof;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previous_sigprof) != 0) {
+        std::cerr << "COMPASS_STATE_SAMPLING: could not install the SIGPROF handler\n";
+        return false;
+    }
+    sampler_running.store(true);
+    return true;
+}
+
+void state_sampler_thread_begin(uint64_t thread_id) {
+    if (!sampler_running.load(std::memory_order_relaxed)) {
+        return;
+    }
+    // Registered before the timer is armed, so the handler recognizes the first signal
+    ThreadStates *states = thread_states.get_or_create();
+    if (!states) {
+        return;
+    }
+    states->thread_id = thread_id;
+
+    struct sigevent event = {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_value.sival_ptr = states;
+    event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    if (timer_create(CLOCK_MONOTONIC, &event, &states->timer) != 0) {
+        std::cerr << "COMPASS_STATE_SAMPLING: could not create the timer of thread " << thread_id << "\n";
+        return;
+    }
+    uint64_t interval_ns = 1000000000ull / tool_config.state_sample_hz;
+    struct itimerspec spec = {};
+    spec.it_interval.tv_sec = (time_t)(interval_ns / 1000000000ull);
+    spec.it_interval.tv_nsec = (long)(interval_ns % 1000000000ull);
+    spec.it_value = spec.it_interval;
+    timer_settime(states->timer, 0, &spec, nullptr);
+    states->armed.store(true, std::memory_order_release);
+}
+
+static void disarm_state_timer(ThreadStates &states) {
+    if (states.armed.exchange(false)) {
+        timer_delete(states.timer);
+    }
+}
+
+void state_sampler_thread_end() {
+    ThreadStates *states = thread_states.local();
+    if (states) {
+        disarm_state_timer(*states);
+    }
+}
+
+void stop_state_sampler() {
+    sampler_running.store(false);
+    for (ThreadStates *states : thread_states.all()) {
+        disarm_state_timer(*states);
+    }
+}
+
+#else
+
+bool start_state_sampler() {
+    std::cerr << "COMPASS_STATE_SAMPLING: per-thread timers are not supported on this platform\n";
+    return false;
+}
+
+void state_sampler_thread_begin(uint64_t) {}
+void state_sampler_thread_end() {}
+void stop_state_sampler() {}
+
+#endif
+
+static double category_share(const uint64_t (&samples)[STATE_CATEGORY_COUNT], uint64_t total, uint32_t category) {
+    return total ? (double)samples[category] * 100 / (double)total : 0.0;
+}
+
+static uint64_t total_samples(const uint64_t (&samples)[STATE_CATEGORY_COUNT]) {
+    uint64_t total = 0;
+    for (uint64_t count : samples) {
+        total += count;
+    }
+    return total;
+}
+
+// "62.0% work, 31.5% barrier", leaving out states without samples
+static std::string format_shares(const uint64_t (&samples)[STATE_CATEGORY_COUNT]) {
+    uint64_t total = total_samples(samples);
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    for (uint32_t category = 0; category < STATE_CATEGORY_COUNT; category++) {
+        if (samples[category] == 0) {
+            continue;
+        }
+        if (out.tellp() > 0) {
+            out << ", ";
+        }
+        out << category_share(samples, total, category) << "% " << state_category_names[category];
+    }
+    return out.str();
+}
+
+struct StateRow {
+    uint64_t samples[STATE_CATEGORY_COUNT] = {};
+};
+
+static void write_state_row(std::ostream &out, const char *scope, const std::string &id,
+                            const uint64_t (&samples)[STATE_CATEGORY_COUNT], const std::string &symbol) {
+    uint64_t total = total_samples(samples);
+    out << scope << "," << id << "," << total << "," << std::fixed << std::setprecision(3)
+        << (double)total / tool_config.state_sample_hz << std::setprecision(1);
+    for (uint32_t category = 0; category < STATE_CATEGORY_COUNT; category++) {
+        out << "," << category_share(samples, total, category);
+    }
+    out << std::defaultfloat << "," << csv_field(symbol) << "\n";
+}
+
+static void write_state_samples(const std::vector<ThreadStates *> &threads) {
+    std::ofstream out(STATE_SAMPLES_FILE_NAME);
+    if (!out) {
+        std::cerr << "Could not open " << STATE_SAMPLES_FILE_NAME << "\n";
+        return;
+    }
+    out << "thread,time_ns,state,parallel_id,task_id\n";
+    for (const ThreadStates *states : threads) {
+        uint64_t kept = std::min<uint64_t>(states->sample_count, STATE_RING_SIZE);
+        for (uint64_t i = states->sample_count - kept; i < states->sample_count; i++) {
+            const StateSample &sample = states->ring[i % STATE_RING_SIZE];
+            out << states->thread_id << "," << timestamp_to_ns(sample.time) << ","
+                << ompt_state_t_to_string(sample.state) << ",";
+            if (sample.parallel_id != TRACE_ID_NONE) {
+                out << sample.parallel_id;
+            }
+            out << ",";
+            if (sample.task_id != TRACE_ID_NONE) {
+                out << sample.task_id;
+            }
+            out << "\n";
+        }
+    }
+}
+
+void write_state_report() {
+    std::vector<ThreadStates *> threads = thread_states.all();
+    std::stable_sort(threads.begin(), threads.end(), [](const ThreadStates *a, const ThreadStates *b) {
+        return a->thread_id < b->thread_id;
+    });
+
+    StateRow process;
+    std::map<uint64_t, StateRow> regions;
+    uint64_t unplaced = 0;
+    for (const ThreadStates *states : threads) {
+        for (uint32_t category = 0; category < STATE_CATEGORY_COUNT; category++) {
+            process.samples[category] += states->samples[category];
+        }
+        for (const RegionStates &region : states->regions) {
+            if (!region.used) {
+                continue;
+            }
+            StateRow &row = regions[region.site];
+            for (uint32_t category = 0; category < STATE_CATEGORY_COUNT; category++) {
+                row.samples[category] += region.samples[category];
+            }
+        }
+        unplaced += states->unplaced_samples;
+    }
+    std::vector<std::pair<uint64_t, const StateRow *>> region_rows;
+    for (const auto &[site, row] : regions) {
+        region_rows.emplace_back(site, &row);
+    }
+    std::stable_sort(region_rows.begin(), region_rows.end(), [](const auto &a, const auto &b) {
+        return total_samples(a.second->samples) > total_samples(b.second->samples);
+    });
+
+    std::ofstream out(STATE_REPORT_FILE_NAME);
+    if (!out) {
+        std::cerr << "Could not open " << STATE_REPORT_FILE_NAME << "\n";
+        return;
+    }
+    std::vector<uint64_t> codeptrs;
+    for (const auto &[site, row] : regions) {
+        if (site) {
+            codeptrs.push_back(site);
+        }
+    }
+    symbolize(codeptrs);
+    auto region_name = [](uint64_t site) {
+        return site ? format_symbol(lookup_symbol(site)) : std::string("outside parallel regions");
+    };
+
+    out << "scope,id,samples,seconds";
+    for (const char *name : state_category_names) {
+        out << "," << name << "_pct";
+    }
+    out << ",symbol\n";
+    for (const ThreadStates *states : threads) {
+        write_state_row(out, "thread", std::to_string(states->thread_id), states->samples, "");
+    }
+    for (const auto &[site, row] : region_rows) {
+        std::ostringstream id;
+        id << "0x" << std::hex << site;
+        write_state_row(out, "region", site ? id.str() : "", row->samples, region_name(site));
+    }
+    write_state_samples(threads);
+
+    std::cout << "Thread states from " << total_samples(process.samples) << " samples of " << threads.size()
+              << " threads at " << tool_config.state_sample_hz << " Hz written to " << STATE_REPORT_FILE_NAME << "\n";
+    std::cout << "  all threads: " << format_shares(process.samples) << "\n";
+    for (size_t i = 0; i < region_rows.size() && i < STATE_REPORT_TOP; i++) {
+        std::cout << "  " << region_name(region_rows[i].first) << ": " << format_shares(region_rows[i].second->samples)
+                  << "\n";
+    }
+    if (unplaced > 0) {
+        std::cout << "  " << unplaced << " samples in parallel regions beyond the " << STATE_REGION_SLOTS
+                  << " sites counted per thread are only in the thread rows\n";
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef STATE_SAMPLER_H
+#define STATE_SAMPLER_H
+
+#include <cstdint>
+#include <omp-tools.h>
+
+// Reports written by write_state_report()
+constexpr const char *STATE_REPORT_FILE_NAME = "logs/states.csv";
+constexpr const char *STATE_SAMPLES_FILE_NAME = "logs/state_samples.csv";
+
+// Statistical thread state profile. Every OpenMP thread gets a POSIX timer
+// that sends it SIGPROF state_sample_hz times per second of wall time; the
+// handler asks the runtime for the thread's ompt_get_state and its current
+// parallel region and task, and counts the sample for the thread and for the
+// region's call site. Nothing happens per OpenMP event, so the cost depends on
+// the sampling rate only. Region call sites come from parallel_begin (see
+// parallel_sites.h); without it every sample is counted outside of parallel
+// regions. Linux only.
+
+// Installs the SIGPROF handler; returns false where per-thread timers are not available
+bool start_state_sampler();
+// Stops every thread's timer, before the report is written
+void stop_state_sampler();
+
+void state_sampler_thread_begin(uint64_t thread_id);
+void state_sampler_thread_end();
+
+/**
+ * @brief Writes the state breakdown to STATE_REPORT_FILE_NAME.
+ *
+ * One "thread" row per OpenMP thread and one "region" row per parallel region
+ * call site with the number of samples, the wall time they stand for and the
+ * share of work, barrier, taskwait, lock, idle, overhead and other states.
+ * The last samples of each thread, with their raw state, parallel region and
+ * task, go to STATE_SAMPLES_FILE_NAME.
+ */
+void write_state_report();
+
+#endif // STATE_SAMPLER_H
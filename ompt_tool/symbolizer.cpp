@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <elf.h>
+#endif
+#include "symbolizer.h"
+
+// Addresses handed to one addr2line/atos invocation
+constexpr size_t LINE_BATCH_SIZE = 256;
+
+// One file-backed mapping from /proc/self/maps
+struct MappedModule {
+    uint64_t start;
+    uint64_t end;
+    std::string path;
+};
+
+// Function symbols of one module, sorted by address
+struct ModuleSymbols {
+    // ET_EXEC: symbol addresses are absolute rather than relative to the load base
+    bool absolute = false;
+    std::vector<uint64_t> starts;
+    std::vector<uint64_t> sizes;
+    std::vector<std::string> names;
+};
+
+// Never freed: reports are symbolized in ompt_finalize
+static std::mutex &symbolizer_mutex = *new std::mutex();
+static std::vector<MappedModule> &module_map = *new std::vector<MappedModule>();
+// Load base of each module: start of its mapping minus that mapping's file offset
+static std::unordered_map<std::string, uint64_t> &module_bases = *new std::unordered_map<std::string, uint64_t>();
+static std::unordered_map<std::string, ModuleSymbols> &module_symbols = *new std::unordered_map<std::string, ModuleSymbols>();
+static std::unordered_map<uint64_t, Symbol> &symbol_cache = *new std::unordered_map<uint64_t, Symbol>();
+
+static void load_module_map_locked() {
+    module_map.clear();
+    module_bases.clear();
+#ifdef __linux__
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+        // start-end perms offset dev inode path
+        std::istringstream fields(line);
+        std::string range, perms, offset, dev, inode, path;
+        fields >> range >> perms >> offset >> dev >> inode;
+        std::getline(fields >> std::ws, path);
+        if (path.empty() || path[0] != '/') {
+            continue;
+        }
+        size_t dash = range.find('-');
+        uint64_t start = std::stoull(range.substr(0, dash), nullptr, 16);
+        uint64_t end = std::stoull(range.substr(dash + 1), nullptr, 16);
+        uint64_t base = start - std::stoull(offset, nullptr, 16);
+        module_map.push_back({start, end, path});
+        auto it = module_bases.find(path);
+        if (it == module_bases.end() || base < it->second) {
+            module_bases[path] = base;
+        }
+    }
+#endif
+}
+
+void load_module_map() {
+    std::lock_guard<std::mutex> lock(symbolizer_mutex);
+    load_module_map_locked();
+}
+
+// Finds the module containing address and its load base. Modules loaded
+// after the map was read are picked up by reading it again once.
+static bool find_module(uint64_t address, std::string &path, uint64_t &base) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        for (const MappedModule &module : module_map) {
+            if (address >= module.start && address < module.end) {
+                path = module.path;
+                base = module_bases[module.path];
+                return true;
+            }
+        }
+        if (attempt == 0) {
+            load_module_map_locked();
+        }
+    }
+
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void *>(address), &info) && info.dli_fname) {
+        path = info.dli_fname;
+        base = reinterpret_cast<uint64_t>(info.dli_fbase);
+        return true;
+    }
+    return false;
+}
+
+static std::string demangle(const char *name) {
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (status != 0 || !demangled) {
+        return name;
+    }
+    std::string result = demangled;
+    free(demangled);
+    return result;
+}
+
+// Reads the function symbols of an ELF file, preferring the full symbol
+// table over the dynamic one. Leaves symbols empty for other formats.
+static void read_elf_symbols(const std::string &path, ModuleSymbols &symbols) {
+#ifdef __linux__
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Elf64_Ehdr)) {
+        ::close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        return;
+    }
+
+    const uint8_t *data = static_cast<const uint8_t *>(mapping);
+    const Elf64_Ehdr *header = reinterpret_cast<const Elf64_Ehdr *>(data);
+    if (std::memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64 ||
+        header->e_shoff + (uint64_t)header->e_shnum * sizeof(Elf64_Shdr) > size) {
+        munmap(mapping, size);
+        return;
+    }
+    symbols.absolute = header->e_type == ET_EXEC;
+
+    const Elf64_Shdr *sections = reinterpret_cast<const Elf64_Shdr *>(data + header->e_shoff);
+    const Elf64_Shdr *table = nullptr;
+    for (int i = 0; i < header->e_shnum; i++) {
+        if (sections[i].sh_type == SHT_SYMTAB || (sections[i].sh_type == SHT_DYNSYM && !table)) {
+            table = &sections[i];
+        }
+    }
+
+    std::vector<std::pair<uint64_t, size_t>> order;
+    std::vector<std::pair<uint64_t, std::string>> found;
+    if (table && table->sh_link < header->e_shnum) {
+        const Elf64_Shdr &strings = sections[table->sh_link];
+        if (table->sh_offset + table->sh_size <= size && strings.sh_offset + strings.sh_size <= size) {
+            const Elf64_Sym *entries = reinterpret_cast<const Elf64_Sym *>(data + table->sh_offset);
+            size_t count = table->sh_size / sizeof(Elf64_Sym);
+            const char *names = reinterpret_cast<const char *>(data + strings.sh_offset);
+            for (size_t i = 0; i < count; i++) {
+                const Elf64_Sym &entry = entries[i];
+                if (ELF64_ST_TYPE(entry.st_info) != STT_FUNC || entry.st_value == 0 ||
+                    entry.st_name >= strings.sh_size) {
+                    continue;
+                }
+                order.emplace_back(entry.st_value, found.size());
+                found.emplace_back(entry.st_size, names + entry.st_name);
+            }
+        }
+    }
+    std::sort(order.begin(), order.end());
+    for (const auto &[start, index] : order) {
+        symbols.starts.push_back(start);
+        symbols.sizes.push_back(found[index].first);
+        symbols.names.push_back(std::move(found[index].second));
+    }
+    munmap(mapping, size);
+#else
+    (void)path;
+    (void)symbols;
+#endif
+}
+
+static ModuleSymbols &get_module_symbols(const std::string &path) {
+    auto it = module_symbols.find(path);
+    if (it == module_symbols.end()) {
+        it = module_symbols.emplace(path, ModuleSymbols()).first;
+        read_elf_symbols(path, it->second);
+    }
+    return it->second;
+}
+
+// Address as the module's own symbol and line tables see it
+static uint64_t module_address(const ModuleSymbols &symbols, const Symbol &symbol, uint64_t address) {
+    return symbols.absolute ? address : symbol.offset;
+}
+
+static void resolve_function(Symbol &symbol, uint64_t address) {
+    const ModuleSymbols &symbols = get_module_symbols(symbol.module);
+    uint64_t target = module_address(symbols, symbol, address);
+    auto it = std::upper_bound(symbols.starts.begin(), symbols.starts.end(), target);
+    if (it != symbols.starts.begin()) {
+        size_t index = it - symbols.starts.begin() - 1;
+        if (target < symbols.starts[index] + std::max<uint64_t>(symbols.sizes[index], 1)) {
+            symbol.function = demangle(symbols.names[index].c_str());
+            return;
+        }
+    }
+
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void *>(address), &info) && info.dli_sname) {
+        symbol.function = demangle(info.dli_sname);
+    }
+}
+
+static std::string shell_quote(const std::string &text) {
+    std::string quoted = "'";
+    for (char c : text) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "'";
+}
+
+// Fills file and line of the given cached addresses, which all belong to module.
+// Each is looked up one byte back, inside the call it returns from.
+static void resolve_lines(const std::string &module, uint64_t base, const std::vector<uint64_t> &addresses) {
+    const ModuleSymbols &symbols = get_module_symbols(module);
+
+    for (size_t first = 0; first < addresses.size(); first += LINE_BATCH_SIZE) {
+        size_t last = std::min(addresses.size(), first + LINE_BATCH_SIZE);
+        std::ostringstream command;
+#ifdef __APPLE__
+        (void)symbols;
+        command << "atos -o " << shell_quote(module) << " -l 0x" << std::hex << base;
+        for (size_t i = first; i < last; i++) {
+            command << " 0x" << addresses[i] - 1;
+        }
+#else
+        (void)base;
+        command << "addr2line -e " << shell_quote(module) << std::hex;
+        for (size_t i = first; i < last; i++) {
+            command << " 0x" << module_address(symbols, symbol_cache[addresses[i]], addresses[i]) - 1;
+        }
+#endif
+        command << " 2>/dev/null";
+
+        FILE *pipe = popen(command.str().c_str(), "r");
+        if (!pipe) {
+            return;
+        }
+        // One output line per address, in order
+        char buffer[4096];
+        for (size_t i = first; i < last && fgets(buffer, sizeof(buffer), pipe); i++) {
+            std::string output(buffer);
+            output.erase(output.find_last_not_of("\r\n") + 1);
+#ifdef __APPLE__
+            // "function (in module) (file:line)"
+            size_t open = output.rfind('(');
+            if (open == std::string::npos || output.back() != ')') {
+                continue;
+            }
+            output = output.substr(open + 1, output.size() - open - 2);
+#else
+            // "file:line", possibly followed by " (discriminator N)"
+            size_t space = output.find(" (");
+            if (space != std::string::npos) {
+                output.resize(space);
+            }
+#endif
+            size_t colon = output.rfind(':');
+            if (colon == std::string::npos || output.compare(0, 2, "??") == 0) {
+                continue;
+            }
+            uint32_t line = (uint32_t)strtoul(output.c_str() + colon + 1, nullptr, 10);
+            if (line == 0) {
+                continue;
+            }
+            Symbol &symbol = symbol_cache[addresses[i]];
+            symbol.file = output.substr(0, colon);
+            symbol.line = line;
+        }
+        pclose(pipe);
+    }
+}
+
+void symbolize(const std::vector<uint64_t> &addresses) {
+    std::lock_guard<std::mutex> lock(symbolizer_mutex);
+
+    // module -> (load base, addresses needing a line lookup)
+    std::unordered_map<std::string, std::pair<uint64_t, std::vector<uint64_t>>> pending;
+    for (uint64_t address : addresses) {
+        if (symbol_cache.count(address)) {
+            continue;
+        }
+        Symbol &symbol = symbol_cache[address];
+        uint64_t base = 0;
+        if (!find_module(address, symbol.module, base)) {
+            continue;
+        }
+        symbol.offset = address - base;
+        resolve_function(symbol, address);
+
+        auto &module = pending[symbol.module];
+        module.first = base;
+        module.second.push_back(address);
+    }
+
+    for (const auto &[module, lookups] : pending) {
+        resolve_lines(module, lookups.first, lookups.second);
+    }
+}
+
+const Symbol &lookup_symbol(uint64_t address) {
+    {
+        std::lock_guard<std::mutex> lock(symbolizer_mutex);
+        auto it = symbol_cache.find(address);
+        if (it != symbol_cache.end()) {
+            return it->second;
+        }
+    }
+    symbolize({address});
+    std::lock_guard<std::mutex> lock(symbolizer_mutex);
+    return symbol_cache[address];
+}
+
+std::string format_symbol(const Symbol &symbol) {
+    std::ostringstream out;
+    if (!symbol.function.empty()) {
+        out << symbol.function;
+    } else if (!symbol.module.empty()) {
+        out << symbol.module << "+0x" << std::hex << symbol.offset << std::dec;
+    } else {
+        out << "??";
+    }
+    if (!symbol.file.empty()) {
+        out << " (" << symbol.file << ":" << symbol.line << ")";
+    }
+    return out.str();
+}
@@ -0,0 +1,46 @@
+#ifndef SYMBOLIZER_H
+#define SYMBOLIZER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Source location of a code pointer.
+ *
+ * Callbacks only ever record raw codeptr_ra values; they are resolved here,
+ * off the hot path, once per unique address.
+ */
+struct Symbol {
+    std::string module;     // path of the executable or shared object
+    uint64_t offset = 0;    // address relative to the module's load base
+    std::string function;   // demangled, empty if unknown
+    std::string file;       // empty if the module has no line information
+    uint32_t line = 0;
+};
+
+// Reads the module layout of the process (/proc/self/maps on Linux), so
+// addresses can be mapped back to files despite ASLR. Called at startup and
+// again whenever an address falls outside every known module.
+void load_module_map();
+
+/**
+ * @brief Resolves addresses, caching the result per address.
+ *
+ * Function names come from the module's ELF symbol table (or dladdr where
+ * there is none); file and line come from its DWARF line table, read by
+ * addr2line (atos on macOS) in one batch per module. Addresses are taken to
+ * be return addresses, as codeptr_ra and unwound frames are: the function is
+ * looked up at the address itself and the line at the byte before it, the
+ * call instruction. Call it with every address of interest at once so each
+ * module is only read once.
+ */
+void symbolize(const std::vector<uint64_t> &addresses);
+
+// Symbol of an address, resolving it on its own if symbolize() has not yet
+const Symbol &lookup_symbol(uint64_t address);
+
+// "function (file:line)", falling back to "module+0xoffset" when nothing better is known
+std::string format_symbol(const Symbol &symbol);
+
+#endif // SYMBOLIZER_H
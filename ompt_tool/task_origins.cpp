@@ -0,0 +1,35 @@
+#include <atomic>
+#include <cstddef>
+#include "task_origins.h"
+#include "trace_buffer.h"
+
+constexpr size_t TASK_ORIGIN_SLOTS = 1 << 16;
+
+struct TaskOrigin {
+    std::atomic<uint64_t> task{TRACE_ID_NONE};
+    std::atomic<uint64_t> codeptr_ra{0};
+};
+
+static TaskOrigin task_origins[TASK_ORIGIN_SLOTS];
+
+void record_task_origin(uint64_t task, const void *codeptr_ra) {
+    TaskOrigin &slot = task_origins[task % TASK_ORIGIN_SLOTS];
+    slot.task.store(TRACE_ID_NONE, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.codeptr_ra.store(reinterpret_cast<uint64_t>(codeptr_ra), std::memory_order_relaxed);
+    slot.task.store(task, std::memory_order_release);
+}
+
+uint64_t task_origin(uint64_t task) {
+    if (task == TRACE_ID_NONE) {
+        return 0;
+    }
+    TaskOrigin &slot = task_origins[task % TASK_ORIGIN_SLOTS];
+    if (slot.task.load(std::memory_order_acquire) != task) {
+        return 0;
+    }
+    uint64_t site = slot.codeptr_ra.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // A newer task may have taken the slot while the site was read
+    return slot.task.load(std::memory_order_relaxed) == task ? site : 0;
+}
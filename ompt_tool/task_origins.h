@@ -0,0 +1,15 @@
+#ifndef TASK_ORIGINS_H
+#define TASK_ORIGINS_H
+
+#include <cstdint>
+
+// Creation sites of explicit tasks by task number, for the granularity report
+// and the counters, which attribute a task to its site on whichever thread
+// runs it. A slot is reused once TASK_ORIGIN_SLOTS newer tasks have been
+// created, and a task that waits longer than that to start has no known site.
+void record_task_origin(uint64_t task, const void *codeptr_ra);
+
+// Creation site of a task, 0 if unknown or an implicit task
+uint64_t task_origin(uint64_t task);
+
+#endif // TASK_ORIGINS_H
@@ -0,0 +1,37 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <iostream>
+
+// Minimal checks for the unit tests under ompt_tool/tests, which must build
+// without anything beyond the tool's own sources. A failed check prints its
+// location and the test carries on; check_result() turns the failures into
+// the test's exit code for `make test`.
+
+inline int check_failures = 0;
+
+#define CHECK(condition)                                                                 \
+    do {                                                                                 \
+        if (!(condition)) {                                                              \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed\n"; \
+            check_failures++;                                                            \
+        }                                                                                \
+    } while (0)
+
+#define CHECK_EQ(actual, expected)                                                       \
+    do {                                                                                 \
+        auto check_actual = (actual);                                                    \
+        auto check_expected = (expected);                                                \
+        if (!(check_actual == check_expected)) {                                         \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK_EQ(" #actual ", " #expected \
+                      << ") failed: " << check_actual << " != " << check_expected << "\n";  \
+            check_failures++;                                                            \
+        }                                                                                \
+    } while (0)
+
+inline int check_result(const char *test) {
+    std::cout << test << ": " << (check_failures ? "FAILED" : "passed") << "\n";
+    return check_failures ? 1 : 0;
+}
+
+#endif // CHECK_H
@@ -0,0 +1,103 @@
+#include <thread>
+#include <vector>
+#include "check.h"
+#include "event_queue.h"
+
+static void test_capacity_rounding() {
+    CHECK_EQ(BoundedMpscQueue<int>(0).capacity(), 2u);
+    CHECK_EQ(BoundedMpscQueue<int>(4).capacity(), 4u);
+    CHECK_EQ(BoundedMpscQueue<int>(5).capacity(), 8u);
+    CHECK_EQ(BoundedMpscQueue<int>(4096).capacity(), 4096u);
+}
+
+// A full queue refuses pushes without blocking and takes them again once
+// the consumer has made room
+static void test_full() {
+    BoundedMpscQueue<int> queue(4);
+    CHECK(queue.empty());
+    for (int i = 0; i < 4; i++) {
+        CHECK(queue.try_push(i));
+    }
+    CHECK(!queue.try_push(4));
+
+    int value = -1;
+    CHECK(queue.pop(value));
+    CHECK_EQ(value, 0);
+    CHECK(queue.try_push(4));
+    CHECK(!queue.try_push(5));
+    CHECK_EQ(queue.high_water_mark(), 4u);
+
+    for (int expected = 1; expected <= 4; expected++) {
+        CHECK(queue.pop(value));
+        CHECK_EQ(value, expected);
+    }
+    CHECK(queue.empty());
+    CHECK(!queue.pop(value));
+}
+
+// Positions keep counting past the capacity, so every slot is reused many
+// times; events must come out in order on every lap
+static void test_wrap_around() {
+    BoundedMpscQueue<int> queue(4);
+    int next_push = 0;
+    int next_pop = 0;
+    for (int lap = 0; lap < 1000; lap++) {
+        int burst = 1 + lap % 4;
+        for (int i = 0; i < burst; i++) {
+            CHECK(queue.try_push(next_push++));
+        }
+        int value = -1;
+        for (int i = 0; i < burst; i++) {
+            CHECK(queue.pop(value));
+            CHECK_EQ(value, next_pop++);
+        }
+        CHECK(queue.empty());
+    }
+    CHECK_EQ(queue.high_water_mark(), 4u);
+}
+
+// Producers racing for positions: every event arrives exactly once and the
+// events of each producer keep their order
+static void test_concurrent_producers() {
+    constexpr int PRODUCERS = 4;
+    constexpr int EVENTS = 20000;
+    BoundedMpscQueue<int> queue(64);
+    std::vector<std::thread> producers;
+    for (int producer = 0; producer < PRODUCERS; producer++) {
+        producers.emplace_back([&queue, producer] {
+            for (int i = 0; i < EVENTS; i++) {
+                while (!queue.try_push(producer * EVENTS + i)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    std::vector<int> next(PRODUCERS, 0);
+    int received = 0;
+    bool ordered = true;
+    while (received < PRODUCERS * EVENTS) {
+        int value;
+        if (!queue.pop(value)) {
+            std::this_thread::yield();
+            continue;
+        }
+        int producer = value / EVENTS;
+        ordered = ordered && value % EVENTS == next[producer];
+        next[producer] = value % EVENTS + 1;
+        received++;
+    }
+    for (std::thread &producer : producers) {
+        producer.join();
+    }
+    CHECK(ordered);
+    CHECK(queue.empty());
+    CHECK(queue.high_water_mark() <= 64u);
+}
+
+int main() {
+    test_capacity_rounding();
+    test_full();
+    test_wrap_around();
+    test_concurrent_producers();
+    return check_result("test_event_queue");
+}
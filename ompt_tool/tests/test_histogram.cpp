@@ -0,0 +1,77 @@
+#include <cstdint>
+#include "check.h"
+#include "histogram.h"
+
+// Values below HISTOGRAM_SUB_BUCKETS have a bucket each; above, every power
+// of two is split into HISTOGRAM_SUB_BUCKETS buckets
+static void test_bucket_boundaries() {
+    for (uint64_t value = 0; value < HISTOGRAM_SUB_BUCKETS; value++) {
+        CHECK_EQ(LogHistogram::bucket_of(value), (uint32_t)value);
+        CHECK_EQ(LogHistogram::bucket_limit((uint32_t)value), value);
+    }
+    CHECK_EQ(LogHistogram::bucket_of(8), 8u);
+    CHECK_EQ(LogHistogram::bucket_of(15), 15u);
+    CHECK_EQ(LogHistogram::bucket_of(16), 16u);
+    CHECK_EQ(LogHistogram::bucket_of(17), 16u);
+    CHECK_EQ(LogHistogram::bucket_of(18), 17u);
+    CHECK_EQ(LogHistogram::bucket_limit(16), 17u);
+    CHECK_EQ(LogHistogram::bucket_of(UINT64_MAX), HISTOGRAM_BUCKETS - 1);
+    CHECK_EQ(LogHistogram::bucket_limit(HISTOGRAM_BUCKETS - 1), UINT64_MAX);
+
+    // Every bucket starts right after the previous one's limit, and a value
+    // is known to within 1/8 of itself
+    for (uint32_t bucket = 1; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        uint64_t lowest = LogHistogram::bucket_limit(bucket - 1) + 1;
+        uint64_t limit = LogHistogram::bucket_limit(bucket);
+        CHECK_EQ(LogHistogram::bucket_of(lowest), bucket);
+        CHECK_EQ(LogHistogram::bucket_of(limit), bucket);
+        CHECK(limit - lowest <= lowest / HISTOGRAM_SUB_BUCKETS);
+    }
+}
+
+static void test_percentiles() {
+    LogHistogram histogram;
+    CHECK_EQ(histogram.percentile(50), 0u);
+
+    for (uint64_t value = 1; value <= 100; value++) {
+        histogram.record(value * 1000);
+    }
+    CHECK_EQ(histogram.count, 100u);
+    CHECK_EQ(histogram.total, 5050000u);
+    CHECK_EQ(histogram.max, 100000u);
+
+    // A percentile is the upper bound of its bucket: the true value rounded
+    // up by at most 1/8
+    for (double percent : {1.0, 25.0, 50.0, 90.0, 99.0}) {
+        uint64_t exact = (uint64_t)percent * 1000;
+        uint64_t reported = histogram.percentile(percent);
+        CHECK(reported >= exact);
+        CHECK(reported - exact <= exact / HISTOGRAM_SUB_BUCKETS);
+    }
+    // Capped at the largest recorded value rather than its bucket's limit
+    CHECK_EQ(histogram.percentile(100), 100000u);
+    CHECK_EQ(histogram.percentile(0), LogHistogram::bucket_limit(LogHistogram::bucket_of(1000)));
+}
+
+static void test_merge() {
+    LogHistogram fast;
+    LogHistogram slow;
+    for (int i = 0; i < 90; i++) {
+        fast.record(10);
+    }
+    for (int i = 0; i < 10; i++) {
+        slow.record(1000000);
+    }
+    fast.merge(slow);
+    CHECK_EQ(fast.count, 100u);
+    CHECK_EQ(fast.max, 1000000u);
+    CHECK_EQ(fast.percentile(90), LogHistogram::bucket_limit(LogHistogram::bucket_of(10)));
+    CHECK_EQ(fast.percentile(91), 1000000u);
+}
+
+int main() {
+    test_bucket_boundaries();
+    test_percentiles();
+    test_merge();
+    return check_result("test_histogram");
+}
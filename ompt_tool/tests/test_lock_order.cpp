@@ -0,0 +1,78 @@
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "check.h"
+#include "lock_order.h"
+
+using LockPairs = std::vector<std::pair<uint64_t, uint64_t>>;
+
+// Takes the locks nested in the given order and releases them again, as one
+// OpenMP thread would
+static void take_nested(uint64_t thread_id, const std::vector<uint64_t> &locks) {
+    for (uint64_t lock : locks) {
+        lock_order_mutex_acquire(ompt_mutex_lock, lock, nullptr, thread_id);
+        lock_order_mutex_acquired(ompt_mutex_lock, lock, nullptr);
+    }
+    for (size_t i = locks.size(); i-- > 0;) {
+        lock_order_mutex_released(ompt_mutex_lock, locks[i]);
+    }
+}
+
+// Each thread has its own held locks, so every scenario runs on a thread of its own
+static void run_as_thread(uint64_t thread_id, const std::vector<uint64_t> &locks) {
+    std::thread([=] { take_nested(thread_id, locks); }).join();
+}
+
+int main() {
+    // Consistent order: no inversion however often it repeats
+    run_as_thread(0, {0xA, 0xB, 0xC});
+    run_as_thread(1, {0xA, 0xC});
+    run_as_thread(2, {0xB, 0xC});
+    CHECK(lock_order_inversions().empty());
+
+    // Re-acquiring a held nest lock adds no edge to itself
+    std::thread([] {
+        lock_order_mutex_acquired(ompt_mutex_nest_lock, 0xD, nullptr);
+        lock_order_mutex_acquire(ompt_mutex_nest_lock, 0xD, nullptr, 3);
+        lock_order_mutex_acquired(ompt_mutex_nest_lock, 0xD, nullptr);
+        lock_order_mutex_released(ompt_mutex_nest_lock, 0xD);
+        lock_order_mutex_released(ompt_mutex_nest_lock, 0xD);
+    }).join();
+    CHECK(lock_order_inversions().empty());
+
+    // C before A closes A -> B -> C -> A; the BFS finds the shortest way back,
+    // A -> C, not A -> B -> C
+    run_as_thread(4, {0xC, 0xA});
+    std::vector<LockPairs> inversions = lock_order_inversions();
+    CHECK_EQ(inversions.size(), 1u);
+    if (inversions.size() == 1) {
+        LockPairs expected{{0xC, 0xA}, {0xA, 0xC}};
+        CHECK(inversions[0] == expected);
+    }
+
+    // A pair that is already in the graph is not reported again
+    run_as_thread(5, {0xC, 0xA});
+    CHECK_EQ(lock_order_inversions().size(), 1u);
+
+    // Test locks never block, so they add no edges
+    std::thread([] {
+        lock_order_mutex_acquired(ompt_mutex_lock, 0xE, nullptr);
+        lock_order_mutex_acquire(ompt_mutex_test_lock, 0xF, nullptr, 6);
+        lock_order_mutex_released(ompt_mutex_lock, 0xE);
+    }).join();
+    run_as_thread(7, {0xF, 0xE});
+    CHECK_EQ(lock_order_inversions().size(), 1u);
+
+    // A longer cycle through three threads: 0xE -> 0x10 -> 0x11 -> 0xE
+    run_as_thread(8, {0xE, 0x10});
+    run_as_thread(9, {0x10, 0x11});
+    run_as_thread(10, {0x11, 0xE});
+    inversions = lock_order_inversions();
+    CHECK_EQ(inversions.size(), 2u);
+    if (inversions.size() == 2) {
+        LockPairs expected{{0x11, 0xE}, {0xE, 0x10}, {0x10, 0x11}};
+        CHECK(inversions[1] == expected);
+    }
+    return check_result("test_lock_order");
+}
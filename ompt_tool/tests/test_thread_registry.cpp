@@ -0,0 +1,64 @@
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "check.h"
+#include "thread_registry.h"
+
+struct Counter {
+    uint64_t value = 0;
+};
+
+static PerThreadRegistry<Counter> counters("test_thread_registry");
+
+// A thread gets the same object every time, and local() sees it only after
+// the first get_or_create()
+static void test_one_object_per_thread() {
+    std::thread([] {
+        CHECK(counters.local() == nullptr);
+        Counter *counter = counters.get_or_create();
+        CHECK(counter != nullptr);
+        CHECK(counters.get_or_create() == counter);
+        CHECK(counters.local() == counter);
+        CHECK(counters.contains(counter));
+        counter->value = 1;
+    }).join();
+
+    Counter other;
+    CHECK(!counters.contains(&other));
+    CHECK(!counters.contains(nullptr));
+    CHECK_EQ(counters.all().size(), 1u);
+}
+
+// Threads beyond the limit get nothing and are counted instead
+static void test_full_registry() {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < MAX_REGISTERED_THREADS + 10; i++) {
+        threads.emplace_back([] {
+            Counter *counter = counters.get_or_create();
+            if (counter) {
+                counter->value = 1;
+            } else {
+                // Rejected once and for all, not retried on every call
+                CHECK(counters.get_or_create() == nullptr);
+                CHECK(counters.local() == nullptr);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    std::vector<Counter *> all = counters.all();
+    CHECK_EQ(all.size(), MAX_REGISTERED_THREADS);
+    CHECK_EQ(counters.rejected_threads(), 10u);
+    uint64_t total = 0;
+    for (Counter *counter : all) {
+        total += counter->value;
+    }
+    CHECK_EQ(total, (uint64_t)MAX_REGISTERED_THREADS);
+}
+
+int main() {
+    test_one_object_per_thread();
+    test_full_registry();
+    return check_result("test_thread_registry");
+}
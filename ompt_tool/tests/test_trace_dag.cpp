@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <omp-tools.h>
+#include "check.h"
+#include "trace_dag.h"
+#include "trace_file.h"
+#include "trace_reader.h"
+
+using TaskPairs = std::vector<std::pair<uint64_t, uint64_t>>;
+
+// Locations named in the depend clauses
+constexpr uint64_t LOCATION_A = 0xA0;
+constexpr uint64_t LOCATION_B = 0xB0;
+
+// Events of one thread, in the order the tool would record them
+struct ThreadEvents {
+    uint16_t thread_id;
+    std::vector<TraceRecord> records;
+
+    TraceRecord &add(TraceEventType event, uint64_t time, uint64_t task, uint64_t aux_id) {
+        TraceRecord record = {};
+        record.event = event;
+        record.thread_id = thread_id;
+        record.time = time;
+        record.task_id = task;
+        record.aux_id = aux_id;
+        records.push_back(record);
+        return records.back();
+    }
+
+    void implicit_task(ompt_scope_endpoint_t endpoint, uint64_t task, uint64_t time) {
+        TraceRecord &record = add(TRACE_IMPLICIT_TASK, time, task, 0);
+        record.endpoint = (uint32_t)endpoint;
+        record.parallel_id = 100;
+    }
+
+    // A task created by parent with the given (dependence type, location) clauses
+    void create(uint64_t task, uint64_t parent, uint64_t time,
+                const std::vector<std::pair<ompt_dependence_type_t, uint64_t>> &clauses) {
+        add(TRACE_TASK_CREATE, time, task, parent).value = !clauses.empty();
+        for (const auto &[type, location] : clauses) {
+            TraceRecord &record = add(TRACE_TASK_DEPENDENCES, time, task, location);
+            record.kind = (uint32_t)type;
+            record.value = clauses.size();
+        }
+    }
+
+    // Runs tasks one after the other from time on, each busy for its ticks,
+    // and switches back to from when done
+    void run(uint64_t from, uint64_t time, const std::vector<std::pair<uint64_t, uint64_t>> &tasks) {
+        uint64_t prior = from;
+        ompt_task_status_t status = ompt_task_switch;
+        for (const auto &[task, busy] : tasks) {
+            add(TRACE_TASK_SCHEDULE, time, prior, task).kind = (uint32_t)status;
+            prior = task;
+            status = ompt_task_complete;
+            time += busy;
+        }
+        add(TRACE_TASK_SCHEDULE, time, prior, from).kind = (uint32_t)status;
+    }
+};
+
+// Writes each thread's events as one events block, except that the first
+// thread's are split around the others', as chunks of a real trace interleave
+static std::string write_trace(const std::vector<ThreadEvents> &threads) {
+    char path[] = "/tmp/test_trace_dag_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        close(fd);
+    }
+    TraceFileWriter writer;
+    CHECK(writer.open(path, sizeof(TraceRecord)));
+    const std::vector<TraceRecord> &first = threads[0].records;
+    size_t half = first.size() / 2;
+    writer.write_block(TRACE_BLOCK_EVENTS, 0, first.data(), half * sizeof(TraceRecord));
+    for (size_t t = threads.size(); t-- > 1;) {
+        writer.write_block(TRACE_BLOCK_EVENTS, threads[t].thread_id, threads[t].records.data(),
+                           threads[t].records.size() * sizeof(TraceRecord));
+    }
+    writer.write_block(TRACE_BLOCK_EVENTS, 0, first.data() + half, (first.size() - half) * sizeof(TraceRecord));
+    writer.close();
+    return path;
+}
+
+// The task graph's edges as (predecessor id, successor id), sorted
+static TaskPairs dependence_ids(const TraceDag &dag) {
+    TaskPairs pairs;
+    for (const auto &[from, to] : dag.task_dependences) {
+        pairs.emplace_back(dag.tasks[from].id, dag.tasks[to].id);
+    }
+    std::sort(pairs.begin(), pairs.end());
+    return pairs;
+}
+
+// Two sibling groups that use the same location but, having different
+// parents, never depend on each other.
+//
+// Parent 1 runs on thread 0 and orders location A as in -> out -> in -> out.
+// Its first two readers are created out of task number order.
+//
+// Parent 2 is an untied task that moves between threads 1 and 2 while it
+// creates tasks 27 down to 21. Location A goes out -> mutexinoutset set -> in
+// -> inoutset set -> mutexinoutset set, so the clauses of one location come
+// from both threads, in reverse task number order, and only the creation
+// times put them back in order.
+static std::vector<ThreadEvents> synthetic_trace() {
+    ThreadEvents thread0{0, {}};
+    thread0.implicit_task(ompt_scope_begin, 1, 50);
+    thread0.create(12, 1, 100, {{ompt_dependence_type_in, LOCATION_A}});
+    thread0.create(11, 1, 110, {{ompt_dependence_type_in, LOCATION_A}});
+    thread0.create(13, 1, 120, {{ompt_dependence_type_out, LOCATION_A}, {ompt_dependence_type_in, LOCATION_B}});
+    thread0.create(14, 1, 130, {{ompt_dependence_type_in, LOCATION_A}});
+    thread0.create(15, 1, 140, {{ompt_dependence_type_inout, LOCATION_A}});
+    thread0.run(1, 1000, {{12, 10}, {11, 30}, {13, 5}, {14, 7}, {15, 3}});
+    thread0.implicit_task(ompt_scope_end, 1, 1100);
+
+    ThreadEvents thread1{1, {}};
+    thread1.implicit_task(ompt_scope_begin, 3, 50);
+    thread1.create(27, 2, 105, {{ompt_dependence_type_out, LOCATION_A}});
+    thread1.create(26, 2, 115, {{ompt_dependence_type_mutexinoutset, LOCATION_A}});
+    thread1.create(24, 2, 135, {{ompt_dependence_type_in, LOCATION_A}});
+    thread1.create(22, 2, 155, {{ompt_dependence_type_inoutset, LOCATION_A}});
+    thread1.run(3, 2000, {{27, 4}, {26, 50}, {25, 2}, {24, 1}, {23, 1}, {22, 20}, {21, 1}});
+    thread1.implicit_task(ompt_scope_end, 3, 2100);
+
+    ThreadEvents thread2{2, {}};
+    thread2.implicit_task(ompt_scope_begin, 4, 50);
+    thread2.create(25, 2, 125, {{ompt_dependence_type_mutexinoutset, LOCATION_A}});
+    thread2.create(23, 2, 145, {{ompt_dependence_type_inoutset, LOCATION_A}});
+    thread2.create(21, 2, 165, {{ompt_dependence_type_mutexinoutset, LOCATION_A}});
+    thread2.implicit_task(ompt_scope_end, 4, 2100);
+
+    return {thread0, thread1, thread2};
+}
+
+static void test_depend_clauses(const TraceDag &dag) {
+    CHECK_EQ(dag.tasks.size(), 12u);
+    TaskPairs expected{
+        // Writers depend on all readers since the last writer, readers on
+        // the writer; 15 does not depend on 13 directly
+        {11, 13}, {12, 13}, {13, 14}, {14, 15},
+        // Set members depend on what the set follows, never on each other,
+        // and whatever follows the set depends on every member
+        {27, 26}, {27, 25}, {26, 24}, {25, 24},
+        {24, 23}, {24, 22},
+        // A set of the other type starts a new set
+        {23, 21}, {22, 21},
+    };
+    std::sort(expected.begin(), expected.end());
+    CHECK(dependence_ids(dag) == expected);
+    CHECK_EQ(dag.edge_counts[DAG_EDGE_DEPENDENCE], expected.size());
+}
+
+static void test_task_critical_path(const TraceDag &dag) {
+    std::map<uint64_t, uint64_t> busy;
+    for (const DagTask &task : dag.tasks) {
+        busy[task.id] = task.busy;
+    }
+    CHECK_EQ(busy[11], 30u);
+    CHECK_EQ(busy[26], 50u);
+    CHECK_EQ(busy[21], 1u);
+
+    // 27 -> 26 -> 24 -> 22 -> 21 outweighs 11 -> 13 -> 14 -> 15 (45 ticks)
+    CriticalPath path = find_task_critical_path(dag);
+    CHECK_EQ(path.work, 55u + 79u);
+    CHECK_EQ(path.span, 76u);
+    CHECK_EQ(path.unordered, 0u);
+    std::vector<uint64_t> ids;
+    for (uint32_t task : path.nodes) {
+        ids.push_back(dag.tasks[task].id);
+    }
+    std::vector<uint64_t> expected{27, 26, 24, 22, 21};
+    CHECK(ids == expected);
+}
+
+int main() {
+    std::string path = write_trace(synthetic_trace());
+    TraceReader reader;
+    CHECK(reader.open(path));
+    TraceDag dag;
+    // More workers than threads, so the passes really run concurrently
+    CHECK(build_trace_dag(reader, dag, 4));
+    reader.close();
+    unlink(path.c_str());
+
+    test_depend_clauses(dag);
+    test_task_critical_path(dag);
+    return check_result("test_trace_dag");
+}
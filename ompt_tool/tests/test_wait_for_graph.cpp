@@ -0,0 +1,111 @@
+#include <sstream>
+#include <vector>
+#include "check.h"
+#include "wait_for_graph.h"
+
+// Two threads each hold one lock and wait for the other's
+static void test_lock_cycle() {
+    std::ostringstream log;
+    DirectedGraph graph(log);
+    uint32_t thread0 = graph.threadNode(0);
+    uint32_t thread1 = graph.threadNode(1);
+    uint32_t lock1 = graph.mutexNode(ompt_mutex_lock, 0x1000);
+    uint32_t lock2 = graph.mutexNode(ompt_mutex_lock, 0x2000);
+
+    graph.addEdge(lock1, thread0);
+    graph.addEdge(lock2, thread1);
+    graph.addEdge(thread0, lock2);
+    CHECK(!graph.hasCycle());
+
+    graph.beginEvent(7);
+    graph.addEdge(thread1, lock1);
+    CHECK(graph.hasCycle());
+    std::vector<uint32_t> expected{thread1, lock1, thread0, lock2, thread1};
+    CHECK(graph.cycle() == expected);
+    CHECK(log.str().find("+ 7 " + std::to_string(thread1) + " " + std::to_string(lock1) + "\n") != std::string::npos);
+
+    // Only edges added since the last check are searched: the cycle is still
+    // there, but nothing new closes it
+    CHECK(!graph.hasCycle());
+    CHECK(graph.cycle().empty());
+}
+
+// An edge that is gone again by the time of the check cannot close a cycle
+static void test_removed_edge_is_not_checked() {
+    std::ostringstream log;
+    DirectedGraph graph(log);
+    uint32_t thread0 = graph.threadNode(0);
+    uint32_t lock = graph.mutexNode(ompt_mutex_lock, 0x1000);
+    graph.addEdge(lock, thread0);
+    graph.addEdge(thread0, lock);
+    graph.removeEdge(thread0, lock);
+    CHECK(!graph.hasCycle());
+}
+
+// Node ids are dense: threads are added on first use in any order, and a
+// mutex is told apart by kind and wait id
+static void test_dense_ids() {
+    std::ostringstream log;
+    DirectedGraph graph(log);
+    CHECK_EQ(graph.nodeCount(), 1u);
+    CHECK_EQ(graph.barrierNode(), 0u);
+    uint32_t thread5 = graph.threadNode(5);
+    uint32_t thread2 = graph.threadNode(2);
+    CHECK_EQ(thread5, 1u);
+    CHECK_EQ(thread2, 2u);
+    CHECK_EQ(graph.threadNode(5), thread5);
+
+    uint32_t lock = graph.mutexNode(ompt_mutex_lock, 0x40);
+    CHECK_EQ(graph.mutexNode(ompt_mutex_nest_lock, 0x40), lock);
+    uint32_t critical = graph.mutexNode(ompt_mutex_critical, 0x40);
+    CHECK(critical != lock);
+    CHECK_EQ(graph.kind(critical), NODE_CRITICAL);
+
+    // Enough mutexes to grow the wait id table several times
+    std::vector<uint32_t> nodes;
+    for (uint64_t wait_id = 1; wait_id <= 500; wait_id++) {
+        nodes.push_back(graph.mutexNode(ompt_mutex_lock, wait_id * 64));
+    }
+    for (uint64_t wait_id = 1; wait_id <= 500; wait_id++) {
+        CHECK_EQ(graph.mutexNode(ompt_mutex_lock, wait_id * 64), nodes[wait_id - 1]);
+    }
+    CHECK_EQ(graph.nodeCount(), 4u + 500u);
+}
+
+// The barrier points at every thread that has not arrived; a thread that
+// waits for a lock held by a thread still outside the barrier closes a cycle
+// through the barrier node, whose edges no longer fit in place
+static void test_barrier_cycle() {
+    std::ostringstream log;
+    DirectedGraph graph(log);
+    uint32_t barrier = graph.barrierNode();
+    std::vector<uint32_t> threads;
+    for (uint64_t thread_id = 0; thread_id < 6; thread_id++) {
+        threads.push_back(graph.threadNode(thread_id));
+        graph.addEdge(barrier, threads.back());
+    }
+    for (uint32_t thread : threads) {
+        CHECK(graph.hasEdge(barrier, thread));
+    }
+    CHECK(!graph.hasCycle());
+
+    uint32_t lock = graph.mutexNode(ompt_mutex_critical, 0x80);
+    graph.removeEdge(barrier, threads[0]);
+    graph.addEdge(threads[0], barrier);
+    graph.addEdge(lock, threads[0]);
+    graph.addEdge(threads[3], lock);
+    CHECK(!graph.hasEdge(barrier, threads[0]));
+    CHECK(graph.hasEdge(barrier, threads[5]));
+    // The first new edge that closes the cycle is the one it is reported through
+    CHECK(graph.hasCycle());
+    std::vector<uint32_t> expected{threads[0], barrier, threads[3], lock, threads[0]};
+    CHECK(graph.cycle() == expected);
+}
+
+int main() {
+    test_lock_cycle();
+    test_removed_edge_is_not_checked();
+    test_dense_ids();
+    test_barrier_cycle();
+    return check_result("test_wait_for_graph");
+}
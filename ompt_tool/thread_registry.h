@@ -0,0 +1,93 @@
+#ifndef THREAD_REGISTRY_H
+#define THREAD_REGISTRY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// Threads a module keeps per-thread state for; later threads are not recorded
+constexpr size_t MAX_REGISTERED_THREADS = 256;
+
+/**
+ * @brief Per-thread state of one module, registered so reports can walk it.
+ *
+ * Each thread creates its own T on first use and only that thread writes it;
+ * the report at finalize reads every registered T. Registration is one
+ * fetch_add on a fixed array, so the registry never allocates. Threads beyond
+ * MAX_REGISTERED_THREADS get no T: they are counted, a warning naming the
+ * module is printed once, and local() stays nullptr for them without retrying.
+ *
+ * The registry is constant-initialized and its T objects are never freed (see
+ * ompt_finalize). The calling thread's T is found through a thread_local
+ * keyed by T, so every module needs its own T type.
+ */
+template <typename T>
+class PerThreadRegistry {
+public:
+    constexpr explicit PerThreadRegistry(const char *module) : module(module) {}
+
+    // The calling thread's T, nullptr before get_or_create() or beyond the limit
+    T *local() const {
+        return local_item;
+    }
+
+    // The calling thread's T, created and registered on first use
+    T *get_or_create() {
+        if (!local_item && !local_rejected) {
+            size_t index = count.fetch_add(1);
+            if (index >= MAX_REGISTERED_THREADS) {
+                local_rejected = true;
+                if (rejected.fetch_add(1) == 0) {
+                    std::cerr << module << ": threads beyond " << MAX_REGISTERED_THREADS << " are not recorded\n";
+                }
+                return nullptr;
+            }
+            local_item = new T();
+            items[index].store(local_item, std::memory_order_release);
+        }
+        return local_item;
+    }
+
+    // Whether pointer is one of the registered T objects. Async-signal-safe.
+    bool contains(const void *pointer) const {
+        size_t registered = std::min(count.load(std::memory_order_acquire), MAX_REGISTERED_THREADS);
+        for (size_t i = 0; i < registered; i++) {
+            if (items[i].load(std::memory_order_relaxed) == pointer) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Every registered T, in registration order
+    std::vector<T *> all() const {
+        std::vector<T *> registered;
+        size_t slots = std::min(count.load(std::memory_order_acquire), MAX_REGISTERED_THREADS);
+        for (size_t i = 0; i < slots; i++) {
+            T *item = items[i].load(std::memory_order_acquire);
+            if (item) {
+                registered.push_back(item);
+            }
+        }
+        return registered;
+    }
+
+    // Threads that found the registry full
+    uint64_t rejected_threads() const {
+        return rejected.load(std::memory_order_relaxed);
+    }
+
+private:
+    const char *module;
+    std::atomic<T *> items[MAX_REGISTERED_THREADS] = {};
+    std::atomic<size_t> count{0};
+    std::atomic<uint64_t> rejected{0};
+
+    static inline thread_local T *local_item = nullptr;
+    static inline thread_local bool local_rejected = false;
+};
+
+#endif // THREAD_REGISTRY_H
@@ -0,0 +1,103 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#include "timestamp.h"
+
+// How long calibrate_timestamps() measures the tick rate for
+constexpr uint64_t CALIBRATION_NS = 20000000;
+
+ClockCalibration clock_calibration = {CLOCK_SOURCE_MONOTONIC_RAW, 1.0, 0, 0, 0};
+
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// The TSC is only usable as a clock if it ticks at a constant rate across
+// frequency changes and sleep states, and is synchronized across cores.
+static bool has_usable_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (edx & (1u << 8)) != 0;
+#elif defined(__aarch64__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Reads the tick counter and CLOCK_MONOTONIC_RAW as close together as
+// possible, keeping the pair with the smallest tick window around the clock read.
+static void sample_clocks(uint64_t &ticks, uint64_t &ns) {
+    uint64_t best_window = UINT64_MAX;
+    for (int i = 0; i < 16; i++) {
+        uint64_t before = read_tsc();
+        uint64_t now = monotonic_raw_ns();
+        uint64_t after = read_tsc();
+        if (after - before < best_window) {
+            best_window = after - before;
+            ticks = before + (after - before) / 2;
+            ns = now;
+        }
+    }
+}
+
+void calibrate_timestamps() {
+    const char *requested = getenv("COMPASS_CLOCK");
+    bool use_tsc = has_usable_tsc() && !(requested && strcmp(requested, "monotonic") == 0);
+
+    if (!use_tsc) {
+        clock_calibration.source = CLOCK_SOURCE_MONOTONIC_RAW;
+        clock_calibration.ns_per_tick = 1.0;
+        clock_calibration.base_realtime_ns = realtime_ns();
+        clock_calibration.base_ns = monotonic_raw_ns();
+        clock_calibration.base_ticks = clock_calibration.base_ns;
+        return;
+    }
+
+    uint64_t start_ticks, start_ns, end_ticks, end_ns;
+    sample_clocks(start_ticks, start_ns);
+    uint64_t start_realtime = realtime_ns();
+    do {
+        sample_clocks(end_ticks, end_ns);
+    } while (end_ns - start_ns < CALIBRATION_NS);
+
+    clock_calibration.source = CLOCK_SOURCE_TSC;
+    clock_calibration.ns_per_tick = (double)(end_ns - start_ns) / (double)(end_ticks - start_ticks);
+    clock_calibration.base_ticks = start_ticks;
+    clock_calibration.base_ns = start_ns;
+    clock_calibration.base_realtime_ns = start_realtime;
+}
+
+uint64_t timestamp_to_ns(uint64_t ticks) {
+    int64_t delta = (int64_t)(ticks - clock_calibration.base_ticks);
+    return clock_calibration.base_ns + (int64_t)(delta * clock_calibration.ns_per_tick);
+}
+
+uint64_t ticks_to_ns(uint64_t ticks) {
+    return (uint64_t)(ticks * clock_calibration.ns_per_tick);
+}
+
+uint64_t timestamp_to_realtime_ns(uint64_t ticks) {
+    int64_t delta = (int64_t)(ticks - clock_calibration.base_ticks);
+    return clock_calibration.base_realtime_ns + (int64_t)(delta * clock_calibration.ns_per_tick);
+}
+
+std::string clock_calibration_meta() {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "clock_source=%s\nclock_ns_per_tick=%.17g\nclock_base_ticks=%llu\nclock_base_ns=%llu\nclock_base_realtime_ns=%llu\n",
+             clock_calibration.source == CLOCK_SOURCE_TSC ? "tsc" : "monotonic_raw",
+             clock_calibration.ns_per_tick,
+             (unsigned long long)clock_calibration.base_ticks,
+             (unsigned long long)clock_calibration.base_ns,
+             (unsigned long long)clock_calibration.base_realtime_ns);
+    return buffer;
+}
@@ -0,0 +1,67 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <cstdint>
+#include <string>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum ClockSource : uint32_t {
+    CLOCK_SOURCE_TSC,            // rdtsc on x86, cntvct_el0 on arm64
+    CLOCK_SOURCE_MONOTONIC_RAW   // clock_gettime(CLOCK_MONOTONIC_RAW), ticks are ns
+};
+
+/**
+ * @brief Relates raw timestamp ticks to nanoseconds.
+ *
+ * Taken once by calibrate_timestamps() and stored in the trace metadata so
+ * analysis can convert ticks offline.
+ */
+struct ClockCalibration {
+    ClockSource source;
+    double ns_per_tick;
+    uint64_t base_ticks;         // tick value at the calibration point
+    uint64_t base_ns;            // CLOCK_MONOTONIC_RAW at the calibration point
+    uint64_t base_realtime_ns;   // CLOCK_REALTIME at the calibration point
+};
+
+extern ClockCalibration clock_calibration;
+
+static inline uint64_t monotonic_raw_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t read_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return monotonic_raw_ns();
+#endif
+}
+
+// Hot-path timestamp in raw ticks of the calibrated clock source
+static inline uint64_t read_timestamp() {
+    return clock_calibration.source == CLOCK_SOURCE_TSC ? read_tsc() : monotonic_raw_ns();
+}
+
+// Picks a clock source and measures its rate. Setting COMPASS_CLOCK=monotonic
+// forces CLOCK_MONOTONIC_RAW.
+void calibrate_timestamps();
+
+uint64_t timestamp_to_ns(uint64_t ticks);
+// Converts a duration, rather than a point in time, from ticks to nanoseconds
+uint64_t ticks_to_ns(uint64_t ticks);
+uint64_t timestamp_to_realtime_ns(uint64_t ticks);
+
+// "key=value" lines describing the calibration for the trace metadata
+std::string clock_calibration_meta();
+
+#endif // TIMESTAMP_H
@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include "sampling.h"
+#include "tool_config.h"
+
+ToolConfig tool_config;
+
+// Modules a profile turns on, one bit per ToolConfig flag
+enum ProfileModule : uint32_t {
+    MODULE_TRACE          = 1 << 0,
+    MODULE_DL_DETECTOR    = 1 << 1,
+    MODULE_AGGREGATE      = 1 << 2,
+    MODULE_CONTENTION     = 1 << 3,
+    MODULE_IMBALANCE      = 1 << 4,
+    MODULE_GRANULARITY    = 1 << 5,
+    MODULE_LOCK_ORDER     = 1 << 6,
+    MODULE_STATE_SAMPLING = 1 << 7,
+    MODULE_PERF_COUNTERS  = 1 << 8,
+    MODULE_CPU_PROFILE    = 1 << 9
+};
+
+struct Profile {
+    const char *name;
+    uint32_t events;    // EventGroup mask
+    uint32_t modules;   // ProfileModule mask
+};
+
+static const Profile profiles[] = {
+    {"full", EVENTS_ALL, MODULE_TRACE},
+    {"workload", EVENTS_THREAD | EVENTS_PARALLEL | EVENTS_WORK | EVENTS_SYNC | EVENTS_MUTEX, MODULE_TRACE},
+    {"tasks", EVENTS_THREAD | EVENTS_PARALLEL | EVENTS_TASKS | EVENTS_SYNC, MODULE_TRACE},
+    {"deadlock-only", EVENTS_THREAD | EVENTS_SYNC | EVENTS_MUTEX, MODULE_DL_DETECTOR},
+    {"summary", EVENTS_THREAD | EVENTS_PARALLEL | EVENTS_SYNC | EVENTS_MUTEX, MODULE_AGGREGATE},
+    {"contention", EVENTS_THREAD | EVENTS_MUTEX, MODULE_CONTENTION},
+    {"imbalance", EVENTS_THREAD | EVENTS_PARALLEL | EVENTS_WORK | EVENTS_SYNC, MODULE_IMBALANCE},
+    {"granularity", EVENTS_THREAD | EVENTS_SYNC | EVENTS_TASKS, MODULE_GRANULARITY},
+    {"lockdep", EVENTS_THREAD | EVENTS_MUTEX, MODULE_LOCK_ORDER},
+    {"states", EVENTS_THREAD | EVENTS_PARALLEL, MODULE_STATE_SAMPLING},
+    {"counters", EVENTS_THREAD | EVENTS_PARALLEL | EVENTS_WORK | EVENTS_TASKS, MODULE_PERF_COUNTERS},
+    {"cpu", EVENTS_THREAD | EVENTS_PARALLEL, MODULE_CPU_PROFILE},
+};
+
+static uint32_t parse_event_groups(const std::string &list) {
+    uint32_t events = 0;
+    std::stringstream stream(list);
+    std::string name;
+    while (std::getline(stream, name, ',')) {
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if (name == "thread") events |= EVENTS_THREAD;
+        else if (name == "parallel") events |= EVENTS_PARALLEL;
+        else if (name == "work") events |= EVENTS_WORK;
+        else if (name == "sync") events |= EVENTS_SYNC;
+        else if (name == "mutex") events |= EVENTS_MUTEX;
+        else if (name == "tasks") events |= EVENTS_TASKS;
+        else if (name == "all") events |= EVENTS_ALL;
+        else if (!name.empty()) std::cerr << "COMPASS_EVENTS: unknown event group " << name << "\n";
+    }
+    return events;
+}
+
+static uint32_t parse_stack_events(const std::string &list) {
+    uint32_t events = 0;
+    std::stringstream stream(list);
+    std::string name;
+    while (std::getline(stream, name, ',')) {
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if (name == "mutex") events |= STACKS_MUTEX;
+        else if (name == "task") events |= STACKS_TASK;
+        else if (name == "barrier") events |= STACKS_BARRIER;
+        else if (name == "all") events |= STACKS_ALL;
+        else if (!name.empty() && name != "none") std::cerr << "COMPASS_STACKS: unknown event " << name << "\n";
+    }
+    return events;
+}
+
+static bool env_flag(const char *name, bool default_value) {
+    const char *value = getenv(name);
+    if (!value || !*value) {
+        return default_value;
+    }
+    return std::string(value) != "0" && std::string(value) != "false";
+}
+
+static long env_number(const char *name, long default_value) {
+    const char *value = getenv(name);
+    if (!value || !*value) {
+        return default_value;
+    }
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (*end) {
+        std::cerr << name << ": invalid number " << value << "\n";
+        return default_value;
+    }
+    return number;
+}
+
+void load_tool_config() {
+    const char *profile_name = getenv("COMPASS_PROFILE");
+    if (profile_name && *profile_name) {
+        bool found = false;
+        for (const Profile &profile : profiles) {
+            if (profile_name == std::string(profile.name)) {
+                tool_config.profile = profile.name;
+                tool_config.events = profile.events;
+                tool_config.trace = profile.modules & MODULE_TRACE;
+                tool_config.dl_detector = profile.modules & MODULE_DL_DETECTOR;
+                tool_config.aggregate = profile.modules & MODULE_AGGREGATE;
+                tool_config.contention = profile.modules & MODULE_CONTENTION;
+                tool_config.imbalance = profile.modules & MODULE_IMBALANCE;
+                tool_config.granularity = profile.modules & MODULE_GRANULARITY;
+                tool_config.lock_order = profile.modules & MODULE_LOCK_ORDER;
+                tool_config.state_sampling = profile.modules & MODULE_STATE_SAMPLING;
+                tool_config.perf_counters = profile.modules & MODULE_PERF_COUNTERS;
+                tool_config.cpu_profile = profile.modules & MODULE_CPU_PROFILE;
+                found = true;
+            }
+        }
+        if (!found) {
+            std::cerr << "COMPASS_PROFILE: unknown profile " << profile_name << ", using full\n";
+        }
+    }
+
+    const char *events = getenv("COMPASS_EVENTS");
+    if (events && *events) {
+        tool_config.events = parse_event_groups(events);
+    }
+    // Thread ids are assigned in the thread_begin callback
+    tool_config.events |= EVENTS_THREAD;
+
+    tool_config.trace = env_flag("COMPASS_TRACE", tool_config.trace);
+    tool_config.dl_detector = env_flag("COMPASS_DL_DETECTOR", tool_config.dl_detector);
+    tool_config.aggregate = env_flag("COMPASS_AGGREGATE", tool_config.aggregate);
+    tool_config.contention = env_flag("COMPASS_CONTENTION", tool_config.contention);
+    tool_config.imbalance = env_flag("COMPASS_IMBALANCE", tool_config.imbalance);
+    tool_config.granularity = env_flag("COMPASS_GRANULARITY", tool_config.granularity);
+    tool_config.lock_order = env_flag("COMPASS_LOCK_ORDER", tool_config.lock_order);
+    tool_config.state_sampling = env_flag("COMPASS_STATE_SAMPLING", tool_config.state_sampling);
+    tool_config.perf_counters = env_flag("COMPASS_PERF_COUNTERS", tool_config.perf_counters);
+    tool_config.cpu_profile = env_flag("COMPASS_CPU_PROFILE", tool_config.cpu_profile);
+    tool_config.task_cutoff_us = (uint32_t)std::max(0L, env_number("COMPASS_TASK_CUTOFF", tool_config.task_cutoff_us));
+    tool_config.state_sample_hz = (uint32_t)std::max(1L, env_number("COMPASS_STATE_HZ", tool_config.state_sample_hz));
+    tool_config.cpu_profile_hz = (uint32_t)std::max(1L, env_number("COMPASS_CPU_PROFILE_HZ", tool_config.cpu_profile_hz));
+
+    tool_config.dl_spin_iterations = (uint32_t)std::max(0L, env_number("COMPASS_DL_SPIN", tool_config.dl_spin_iterations));
+    tool_config.dl_yield_iterations = (uint32_t)std::max(0L, env_number("COMPASS_DL_YIELD", tool_config.dl_yield_iterations));
+    tool_config.dl_park = env_flag("COMPASS_DL_PARK", tool_config.dl_park);
+    tool_config.dl_cpu = (int)env_number("COMPASS_DL_CPU", tool_config.dl_cpu);
+    tool_config.dl_queue_capacity = (uint32_t)std::max(1L, env_number("COMPASS_DL_QUEUE", tool_config.dl_queue_capacity));
+    tool_config.dl_snapshot_interval = (uint32_t)std::max(0L, env_number("COMPASS_DL_SNAPSHOT", tool_config.dl_snapshot_interval));
+
+    const char *overflow = getenv("COMPASS_DL_OVERFLOW");
+    if (overflow && *overflow) {
+        if (std::string(overflow) == "drop") {
+            tool_config.dl_queue_drop = true;
+        } else if (std::string(overflow) == "block") {
+            tool_config.dl_queue_drop = false;
+        } else {
+            std::cerr << "COMPASS_DL_OVERFLOW: unknown policy " << overflow << ", using block\n";
+        }
+    }
+
+    const char *stacks = getenv("COMPASS_STACKS");
+    if (stacks && *stacks) {
+        tool_config.stack_events = parse_stack_events(stacks);
+    }
+
+    const char *format = getenv("COMPASS_TRACE_FORMAT");
+    tool_config.trace_format_text = format && std::string(format) == "text";
+
+    configure_sampling(getenv("COMPASS_SAMPLING"));
+}
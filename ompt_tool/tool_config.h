@@ -0,0 +1,110 @@
+#ifndef TOOL_CONFIG_H
+#define TOOL_CONFIG_H
+
+#include <cstdint>
+#include <string>
+
+// Groups of OMPT callbacks that are registered together
+enum EventGroup : uint32_t {
+    EVENTS_THREAD   = 1 << 0,   // thread_begin (always registered, it assigns thread ids)
+    EVENTS_PARALLEL = 1 << 1,   // parallel_begin, parallel_end, implicit_task
+    EVENTS_WORK     = 1 << 2,   // work
+    EVENTS_SYNC     = 1 << 3,   // sync_region, sync_region_wait
+    EVENTS_MUTEX    = 1 << 4,   // mutex_acquire, mutex_acquired, mutex_released
+    EVENTS_TASKS    = 1 << 5,   // task_create, task_schedule, dependences, task_dependence
+    EVENTS_ALL      = (1 << 6) - 1
+};
+
+// Events whose application call stacks are captured, see call_stack.h
+enum StackEvent : uint32_t {
+    STACKS_MUTEX    = 1 << 0,   // mutex_acquire
+    STACKS_TASK     = 1 << 1,   // task_create
+    STACKS_BARRIER  = 1 << 2,   // sync_region_wait begin of a barrier
+    STACKS_ALL      = (1 << 3) - 1
+};
+
+struct ToolConfig {
+    std::string profile = "full";
+    uint32_t events = EVENTS_ALL;       // EventGroup mask of callbacks to register
+    bool trace = true;                  // record events into logs/
+    bool trace_format_text = false;     // write logs/logs_thread_N.txt instead of logs/trace.compass
+    bool dl_detector = false;
+    bool aggregate = false;             // accumulate per-region time in process, see aggregate.h
+    bool contention = false;            // profile lock wait and hold times in process, see contention.h
+    bool imbalance = false;             // compare threads' busy time per region and loop, see imbalance.h
+    bool granularity = false;           // per-site explicit task execution times, see granularity.h
+    bool lock_order = false;            // report lock order inversions, see lock_order.h
+    bool state_sampling = false;        // sample thread states from a per-thread timer, see state_sampler.h
+    bool perf_counters = false;         // performance counters per region, loop and task, see perf_counters.h
+    bool cpu_profile = false;           // sample call stacks from a per-thread CPU timer, see cpu_profiler.h
+    uint32_t stack_events = 0;          // StackEvent mask of events whose call stacks are captured
+
+    // How the deadlock detector thread waits for events: it polls the queue
+    // dl_spin_iterations times, then yields dl_yield_iterations times, then
+    // sleeps until a producer wakes it (or keeps yielding if dl_park is off)
+    uint32_t dl_spin_iterations = 2000;
+    uint32_t dl_yield_iterations = 100;
+    bool dl_park = true;
+    int dl_cpu = -1;                    // CPU to pin the detector thread to, -1 for none
+    uint32_t dl_queue_capacity = 4096;  // events the detector queue holds, rounded up to a power of two
+    bool dl_queue_drop = false;         // drop events when the queue is full instead of waiting
+    uint32_t dl_snapshot_interval = 10000; // events between full graph snapshots in the detector log, 0 for none
+
+    uint32_t task_cutoff_us = 10;       // tasks shorter than this count as too fine-grained in the granularity report
+    uint32_t state_sample_hz = 100;     // thread state samples per second of wall time per thread
+    uint32_t cpu_profile_hz = 1000;     // call stack samples per second of CPU time per thread
+};
+
+extern ToolConfig tool_config;
+
+/**
+ * @brief Fills tool_config from the environment.
+ *
+ * COMPASS_PROFILE selects a named profile:
+ *   full           every callback, traced (default)
+ *   workload       parallel regions, worksharing, sync and mutex events, traced
+ *   tasks          parallel regions, tasks and sync events, traced
+ *   deadlock-only  mutex and barrier events feeding the deadlock detector, no trace
+ *   summary        per-thread time per parallel region aggregated in process, no trace
+ *   contention     lock wait and hold times per lock and call site, no trace
+ *   imbalance      load imbalance per parallel region and worksharing loop, no trace
+ *   granularity    explicit task execution time per creation site, no trace
+ *   lockdep        lock order graph reporting potential deadlocks, no trace
+ *   states         sampled thread states per thread and parallel region, no trace
+ *   counters       performance counters per parallel region, loop and task site, no trace
+ *   cpu            sampled call stacks per parallel region and thread, no trace
+ *
+ * COMPASS_EVENTS overrides the profile's callback groups with a comma separated
+ * list of: thread, parallel, work, sync, mutex, tasks, all.
+ *
+ * These switches, each 0 or 1, override the modules the profile turns on:
+ *   COMPASS_TRACE            event trace in logs/
+ *   COMPASS_DL_DETECTOR      deadlock detection
+ *   COMPASS_AGGREGATE        per-region time aggregation
+ *   COMPASS_CONTENTION       lock contention profile
+ *   COMPASS_IMBALANCE        load imbalance analysis
+ *   COMPASS_GRANULARITY      task granularity report
+ *   COMPASS_LOCK_ORDER       lock order checking
+ *   COMPASS_STATE_SAMPLING   thread state sampling
+ *   COMPASS_PERF_COUNTERS    performance counters
+ *   COMPASS_CPU_PROFILE      CPU profiling
+ *
+ * COMPASS_TRACE_FORMAT=text selects the text logs. COMPASS_STACKS lists the
+ * events whose call stacks are captured: mutex, task, barrier or all (none by
+ * default). COMPASS_SAMPLING thins out task and worksharing events (see
+ * configure_sampling).
+ *
+ * COMPASS_TASK_CUTOFF sets the task duration in microseconds below which the
+ * granularity report calls a task too fine-grained. COMPASS_STATE_HZ sets the
+ * thread state samples per second, and COMPASS_CPU_PROFILE_HZ the call stack
+ * samples per second of CPU time.
+ *
+ * COMPASS_DL_SPIN, COMPASS_DL_YIELD, COMPASS_DL_PARK=0/1 and COMPASS_DL_CPU
+ * tune the deadlock detector thread. COMPASS_DL_QUEUE and
+ * COMPASS_DL_OVERFLOW=block/drop size its event queue and pick what happens
+ * when it is full. COMPASS_DL_SNAPSHOT sets how often the detector log holds
+ * a full snapshot of the graph between its edge deltas.
+ */
+void load_tool_config();
+
+#endif // TOOL_CONFIG_H
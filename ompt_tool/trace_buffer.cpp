@@ -0,0 +1,365 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <unistd.h>
+#include <omp-tools.h>
+#include "helper.h"
+#include "sampling.h"
+#include "symbolizer.h"
+#include "thread_registry.h"
+#include "timestamp.h"
+#include "tool_config.h"
+#include "trace_buffer.h"
+#include "trace_file.h"
+
+// Must be a power of two so indices can be masked instead of divided
+constexpr uint64_t TRACE_BUFFER_CAPACITY = 1 << 14;
+
+// Metadata key suffix of each TraceEventType
+static const char *const trace_event_keys[TRACE_EVENT_TYPE_COUNT] = {
+    "thread_create", "parallel_begin", "parallel_end", "work", "task_create", "task_schedule",
+    "implicit_task", "sync_region", "sync_region_wait", "mutex_acquire", "mutex_acquired", "mutex_released",
+    "task_dependences", "task_dependence"
+};
+
+// Single-producer single-consumer ring: the owning OpenMP thread advances
+// head, the writer thread advances tail. Each index lives on its own cache line.
+struct ThreadTraceBuffer {
+    alignas(64) std::atomic<uint64_t> head{0};
+    uint64_t cached_tail = 0;
+    // Written only by the owning thread, read at finalize
+    uint64_t event_counts[TRACE_EVENT_TYPE_COUNT] = {};
+    uint64_t skipped_counts[TRACE_EVENT_TYPE_COUNT] = {};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) TraceRecord records[TRACE_BUFFER_CAPACITY];
+};
+
+static PerThreadRegistry<ThreadTraceBuffer> buffers("COMPASS_TRACE");
+static std::atomic<uint64_t> dropped_events{0};
+static std::atomic<bool> writer_running{false};
+// Never freed, see ompt_finalize
+static std::thread *writer_thread = nullptr;
+
+void trace_skip_event(TraceEventType event) {
+    ThreadTraceBuffer *buffer = buffers.get_or_create();
+    if (buffer) {
+        buffer->event_counts[event]++;
+        buffer->skipped_counts[event]++;
+    }
+}
+
+void trace_event(TraceRecord record) {
+    ThreadTraceBuffer *buffer = buffers.get_or_create();
+    if (!buffer) {
+        dropped_events.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (record.event < TRACE_EVENT_TYPE_COUNT) {
+        buffer->event_counts[record.event]++;
+    }
+
+    record.time = read_timestamp();
+
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    while (head - buffer->cached_tail >= TRACE_BUFFER_CAPACITY) {
+        buffer->cached_tail = buffer->tail.load(std::memory_order_acquire);
+        if (head - buffer->cached_tail < TRACE_BUFFER_CAPACITY) {
+            break;
+        }
+        if (!writer_running.load(std::memory_order_relaxed)) {
+            dropped_events.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        std::this_thread::yield();
+    }
+
+    buffer->records[head & (TRACE_BUFFER_CAPACITY - 1)] = record;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+static std::string id_to_string(uint64_t id) {
+    return id == TRACE_ID_NONE ? "N/A" : std::to_string(id);
+}
+
+// Renders a record in the "Key: Value" text format read by visualization/diagram.py
+static void format_record(const TraceRecord &r, std::string &out) {
+    out += "Time: " + std::to_string(timestamp_to_realtime_ns(r.time) / 1000) + " µs\n";
+
+    switch (r.event) {
+        case TRACE_THREAD_CREATE:
+            out += "Event: Thread Create\n";
+            out += "Thread Type: " + ompt_thread_t_to_string((ompt_thread_t)r.kind) + "\n";
+            break;
+        case TRACE_PARALLEL_BEGIN:
+            out += "Event: Parallel Begin\n";
+            out += "Parallel ID: " + std::to_string(r.parallel_id) + "\n";
+            out += "Requested Parallelism: " + std::to_string(r.value) + "\n";
+            out += "Flags: " + std::to_string((int)r.flags) + "\n";
+            out += "Code Pointer Return Address: " + std::to_string(r.codeptr_ra) + "\n";
+            break;
+        case TRACE_PARALLEL_END:
+            out += "Event: Parallel End\n";
+            out += "Parallel ID: " + std::to_string(r.parallel_id) + "\n";
+            out += "Code Pointer Return Address: " + std::to_string(r.codeptr_ra) + "\n";
+            break;
+        case TRACE_WORK:
+            out += "Event: Work\n";
+            out += "Parallel ID: " + id_to_string(r.parallel_id) + "\n";
+            out += "Work Type: " + ompt_work_t_to_string((ompt_work_t)r.kind) + "\n";
+            out += "Endpoint: " + ompt_scope_endpoint_t_to_string((ompt_scope_endpoint_t)r.endpoint) + "\n";
+            out += "Count: " + std::to_string(r.value) + "\n";
+            out += "Code Pointer Return Address: " + std::to_string(r.codeptr_ra) + "\n";
+            break;
+        case TRACE_TASK_CREATE:
+            out += "Event: Task Create\n";
+            out += "Task Number: " + std::to_string(r.task_id) + "\n";
+            out += "Parent Task Number: " + std::to_string(r.aux_id) + "\n";
+            out += "Flags: " + std::to_string((int)r.flags) + "\n";
+            out += "Has Dependences: " + std::to_string(r.value) + "\n";
+            out += "Code Pointer Return Address: " + std::to_string(r.codeptr_ra) + "\n";
+            break;
+        case TRACE_TASK_SCHEDULE:
+            out += "Event: Task Schedule\n";
+            out += "Prior Task Data: " + std::to_string(r.task_id) + "\n";
+            out += "Prior Task Status: " + ompt_task_status_t_to_string((ompt_task_status_t)r.kind) + "\n";
+            out += "Next Task Data: " + id_to_string(r.aux_id) + "\n";
+            break;
+        case TRACE_IMPLICIT_TASK:
+            out += "Event: Implicit Task\n";
+            out += "Task Number: " + std::to_string(r.task_id) + "\n";
+            out += "Endpoint: " + ompt_scope_endpoint_t_to_string((ompt_scope_endpoint_t)r.endpoint) + "\n";
+            out += "Actual Parallelism: " + std::to_string(r.value) + "\n";
+            out += "Index: " + std::to_string(r.aux_id) + "\n";
+            out += "Flags: " + std::to_string((int)r.flags) + "\n";
+            out += "Parallel ID: " + id_to_string(r.parallel_id) + "\n";
+            break;
+        case TRACE_SYNC_REGION:
+        case TRACE_SYNC_REGION_WAIT:
+            out += r.event == TRACE_SYNC_REGION ? "Event: Sync Region\n" : "Event: Sync Region Wait\n";
+            out += "Parallel ID: " + id_to_string(r.parallel_id) + "\n";
+            out += "Kind: " + ompt_sync_region_t_to_string((ompt_sync_region_t)r.kind) + "\n";
+            out += "Endpoint: " + ompt_scope_endpoint_t_to_string((ompt_scope_endpoint_t)r.endpoint) + "\n";
+            out += "Code Pointer Return Address: " + std::to_string(r.codeptr_ra) + "\n";
+            break;
+        case TRACE_MUTEX_ACQUIRE:
+        case TRACE_MUTEX_ACQUIRED:
+        case TRACE_MUTEX_RELEASED:
+            out += r.event == TRACE_MUTEX_ACQUIRE  ? "Event: Mutex Acquire\n"
+                 : r.event == TRACE_MUTEX_ACQUIRED ? "Event: Mutex Acquired\n"
+                                                   : "Event: Mutex Released\n";
+            out += "Kind: " + ompt_mutex_t_to_string((ompt_mutex_t)r.kind) + "\n";
+            out += "Wait id: " + std::to_string(r.aux_id) + "\n";
+            out += "Code Pointer Return Address: " + std::to_string(r.codeptr_ra) + "\n";
+            break;
+        case TRACE_TASK_DEPENDENCES:
+            out += "Event: Task Dependences\n";
+            out += "Task Number: " + std::to_string(r.task_id) + "\n";
+            out += "Dependence Type: " + ompt_dependence_type_t_to_string((ompt_dependence_type_t)r.kind) + "\n";
+            out += "Variable: " + std::to_string(r.aux_id) + "\n";
+            out += "Dependence Count: " + std::to_string(r.value) + "\n";
+            break;
+        case TRACE_TASK_DEPENDENCE:
+            out += "Event: Task Dependence\n";
+            out += "Source Task Number: " + std::to_string(r.task_id) + "\n";
+            out += "Sink Task Number: " + std::to_string(r.aux_id) + "\n";
+            break;
+    }
+
+    out += "--------------------------\n";
+}
+
+// State owned by the writer thread
+struct TraceWriterState {
+    bool text_format = false;
+    TraceFileWriter file;
+    std::unordered_map<uint64_t, std::ofstream> text_files;
+    std::unordered_set<uint64_t> codeptrs;
+    uint64_t records_written = 0;
+    uint64_t records_lost = 0;  // drained while the trace file was failed or not open
+};
+
+static TraceWriterState *writer_state = nullptr;
+
+static void write_text_records(TraceWriterState &state, const TraceRecord *records, size_t count) {
+    std::string text;
+    for (size_t i = 0; i < count; i++) {
+        const TraceRecord &record = records[i];
+        auto it = state.text_files.find(record.thread_id);
+        if (it == state.text_files.end()) {
+            std::string filename = "logs/logs_thread_" + std::to_string(record.thread_id) + ".txt";
+            it = state.text_files.emplace(record.thread_id, std::ofstream(filename, std::ios::app)).first;
+        }
+        text.clear();
+        format_record(record, text);
+        it->second << text;
+    }
+}
+
+static void collect_codeptrs(TraceWriterState &state, const TraceRecord *records, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].codeptr_ra) {
+            state.codeptrs.insert(records[i].codeptr_ra);
+        }
+    }
+}
+
+// Moves every pending record out of the thread buffers, either as one events
+// block per buffer or as text. Returns the number of records drained. Records
+// that could not be written are still drained, so the buffers keep accepting
+// events, but are counted as lost rather than written.
+static size_t drain_buffers(TraceWriterState &state) {
+    size_t drained = 0;
+
+    for (ThreadTraceBuffer *buffer : buffers.all()) {
+        uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        if (tail == head) {
+            continue;
+        }
+
+        // The pending range may wrap around the end of the ring
+        size_t start = tail & (TRACE_BUFFER_CAPACITY - 1);
+        size_t pending = head - tail;
+        size_t first = std::min(pending, (size_t)TRACE_BUFFER_CAPACITY - start);
+        const TraceRecord *first_part = &buffer->records[start];
+        const TraceRecord *second_part = &buffer->records[0];
+
+        if (state.text_format) {
+            write_text_records(state, first_part, first);
+            write_text_records(state, second_part, pending - first);
+            state.records_written += pending;
+        } else if (state.file.write_block(TRACE_BLOCK_EVENTS, first_part->thread_id,
+                                          first_part, first * sizeof(TraceRecord),
+                                          second_part, (pending - first) * sizeof(TraceRecord))) {
+            collect_codeptrs(state, first_part, first);
+            collect_codeptrs(state, second_part, pending - first);
+            state.records_written += pending;
+        } else {
+            state.records_lost += pending;
+        }
+
+        buffer->tail.store(head, std::memory_order_release);
+        drained += pending;
+    }
+    return drained;
+}
+
+static void write_meta_block(TraceWriterState &state, const std::string &meta) {
+    state.file.write_block(TRACE_BLOCK_META, 0, meta.data(), meta.size());
+}
+
+// Writes the code pointer table: each code pointer seen in the trace mapped to
+// "module+0xoffset\tfunction\tfile:line". The records only hold raw addresses;
+// they are symbolized here, once each, when the trace is closed.
+static void write_codeptr_table(TraceWriterState &state) {
+    std::vector<uint64_t> codeptrs(state.codeptrs.begin(), state.codeptrs.end());
+    symbolize(codeptrs);
+
+    std::string payload;
+    for (uint64_t codeptr : codeptrs) {
+        std::string name;
+        const Symbol &symbol = lookup_symbol(codeptr);
+        if (!symbol.module.empty()) {
+            std::ostringstream out;
+            out << symbol.module << "+0x" << std::hex << symbol.offset << std::dec << "\t" << symbol.function << "\t";
+            if (!symbol.file.empty()) {
+                out << symbol.file << ":" << symbol.line;
+            }
+            name = out.str();
+        }
+        uint32_t length = (uint32_t)name.size();
+        payload.append(reinterpret_cast<const char *>(&codeptr), sizeof(codeptr));
+        payload.append(reinterpret_cast<const char *>(&length), sizeof(length));
+        payload.append(name);
+    }
+    state.file.write_block(TRACE_BLOCK_STRINGS, 0, payload.data(), payload.size());
+}
+
+// Exact number of events of each type seen by the callbacks, and how many of
+// them were recorded, summed over all threads
+static std::string event_count_meta() {
+    uint64_t counts[TRACE_EVENT_TYPE_COUNT] = {};
+    uint64_t skipped[TRACE_EVENT_TYPE_COUNT] = {};
+    for (ThreadTraceBuffer *buffer : buffers.all()) {
+        for (int event = 0; event < TRACE_EVENT_TYPE_COUNT; event++) {
+            counts[event] += buffer->event_counts[event];
+            skipped[event] += buffer->skipped_counts[event];
+        }
+    }
+
+    std::string meta;
+    for (int event = 0; event < TRACE_EVENT_TYPE_COUNT; event++) {
+        meta += "count." + std::string(trace_event_keys[event]) + "=" + std::to_string(counts[event]) + "\n";
+        meta += "recorded." + std::string(trace_event_keys[event]) + "=" +
+                std::to_string(counts[event] - skipped[event]) + "\n";
+    }
+    return meta;
+}
+
+static void trace_writer_thread() {
+    TraceWriterState &state = *writer_state;
+
+    while (writer_running.load(std::memory_order_acquire)) {
+        if (drain_buffers(state) == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    drain_buffers(state);
+}
+
+void start_trace_writer() {
+    writer_state = new TraceWriterState();
+
+    writer_state->text_format = tool_config.trace_format_text;
+
+    if (!writer_state->text_format && writer_state->file.open(TRACE_FILE_NAME, sizeof(TraceRecord))) {
+        write_meta_block(*writer_state,
+                         "record_fields=" + std::string(TRACE_RECORD_FIELDS) + "\n" +
+                         "time_unit=ticks\n" +
+                         clock_calibration_meta() +
+                         sampling_meta() +
+                         "pid=" + std::to_string(getpid()) + "\n");
+    }
+
+    writer_running = true;
+    writer_thread = new std::thread(trace_writer_thread);
+}
+
+void end_trace_writer() {
+    writer_running = false;
+    if (writer_thread) {
+        writer_thread->join();
+        delete writer_thread;
+        writer_thread = nullptr;
+    }
+    if (!writer_state) {
+        return;
+    }
+
+    uint64_t dropped = dropped_events.load();
+    if (dropped > 0) {
+        std::cerr << "Trace writer dropped " << dropped << " events\n";
+    }
+
+    if (writer_state->file.is_open()) {
+        write_codeptr_table(*writer_state);
+        write_meta_block(*writer_state,
+                         "records=" + std::to_string(writer_state->records_written) + "\n" +
+                         "dropped=" + std::to_string(dropped) + "\n" +
+                         event_count_meta());
+        writer_state->file.close();
+    }
+    if (writer_state->records_lost > 0) {
+        std::cerr << "Trace writer lost " << writer_state->records_lost
+                  << " events that could not be written to the trace file\n";
+    }
+    delete writer_state;
+    writer_state = nullptr;
+}
@@ -0,0 +1,72 @@
+#ifndef TRACE_BUFFER_H
+#define TRACE_BUFFER_H
+
+#include <cstdint>
+
+// Marks an id field that has no value (printed as "N/A" in the text logs)
+constexpr uint64_t TRACE_ID_NONE = UINT64_MAX;
+
+enum TraceEventType : uint16_t {
+    TRACE_THREAD_CREATE,
+    TRACE_PARALLEL_BEGIN,
+    TRACE_PARALLEL_END,
+    TRACE_WORK,
+    TRACE_TASK_CREATE,
+    TRACE_TASK_SCHEDULE,
+    TRACE_IMPLICIT_TASK,
+    TRACE_SYNC_REGION,
+    TRACE_SYNC_REGION_WAIT,
+    TRACE_MUTEX_ACQUIRE,
+    TRACE_MUTEX_ACQUIRED,
+    TRACE_MUTEX_RELEASED,
+    TRACE_TASK_DEPENDENCES,
+    TRACE_TASK_DEPENDENCE,
+    TRACE_EVENT_TYPE_COUNT
+};
+
+/**
+ * @brief Fixed-size binary record for a single OMPT event.
+ *
+ * The meaning of the generic fields depends on the event type:
+ *   kind      - thread/work/sync/mutex kind, prior task status or dependence type
+ *   task_id   - task number (new task, prior task, implicit task, dependent task
+ *               or dependence source task)
+ *   aux_id    - wait id, parent task number, next task number, implicit task index,
+ *               dependence variable address or dependence sink task number
+ *   value     - requested/actual parallelism, work count, has_dependences or
+ *               number of dependences
+ *
+ * TRACE_TASK_DEPENDENCES is written once per item of a task's depend clauses.
+ */
+struct TraceRecord {
+    uint16_t event;
+    uint16_t thread_id;
+    uint32_t kind;
+    uint32_t endpoint;
+    uint32_t flags;
+    uint64_t time;
+    uint64_t codeptr_ra;
+    uint64_t parallel_id;
+    uint64_t task_id;
+    uint64_t aux_id;
+    uint64_t value;
+};
+
+static_assert(sizeof(TraceRecord) == 64, "TraceRecord must fill exactly one cache line");
+
+/**
+ * @brief Timestamps a record and appends it to the calling thread's ring buffer.
+ *
+ * Lock-free and allocation-free after the first call on each thread. Blocks
+ * (yielding) only if the background writer has fallen a full buffer behind.
+ */
+void trace_event(TraceRecord record);
+
+// Counts an event that sampling chose not to record. Totals of counted and
+// recorded events per type go into the trace metadata.
+void trace_skip_event(TraceEventType event);
+
+void start_trace_writer();
+void end_trace_writer();
+
+#endif // TRACE_BUFFER_H
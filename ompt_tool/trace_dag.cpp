@@ -0,0 +1,561 @@
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <omp-tools.h>
+#include "helper.h"
+#include "trace_dag.h"
+
+// Records read from the trace per call
+constexpr size_t DAG_READ_BATCH = 1 << 16;
+
+static const char *const trace_event_names[TRACE_EVENT_TYPE_COUNT] = {
+    "Thread Create",
+    "Parallel Begin",
+    "Parallel End",
+    "Work",
+    "Task Create",
+    "Task Schedule",
+    "Implicit Task",
+    "Sync Region",
+    "Sync Region Wait",
+    "Mutex Acquire",
+    "Mutex Acquired",
+    "Mutex Released",
+    "Task Dependences",
+    "Task Dependence",
+};
+
+const char *trace_event_name(uint16_t event) {
+    return event < TRACE_EVENT_TYPE_COUNT ? trace_event_names[event] : "Unknown";
+}
+
+struct DagEdge {
+    uint32_t from;
+    uint32_t to;
+    uint8_t type;
+};
+
+// Everything one thread contributes to the graph, in thread-local node
+// indices until the threads are merged
+struct ThreadPass {
+    uint16_t thread_id;
+    std::vector<TraceRecord> events;
+    std::vector<TraceRecord> nodes;
+    std::vector<uint64_t> weights;
+    std::vector<DagEdge> edges;
+
+    std::vector<std::pair<uint64_t, uint32_t>> task_creates;
+    std::vector<std::pair<uint64_t, uint32_t>> task_starts;
+    std::vector<std::pair<uint64_t, uint32_t>> task_completes;
+    std::vector<std::pair<uint64_t, uint32_t>> parallel_begins;
+    std::vector<std::pair<uint64_t, uint32_t>> parallel_ends;
+    // (parallel id, implicit task begin, matching implicit task end)
+    std::vector<std::tuple<uint64_t, uint32_t, uint32_t>> implicit_tasks;
+
+    std::unordered_map<uint64_t, uint64_t> task_busy;
+    // Depend clause items, and (source, sink) task pairs reported by the runtime
+    std::vector<TraceRecord> depend_items;
+    std::vector<std::pair<uint64_t, uint64_t>> reported_dependences;
+};
+
+// The events diagram.py leaves out of the graph
+static bool is_dag_node(const TraceRecord &record) {
+    switch (record.event) {
+        case TRACE_WORK:
+        case TRACE_SYNC_REGION:
+        case TRACE_TASK_DEPENDENCES:
+        case TRACE_TASK_DEPENDENCE:
+            return false;
+        case TRACE_SYNC_REGION_WAIT: {
+            if (record.endpoint == ompt_scope_begin) {
+                return false;
+            }
+            std::string kind = ompt_sync_region_t_to_string((ompt_sync_region_t)record.kind);
+            return kind.find("implicit") == std::string::npos && kind.find("taskgroup") == std::string::npos;
+        }
+        default:
+            return true;
+    }
+}
+
+static void process_thread(ThreadPass &pass) {
+    std::stable_sort(pass.events.begin(), pass.events.end(),
+                     [](const TraceRecord &a, const TraceRecord &b) { return a.time < b.time; });
+
+    uint32_t current = DAG_NO_NODE;
+    uint64_t last_time = 0;
+    int implicit_depth = 0;
+    // Open waits of the running task; saved per task while it is switched out
+    int waits = 0;
+    std::unordered_map<uint64_t, int> suspended_waits;
+    uint64_t running_task = TRACE_ID_NONE;
+
+    std::unordered_map<uint64_t, uint32_t> pending_acquires;
+    std::unordered_map<uint64_t, uint32_t> held_mutexes;
+    std::unordered_set<uint64_t> started_tasks;
+    // Implicit task begins not yet ended: (parallel id, node)
+    std::vector<std::pair<uint64_t, uint32_t>> implicit_stack;
+
+    for (const TraceRecord &record : pass.events) {
+        if (current != DAG_NO_NODE && implicit_depth > 0 && waits == 0) {
+            pass.weights[current] += record.time - last_time;
+            if (running_task != TRACE_ID_NONE) {
+                pass.task_busy[running_task] += record.time - last_time;
+            }
+        }
+        last_time = record.time;
+
+        uint32_t node = DAG_NO_NODE;
+        if (is_dag_node(record)) {
+            node = (uint32_t)pass.nodes.size();
+            pass.nodes.push_back(record);
+            pass.weights.push_back(0);
+            if (current != DAG_NO_NODE) {
+                pass.edges.push_back({current, node, DAG_EDGE_TEMPORAL});
+            }
+            current = node;
+        }
+
+        switch (record.event) {
+            case TRACE_PARALLEL_BEGIN:
+                pass.parallel_begins.emplace_back(record.parallel_id, node);
+                break;
+            case TRACE_PARALLEL_END:
+                pass.parallel_ends.emplace_back(record.parallel_id, node);
+                break;
+            case TRACE_IMPLICIT_TASK:
+                if (record.endpoint == ompt_scope_begin) {
+                    implicit_depth++;
+                    implicit_stack.emplace_back(record.parallel_id, node);
+                    running_task = record.task_id;
+                } else if (!implicit_stack.empty()) {
+                    // The end event does not reliably carry the parallel id, so
+                    // it is matched with the innermost open begin instead
+                    implicit_depth--;
+                    pass.implicit_tasks.emplace_back(implicit_stack.back().first, implicit_stack.back().second, node);
+                    implicit_stack.pop_back();
+                }
+                break;
+            case TRACE_TASK_CREATE:
+                pass.task_creates.emplace_back(record.task_id, node);
+                break;
+            case TRACE_TASK_SCHEDULE:
+                if (record.kind == ompt_task_complete) {
+                    pass.task_completes.emplace_back(record.task_id, node);
+                    suspended_waits.erase(record.task_id);
+                } else {
+                    suspended_waits[record.task_id] = waits;
+                }
+                running_task = record.aux_id;
+                if (record.aux_id != TRACE_ID_NONE) {
+                    if (started_tasks.insert(record.aux_id).second) {
+                        pass.task_starts.emplace_back(record.aux_id, node);
+                    }
+                    auto it = suspended_waits.find(record.aux_id);
+                    waits = it == suspended_waits.end() ? 0 : it->second;
+                }
+                break;
+            case TRACE_TASK_DEPENDENCES:
+                pass.depend_items.push_back(record);
+                break;
+            case TRACE_TASK_DEPENDENCE:
+                pass.reported_dependences.emplace_back(record.task_id, record.aux_id);
+                break;
+            case TRACE_SYNC_REGION_WAIT:
+                if (record.endpoint == ompt_scope_begin) {
+                    waits++;
+                } else if (waits > 0) {
+                    waits--;
+                }
+                break;
+            case TRACE_MUTEX_ACQUIRE:
+                waits++;
+                pending_acquires[record.aux_id] = node;
+                break;
+            case TRACE_MUTEX_ACQUIRED: {
+                auto it = pending_acquires.find(record.aux_id);
+                if (it != pending_acquires.end()) {
+                    waits = std::max(waits - 1, 0);
+                    pass.edges.push_back({it->second, node, DAG_EDGE_MUTEX});
+                    pending_acquires.erase(it);
+                }
+                held_mutexes[record.aux_id] = node;
+                break;
+            }
+            case TRACE_MUTEX_RELEASED: {
+                auto it = held_mutexes.find(record.aux_id);
+                if (it != held_mutexes.end()) {
+                    pass.edges.push_back({it->second, node, DAG_EDGE_MUTEX});
+                    held_mutexes.erase(it);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    pass.events.clear();
+    pass.events.shrink_to_fit();
+}
+
+// Dependence state of one storage location among the children of one task
+struct DependState {
+    std::vector<uint32_t> writers;      // last out/inout task, or the members of the last set
+    std::vector<uint32_t> readers;      // in tasks since the writers
+    std::vector<uint32_t> set_sources;  // what the members of the current set depend on
+    uint32_t set_type = 0;              // mutexinoutset or inoutset while writers form a set
+};
+
+// Derives the edges the depend clauses imply: sibling tasks, in creation order,
+// ordered by the in/out semantics of each location. Unlike the runtime's own
+// reports this includes predecessors that had already finished.
+static void link_depend_clauses(const TraceDag &dag, const std::unordered_map<uint64_t, uint32_t> &task_index,
+                                const std::vector<TraceRecord> &items, std::vector<std::pair<uint32_t, uint32_t>> &edges) {
+    std::vector<std::pair<uint32_t, const TraceRecord *>> ordered;
+    for (const TraceRecord &item : items) {
+        auto it = task_index.find(item.task_id);
+        if (it != task_index.end()) {
+            ordered.emplace_back(it->second, &item);
+        }
+    }
+    // Items of one task are consecutive, so a stable sort keeps their clause order
+    std::stable_sort(ordered.begin(), ordered.end(), [&](const auto &a, const auto &b) {
+        const DagTask &x = dag.tasks[a.first];
+        const DagTask &y = dag.tasks[b.first];
+        uint64_t x_time = dag.nodes[x.create_node].time, y_time = dag.nodes[y.create_node].time;
+        return std::tie(x.parent, x_time, x.id) < std::tie(y.parent, y_time, y.id);
+    });
+
+    std::map<std::pair<uint64_t, uint64_t>, DependState> locations;
+    auto depend_on = [&](const std::vector<uint32_t> &sources, uint32_t task) {
+        for (uint32_t source : sources) {
+            edges.emplace_back(source, task);
+        }
+    };
+    for (const auto &[task, item] : ordered) {
+        DependState &state = locations[{dag.tasks[task].parent, item->aux_id}];
+        switch (item->kind) {
+            case ompt_dependence_type_in:
+                depend_on(state.writers, task);
+                state.readers.push_back(task);
+                break;
+            case ompt_dependence_type_out:
+            case ompt_dependence_type_inout:
+                // Readers already depend on the writers, so those edges would be redundant
+                depend_on(state.readers.empty() ? state.writers : state.readers, task);
+                state.writers = {task};
+                state.readers.clear();
+                state.set_type = 0;
+                break;
+            case ompt_dependence_type_mutexinoutset:
+            case ompt_dependence_type_inoutset:
+                if (state.set_type == item->kind && state.readers.empty()) {
+                    depend_on(state.set_sources, task);
+                    state.writers.push_back(task);
+                } else {
+                    state.set_sources = state.readers.empty() ? state.writers : state.readers;
+                    depend_on(state.set_sources, task);
+                    state.writers = {task};
+                    state.readers.clear();
+                    state.set_type = item->kind;
+                }
+                break;
+            default:
+                // source/sink belong to doacross loops, not to tasks
+                break;
+        }
+    }
+}
+
+bool build_trace_dag(TraceReader &reader, TraceDag &dag, unsigned workers) {
+    dag = TraceDag();
+
+    // Events arrive in per-thread chunks, but chunks of different threads interleave
+    std::map<uint16_t, ThreadPass> by_thread;
+    std::vector<TraceRecord> batch(DAG_READ_BATCH);
+    reader.rewind();
+    size_t count;
+    while ((count = reader.read_events(batch.data(), batch.size())) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            by_thread[batch[i].thread_id].events.push_back(batch[i]);
+        }
+    }
+
+    std::vector<ThreadPass> passes;
+    passes.reserve(by_thread.size());
+    for (auto &[thread_id, pass] : by_thread) {
+        pass.thread_id = thread_id;
+        passes.push_back(std::move(pass));
+    }
+    by_thread.clear();
+
+    if (workers == 0) {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    workers = std::min<unsigned>(workers, std::max<size_t>(passes.size(), 1));
+    std::atomic<size_t> next_pass{0};
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; i++) {
+        pool.emplace_back([&]() {
+            size_t index;
+            while ((index = next_pass.fetch_add(1)) < passes.size()) {
+                process_thread(passes[index]);
+            }
+        });
+    }
+    for (std::thread &worker : pool) {
+        worker.join();
+    }
+
+    // Give every thread's nodes a global range and move them into place
+    std::vector<uint32_t> offsets;
+    size_t total_nodes = 0;
+    for (const ThreadPass &pass : passes) {
+        offsets.push_back((uint32_t)total_nodes);
+        total_nodes += pass.nodes.size();
+    }
+    if (total_nodes >= DAG_NO_NODE) {
+        return false;
+    }
+    dag.nodes.reserve(total_nodes);
+    dag.weights.reserve(total_nodes);
+    std::vector<DagEdge> edges;
+    for (size_t t = 0; t < passes.size(); t++) {
+        ThreadPass &pass = passes[t];
+        if (pass.nodes.empty()) {
+            continue;
+        }
+        dag.threads.push_back(pass.thread_id);
+        dag.thread_first.push_back(offsets[t]);
+        dag.nodes.insert(dag.nodes.end(), pass.nodes.begin(), pass.nodes.end());
+        dag.weights.insert(dag.weights.end(), pass.weights.begin(), pass.weights.end());
+        for (const DagEdge &edge : pass.edges) {
+            edges.push_back({edge.from + offsets[t], edge.to + offsets[t], edge.type});
+        }
+    }
+    dag.thread_first.push_back((uint32_t)total_nodes);
+
+    // Cross-thread edges: tasks and parallel regions
+    std::unordered_map<uint64_t, uint32_t> task_creates, task_starts, task_completes;
+    std::unordered_map<uint64_t, uint32_t> parallel_begins, parallel_ends;
+    for (size_t t = 0; t < passes.size(); t++) {
+        const ThreadPass &pass = passes[t];
+        for (const auto &[task, node] : pass.task_creates) {
+            task_creates[task] = node + offsets[t];
+        }
+        for (const auto &[task, node] : pass.task_starts) {
+            // A task that was switched to on several threads started on the earliest
+            uint32_t global = node + offsets[t];
+            auto [it, inserted] = task_starts.emplace(task, global);
+            if (!inserted && dag.nodes[global].time < dag.nodes[it->second].time) {
+                it->second = global;
+            }
+        }
+        for (const auto &[task, node] : pass.task_completes) {
+            task_completes[task] = node + offsets[t];
+        }
+        for (const auto &[region, node] : pass.parallel_begins) {
+            parallel_begins[region] = node + offsets[t];
+        }
+        for (const auto &[region, node] : pass.parallel_ends) {
+            parallel_ends[region] = node + offsets[t];
+        }
+    }
+
+    // Explicit tasks, in task number order
+    std::vector<uint64_t> task_ids;
+    for (const auto &[task, create] : task_creates) {
+        task_ids.push_back(task);
+    }
+    std::sort(task_ids.begin(), task_ids.end());
+    std::unordered_map<uint64_t, uint32_t> task_index;
+    for (uint64_t task : task_ids) {
+        auto start = task_starts.find(task);
+        auto complete = task_completes.find(task);
+        uint32_t create = task_creates[task];
+        task_index[task] = (uint32_t)dag.tasks.size();
+        dag.tasks.push_back({task, dag.nodes[create].aux_id, create,
+                             start == task_starts.end() ? DAG_NO_NODE : start->second,
+                             complete == task_completes.end() ? DAG_NO_NODE : complete->second});
+
+        uint32_t previous = create;
+        if (start != task_starts.end()) {
+            edges.push_back({previous, start->second, DAG_EDGE_TASK});
+            previous = start->second;
+        }
+        if (complete != task_completes.end()) {
+            edges.push_back({previous, complete->second, DAG_EDGE_TASK});
+        }
+    }
+
+    std::vector<TraceRecord> depend_items;
+    std::vector<std::pair<uint32_t, uint32_t>> dependences;
+    for (const ThreadPass &pass : passes) {
+        for (const auto &[task, busy] : pass.task_busy) {
+            auto it = task_index.find(task);
+            if (it != task_index.end()) {
+                dag.tasks[it->second].busy += busy;
+            }
+        }
+        depend_items.insert(depend_items.end(), pass.depend_items.begin(), pass.depend_items.end());
+        for (const auto &[source, sink] : pass.reported_dependences) {
+            auto from = task_index.find(source);
+            auto to = task_index.find(sink);
+            if (from != task_index.end() && to != task_index.end()) {
+                dependences.emplace_back(from->second, to->second);
+            }
+        }
+    }
+    link_depend_clauses(dag, task_index, depend_items, dependences);
+    std::sort(dependences.begin(), dependences.end());
+    dependences.erase(std::unique(dependences.begin(), dependences.end()), dependences.end());
+    for (const auto &[from, to] : dependences) {
+        const DagTask &source = dag.tasks[from];
+        const DagTask &sink = dag.tasks[to];
+        if (from != to && source.complete_node != DAG_NO_NODE && sink.start_node != DAG_NO_NODE) {
+            edges.push_back({source.complete_node, sink.start_node, DAG_EDGE_DEPENDENCE});
+            dag.task_dependences.emplace_back(from, to);
+        }
+    }
+    for (size_t t = 0; t < passes.size(); t++) {
+        for (const auto &[region, first, last] : passes[t].implicit_tasks) {
+            auto begin = parallel_begins.find(region);
+            auto end = parallel_ends.find(region);
+            if (begin == parallel_begins.end() || end == parallel_ends.end()) {
+                continue;
+            }
+            edges.push_back({begin->second, first + offsets[t], DAG_EDGE_NESTING});
+            edges.push_back({last + offsets[t], end->second, DAG_EDGE_NESTING});
+        }
+    }
+    passes.clear();
+
+    // Counting sort of the edges by source
+    dag.edge_offsets.assign(total_nodes + 1, 0);
+    for (const DagEdge &edge : edges) {
+        dag.edge_offsets[edge.from + 1]++;
+        dag.edge_counts[edge.type]++;
+    }
+    for (size_t n = 0; n < total_nodes; n++) {
+        dag.edge_offsets[n + 1] += dag.edge_offsets[n];
+    }
+    dag.edge_targets.resize(edges.size());
+    dag.edge_types.resize(edges.size());
+    std::vector<uint64_t> fill(dag.edge_offsets.begin(), dag.edge_offsets.end() - 1);
+    for (const DagEdge &edge : edges) {
+        uint64_t slot = fill[edge.from]++;
+        dag.edge_targets[slot] = edge.to;
+        dag.edge_types[slot] = edge.type;
+    }
+    return true;
+}
+
+CriticalPath find_critical_path(const TraceDag &dag) {
+    CriticalPath path;
+    size_t node_count = dag.nodes.size();
+    std::vector<uint32_t> in_degree(node_count, 0);
+    for (uint32_t target : dag.edge_targets) {
+        in_degree[target]++;
+    }
+
+    // Longest path by Kahn's topological order. Events are instants: a node's
+    // busy time lies on the temporal edge to its thread's next node, and the
+    // other edges only order events. finish[n] is the heaviest path up to node n.
+    std::vector<uint64_t> finish(node_count, 0);
+    std::vector<uint32_t> predecessor(node_count, DAG_NO_NODE);
+    std::vector<uint32_t> ready;
+    for (uint32_t n = 0; n < node_count; n++) {
+        if (in_degree[n] == 0) {
+            ready.push_back(n);
+        }
+    }
+    size_t ordered = 0;
+    uint32_t last = DAG_NO_NODE;
+    while (!ready.empty()) {
+        uint32_t node = ready.back();
+        ready.pop_back();
+        ordered++;
+        path.work += dag.weights[node];
+        if (last == DAG_NO_NODE || finish[node] + dag.weights[node] > path.span) {
+            last = node;
+            path.span = finish[node] + dag.weights[node];
+        }
+        for (uint64_t e = dag.edge_offsets[node]; e < dag.edge_offsets[node + 1]; e++) {
+            uint32_t target = dag.edge_targets[e];
+            uint64_t reach = finish[node] + (dag.edge_types[e] == DAG_EDGE_TEMPORAL ? dag.weights[node] : 0);
+            if (predecessor[target] == DAG_NO_NODE || reach > finish[target]) {
+                finish[target] = reach;
+                predecessor[target] = node;
+            }
+            if (--in_degree[target] == 0) {
+                ready.push_back(target);
+            }
+        }
+    }
+    path.unordered = node_count - ordered;
+
+    if (last != DAG_NO_NODE) {
+        for (uint32_t node = last; node != DAG_NO_NODE; node = predecessor[node]) {
+            path.nodes.push_back(node);
+        }
+        std::reverse(path.nodes.begin(), path.nodes.end());
+    }
+    return path;
+}
+
+CriticalPath find_task_critical_path(const TraceDag &dag) {
+    CriticalPath path;
+    size_t task_count = dag.tasks.size();
+    std::vector<std::vector<uint32_t>> successors(task_count);
+    std::vector<uint32_t> in_degree(task_count, 0);
+    for (const auto &[from, to] : dag.task_dependences) {
+        successors[from].push_back(to);
+        in_degree[to]++;
+    }
+
+    // finish[t] is the heaviest dependence chain ending with task t, including it
+    std::vector<uint64_t> finish(task_count, 0);
+    std::vector<uint32_t> predecessor(task_count, DAG_NO_NODE);
+    std::vector<uint32_t> ready;
+    for (uint32_t t = 0; t < task_count; t++) {
+        if (in_degree[t] == 0) {
+            ready.push_back(t);
+        }
+    }
+    size_t ordered = 0;
+    uint32_t last = DAG_NO_NODE;
+    while (!ready.empty()) {
+        uint32_t task = ready.back();
+        ready.pop_back();
+        ordered++;
+        finish[task] += dag.tasks[task].busy;
+        path.work += dag.tasks[task].busy;
+        if (last == DAG_NO_NODE || finish[task] > path.span) {
+            last = task;
+            path.span = finish[task];
+        }
+        for (uint32_t successor : successors[task]) {
+            if (predecessor[successor] == DAG_NO_NODE || finish[task] > finish[successor]) {
+                finish[successor] = finish[task];
+                predecessor[successor] = task;
+            }
+            if (--in_degree[successor] == 0) {
+                ready.push_back(successor);
+            }
+        }
+    }
+    path.unordered = task_count - ordered;
+
+    if (last != DAG_NO_NODE) {
+        for (uint32_t task = last; task != DAG_NO_NODE; task = predecessor[task]) {
+            path.nodes.push_back(task);
+        }
+        std::reverse(path.nodes.begin(), path.nodes.end());
+    }
+    return path;
+}
@@ -0,0 +1,93 @@
+#ifndef TRACE_DAG_H
+#define TRACE_DAG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "trace_buffer.h"
+#include "trace_reader.h"
+
+constexpr uint32_t DAG_NO_NODE = UINT32_MAX;
+
+enum DagEdgeType : uint8_t {
+    DAG_EDGE_TEMPORAL,   // consecutive events of one thread
+    DAG_EDGE_NESTING,    // parallel begin -> implicit tasks -> parallel end
+    DAG_EDGE_TASK,       // task create -> first switch to the task -> task complete
+    DAG_EDGE_MUTEX,      // mutex acquire -> acquired -> released on one thread
+    DAG_EDGE_DEPENDENCE, // task complete -> first switch to a task depending on it
+    DAG_EDGE_TYPE_COUNT
+};
+
+// An explicit task of the trace. Node fields are DAG_NO_NODE when the event was not recorded.
+struct DagTask {
+    uint64_t id;
+    uint64_t parent;
+    uint32_t create_node;
+    uint32_t start_node;
+    uint32_t complete_node;
+    uint64_t busy = 0;      // ticks the task ran, without time switched out or waiting
+};
+
+/**
+ * @brief Happens-before graph of a trace, the same one visualization/diagram.py
+ * draws, in compressed sparse row form.
+ *
+ * Nodes are the events diagram.py keeps (everything but worksharing and sync
+ * region events, implicit barrier waits and the begin of other waits),
+ * grouped by thread and sorted by time within a thread. The out edges of node
+ * n are edge_targets[edge_offsets[n] .. edge_offsets[n + 1]).
+ *
+ * Each node is weighted with the busy time of its thread from the node until
+ * the thread's next node: time spent inside an implicit task and not waiting
+ * at a barrier, taskwait, task group or lock. Waits are tracked per task, so a
+ * task run from inside a barrier counts as busy.
+ */
+struct TraceDag {
+    std::vector<TraceRecord> nodes;
+    std::vector<uint64_t> weights;          // ticks
+    // Threads that have nodes, and where their nodes start; threads.size() + 1 entries in thread_first
+    std::vector<uint16_t> threads;
+    std::vector<uint32_t> thread_first;
+
+    std::vector<uint64_t> edge_offsets;     // nodes.size() + 1 entries
+    std::vector<uint32_t> edge_targets;
+    std::vector<uint8_t> edge_types;
+    size_t edge_counts[DAG_EDGE_TYPE_COUNT] = {};
+
+    // The task graph: explicit tasks and (predecessor, successor) pairs of
+    // indices into tasks, from the depend clauses and the runtime's reports
+    std::vector<DagTask> tasks;
+    std::vector<std::pair<uint32_t, uint32_t>> task_dependences;
+};
+
+// Reads every event of the trace and builds its graph. Threads are processed
+// in parallel on up to workers threads (0 for one per hardware thread).
+bool build_trace_dag(TraceReader &reader, TraceDag &dag, unsigned workers = 0);
+
+/**
+ * @brief Work and span of the graph, in ticks.
+ *
+ * work (T1) is the total busy time over all nodes and span (T∞) the heaviest
+ * path through the graph, where a node's busy time is carried by the temporal
+ * edge leaving it and all other edges weigh nothing. work / span bounds the
+ * speedup any number of threads could get out of this execution, and nodes
+ * lists the path that sets the span. Nodes on a cycle, which only skewed
+ * clocks between threads can create, are left out and counted in unordered.
+ */
+struct CriticalPath {
+    uint64_t work = 0;
+    uint64_t span = 0;
+    std::vector<uint32_t> nodes;
+    size_t unordered = 0;
+};
+
+CriticalPath find_critical_path(const TraceDag &dag);
+
+// The same over the task graph alone: tasks weighted with their busy time and
+// ordered only by their dependences. nodes holds indices into dag.tasks.
+CriticalPath find_task_critical_path(const TraceDag &dag);
+
+// "Parallel Begin", "Task Schedule", ... as in visualization/trace_reader.py
+const char *trace_event_name(uint16_t event);
+
+#endif // TRACE_DAG_H
@@ -0,0 +1,119 @@
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "trace_file.h"
+
+// Size of the mapped window; the file is also grown in steps of this size
+constexpr size_t TRACE_MAP_WINDOW = 64 << 20;
+
+TraceFileWriter::~TraceFileWriter() {
+    close();
+}
+
+bool TraceFileWriter::open(const std::string &path, uint32_t record_size) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to open trace file " << path << "\n";
+        return false;
+    }
+
+    TraceFileHeader header{};
+    std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_FORMAT_VERSION;
+    header.header_size = sizeof(TraceFileHeader);
+    header.record_size = record_size;
+    write_failed = false;
+    if (!reserve(sizeof(header))) {
+        close();
+        return false;
+    }
+    append(&header, sizeof(header));
+    return true;
+}
+
+void TraceFileWriter::fail(const char *message) {
+    std::cerr << message << ", dropping the rest of the trace\n";
+    write_failed = true;
+    if (window) {
+        munmap(window, window_size);
+        window = nullptr;
+    }
+}
+
+// Makes the next bytes writable through the window; false once the writer has failed
+bool TraceFileWriter::reserve(size_t bytes) {
+    if (write_failed) {
+        return false;
+    }
+    if (window && offset + bytes <= window_offset + window_size) {
+        return true;
+    }
+    if (window) {
+        munmap(window, window_size);
+        window = nullptr;
+    }
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    window_offset = offset & ~(page_size - 1);
+    window_size = TRACE_MAP_WINDOW;
+    while (window_offset + window_size < offset + bytes) {
+        window_size += TRACE_MAP_WINDOW;
+    }
+
+    // Pages of the window beyond the end of the file would raise SIGBUS when written
+    if (window_offset + window_size > file_size) {
+        if (ftruncate(fd, (off_t)(window_offset + window_size)) != 0) {
+            fail("Failed to grow trace file");
+            return false;
+        }
+        file_size = window_offset + window_size;
+    }
+
+    void *mapped = mmap(nullptr, window_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)window_offset);
+    if (mapped == MAP_FAILED) {
+        fail("Failed to map trace file");
+        return false;
+    }
+    window = static_cast<uint8_t *>(mapped);
+    return true;
+}
+
+// Only called for bytes reserved before
+void TraceFileWriter::append(const void *data, size_t size) {
+    if (size == 0 || !window) {
+        return;
+    }
+    std::memcpy(window + (offset - window_offset), data, size);
+    offset += size;
+}
+
+bool TraceFileWriter::write_block(uint32_t type, uint32_t thread_id,
+                                  const void *data, size_t size,
+                                  const void *extra, size_t extra_size) {
+    // The whole block is reserved first, so a failure never leaves half a block
+    TraceBlockHeader header{type, thread_id, size + extra_size};
+    if (fd < 0 || !reserve(sizeof(header) + size + extra_size)) {
+        return false;
+    }
+    append(&header, sizeof(header));
+    append(data, size);
+    append(extra, extra_size);
+    return true;
+}
+
+void TraceFileWriter::close() {
+    if (fd < 0) {
+        return;
+    }
+    if (window) {
+        munmap(window, window_size);
+        window = nullptr;
+    }
+    if (ftruncate(fd, (off_t)offset) != 0) {
+        std::cerr << "Failed to trim trace file\n";
+    }
+    ::close(fd);
+    fd = -1;
+}
@@ -0,0 +1,51 @@
+#ifndef TRACE_FILE_H
+#define TRACE_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "trace_format.h"
+
+/**
+ * @brief Appends blocks to a trace file through a sliding mmap window.
+ *
+ * The file is grown in large steps with ftruncate and the window is remapped
+ * whenever a block would run past it, so each write is a memcpy into the page
+ * cache. close() trims the file back to the bytes actually written.
+ *
+ * If the file cannot be grown or mapped, the writer reports it once and
+ * drops every later block, so the file ends with the last complete block and
+ * stays readable.
+ */
+class TraceFileWriter {
+public:
+    ~TraceFileWriter();
+
+    bool open(const std::string &path, uint32_t record_size);
+    bool is_open() const { return fd >= 0; }
+    bool failed() const { return write_failed; }
+
+    // Writes a block whose payload is the concatenation of two byte ranges,
+    // which lets callers write a wrapped ring buffer without copying it first.
+    // Returns false if the block was dropped.
+    bool write_block(uint32_t type, uint32_t thread_id,
+                     const void *data, size_t size,
+                     const void *extra = nullptr, size_t extra_size = 0);
+
+    void close();
+
+private:
+    bool reserve(size_t bytes);
+    void append(const void *data, size_t size);
+    void fail(const char *message);
+
+    int fd = -1;
+    uint8_t *window = nullptr;
+    size_t window_offset = 0;   // file offset of window[0], page aligned
+    size_t window_size = 0;
+    size_t file_size = 0;       // bytes of the file currently allocated
+    size_t offset = 0;          // logical end of the written data
+    bool write_failed = false;
+};
+
+#endif // TRACE_FILE_H
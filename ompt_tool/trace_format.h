@@ -0,0 +1,93 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <cstdint>
+
+// On-disk layout of logs/trace.compass, shared by the tool's writer and the
+// reader library.
+//
+//   TraceFileHeader
+//   TraceBlockHeader + payload
+//   TraceBlockHeader + payload
+//   ...
+//
+// Blocks can be skipped without being understood, so newer writers can add
+// block types that older readers ignore. All integers are little-endian.
+
+constexpr char TRACE_MAGIC[8] = {'C', 'O', 'M', 'P', 'A', 'S', 'S', 'T'};
+constexpr uint32_t TRACE_FORMAT_VERSION = 1;
+constexpr const char *TRACE_FILE_NAME = "logs/trace.compass";
+
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;   // sizeof(TraceFileHeader), the first block starts here
+    uint32_t record_size;   // sizeof(TraceRecord)
+    uint32_t reserved;
+};
+
+static_assert(sizeof(TraceFileHeader) == 24, "TraceFileHeader layout changed");
+
+enum TraceBlockType : uint32_t {
+    // "key=value\n" lines describing the trace (record layout, clock, ...)
+    TRACE_BLOCK_META = 1,
+    // Repeated (uint64_t key, uint32_t length, char bytes[length]) entries.
+    // Keys are code pointers or interned string ids. A code pointer maps to
+    // "module+0xoffset\tfunction\tfile:line", with empty fields when unknown.
+    TRACE_BLOCK_STRINGS = 2,
+    // A chunk of TraceRecords written by a single thread
+    TRACE_BLOCK_EVENTS = 3,
+    // A chunk of ScopeRecords written by a single application thread
+    TRACE_BLOCK_SCOPES = 4
+};
+
+struct TraceBlockHeader {
+    uint32_t type;
+    uint32_t thread_id;
+    uint64_t size;          // payload bytes following this header
+};
+
+static_assert(sizeof(TraceBlockHeader) == 16, "TraceBlockHeader layout changed");
+
+// Field layout of TraceRecord, stored in the META block under "record_fields"
+// so external readers can decode records without this header.
+constexpr const char *TRACE_RECORD_FIELDS =
+    "event:u16,thread_id:u16,kind:u32,endpoint:u32,flags:u32,time:u64,codeptr_ra:u64,"
+    "parallel_id:u64,task_id:u64,aux_id:u64,value:u64";
+
+// Scopes recorded by COMPASS_SCOPE in the application (see compass.h) go to
+// their own file in the same layout: META and STRINGS blocks, where the keys
+// are the interned name ids, and SCOPES blocks.
+constexpr const char *SCOPE_FILE_NAME = "logs/scopes.compass";
+
+// Begin or end of a named scope on one thread. time is in the same ticks as
+// TraceRecord::time, so scopes line up with the OMPT events of the trace.
+//
+// Metric samples (endpoint SCOPE_COUNTER or SCOPE_GAUGE) follow the record
+// they were taken at, a scope begin or end or a SCOPE_SAMPLE, and share its time. They hold the thread's counter total
+// or the bits of its double gauge value in place of the time, and the metric
+// id in name_id; metric names are stored under SCOPE_METRIC_KEY(id).
+struct ScopeRecord {
+    uint64_t time;
+    uint32_t name_id;
+    uint16_t thread_id;
+    uint16_t endpoint;
+};
+
+enum ScopeEndpoint : uint16_t {
+    SCOPE_BEGIN = 1,        // ompt_scope_begin
+    SCOPE_END = 2,          // ompt_scope_end
+    SCOPE_COUNTER = 3,
+    SCOPE_GAUGE = 4,
+    SCOPE_SAMPLE = 5        // only a time for the metric samples after it
+};
+
+constexpr uint64_t SCOPE_METRIC_KEY(uint32_t id) {
+    return (1ull << 32) | id;
+}
+
+static_assert(sizeof(ScopeRecord) == 16, "ScopeRecord layout changed");
+
+constexpr const char *SCOPE_RECORD_FIELDS = "time:u64,name_id:u32,thread_id:u16,endpoint:u16";
+
+#endif // TRACE_FORMAT_H
@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <omp-tools.h>
+#include "helper.h"
+#include "trace_reader.h"
+
+// Consumed event data is handed back to the kernel in steps of this size
+constexpr size_t TRACE_RELEASE_STEP = 64 << 20;
+
+TraceReader::~TraceReader() {
+    close();
+}
+
+bool TraceReader::open(const std::string &path) {
+    close();
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Failed to open trace file " << path << "\n";
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TraceFileHeader)) {
+        std::cerr << "Trace file " << path << " is too small\n";
+        close();
+        return false;
+    }
+    data_size = (size_t)st.st_size;
+
+    void *mapped = mmap(nullptr, data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Failed to map trace file " << path << "\n";
+        data = nullptr;
+        close();
+        return false;
+    }
+    data = static_cast<const uint8_t *>(mapped);
+    madvise(mapped, data_size, MADV_SEQUENTIAL);
+
+    file_header = reinterpret_cast<const TraceFileHeader *>(data);
+    if (std::memcmp(file_header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        std::cerr << path << " is not a compass trace\n";
+        close();
+        return false;
+    }
+    if (file_header->version > TRACE_FORMAT_VERSION) {
+        std::cerr << path << " has trace format version " << file_header->version
+                  << ", newer than the supported version " << TRACE_FORMAT_VERSION << "\n";
+        close();
+        return false;
+    }
+
+    index_blocks();
+    rewind();
+    return true;
+}
+
+void TraceReader::close() {
+    if (data) {
+        munmap(const_cast<uint8_t *>(data), data_size);
+        data = nullptr;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    file_header = nullptr;
+    data_size = 0;
+    meta_values.clear();
+    strings.clear();
+}
+
+// Walks the block headers once to load metadata and string tables. Event
+// payloads are skipped, so this touches only a small part of the file.
+void TraceReader::index_blocks() {
+    rewind();
+    TraceBlock block;
+    while (next_block(block)) {
+        if (block.type == TRACE_BLOCK_META) {
+            std::string text(reinterpret_cast<const char *>(block.data), block.size);
+            size_t start = 0;
+            while (start < text.size()) {
+                size_t end = text.find('\n', start);
+                if (end == std::string::npos) {
+                    end = text.size();
+                }
+                std::string line = text.substr(start, end - start);
+                size_t equals = line.find('=');
+                if (equals != std::string::npos) {
+                    meta_values[line.substr(0, equals)] = line.substr(equals + 1);
+                }
+                start = end + 1;
+            }
+        } else if (block.type == TRACE_BLOCK_STRINGS) {
+            size_t pos = 0;
+            while (pos + sizeof(uint64_t) + sizeof(uint32_t) <= block.size) {
+                uint64_t key;
+                uint32_t length;
+                std::memcpy(&key, block.data + pos, sizeof(key));
+                std::memcpy(&length, block.data + pos + sizeof(key), sizeof(length));
+                pos += sizeof(key) + sizeof(length);
+                if (pos + length > block.size) {
+                    break;
+                }
+                strings[key] = std::string(reinterpret_cast<const char *>(block.data + pos), length);
+                pos += length;
+            }
+        }
+    }
+}
+
+const char *TraceReader::lookup_string(uint64_t key) const {
+    auto it = strings.find(key);
+    return it == strings.end() ? nullptr : it->second.c_str();
+}
+
+bool TraceReader::next_block(TraceBlock &block) {
+    if (!data || next_block_offset + sizeof(TraceBlockHeader) > data_size) {
+        return false;
+    }
+    TraceBlockHeader header;
+    std::memcpy(&header, data + next_block_offset, sizeof(header));
+    size_t payload = next_block_offset + sizeof(header);
+    if (header.size > data_size - payload) {
+        std::cerr << "Trace file is truncated, ignoring the last block\n";
+        next_block_offset = data_size;
+        return false;
+    }
+
+    block.type = header.type;
+    block.thread_id = header.thread_id;
+    block.data = data + payload;
+    block.size = header.size;
+    next_block_offset = payload + header.size;
+    return true;
+}
+
+void TraceReader::release_consumed(size_t upto) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    upto &= ~(page_size - 1);
+    if (upto < released_offset + TRACE_RELEASE_STEP) {
+        return;
+    }
+    madvise(const_cast<uint8_t *>(data) + released_offset, upto - released_offset, MADV_DONTNEED);
+    released_offset = upto;
+}
+
+// Copies records out of the blocks of one type. Records of a different size,
+// written by a different version of the tool, have their common prefix copied.
+size_t TraceReader::read_records(uint32_t block_type, void *out, size_t out_record_size, size_t max) {
+    size_t record_size = file_header ? file_header->record_size : 0;
+    if (record_size == 0) {
+        return 0;
+    }
+
+    uint8_t *target = static_cast<uint8_t *>(out);
+    size_t copied = 0;
+    while (copied < max) {
+        if (current_event == current_event_count) {
+            TraceBlock block;
+            do {
+                if (!next_block(block)) {
+                    return copied;
+                }
+            } while (block.type != block_type);
+            current_events = block;
+            current_event = 0;
+            current_event_count = block.size / record_size;
+            release_consumed(block.data - data);
+            continue;
+        }
+
+        size_t count = std::min(max - copied, current_event_count - current_event);
+        const uint8_t *source = current_events.data + current_event * record_size;
+        if (record_size == out_record_size) {
+            std::memcpy(target + copied * out_record_size, source, count * out_record_size);
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                uint8_t *record = target + (copied + i) * out_record_size;
+                std::memset(record, 0, out_record_size);
+                std::memcpy(record, source + i * record_size, std::min(record_size, out_record_size));
+            }
+        }
+        copied += count;
+        current_event += count;
+    }
+    return copied;
+}
+
+size_t TraceReader::read_events(TraceRecord *out, size_t max) {
+    return read_records(TRACE_BLOCK_EVENTS, out, sizeof(TraceRecord), max);
+}
+
+size_t TraceReader::read_scopes(ScopeRecord *out, size_t max) {
+    return read_records(TRACE_BLOCK_SCOPES, out, sizeof(ScopeRecord), max);
+}
+
+void TraceReader::rewind() {
+    next_block_offset = file_header ? file_header->header_size : 0;
+    released_offset = 0;
+    current_event = current_event_count = 0;
+}
+
+// C interface used by the Python bindings in visualization/trace_reader.py
+
+extern "C" {
+
+void *compass_trace_open(const char *path) {
+    TraceReader *reader = new TraceReader();
+    if (!reader->open(path)) {
+        delete reader;
+        return nullptr;
+    }
+    return reader;
+}
+
+void compass_trace_close(void *handle) {
+    delete static_cast<TraceReader *>(handle);
+}
+
+size_t compass_trace_read(void *handle, TraceRecord *out, size_t max) {
+    return static_cast<TraceReader *>(handle)->read_events(out, max);
+}
+
+size_t compass_trace_read_scopes(void *handle, ScopeRecord *out, size_t max) {
+    return static_cast<TraceReader *>(handle)->read_scopes(out, max);
+}
+
+void compass_trace_rewind(void *handle) {
+    static_cast<TraceReader *>(handle)->rewind();
+}
+
+const char *compass_trace_meta(void *handle, const char *key) {
+    const auto &meta = static_cast<TraceReader *>(handle)->meta();
+    auto it = meta.find(key);
+    return it == meta.end() ? nullptr : it->second.c_str();
+}
+
+const char *compass_trace_string(void *handle, uint64_t key) {
+    return static_cast<TraceReader *>(handle)->lookup_string(key);
+}
+
+// Returns the same names the text logs use for the kind field of an event
+const char *compass_trace_kind_name(uint16_t event, uint32_t kind) {
+    static thread_local std::string name;
+    switch (event) {
+        case TRACE_THREAD_CREATE:
+            name = ompt_thread_t_to_string((ompt_thread_t)kind);
+            break;
+        case TRACE_WORK:
+            name = ompt_work_t_to_string((ompt_work_t)kind);
+            break;
+        case TRACE_TASK_SCHEDULE:
+            name = ompt_task_status_t_to_string((ompt_task_status_t)kind);
+            break;
+        case TRACE_SYNC_REGION:
+        case TRACE_SYNC_REGION_WAIT:
+            name = ompt_sync_region_t_to_string((ompt_sync_region_t)kind);
+            break;
+        case TRACE_MUTEX_ACQUIRE:
+        case TRACE_MUTEX_ACQUIRED:
+        case TRACE_MUTEX_RELEASED:
+            name = ompt_mutex_t_to_string((ompt_mutex_t)kind);
+            break;
+        case TRACE_TASK_DEPENDENCES:
+            name = ompt_dependence_type_t_to_string((ompt_dependence_type_t)kind);
+            break;
+        default:
+            name = std::to_string(kind);
+            break;
+    }
+    return name.c_str();
+}
+
+const char *compass_trace_endpoint_name(uint32_t endpoint) {
+    static thread_local std::string name;
+    name = ompt_scope_endpoint_t_to_string((ompt_scope_endpoint_t)endpoint);
+    return name.c_str();
+}
+
+}
@@ -0,0 +1,70 @@
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include "trace_buffer.h"
+#include "trace_format.h"
+
+struct TraceBlock {
+    uint32_t type;
+    uint32_t thread_id;
+    const uint8_t *data;
+    uint64_t size;
+};
+
+/**
+ * @brief Streams a trace file written by the OMPT tool.
+ *
+ * The file is mapped read-only and only block headers, metadata and string
+ * tables are parsed on open. Event blocks are visited lazily, and pages that
+ * have been consumed are released again, so traces larger than memory can be
+ * read front to back.
+ */
+class TraceReader {
+public:
+    ~TraceReader();
+
+    bool open(const std::string &path);
+    void close();
+
+    const TraceFileHeader &header() const { return *file_header; }
+    const std::unordered_map<std::string, std::string> &meta() const { return meta_values; }
+
+    // Returns nullptr if the key is not in any string table of the trace
+    const char *lookup_string(uint64_t key) const;
+
+    // Visits blocks in file order. Returns false at the end of the file.
+    bool next_block(TraceBlock &block);
+
+    // Copies up to max event records into out, continuing where the previous
+    // call stopped. Returns 0 at the end of the trace.
+    size_t read_events(TraceRecord *out, size_t max);
+
+    // The same for the ScopeRecords of a scope file (SCOPE_FILE_NAME)
+    size_t read_scopes(ScopeRecord *out, size_t max);
+
+    void rewind();
+
+private:
+    void index_blocks();
+    void release_consumed(size_t upto);
+    size_t read_records(uint32_t block_type, void *out, size_t out_record_size, size_t max);
+
+    int fd = -1;
+    const uint8_t *data = nullptr;
+    size_t data_size = 0;
+    const TraceFileHeader *file_header = nullptr;
+    std::unordered_map<std::string, std::string> meta_values;
+    std::unordered_map<uint64_t, std::string> strings;
+
+    size_t next_block_offset = 0;
+    size_t released_offset = 0;
+    TraceBlock current_events{};
+    size_t current_event = 0;
+    size_t current_event_count = 0;
+};
+
+#endif // TRACE_READER_H
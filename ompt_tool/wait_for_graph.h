@@ -0,0 +1,357 @@
+#ifndef WAIT_FOR_GRAPH_H
+#define WAIT_FOR_GRAPH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <omp-tools.h>
+
+enum NodeKind : uint32_t {
+    NODE_BARRIER,
+    NODE_THREAD,
+    NODE_LOCK,
+    NODE_CRITICAL,
+    NODE_MUTEX
+};
+
+inline const char *const node_kind_prefixes[] = {"Barrier", "Thread: ", "Lock: ", "Critical: ", "Mutex: "};
+
+constexpr uint32_t NO_NODE = UINT32_MAX;
+
+inline NodeKind mutex_node_kind(ompt_mutex_t kind) {
+    switch (kind) {
+        case ompt_mutex_lock:
+        case ompt_mutex_test_lock:
+        case ompt_mutex_nest_lock:
+        case ompt_mutex_test_nest_lock:
+            return NODE_LOCK;
+        case ompt_mutex_critical:
+            return NODE_CRITICAL;
+        default:
+            return NODE_MUTEX;
+    }
+}
+
+// Targets of one node's edges. Up to INLINE_EDGES are stored in place; a
+// thread waits on one mutex and a mutex is held by one thread, so only the
+// barrier node, which points at every thread, normally moves to the heap.
+class EdgeList {
+private:
+    static constexpr uint32_t INLINE_EDGES = 3;
+    uint32_t inlineEdges[INLINE_EDGES];
+    uint32_t count = 0;
+    bool onHeap = false;
+    std::vector<uint32_t> heapEdges;
+
+public:
+    const uint32_t *begin() const { return onHeap ? heapEdges.data() : inlineEdges; }
+    const uint32_t *end() const { return begin() + count; }
+
+    bool contains(uint32_t node) const {
+        return std::find(begin(), end(), node) != end();
+    }
+
+    bool insert(uint32_t node) {
+        if (contains(node)) {
+            return false;
+        }
+        if (!onHeap && count == INLINE_EDGES) {
+            heapEdges.assign(inlineEdges, inlineEdges + count);
+            onHeap = true;
+        }
+        if (onHeap) {
+            heapEdges.push_back(node);
+        } else {
+            inlineEdges[count] = node;
+        }
+        count++;
+        return true;
+    }
+
+    // Order is not kept: the last target takes the removed one's place
+    bool erase(uint32_t node) {
+        uint32_t *edges = onHeap ? heapEdges.data() : inlineEdges;
+        for (uint32_t i = 0; i < count; i++) {
+            if (edges[i] == node) {
+                edges[i] = edges[count - 1];
+                count--;
+                if (onHeap) {
+                    heapEdges.pop_back();
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Open-addressing map from a mutex's kind and wait id to its node id. Lookups
+// of known mutexes never allocate; the table only grows when it is half full.
+class WaitIdMap {
+private:
+    struct Slot {
+        ompt_wait_id_t wait_id;
+        uint32_t kind;
+        uint32_t node;          // NO_NODE for an empty slot
+    };
+    std::vector<Slot> slots = std::vector<Slot>(64, Slot{0, 0, NO_NODE});
+    size_t used = 0;
+
+    static size_t hash(NodeKind kind, ompt_wait_id_t wait_id) {
+        uint64_t h = (wait_id ^ ((uint64_t)kind << 60)) * 0x9E3779B97F4A7C15ull;
+        return (size_t)(h ^ (h >> 32));
+    }
+
+    void grow() {
+        std::vector<Slot> old(slots.size() * 2, Slot{0, 0, NO_NODE});
+        old.swap(slots);
+        for (const Slot &slot : old) {
+            if (slot.node != NO_NODE) {
+                size_t mask = slots.size() - 1;
+                size_t i = hash((NodeKind)slot.kind, slot.wait_id) & mask;
+                while (slots[i].node != NO_NODE) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = slot;
+            }
+        }
+    }
+
+public:
+    // Returns the node of (kind, wait_id), or stores and returns newNode if
+    // there is none yet
+    uint32_t findOrInsert(NodeKind kind, ompt_wait_id_t wait_id, uint32_t newNode) {
+        size_t mask = slots.size() - 1;
+        size_t i = hash(kind, wait_id) & mask;
+        while (slots[i].node != NO_NODE) {
+            if (slots[i].wait_id == wait_id && slots[i].kind == kind) {
+                return slots[i].node;
+            }
+            i = (i + 1) & mask;
+        }
+        slots[i] = Slot{wait_id, kind, newNode};
+        if (++used * 2 > slots.size()) {
+            grow();
+        }
+        return newNode;
+    }
+};
+
+// Wait-for graph over dense node ids. Threads are indexed directly by their
+// thread number and mutexes are interned through a WaitIdMap.
+//
+// Every change is appended to a line-based log instead of rewriting the whole
+// graph, one record per line:
+//   N <node> <name>          name of a new node
+//   + <event> <from> <to>    edge added while processing event
+//   - <event> <from> <to>    edge removed while processing event
+//   S <event> <edges>        snapshot after event, followed by one
+//                            "<from> <to>" line per edge
+//   C <event> <node>...      deadlock cycle found after event
+// graph_dl_detector.py replays it to rebuild the graph at any event.
+class DirectedGraph {
+private:
+    struct Node {
+        NodeKind kind;
+        uint64_t value;         // thread number or wait id
+    };
+    std::vector<Node> nodes;
+    std::vector<EdgeList> edges;
+    std::vector<uint32_t> threadNodes;
+    WaitIdMap waitNodes;
+    std::vector<uint32_t> currentCycle;
+    // Edges added since the last hasCycle() call
+    std::vector<std::pair<uint32_t, uint32_t>> newEdges;
+
+    // Search state reused across calls. parent[node] is only valid while
+    // visitMark[node] equals visitEpoch, so nothing is cleared between searches.
+    std::vector<uint32_t> parent;
+    std::vector<uint32_t> visitMark;
+    uint32_t visitEpoch = 0;
+    std::vector<uint32_t> searchStack;
+
+    std::ostream& log;
+    uint64_t event = 0;
+
+    uint32_t addNode(NodeKind kind, uint64_t value) {
+        uint32_t node = (uint32_t)nodes.size();
+        nodes.push_back({kind, value});
+        edges.emplace_back();
+        parent.push_back(NO_NODE);
+        visitMark.push_back(0);
+
+        log << "N " << node << ' ';
+        writeName(log, node);
+        log << '\n';
+        return node;
+    }
+
+    bool visit(uint32_t node, uint32_t from) {
+        if (visitMark[node] == visitEpoch) {
+            return false;
+        }
+        visitMark[node] = visitEpoch;
+        parent[node] = from;
+        return true;
+    }
+
+    // Looks for a path from the target of a new edge back to its source. The
+    // graph was acyclic before the edge was added, so any new cycle has to
+    // close through it, and only nodes reachable from its target are visited.
+    bool findCycleThrough(uint32_t fromNode, uint32_t toNode) {
+        if (++visitEpoch == 0) {
+            std::fill(visitMark.begin(), visitMark.end(), 0);
+            visitEpoch = 1;
+        }
+        searchStack.clear();
+        visit(toNode, fromNode);
+        searchStack.push_back(toNode);
+
+        while (!searchStack.empty()) {
+            uint32_t node = searchStack.back();
+            searchStack.pop_back();
+            if (node == fromNode) {
+                // Walk the parents back to reconstruct fromNode -> toNode -> ... -> fromNode
+                currentCycle.clear();
+                currentCycle.push_back(fromNode);
+                for (uint32_t current = parent[fromNode]; current != fromNode; current = parent[current]) {
+                    currentCycle.push_back(current);
+                }
+                currentCycle.push_back(fromNode);
+                std::reverse(currentCycle.begin() + 1, currentCycle.end() - 1);
+                return true;
+            }
+
+            for (uint32_t neighbor : edges[node]) {
+                if (visit(neighbor, node)) {
+                    searchStack.push_back(neighbor);
+                }
+            }
+        }
+        return false;
+    }
+
+public:
+    void writeName(std::ostream& out, uint32_t node) const {
+        out << node_kind_prefixes[nodes[node].kind];
+        if (nodes[node].kind != NODE_BARRIER) {
+            out << nodes[node].value;
+        }
+    }
+
+    explicit DirectedGraph(std::ostream& log) : log(log) {
+        addNode(NODE_BARRIER, 0);
+    }
+
+    // Index of the event being processed, recorded with every edge change
+    void beginEvent(uint64_t index) {
+        event = index;
+    }
+
+    uint32_t barrierNode() const {
+        return 0;
+    }
+
+    size_t nodeCount() const {
+        return nodes.size();
+    }
+
+    NodeKind kind(uint32_t node) const {
+        return nodes[node].kind;
+    }
+
+    // Node of an OpenMP thread, added on first use
+    uint32_t threadNode(uint64_t thread_id) {
+        if (thread_id >= threadNodes.size()) {
+            threadNodes.resize(thread_id + 1, NO_NODE);
+        }
+        if (threadNodes[thread_id] == NO_NODE) {
+            threadNodes[thread_id] = addNode(NODE_THREAD, thread_id);
+        }
+        return threadNodes[thread_id];
+    }
+
+    // Node of a mutex, added on first use
+    uint32_t mutexNode(ompt_mutex_t kind, ompt_wait_id_t wait_id) {
+        NodeKind nodeKind = mutex_node_kind(kind);
+        uint32_t node = waitNodes.findOrInsert(nodeKind, wait_id, (uint32_t)nodes.size());
+        if (node == nodes.size()) {
+            addNode(nodeKind, wait_id);
+        }
+        return node;
+    }
+
+    // Add a directed edge from node1 to node2
+    void addEdge(uint32_t fromNode, uint32_t toNode) {
+        // Ensure both nodes exist
+        if (fromNode >= nodes.size() || toNode >= nodes.size()) {
+            throw std::invalid_argument("One or both nodes do not exist in the graph.");
+        }
+        if (edges[fromNode].insert(toNode)) {
+            newEdges.emplace_back(fromNode, toNode);
+            log << "+ " << event << ' ' << fromNode << ' ' << toNode << '\n';
+        }
+    }
+
+    // Remove a directed edge from node1 to node2
+    void removeEdge(uint32_t fromNode, uint32_t toNode) {
+        if (fromNode < nodes.size() && edges[fromNode].erase(toNode)) {
+            log << "- " << event << ' ' << fromNode << ' ' << toNode << '\n';
+        }
+    }
+
+    // Write every edge, so the log can be replayed from here
+    void snapshot() const {
+        size_t edgeCount = 0;
+        for (const EdgeList& targets : edges) {
+            edgeCount += targets.end() - targets.begin();
+        }
+        log << "S " << event << ' ' << edgeCount << '\n';
+        for (uint32_t node = 0; node < nodes.size(); node++) {
+            for (uint32_t neighbor : edges[node]) {
+                log << node << ' ' << neighbor << '\n';
+            }
+        }
+    }
+
+    bool hasEdge(uint32_t fromNode, uint32_t toNode) const {
+        if (fromNode >= nodes.size() || toNode >= nodes.size()) {
+            return false;
+        }
+        return edges[fromNode].contains(toNode);
+    }
+
+    // Checks only the edges added since the previous call; removing edges
+    // never creates a cycle
+    bool hasCycle() {
+        currentCycle.clear();
+        bool found = false;
+
+        for (const auto& [fromNode, toNode] : newEdges) {
+            if (hasEdge(fromNode, toNode) && findCycleThrough(fromNode, toNode)) {
+                found = true;
+                break;
+            }
+        }
+        newEdges.clear();
+        return found;
+    }
+
+    // Nodes of the cycle found by the last hasCycle(), the first one repeated at the end
+    const std::vector<uint32_t>& cycle() const {
+        return currentCycle;
+    }
+
+    void writeCycle() const {
+        log << "C " << event;
+        for (uint32_t node : currentCycle) {
+            log << ' ' << node;
+        }
+        log << '\n';
+    }
+};
+
+#endif // WAIT_FOR_GRAPH_H
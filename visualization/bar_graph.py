@@ -7,6 +7,7 @@ import os
 import uuid
 from enum import Enum
 import plotly.express as px
+import csv
 from collections import defaultdict
 from diagram import *
 
@@ -17,6 +18,13 @@ def convert_from_micro_to_milli(d: dict):
             for key3 in d[key1][key2]:
                 d[key1][key2][key3] = round(d[key1][key2][key3] / 1000, 3)
 
+def events_between(events: list, first_event, last_event) -> list:
+    """ Events from first_event to last_event inclusive. Selected by position, since
+    events of neighbouring regions can share a microsecond timestamp. """
+    start = next(i for i, event in enumerate(events) if event is first_event)
+    end = next(i for i, event in enumerate(events) if event is last_event)
+    return events[start:end + 1]
+
 def get_time_spent_by_section(thread_num_to_events: dict):
     """ 
     Calculates the time spent synchronizing by each thread in different sections within each parallel section.
@@ -89,9 +97,7 @@ def get_time_spent_by_section(thread_num_to_events: dict):
             events = thread_num_to_events[thread]
             prev_event = None
 
-            for event in events:
-                if not (first_event.time <= event.time <= last_event.time):
-                    continue
+            for event in events_between(events, first_event, last_event):
                 if isinstance(event, MutexAcquireEvent) and event.kind == "ompt_mutex_critical":
                     assert(prev_event == None)
                     prev_event = event
@@ -150,10 +156,17 @@ def get_time_spent_by_section(thread_num_to_events: dict):
     
     return sections
 
-def get_time_spent_by_task(thread_num_to_events: dict):
+def running_task(event):
+    """ Task that starts running at an implicit task begin or task schedule event. """
+    return event.task_number if isinstance(event, ImplicitTaskEvent) else event.next_task_data
+
+def get_time_spent_by_task(thread_num_to_events: dict, sampled: bool = False):
     """ 
     Calculates the time spent in each task by each thread in different sections within each parallel section.
 
+    With a sampled trace only switches to and from sampled tasks are recorded, so the
+    time of an unsampled task is charged to the task that was last seen starting.
+
     Returns a dictionary in the following format:
     {
         'Parallel Section 1': {
@@ -214,23 +227,21 @@ def get_time_spent_by_task(thread_num_to_events: dict):
             stack = []
             prev_custom_callback = {}
 
-            for event in events:
-                if not (first_event.time <= event.time <= last_event.time):
-                    continue
+            for event in events_between(events, first_event, last_event):
                 if isinstance(event, ImplicitTaskEvent) and event.endpoint == "ompt_scope_begin":
                     stack.append(event)
                 elif isinstance(event, ImplicitTaskEvent) and event.endpoint == "ompt_scope_end":
                     prev_event = stack.pop()
-                    assert((isinstance(prev_event, ImplicitTaskEvent) and prev_event.task_number == event.task_number) \
+                    assert(sampled or (isinstance(prev_event, ImplicitTaskEvent) and prev_event.task_number == event.task_number) \
                         or (isinstance(prev_event, TaskScheduleEvent) and prev_event.next_task_data == event.task_number))
-                    sections[f"Parallel id: {parallel_id}"][thread]["Task " + str(event.task_number)] += event.time - prev_event.time
+                    sections[f"Parallel id: {parallel_id}"][thread]["Task " + str(running_task(prev_event))] += event.time - prev_event.time
                 elif isinstance(event, TaskScheduleEvent):
                     # Task Schedule Event is essentially an end TaskEvent and then a start TaskEvent
                     prev_event = stack.pop()
                         
-                    assert((isinstance(prev_event, ImplicitTaskEvent) and prev_event.task_number == event.prior_task_data) \
+                    assert(sampled or (isinstance(prev_event, ImplicitTaskEvent) and prev_event.task_number == event.prior_task_data) \
                         or (isinstance(prev_event, TaskScheduleEvent) and prev_event.next_task_data == event.prior_task_data))
-                    sections[f"Parallel id: {parallel_id}"][thread]["Task " + str(event.prior_task_data)] += event.time - prev_event.time
+                    sections[f"Parallel id: {parallel_id}"][thread]["Task " + str(running_task(prev_event))] += event.time - prev_event.time
                     
                     stack.append(event)
                 elif isinstance(event, CustomEventStart):
@@ -259,7 +270,41 @@ def get_time_spent_by_task(thread_num_to_events: dict):
     return sections
                     
                     
-def create_stacked_bar_chart(parallel_sections_data, sections):
+def read_task_sampling_scale(folder_name: str) -> float:
+    """ Ratio of created to recorded explicit tasks, 1.0 for unsampled or text traces. """
+    path = os.path.join(folder_name, TRACE_FILE_NAME)
+    if not os.path.exists(path):
+        return 1.0
+    with CompassTrace(path) as trace:
+        return trace.sampling_scale(TRACE_EVENT_NAMES.index("Task Create"))
+
+def rescale_sampled_tasks(parallel_sections_data: dict, thread_num_to_events: dict, scale: float):
+    """
+    Scales explicit task time measured on the sampled tasks up to all tasks.
+
+    The estimated time of the unsampled tasks is shown as its own section and taken
+    out of the implicit tasks, which were charged with it while the trace was parsed.
+    """
+    implicit_tasks = {"Task " + str(event.task_number)
+                      for events in thread_num_to_events.values()
+                      for event in events if isinstance(event, ImplicitTaskEvent)}
+    for section_name, thread_data in parallel_sections_data.items():
+        if not section_name.startswith("Parallel id"):
+            continue
+        for thread, tasks in thread_data.items():
+            implicit_time = sum(t for task, t in tasks.items() if task in implicit_tasks)
+            explicit_time = sum(t for task, t in tasks.items() if task not in implicit_tasks)
+            estimate = min(explicit_time * (scale - 1), implicit_time)
+            if estimate <= 0:
+                continue
+            for task in tasks:
+                if task in implicit_tasks:
+                    tasks[task] -= estimate * tasks[task] / implicit_time
+            tasks["Unsampled Tasks (estimated)"] = estimate
+
+def create_stacked_bar_chart(parallel_sections_data, sections,
+                             title='Time Spent by Threads in Different Sections in Parallel Regions',
+                             yaxis_title='Time Spent (ms)'):
     """
     Creates and displays a stacked bar chart using Plotly for each parallel section.
 
@@ -301,7 +346,7 @@ def create_stacked_bar_chart(parallel_sections_data, sections):
                 hovertemplate=(
                     'Thread: %{x}<br>' +
                     'Section: ' + str(section) + '<br>' +
-                    'Time Spent: %{y}<extra></extra>'
+                    yaxis_title + ': %{y}<extra></extra>'
                 ),
                 showlegend=(pos == 0),  # Show legend only for the first subplot
                 legendgroup=section  # Group traces by section for synchronized toggling
@@ -309,19 +354,65 @@ def create_stacked_bar_chart(parallel_sections_data, sections):
 
     fig.update_layout(
         barmode='stack',
-        title='Time Spent by Threads in Different Sections in Parallel Regions',
+        title=title,
         xaxis_title='Threads',
-        yaxis_title='Time Spent (ms)',
+        yaxis_title=yaxis_title,
         legend_title='Sections'
     )
 
     # Show the plot
     fig.show()
 
+# Columns of logs/summary.csv (ompt_tool/aggregate.cpp) and the matching get_time_spent_by_section sections
+SUMMARY_SECTIONS = {
+    "working_ns": "Working",
+    "critical_wait_ns": "Critical",
+    "lock_wait_ns": "Lock",
+    "implicit_barrier_ns": "Implicit Barrier",
+    "barrier_ns": "Barrier",
+    "taskgroup_ns": "Task Group",
+    "taskwait_ns": "Task Wait",
+}
+
+def read_summary(file_name: str):
+    """
+    Reads the summary written by the tool's aggregation mode (COMPASS_PROFILE=summary)
+    into the format returned by get_time_spent_by_section, in milliseconds.
+    """
+    sections = defaultdict(lambda : defaultdict(lambda : defaultdict(int)))
+    with open(file_name, "r") as f:
+        for row in csv.DictReader(f):
+            thread = int(row["thread"])
+            for column, section in SUMMARY_SECTIONS.items():
+                sections[f"Parallel id: {row['parallel_id']}"][thread][section] = round(int(row[column]) / 1e6, 3)
+    return sections
+
+def make_summary_bar_chart():
+    parallel_sections_data = read_summary("../logs/summary.csv")
+    create_stacked_bar_chart(parallel_sections_data, set(SUMMARY_SECTIONS.values()))
+
+def read_metric_totals(file_name: str):
+    """
+    Final value of every counter and gauge per thread from the scope file written
+    by compass_counter_add/compass_value, one subplot per metric.
+    """
+    metrics = defaultdict(lambda : defaultdict(dict))
+    with CompassTrace(file_name) as scopes:
+        for (thread, name), samples in scopes.metrics().items():
+            metrics[name][thread][name] = samples[-1][1]
+    return metrics
+
+def make_metrics_bar_chart():
+    metrics = read_metric_totals("../logs/" + SCOPE_FILE_NAME)
+    create_stacked_bar_chart(metrics, set(metrics.keys()), title='Application Metrics per Thread', yaxis_title='Value')
+
 def make_task_bar_chart():
     log_folder_name = "../logs/"
     thread_num_to_events = parse_logs_for_thread_events(log_folder_name)
-    parallel_sections_data = get_time_spent_by_task(thread_num_to_events)
+    task_scale = read_task_sampling_scale(log_folder_name)
+    parallel_sections_data = get_time_spent_by_task(thread_num_to_events, sampled=task_scale > 1)
+    if task_scale > 1:
+        rescale_sampled_tasks(parallel_sections_data, thread_num_to_events, task_scale)
     convert_from_micro_to_milli(parallel_sections_data)
 
     sections = set()
@@ -334,4 +425,6 @@ def make_task_bar_chart():
 
 if __name__ == "__main__":
     # make_synchronization_bar_chart()
+    # make_summary_bar_chart()
+    # make_metrics_bar_chart()
     make_task_bar_chart()
@@ -7,6 +7,7 @@ import uuid
 import matplotlib.pyplot as plt
 import networkx as nx
 from enum import Enum, auto
+from trace_reader import CompassTrace, TraceRecord, TRACE_EVENT_NAMES, TRACE_FILE_NAME, TRACE_ID_NONE, SCOPE_FILE_NAME, SCOPE_BEGIN, SCOPE_END
 @dataclass
 class LogEvent:
     time: int
@@ -98,11 +99,25 @@ class TaskScheduleEvent(LogEvent):
 class ParallelEndEvent(LogEvent):
     parallel_id: int
 
+@dataclass
+class TaskDependencesEvent(LogEvent):
+    """ One item of a task's depend clauses """
+    task_number: int
+    dependence_type: str
+    variable: int
+
+@dataclass
+class TaskDependenceEvent(LogEvent):
+    """ A dependence edge reported by the runtime: sink may only start after source completes """
+    source_task_number: int
+    sink_task_number: int
+
 class EdgeType(Enum):
     TEMPORAL = auto()
     NESTING = auto()
     TASK = auto()
     MUTEX = auto()
+    DEPENDENCE = auto()
 
 @dataclass
 class GraphNode:
@@ -116,7 +131,9 @@ class GraphNode:
 
 # Same as diagram.py
 def parse_logs_for_thread_events(folder_name: str):
-    """ Parses text files in logs/ to return event objects for each log file (thread). """
+    """ Returns event objects for each thread, from the binary trace if the folder has one, else from the text logs. """
+    if os.path.exists(os.path.join(folder_name, TRACE_FILE_NAME)):
+        return parse_trace_for_thread_events(folder_name)
     log_files = [file for file in os.listdir(folder_name) if file.endswith(".txt")]
     sorted_log_files = sorted(log_files)  # sorted by file name (i.e., thread number)
     thread_num_to_events = {}
@@ -127,6 +144,114 @@ def parse_logs_for_thread_events(folder_name: str):
         thread_num_to_events[i] = parsed_events
     return thread_num_to_events
 
+def parse_trace_for_thread_events(folder_name: str):
+    """ Reads logs/trace.compass through the C++ reader. Custom callback events from the text logs and logs/scopes.compass are merged in. """
+    thread_num_to_events: Dict[int, List[LogEvent]] = {}
+    with CompassTrace(os.path.join(folder_name, TRACE_FILE_NAME)) as trace:
+        for record in trace.records():
+            event = create_event_from_record(trace, record)
+            thread_num_to_events.setdefault(record.thread_id, []).append(event)
+
+    # compass_trace_begin/end still write text logs from the application
+    custom_events_by_thread: Dict[int, List[LogEvent]] = {}
+    for file in os.listdir(folder_name):
+        if not (file.startswith("logs_thread_") and file.endswith(".txt")):
+            continue
+        thread_number = int(file[len("logs_thread_"):-len(".txt")])
+        with open(f"{folder_name}/{file}", "r") as f:
+            custom_events_by_thread.setdefault(thread_number, []).extend(
+                event for event in parse_log(f.read(), thread_number)
+                if isinstance(event, (CustomEventStart, CustomEventEnd)))
+
+    # COMPASS_SCOPE writes binary scope records, timed with the same clock as the trace
+    scope_path = os.path.join(folder_name, SCOPE_FILE_NAME)
+    if os.path.exists(scope_path):
+        with CompassTrace(scope_path) as scopes:
+            names: Dict[int, str] = {}
+            for record in scopes.scopes():
+                if record.endpoint not in (SCOPE_BEGIN, SCOPE_END):
+                    continue
+                if record.name_id not in names:
+                    names[record.name_id] = scopes.string(record.name_id) or str(record.name_id)
+                event_class = CustomEventStart if record.endpoint == SCOPE_BEGIN else CustomEventEnd
+                custom_events_by_thread.setdefault(record.thread_id, []).append(event_class(
+                    time=scopes.to_microseconds(record.time),
+                    event="Custom Callback Begin" if record.endpoint == SCOPE_BEGIN else "Custom Callback End",
+                    thread_number=record.thread_id,
+                    name=names[record.name_id]))
+
+    for thread_number, custom_events in custom_events_by_thread.items():
+        if custom_events:
+            events = thread_num_to_events.setdefault(thread_number, [])
+            events.extend(custom_events)
+            events.sort(key=lambda e: e.time)
+    return thread_num_to_events
+
+def create_event_from_record(trace: CompassTrace, record: TraceRecord):
+    """ Create an event object from a binary trace record, matching create_event for the text logs. """
+    event = TRACE_EVENT_NAMES[record.event] if record.event < len(TRACE_EVENT_NAMES) else str(record.event)
+    base_params = {
+        "time": trace.to_microseconds(record.time),
+        "event": event,
+        "thread_number": record.thread_id
+    }
+    optional_id = lambda value: None if value == TRACE_ID_NONE else value
+    kind = trace.kind_name(record.event, record.kind)
+    if event == "Thread Create":
+        return ThreadCreateEvent(**base_params, thread_type=kind)
+    if event == "Implicit Task":
+        return ImplicitTaskEvent(
+            **base_params,
+            task_number=record.task_id,
+            endpoint=trace.endpoint_name(record.endpoint),
+            parallel_id=optional_id(record.parallel_id)
+        )
+    if event == "Parallel Begin":
+        return ParallelEvent(**base_params, parallel_id=record.parallel_id, requested_parallelism=record.value)
+    if event == "Parallel End":
+        return ParallelEndEvent(**base_params, parallel_id=record.parallel_id)
+    if event == "Work":
+        return WorkEvent(
+            **base_params,
+            parallel_id=optional_id(record.parallel_id),
+            work_type=kind,
+            endpoint=trace.endpoint_name(record.endpoint),
+        )
+    if event == "Mutex Acquire":
+        return MutexAcquireEvent(**base_params, kind=kind, wait_id=record.aux_id)
+    if event == "Mutex Acquired":
+        return MutexAcquiredEvent(**base_params, kind=kind, wait_id=record.aux_id)
+    if event == "Mutex Released":
+        return MutexReleaseEvent(**base_params, kind=kind, wait_id=record.aux_id)
+    if event == "Sync Region Wait":
+        return SyncRegionWaitEvent(
+            **base_params,
+            parallel_id=optional_id(record.parallel_id),
+            kind=kind,
+            endpoint=trace.endpoint_name(record.endpoint),
+        )
+    if event == "Sync Region":
+        return SyncRegionEvent(
+            **base_params,
+            parallel_id=optional_id(record.parallel_id),
+            kind=kind,
+            endpoint=trace.endpoint_name(record.endpoint),
+        )
+    if event == "Task Create":
+        return TaskCreateEvent(**base_params, task_number=record.task_id, parent_task_number=record.aux_id)
+    if event == "Task Schedule":
+        return TaskScheduleEvent(
+            **base_params,
+            prior_task_data=record.task_id,
+            prior_task_status=kind,
+            next_task_data=optional_id(record.aux_id)
+        )
+    if event == "Task Dependences":
+        return TaskDependencesEvent(**base_params, task_number=record.task_id, dependence_type=kind, variable=record.aux_id)
+    if event == "Task Dependence":
+        return TaskDependenceEvent(**base_params, source_task_number=record.task_id, sink_task_number=record.aux_id)
+    return LogEvent(**base_params)
+
 # Same as diagram.py
 def extract_parallel_id(event: LogEvent):
     """ Try all events that potentially have parallel_id """
@@ -252,6 +377,19 @@ def create_event(event_dict, thread_number: int):
             prior_task_status=event_dict["prior_task_status"],
             next_task_data=int(event_dict["next_task_data"]) if event_dict.get("next_task_data", "N/A") != "N/A" else None
         )
+    if event == "Task Dependences":
+        return TaskDependencesEvent(
+            **base_params,
+            task_number=int(event_dict["task_number"]),
+            dependence_type=event_dict["dependence_type"],
+            variable=int(event_dict["variable"]),
+        )
+    if event == "Task Dependence":
+        return TaskDependenceEvent(
+            **base_params,
+            source_task_number=int(event_dict["source_task_number"]),
+            sink_task_number=int(event_dict["sink_task_number"]),
+        )
     if event == "Custom Callback Begin":
         return CustomEventStart(
             **base_params,
@@ -304,6 +442,8 @@ def generate_dag(thread_num_to_events: Dict[int, List[LogEvent]], detailed: bool
                 - Can be matched afterwards using task number
             - Every task schedule switch event gets a dependency edge to its corresponding task complete event
                 - Can be matched afterwards using task number
+            - Every task complete event gets a dependence edge to the task schedule switch event of each task
+              the runtime reported as depending on it (depend clauses)
             - Every first event (typically an implicit task begin) of a parallel region (except for parallel begin) gets a dependency edge to its corresponding parallel begin event
             - Every last event (typically an implicit task end) of a parallel region (except for parallel end) gets a dependency edge to its corresponding parallel end event
             - (TBD) Every mutex acquire event gets a dependency edge to its corresponding mutex acquired event
@@ -329,6 +469,7 @@ def generate_dag(thread_num_to_events: Dict[int, List[LogEvent]], detailed: bool
     parallel_id_to_begin_node: Dict[int, GraphNode] = {}
     parallel_id_to_end_node: Dict[int, GraphNode] = {}
     mutex_wait_id_to_nodes: Dict[int, Dict[str, GraphNode]] = {}
+    task_dependences: List[Tuple[int, int]] = []
 
     # Find minimum time
     min_time = min(event.time for events in thread_num_to_events.values() for event in events)
@@ -350,6 +491,11 @@ def generate_dag(thread_num_to_events: Dict[int, List[LogEvent]], detailed: bool
                 continue
             if isinstance(event, SyncRegionWaitEvent) and ('implicit' in event.kind or 'taskgroup' in event.kind or 'ompt_scope_begin' in event.endpoint):
                 continue
+            if isinstance(event, TaskDependencesEvent):
+                continue
+            if isinstance(event, TaskDependenceEvent):
+                task_dependences.append((event.source_task_number, event.sink_task_number))
+                continue
             # if isinstance(event, SyncRegionWaitEvent):
             #     # skip sync region wait events
             #     continue
@@ -393,6 +539,11 @@ def generate_dag(thread_num_to_events: Dict[int, List[LogEvent]], detailed: bool
         assert create_node and schedule_node and complete_node, "Task create, schedule, and complete nodes must all be present"
         create_node.add_child(EdgeType.TASK, schedule_node)
         schedule_node.add_child(EdgeType.TASK, complete_node)
+    for source, sink in task_dependences:
+        source_node = task_number_to_complete_node.get(source)
+        sink_node = task_number_to_schedule_node.get(sink)
+        if source_node and sink_node:
+            source_node.add_child(EdgeType.DEPENDENCE, sink_node)
     # b. Parallel region dependencies
     parallel_ids = set(extract_parallel_id(node.event) for node in graph_nodes if extract_parallel_id(node.event) is not None)
     for parallel_id in parallel_ids:
@@ -605,6 +756,10 @@ def create_graphviz_graph(graph_nodes: List[GraphNode], output_file: str, style:
             style = 'solid'
             penwidth = '2.0'
             color = 'green'
+        elif edge_type == EdgeType.DEPENDENCE:
+            style = 'dashed'
+            penwidth = '2.0'
+            color = 'darkgreen'
         return style, penwidth, color
     
     if style == 'thread_groups':
@@ -700,6 +855,10 @@ def create_graphviz_graph_by_time(graph_nodes: List[GraphNode], output_file: str
             style = 'solid'
             penwidth = '2.0'
             color = 'green'
+        elif edge_type == EdgeType.DEPENDENCE:
+            style = 'dashed'
+            penwidth = '2.0'
+            color = 'darkgreen'
         return style, penwidth, color
     
     # Group nodes by thread number
@@ -0,0 +1,220 @@
+# Python bindings for the C++ trace reader (ompt_tool/trace_reader.cpp)
+import ctypes
+import os
+import struct
+from typing import Dict, Iterator, List, Optional, Tuple
+
+TRACE_FILE_NAME = "trace.compass"
+# Written by COMPASS_SCOPE in the application (ompt_tool/compass.h)
+SCOPE_FILE_NAME = "scopes.compass"
+# ScopeEndpoint in ompt_tool/trace_format.h
+SCOPE_BEGIN = 1
+SCOPE_END = 2
+SCOPE_COUNTER = 3
+SCOPE_GAUGE = 4
+SCOPE_SAMPLE = 5
+TRACE_ID_NONE = (1 << 64) - 1
+
+# TraceEventType in ompt_tool/trace_buffer.h
+TRACE_EVENT_NAMES = [
+    "Thread Create",
+    "Parallel Begin",
+    "Parallel End",
+    "Work",
+    "Task Create",
+    "Task Schedule",
+    "Implicit Task",
+    "Sync Region",
+    "Sync Region Wait",
+    "Mutex Acquire",
+    "Mutex Acquired",
+    "Mutex Released",
+    "Task Dependences",
+    "Task Dependence",
+]
+
+
+class TraceRecord(ctypes.Structure):
+    """ Mirrors TraceRecord in ompt_tool/trace_buffer.h """
+    _fields_ = [
+        ("event", ctypes.c_uint16),
+        ("thread_id", ctypes.c_uint16),
+        ("kind", ctypes.c_uint32),
+        ("endpoint", ctypes.c_uint32),
+        ("flags", ctypes.c_uint32),
+        ("time", ctypes.c_uint64),
+        ("codeptr_ra", ctypes.c_uint64),
+        ("parallel_id", ctypes.c_uint64),
+        ("task_id", ctypes.c_uint64),
+        ("aux_id", ctypes.c_uint64),
+        ("value", ctypes.c_uint64),
+    ]
+
+
+class ScopeRecord(ctypes.Structure):
+    """ Mirrors ScopeRecord in ompt_tool/trace_format.h """
+    _fields_ = [
+        ("time", ctypes.c_uint64),
+        ("name_id", ctypes.c_uint32),
+        ("thread_id", ctypes.c_uint16),
+        ("endpoint", ctypes.c_uint16),
+    ]
+
+
+def _default_library_path():
+    # The Makefile names its shared libraries .dylib on every platform
+    here = os.path.dirname(os.path.abspath(__file__))
+    return os.path.join(here, "..", "build", "libcompass_trace.dylib")
+
+
+def _load_library(path: Optional[str] = None):
+    path = path or os.environ.get("COMPASS_TRACE_LIB") or _default_library_path()
+    lib = ctypes.CDLL(path)
+    lib.compass_trace_open.argtypes = [ctypes.c_char_p]
+    lib.compass_trace_open.restype = ctypes.c_void_p
+    lib.compass_trace_close.argtypes = [ctypes.c_void_p]
+    lib.compass_trace_close.restype = None
+    lib.compass_trace_read.argtypes = [ctypes.c_void_p, ctypes.POINTER(TraceRecord), ctypes.c_size_t]
+    lib.compass_trace_read.restype = ctypes.c_size_t
+    lib.compass_trace_read_scopes.argtypes = [ctypes.c_void_p, ctypes.POINTER(ScopeRecord), ctypes.c_size_t]
+    lib.compass_trace_read_scopes.restype = ctypes.c_size_t
+    lib.compass_trace_rewind.argtypes = [ctypes.c_void_p]
+    lib.compass_trace_rewind.restype = None
+    lib.compass_trace_meta.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    lib.compass_trace_meta.restype = ctypes.c_char_p
+    lib.compass_trace_string.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+    lib.compass_trace_string.restype = ctypes.c_char_p
+    lib.compass_trace_kind_name.argtypes = [ctypes.c_uint16, ctypes.c_uint32]
+    lib.compass_trace_kind_name.restype = ctypes.c_char_p
+    lib.compass_trace_endpoint_name.argtypes = [ctypes.c_uint32]
+    lib.compass_trace_endpoint_name.restype = ctypes.c_char_p
+    return lib
+
+
+class CompassTrace:
+    """
+    A trace file opened through the C++ reader. Records are streamed in batches
+    straight out of the memory-mapped file, so multi-GB traces never have to be
+    held in memory at once.
+
+    with CompassTrace("logs/trace.compass") as trace:
+        for record in trace.records():
+            ...
+    """
+
+    def __init__(self, path: str, library: Optional[str] = None):
+        self._lib = _load_library(library)
+        self._handle = self._lib.compass_trace_open(path.encode())
+        if not self._handle:
+            raise IOError(f"Could not open trace {path}")
+        self._kind_names: Dict[Tuple[int, int], str] = {}
+        self._endpoint_names: Dict[int, str] = {}
+        # Clock calibration written by ompt_tool/timestamp.cpp
+        self._ns_per_tick = float(self.meta("clock_ns_per_tick", "1"))
+        self._base_ticks = int(self.meta("clock_base_ticks", "0"))
+        self._base_realtime_ns = int(self.meta("clock_base_realtime_ns", "0"))
+
+    def close(self):
+        if self._handle:
+            self._lib.compass_trace_close(self._handle)
+            self._handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def meta(self, key: str, default: Optional[str] = None) -> Optional[str]:
+        value = self._lib.compass_trace_meta(self._handle, key.encode())
+        return value.decode() if value is not None else default
+
+    def string(self, key: int) -> Optional[str]:
+        value = self._lib.compass_trace_string(self._handle, key)
+        return value.decode() if value is not None else None
+
+    def symbol(self, codeptr: int) -> Optional[Tuple[str, str, str]]:
+        """ (module+offset, function, file:line) of a code pointer, with empty strings where unknown. """
+        value = self.string(codeptr)
+        if value is None:
+            return None
+        fields = value.split("\t") + ["", ""]
+        return fields[0], fields[1], fields[2]
+
+    def event_counts(self, event: int) -> Tuple[int, int]:
+        """ (seen, recorded) totals for an event type. They differ when sampling was on. """
+        key = TRACE_EVENT_NAMES[event].lower().replace(" ", "_")
+        recorded = int(self.meta(f"recorded.{key}", "0"))
+        return int(self.meta(f"count.{key}", str(recorded))), recorded
+
+    def sampling_scale(self, event: int) -> float:
+        """ Factor that scales totals over the recorded events of a type up to all events. """
+        seen, recorded = self.event_counts(event)
+        return seen / recorded if recorded else 1.0
+
+    def to_realtime_ns(self, ticks: int) -> int:
+        """ Converts a record timestamp to wall-clock nanoseconds since the epoch. """
+        return self._base_realtime_ns + int((ticks - self._base_ticks) * self._ns_per_tick)
+
+    def to_microseconds(self, ticks: int) -> int:
+        """ Converts a record timestamp to the wall-clock microseconds used by the text logs. """
+        return self.to_realtime_ns(ticks) // 1000
+
+    def kind_name(self, event: int, kind: int) -> str:
+        key = (event, kind)
+        if key not in self._kind_names:
+            self._kind_names[key] = self._lib.compass_trace_kind_name(event, kind).decode()
+        return self._kind_names[key]
+
+    def endpoint_name(self, endpoint: int) -> str:
+        if endpoint not in self._endpoint_names:
+            self._endpoint_names[endpoint] = self._lib.compass_trace_endpoint_name(endpoint).decode()
+        return self._endpoint_names[endpoint]
+
+    def batches(self, batch_size: int = 1 << 16) -> Iterator[Tuple[ctypes.Array, int]]:
+        """ Yields (buffer, count) pairs. The buffer is reused between batches. """
+        self._lib.compass_trace_rewind(self._handle)
+        buffer = (TraceRecord * batch_size)()
+        while True:
+            count = self._lib.compass_trace_read(self._handle, buffer, batch_size)
+            if count == 0:
+                return
+            yield buffer, count
+
+    def records(self, batch_size: int = 1 << 16) -> Iterator[TraceRecord]:
+        """ Yields a copy of every record in file order. """
+        for buffer, count in self.batches(batch_size):
+            for i in range(count):
+                yield TraceRecord.from_buffer_copy(buffer[i])
+
+    def scopes(self, batch_size: int = 1 << 16) -> Iterator[ScopeRecord]:
+        """ Yields a copy of every scope record of a scope file in file order. Names are in string(name_id). """
+        self._lib.compass_trace_rewind(self._handle)
+        buffer = (ScopeRecord * batch_size)()
+        while True:
+            count = self._lib.compass_trace_read_scopes(self._handle, buffer, batch_size)
+            if count == 0:
+                return
+            for i in range(count):
+                yield ScopeRecord.from_buffer_copy(buffer[i])
+
+    def metrics(self) -> Dict[Tuple[int, str], List[Tuple[int, float]]]:
+        """
+        Samples of the counters and gauges of a scope file, as (time in microseconds, value)
+        lists per (thread, metric name). Counter values are the thread's running total.
+        """
+        samples: Dict[Tuple[int, str], List[Tuple[int, float]]] = {}
+        names: Dict[int, str] = {}
+        time = 0
+        for record in self.scopes():
+            if record.endpoint not in (SCOPE_COUNTER, SCOPE_GAUGE):
+                time = self.to_microseconds(record.time)
+                continue
+            if record.name_id not in names:
+                names[record.name_id] = self.string((1 << 32) | record.name_id) or str(record.name_id)
+            if record.endpoint == SCOPE_COUNTER:
+                value = float(record.time)
+            else:
+                value = struct.unpack("<d", struct.pack("<Q", record.time))[0]
+            samples.setdefault((record.thread_id, names[record.name_id]), []).append((time, value))
+        return samples